@@ -17,7 +17,9 @@ typedef struct {
  * Atomic operations that C can't guarantee us.  Useful for
  * resource counting etc..
  *
- * Excerpts obtained from the Linux kernel sources.
+ * Excerpts obtained from the Linux kernel sources.  Objects, e.g. pages
+ * or messages, are passed between reactors (see reactor.h), so these
+ * are real atomics based on gcc builtins.
  */
 
 #define ATOMIC_INIT(i)	{ (i) }
@@ -30,12 +32,12 @@ typedef struct {
  */
 static inline int atomic_read(const atomic_t *v)
 {
-	return v->counter;
+	return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
 }
 
 static inline s64 atomic64_read(const atomic64_t *v)
 {
-	return v->counter;
+	return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
 }
 
 /**
@@ -47,7 +49,7 @@ static inline s64 atomic64_read(const atomic64_t *v)
  */
 static inline void atomic_set(atomic_t *v, int i)
 {
-	v->counter = i;
+	__atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
 }
 
 /**
@@ -58,36 +60,32 @@ static inline void atomic_set(atomic_t *v, int i)
  */
 static inline void atomic_inc(atomic_t *v)
 {
-	v->counter++;
+	__atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST);
 }
 
 static inline void atomic_dec(atomic_t *v)
 {
-	v->counter--;
+	__atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST);
 }
 
 static inline int atomic_inc_return(atomic_t *v)
 {
-	return ++v->counter;
+	return __atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST);
 }
 
 static inline s64 atomic64_inc_return(atomic64_t *v)
 {
-	return ++v->counter;
+	return __atomic_add_fetch(&v->counter, 1, __ATOMIC_SEQ_CST);
 }
 
 static inline int atomic_fetch_add_relaxed(int i, atomic_t *v)
 {
-	int old = v->counter;
-	v->counter += i;
-	return old;
+	return __atomic_fetch_add(&v->counter, i, __ATOMIC_RELAXED);
 }
 
 static inline int atomic_fetch_sub_release(int i, atomic_t *v)
 {
-	int old = v->counter;
-	v->counter -= i;
-	return old;
+	return __atomic_fetch_sub(&v->counter, i, __ATOMIC_RELEASE);
 }
 
 /**
@@ -100,22 +98,19 @@ static inline int atomic_fetch_sub_release(int i, atomic_t *v)
  */
 static inline int atomic_dec_and_test(atomic_t *v)
 {
-	return (--v->counter == 0);
+	return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST) == 0;
 }
 
 static inline int atomic_cmpxchg(atomic_t *v, int oldval, int newval)
 {
-	int old = v->counter;
-	if (old == oldval)
-		v->counter = newval;
-	return old;
+	__atomic_compare_exchange_n(&v->counter, &oldval, newval, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return oldval;
 }
 
 static inline int atomic_xchg(atomic_t *v, int val)
 {
-	int old = v->counter;
-	v->counter = val;
-	return old;
+	return __atomic_exchange_n(&v->counter, val, __ATOMIC_SEQ_CST);
 }
 
 static inline bool atomic_try_cmpxchg_relaxed(atomic_t *v, int *old, int new)
@@ -12,6 +12,15 @@
 #define BIT_ULL_WORD(nr)	((nr) / BITS_PER_LONG_LONG)
 #define BITS_PER_BYTE		8
 
+/**
+ * __ffs64 - find first set bit in a 64 bit word
+ * @word: The word to search, the result is undefined if no bit is set
+ */
+static inline unsigned int __ffs64(u64 word)
+{
+	return __builtin_ctzll(word);
+}
+
 /**
  * test_bit - Determine whether a bit is set
  * @nr: bit number to test
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _FS_CEPH_ADMIN_SOCKET_H
+#define _FS_CEPH_ADMIN_SOCKET_H
+
+#include "types.h"
+#include "printk.h"
+
+/*
+ * Admin socket: a unix stream socket which answers commands of the
+ * operator with JSON, the protocol is the one of the Ceph admin socket,
+ * so `ceph --admin-daemon <path> <command>` works:
+ *
+ *    request: command, either plain "perf dump" or {"prefix": "perf dump"},
+ *             terminated by '\0' or '\n'
+ *    reply:   __be32 length of the output followed by the output
+ *
+ * One command per connection.  Built-in commands are "help", "perf dump",
+ * "perf histogram dump" and "allocator stats", the owner of the socket
+ * adds its own, see struct ceph_admin_command.
+ */
+
+struct ceph_admin_socket;
+struct ceph_admin_out;
+
+/**
+ * struct ceph_admin_command - command of the admin socket
+ *
+ * @prefix:  command, e.g. "dump_ops_in_flight"
+ * @help:    one line description for "help"
+ * @handler: prints JSON to @out, called from a task on the reactor which
+ *           has started the socket, so may sleep, e.g. in reactor_call().
+ *           Returns 0 or -errno, which is reported instead of the output.
+ */
+struct ceph_admin_command {
+	const char *prefix;
+	const char *help;
+	int (*handler)(struct ceph_admin_out *out, void *priv);
+};
+
+extern struct ceph_admin_socket *
+ceph_admin_socket_start(const char *path,
+			const struct ceph_admin_command *cmds,
+			unsigned int nr_cmds, void *priv);
+extern void ceph_admin_socket_stop(struct ceph_admin_socket *asok);
+
+/* Output helpers, errors are sticky and reported by the socket */
+
+extern __printf(2, 3)
+void ceph_admin_printf(struct ceph_admin_out *out, const char *fmt, ...);
+extern void ceph_admin_json_str(struct ceph_admin_out *out,
+				const char *str, size_t len);
+
+#endif
@@ -56,6 +56,11 @@ struct ceph_options {
 	unsigned long osd_idle_ttl;		/* jiffies */
 	unsigned long osd_keepalive_timeout;	/* jiffies */
 	unsigned long osd_request_timeout;	/* jiffies */
+	unsigned int osd_op_tasks;		/* tasks executing osd ops */
+	unsigned int reply_cork_usecs;		/* max delay of corked replies */
+	unsigned int reply_cork_bytes;		/* corked replies to flush at */
+	unsigned int tcp_zerocopy_bytes;	/* data to send zero-copy from,
+						   0 disables */
 
 	/*
 	 * any type that can't be simply compared or doesn't need
@@ -68,6 +73,10 @@ struct ceph_options {
 	int num_mon;
 	char *name;
 	char *class_dir;
+	char *objectstore;
+	char *osd_data;
+	char *shm_path;
+	char *admin_socket;
 	struct ceph_crypto_key *key;
 };
 
@@ -78,6 +87,9 @@ struct ceph_options {
 #define CEPH_OSD_KEEPALIVE_DEFAULT	msecs_to_jiffies(5 * 1000)
 #define CEPH_OSD_IDLE_TTL_DEFAULT	msecs_to_jiffies(60 * 1000)
 #define CEPH_OSD_REQUEST_TIMEOUT_DEFAULT 0  /* no timeout */
+#define CEPH_OSD_OP_TASKS_DEFAULT	64
+#define CEPH_REPLY_CORK_USECS_DEFAULT	50  /* 0 disables corking */
+#define CEPH_REPLY_CORK_BYTES_DEFAULT	(256 << 10)
 
 #define CEPH_MONC_HUNT_INTERVAL		msecs_to_jiffies(3 * 1000)
 #define CEPH_MONC_PING_INTERVAL		msecs_to_jiffies(10 * 1000)
@@ -9,6 +9,7 @@
 //#include <linux/radix-tree.h>
 #include "uio.h"
 #include "workqueue.h"
+#include "reactor.h"
 //#include <net/net_namespace.h>
 
 #include "timedef.h"
@@ -27,6 +28,12 @@ struct ceph_messenger;
  * Ceph defines these callbacks for handling connection events.
  */
 struct ceph_connection_operations {
+	/*
+	 * Callbacks never sleep, so the connection work may run right
+	 * from the event loop instead of a workqueue worker.
+	 */
+	bool nosleep;
+
 	struct ceph_connection *(*get)(struct ceph_connection *);
 	void (*put)(struct ceph_connection *);
 
@@ -57,6 +64,12 @@ struct ceph_connection_operations {
 	struct ceph_msg * (*alloc_msg) (struct ceph_connection *con,
 					struct ceph_msg_header *hdr,
 					int *skip);
+	/*
+	 * Optional, called when front and middle of the incoming message
+	 * are read, if ->alloc_msg() did not provide data for the payload.
+	 */
+	int (*alloc_msg_data) (struct ceph_connection *con,
+			       struct ceph_msg *msg);
 
 	void (*reencode_message) (struct ceph_msg *msg);
 
@@ -69,6 +82,19 @@ struct ceph_connection_operations {
 
 struct sock;
 
+/*
+ * Listening socket of a reactor.  Each reactor accepts connections on
+ * own socket bound to the same address with SO_REUSEPORT, so the kernel
+ * spreads incoming connections between reactors.
+ */
+struct ceph_msgr_listener {
+	struct ceph_messenger *msgr;
+	struct sockaddr_storage addr;
+	struct work_struct accept_work;
+	struct socket *sock;
+	void (*def_data_ready)(struct sock *sk);
+};
+
 struct ceph_messenger {
 	struct ceph_entity_inst inst;    /* my name+address */
 	struct ceph_entity_addr my_enc_addr;
@@ -84,12 +110,10 @@ struct ceph_messenger {
 	 * the global_seq counts connections i (attempt to) initiate
 	 * in order to disambiguate certain connect race conditions.
 	 */
-	u32 global_seq;
-	spinlock_t global_seq_lock;
+	atomic_t global_seq;
 
-	struct work_struct accept_work;
-	struct socket *listen_sock;
-	void (*def_data_ready)(struct sock *sk);
+	struct ceph_msgr_listener listeners[REACTORS_MAX];
+	unsigned int nr_listeners;
 	const struct ceph_connection_operations *con_ops;
 };
 
@@ -270,9 +294,15 @@ struct ceph_msg {
 	struct kref kref;
 	bool more_to_follow;
 	bool needs_out_seq;
+	bool out_ready;                 /* tx: seq, crcs and footer are final */
+	bool data_crc_ready;            /* tx: footer.data_crc is summed */
 	int front_alloc_len;
 	unsigned long ack_stamp;        /* tx: when we were acked */
 
+	/* rx: state of the connection owner, released with the message */
+	void *private;
+	void (*release_private)(struct ceph_msg *msg);
+
 	struct ceph_msgpool *pool;
 };
 
@@ -323,6 +353,7 @@ struct ceph_connection {
 	u64 out_seq;		     /* last message queued for send */
 
 	u64 in_seq, in_seq_acked;  /* last message received, acked */
+	u64 in_bytes, out_bytes;   /* payload of received, sent messages */
 
 	/* connection negotiation temps */
 	char in_banner[CEPH_BANNER_MAX_LEN];
@@ -370,12 +401,29 @@ struct ceph_connection {
 	struct delayed_work work;	    /* send|recv work */
 	unsigned long       delay;          /* current delay interval */
 
+	struct list_head    cork_item;      /* in corked cons of the loop */
+	u64                 cork_stamp;     /* nsecs of the first corked */
+	unsigned int        cork_bytes;     /* bytes of corked messages */
+
+	struct list_head    ready_item;     /* in ready cons of the loop */
+
 	/* Default socket callbacks for safe socket close */
 	void (*def_data_ready)(struct sock *sk);
 	void (*def_write_space)(struct sock *sk);
 	void (*def_state_change)(struct sock *sk);
 };
 
+/*
+ * Snapshot of a connection, see ceph_con_get_stats().
+ */
+struct ceph_con_stats {
+	const char   *state;
+	unsigned int out_queue;   /* messages waiting for send */
+	unsigned int out_sent;    /* sending or sent but unacked */
+	unsigned int cork_bytes;
+	u64          in_seq, out_seq;
+	u64          in_bytes, out_bytes;
+};
 
 extern const char *ceph_pr_addr(const struct ceph_entity_addr *addr);
 
@@ -408,6 +456,8 @@ extern void ceph_con_open(struct ceph_connection *con,
 extern bool ceph_con_opened(struct ceph_connection *con);
 extern void ceph_con_close(struct ceph_connection *con);
 extern void ceph_con_send(struct ceph_connection *con, struct ceph_msg *msg);
+extern void ceph_con_send_corked(struct ceph_connection *con,
+				 struct ceph_msg *msg);
 
 extern void ceph_msg_revoke(struct ceph_msg *msg);
 extern void ceph_msg_revoke_incoming(struct ceph_msg *msg);
@@ -415,6 +465,8 @@ extern void ceph_msg_revoke_incoming(struct ceph_msg *msg);
 extern void ceph_con_keepalive(struct ceph_connection *con);
 extern bool ceph_con_keepalive_expired(struct ceph_connection *con,
 				       unsigned long interval);
+extern void ceph_con_get_stats(struct ceph_connection *con,
+			       struct ceph_con_stats *st);
 
 void ceph_msg_data_init(struct ceph_msg_data *data);
 void ceph_msg_data_release(struct ceph_msg_data *data);
@@ -0,0 +1,390 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _FS_CEPH_OBJSTORE_H
+#define _FS_CEPH_OBJSTORE_H
+
+#include "rbtree.h"
+#include "hashtable.h"
+
+#include "ceph/libceph.h"
+#include "ceph/messenger.h"
+#include "ceph/osd_client.h"
+#include "ceph/osdmap.h"
+#include "ceph/pagelist.h"
+
+struct ceph_objstore;
+
+/*
+ * Generic object, backends embed it into own object structure and
+ * get to the backend part with container_of().  Omap and xattrs are
+ * kept in memory by the generic layer, changed entries are put on the
+ * dirty lists with ceph_omap_set_dirty() and backend is asked to
+ * persist them with ->sync_meta().
+ *
+ * Objects returned by ceph_objstore_lookup() and ceph_objstore_create_object()
+ * are used till ceph_objstore_put_object(), only clean objects which
+ * are not used can be evicted from the cache, see @max_objects.
+ */
+struct ceph_osds_object {
+	struct rb_node         o_node;    /* node of ->c_objects */
+	struct list_head       o_lru;     /* node of ->sh_lru */
+	struct ceph_objstore_coll *o_coll;
+	struct ceph_hobject_id o_hoid;
+	struct rb_root         o_omap;    /* omap of the object */
+	struct rb_root         o_xattrs;  /* xattr of the object */
+	struct list_head       o_dirty_omap;   /* changed omap entries */
+	struct list_head       o_dirty_xattrs; /* changed xattrs */
+	size_t                 o_size;    /* size of an object */
+	struct timespec64      o_mtime;   /* modification time of an object */
+	unsigned int           o_shard;   /* shard which owns the object */
+	unsigned int           o_users;   /* requests which use the object */
+};
+
+struct ceph_objstore_slot {
+	u32                     s_hash;   /* raw hash of the hoid */
+	struct ceph_osds_object *s_obj;
+};
+
+/*
+ * Collection holds objects of one placement group.  Objects are looked
+ * up by an open-addressing hash table with linear probing on the hoid
+ * hash, and are also kept in an rbtree ordered by hoid, which is used
+ * only for ordered iteration, e.g. listing.
+ */
+struct ceph_objstore_coll {
+	struct hlist_node         c_node;    /* node of ->sh_colls */
+	struct ceph_spg           c_spgid;
+	struct rb_root            c_objects; /* objects ordered by hoid */
+	struct ceph_objstore_slot *c_slots;
+	unsigned int              c_bits;    /* 1<<c_bits slots */
+	unsigned int              c_count;   /* number of objects */
+};
+
+struct ceph_osds_omap_entry {
+	struct rb_node         e_node;   /* node of ->o_omap or ->o_xattrs */
+	struct list_head       e_dirty;  /* node of ->o_dirty_omap or
+					    ->o_dirty_xattrs */
+	char                   *e_key;
+	unsigned int           e_key_len;
+	struct ceph_pagelist   *e_val_pl;
+};
+
+/*
+ * Statistics of cached objects, i.e. of the whole store for memstore.
+ */
+struct ceph_objstore_stats {
+	u64 colls;
+	u64 objects;
+	u64 bytes;         /* sum of object sizes */
+	u64 blocks;        /* allocated by the backend */
+	u64 block_bytes;
+	u64 omap_entries;
+	u64 omap_bytes;    /* keys and values */
+	u64 xattrs;
+	u64 xattr_bytes;
+};
+
+/**
+ * struct ceph_objstore_ops - object store backend
+ *
+ * @block_shift:   WRITE payload is received into buffers of 1<<block_shift
+ *                 which are aligned on object offsets, so a backend can
+ *                 take whole blocks of the write without a copy, see
+ *                 ceph_objstore_block_page().  0 means any layout.
+ * @max_objects:   limit of cached objects, split between shards.  Least
+ *                 recently used objects which are clean and not used are
+ *                 freed and loaded again by @load_object.  0 means no
+ *                 limit, e.g. for memstore which keeps data in objects.
+ *
+ * All object callbacks are called for objects which are already in
+ * the index of the generic layer.  Callbacks which modify data are
+ * responsible for updating ->o_size and ->o_mtime of the object.
+ *
+ * @load_object:   optional, called on index miss, should fill in
+ *                 size, mtime, omap and xattrs of an object or return
+ *                 -ENOENT if object does not exist on the storage.
+ * @create_object: optional, makes an empty object persistent.
+ * @read:          reads @len bytes at @off to @dst, caller guarantees
+ *                 that the range is inside the object.  Holes are
+ *                 read as zeroes.
+ * @read_bvecs:    optional, zero-copy read of the same range: allocates
+ *                 an array of bvecs which reference pages of the object,
+ *                 first @nr_head entries are left for the caller.  Pages
+ *                 are referenced, so the caller owns both the array and
+ *                 the pages and releases them with put_page() and kfree().
+ *                 Backend must not modify referenced pages in place.
+ * @write:         writes @len bytes at @off from @in_cur, truncates the
+ *                 object to @off + @len if @truncate is true.
+ * @truncate:      changes object size, extends with zeroes.
+ * @zero:          zeroes out the range and releases the space if possible,
+ *                 does not change object size.
+ * @sync_meta:     optional, persists omap and xattrs of an object, entries
+ *                 which have been changed since the last successful call
+ *                 are on ->o_dirty_omap and ->o_dirty_xattrs.
+ * @sync_object:   optional, makes data changes of the object persistent,
+ *                 called once per request before the reply, which claims
+ *                 the changes are on disk.
+ * @set_alloc_hint: optional, expected object and write sizes which the
+ *                 client passes by CEPH_OSD_OP_SETALLOCHINT, backend may
+ *                 use them to choose allocation granularity.
+ * @object_stats:  optional, adds blocks and bytes of storage the object
+ *                 takes to @st, see ceph_objstore_shard_stats().
+ */
+struct ceph_objstore_ops {
+	const char *name;
+	unsigned int block_shift;
+	unsigned int max_objects;
+
+	struct ceph_objstore *(*create)(struct ceph_options *opt,
+					unsigned int nr_shards);
+	void (*destroy)(struct ceph_objstore *os);
+
+	struct ceph_osds_object *(*alloc_object)(struct ceph_objstore *os);
+	void (*free_object)(struct ceph_objstore *os,
+			    struct ceph_osds_object *obj);
+	int (*load_object)(struct ceph_objstore *os,
+			   struct ceph_osds_object *obj);
+	int (*create_object)(struct ceph_objstore *os,
+			     struct ceph_osds_object *obj);
+
+	int (*read)(struct ceph_objstore *os, struct ceph_osds_object *obj,
+		    void *dst, u64 off, u64 len);
+	int (*read_bvecs)(struct ceph_objstore *os,
+			  struct ceph_osds_object *obj, u64 off, u64 len,
+			  unsigned int nr_head, struct ceph_bvec_iter *it,
+			  unsigned int *num_bvecs);
+	int (*write)(struct ceph_objstore *os, struct ceph_osds_object *obj,
+		     struct ceph_msg_data_cursor *in_cur, u64 off, u64 len,
+		     bool truncate, const struct timespec64 *mtime);
+	int (*truncate)(struct ceph_objstore *os, struct ceph_osds_object *obj,
+			u64 size, const struct timespec64 *mtime);
+	int (*zero)(struct ceph_objstore *os, struct ceph_osds_object *obj,
+		    u64 off, u64 len, const struct timespec64 *mtime);
+	int (*sync_meta)(struct ceph_objstore *os,
+			 struct ceph_osds_object *obj);
+	int (*sync_object)(struct ceph_objstore *os,
+			   struct ceph_osds_object *obj);
+	int (*set_alloc_hint)(struct ceph_objstore *os,
+			      struct ceph_osds_object *obj,
+			      u64 expected_object_size,
+			      u64 expected_write_size);
+	void (*object_stats)(struct ceph_objstore *os,
+			     struct ceph_osds_object *obj,
+			     struct ceph_objstore_stats *st);
+};
+
+enum {
+	CEPH_OBJSTORE_COLLS_HASH_BITS = 8,
+};
+
+/*
+ * Collections are sharded by PG, see ceph_objstore_shard(), a shard
+ * and all objects of its collections are accessed only by one owner,
+ * so the store needs no locks.  Backend state which is not per object,
+ * e.g. the LRU of opened files, should be sharded the same way.
+ */
+struct ceph_objstore_shard {
+	/* collections of all cached objects, one per PG */
+	DECLARE_HASHTABLE(sh_colls, CEPH_OBJSTORE_COLLS_HASH_BITS);
+	struct list_head  sh_lru;        /* cached objects, LRU first */
+	unsigned int      sh_nr_objects;
+};
+
+struct ceph_objstore {
+	const struct ceph_objstore_ops *ops;
+	unsigned int                   os_nr_shards;
+	unsigned int                   os_max_objects; /* per shard */
+	struct ceph_objstore_shard     *os_shards;
+};
+
+extern const struct ceph_objstore_ops ceph_memstore_ops;
+extern const struct ceph_objstore_ops ceph_filestore_ops;
+
+extern struct ceph_objstore *ceph_objstore_create(struct ceph_options *opt,
+						  unsigned int nr_shards);
+extern void ceph_objstore_destroy(struct ceph_objstore *os);
+
+static inline u64 ceph_spgid_key(const struct ceph_spg *spgid)
+{
+	return spgid->pgid.pool ^ ((u64)spgid->pgid.seed << 32) ^
+		((u64)(u8)spgid->shard << 24);
+}
+
+/**
+ * ceph_objstore_shard() - returns the shard which owns the collection
+ *                         of the PG.  All calls for objects of the PG
+ *                         should be made by the owner of the shard.
+ */
+static inline unsigned int
+ceph_objstore_shard(struct ceph_objstore *os, const struct ceph_spg *spgid)
+{
+	return hash_64(ceph_spgid_key(spgid), 32) % os->os_nr_shards;
+}
+
+extern void ceph_objstore_shard_stats(struct ceph_objstore *os,
+				      unsigned int shard,
+				      struct ceph_objstore_stats *st);
+
+extern struct ceph_objstore_coll *
+ceph_objstore_lookup_coll(struct ceph_objstore *os,
+			  const struct ceph_spg *spgid);
+extern struct ceph_osds_object *
+ceph_objstore_lookup(struct ceph_objstore *os, const struct ceph_spg *spgid,
+		     const struct ceph_hobject_id *hoid);
+extern struct ceph_osds_object *
+ceph_objstore_create_object(struct ceph_objstore *os,
+			    const struct ceph_spg *spgid,
+			    const struct ceph_hobject_id *hoid);
+extern void ceph_objstore_put_object(struct ceph_objstore *os,
+				     struct ceph_osds_object *obj);
+
+/* Ordered iteration over objects of a collection */
+
+static inline struct ceph_osds_object *
+ceph_coll_first_object(struct ceph_objstore_coll *coll)
+{
+	return rb_entry_safe(rb_first(&coll->c_objects),
+			     struct ceph_osds_object, o_node);
+}
+
+static inline struct ceph_osds_object *
+ceph_coll_next_object(struct ceph_osds_object *obj)
+{
+	return rb_entry_safe(rb_next(&obj->o_node),
+			     struct ceph_osds_object, o_node);
+}
+
+static inline int ceph_objstore_read(struct ceph_objstore *os,
+				     struct ceph_osds_object *obj,
+				     void *dst, u64 off, u64 len)
+{
+	return os->ops->read(os, obj, dst, off, len);
+}
+
+static inline bool ceph_objstore_can_read_bvecs(struct ceph_objstore *os)
+{
+	return os->ops->read_bvecs;
+}
+
+static inline int ceph_objstore_read_bvecs(struct ceph_objstore *os,
+					   struct ceph_osds_object *obj,
+					   u64 off, u64 len,
+					   unsigned int nr_head,
+					   struct ceph_bvec_iter *it,
+					   unsigned int *num_bvecs)
+{
+	return os->ops->read_bvecs(os, obj, off, len, nr_head, it,
+				   num_bvecs);
+}
+
+static inline int ceph_objstore_write(struct ceph_objstore *os,
+				      struct ceph_osds_object *obj,
+				      struct ceph_msg_data_cursor *in_cur,
+				      u64 off, u64 len, bool truncate,
+				      const struct timespec64 *mtime)
+{
+	return os->ops->write(os, obj, in_cur, off, len, truncate, mtime);
+}
+
+static inline int ceph_objstore_truncate(struct ceph_objstore *os,
+					 struct ceph_osds_object *obj,
+					 u64 size,
+					 const struct timespec64 *mtime)
+{
+	return os->ops->truncate(os, obj, size, mtime);
+}
+
+static inline int ceph_objstore_zero(struct ceph_objstore *os,
+				     struct ceph_osds_object *obj,
+				     u64 off, u64 len,
+				     const struct timespec64 *mtime)
+{
+	return os->ops->zero(os, obj, off, len, mtime);
+}
+
+extern int ceph_objstore_sync_meta(struct ceph_objstore *os,
+				   struct ceph_osds_object *obj);
+
+static inline int ceph_objstore_sync_object(struct ceph_objstore *os,
+					    struct ceph_osds_object *obj)
+{
+	if (!os->ops->sync_object)
+		return 0;
+
+	return os->ops->sync_object(os, obj);
+}
+
+static inline int ceph_objstore_set_alloc_hint(struct ceph_objstore *os,
+					       struct ceph_osds_object *obj,
+					       u64 expected_object_size,
+					       u64 expected_write_size)
+{
+	if (!os->ops->set_alloc_hint)
+		return 0;
+
+	return os->ops->set_alloc_hint(os, obj, expected_object_size,
+				       expected_write_size);
+}
+
+/**
+ * ceph_objstore_block_page() - returns page of the current input segment
+ *                              if it is a whole block of 1<<@block_shift,
+ *                              i.e. a backend can take it instead of copying.
+ */
+static inline struct page *
+ceph_objstore_block_page(struct ceph_msg_data_cursor *in_cur,
+			 unsigned int block_shift)
+{
+	const struct iov_iter *iter = &in_cur->iter;
+	const struct bio_vec *bv;
+
+	if (!iov_iter_is_bvec(iter) || iter->iov_offset ||
+	    iov_iter_count(iter) < (1UL << block_shift))
+		return NULL;
+
+	bv = iter->bvec;
+	if (bv->bv_offset || bv->bv_len != (1UL << block_shift) ||
+	    bv->bv_page->order != block_shift - PAGE_SHIFT)
+		return NULL;
+
+	return bv->bv_page;
+}
+
+/* Helpers for omap and xattrs of an object */
+
+extern struct ceph_osds_omap_entry *
+ceph_omap_lookup(struct rb_root *root, const char *key);
+extern struct ceph_osds_omap_entry *
+ceph_omap_lookup_ge(struct rb_root *root, const char *key);
+extern struct ceph_osds_omap_entry *
+ceph_omap_lookup_gt(struct rb_root *root, const char *key);
+extern struct ceph_osds_omap_entry *
+ceph_omap_create_and_insert(struct rb_root *root, const char *key,
+			    size_t key_len);
+extern void ceph_omap_destroy(struct rb_root *root);
+
+/**
+ * ceph_omap_set_dirty() - puts a changed entry on the dirty list of
+ *                         its map, see ->sync_meta().
+ */
+static inline void ceph_omap_set_dirty(struct list_head *dirty,
+				       struct ceph_osds_omap_entry *ome)
+{
+	if (list_empty(&ome->e_dirty))
+		list_add_tail(&ome->e_dirty, dirty);
+}
+
+static inline struct ceph_osds_omap_entry *
+ceph_omap_first(struct rb_root *root)
+{
+	return rb_entry_safe(rb_first(root), struct ceph_osds_omap_entry,
+			     e_node);
+}
+
+static inline struct ceph_osds_omap_entry *
+ceph_omap_next(struct ceph_osds_omap_entry *ome)
+{
+	return rb_entry_safe(rb_next(&ome->e_node),
+			     struct ceph_osds_omap_entry, e_node);
+}
+
+#endif
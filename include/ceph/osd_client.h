@@ -316,6 +316,8 @@ struct ceph_osd_client {
 	struct ceph_client     *client;
 
 	struct ceph_osdmap     *osdmap;       /* current map */
+	atomic_t               epoch;         /* of ->osdmap, for reactors
+						 which don't own the map */
 	struct rw_semaphore    lock;
 
 	struct rb_root         osds;          /* osds */
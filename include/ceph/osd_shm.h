@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _FS_CEPH_OSD_SHM_H
+#define _FS_CEPH_OSD_SHM_H
+
+#include "atomic.h"
+
+#include "ceph/messenger.h"
+
+/*
+ * Shared-memory transport for clients on the same host.
+ *
+ * Client connects to the unix seqpacket socket at `shm_path` and sends
+ * struct ceph_osd_shm_hello.  Server replies with the same structure
+ * and passes three fds with SCM_RIGHTS: a memfd of the shared area and
+ * two eventfds, the request doorbell (client rings, server reads) and
+ * the reply doorbell (server rings, client reads).  The control socket
+ * stays open for the lifetime of the session, closing it closes the
+ * session.
+ *
+ * Shared area layout, each part is page aligned:
+ *
+ *    header | request ring | reply ring | client data | reply data
+ *
+ * Rings are single-producer/single-consumer rings of fixed size slots:
+ * the producer owns ->tail, the consumer owns ->head, each side
+ * publishes its index with release and reads the other one with
+ * acquire.  The doorbell is rung only when ->notified flips from 0 to
+ * 1, the consumer clears it before draining.
+ *
+ * Request slot carries the front of CEPH_MSG_OSD_OP encoded as on the
+ * wire, write data is taken from the client data part, which the client
+ * manages itself, and is copied out before the request slot is released.
+ * Reply slot carries the front of CEPH_MSG_OSD_OPREPLY, reply data is
+ * placed by the server in the reply data part and is valid till the
+ * reply slot is released.  If the server runs out of reply slots or
+ * reply data it sets ->srv_waiting, then the client should ring the
+ * request doorbell after it has released replies.
+ *
+ * Clients are trusted: there is no cephx, the entity name is taken from
+ * the hello as is.  So the socket is created with mode 0600 and only
+ * processes of the user of the OSD (or root) are accepted, checked by
+ * SO_PEERCRED.
+ */
+
+#define CEPH_OSD_SHM_MAGIC	0x70656368  /* "pech" */
+#define CEPH_OSD_SHM_VERSION	1
+
+enum {
+	CEPH_OSD_SHM_SLOT_SIZE   = 4096,
+	CEPH_OSD_SHM_RING_SIZE   = 256,  /* slots, ^2 */
+	CEPH_OSD_SHM_CLIENT_DATA = 16 << 20,
+	CEPH_OSD_SHM_REPLY_DATA  = 64 << 20,
+};
+
+struct ceph_osd_shm_hello {
+	__u32 magic;
+	__u32 version;
+	__s32 result;       /* reply: 0 or -errno */
+	__u32 pad;
+	__u64 features;     /* request: features of the client */
+	__u8  entity_type;  /* request: CEPH_ENTITY_TYPE_CLIENT */
+	__u8  pad2[7];
+	__u64 entity_num;
+	/* Reply: layout of the shared area, offsets in bytes */
+	__u64 size;
+	__u64 req_ring_off;
+	__u64 rep_ring_off;
+	__u64 client_data_off;
+	__u64 reply_data_off;
+	__u32 slot_size;
+	__u32 ring_size;
+	__u32 client_data_size;
+	__u32 reply_data_size;
+};
+
+struct ceph_osd_shm_ring {
+	__u32    head ____cacheline_aligned; /* consumer */
+	__u32    tail ____cacheline_aligned; /* producer */
+	atomic_t notified ____cacheline_aligned;
+};
+
+struct ceph_osd_shm_header {
+	struct ceph_osd_shm_ring req;
+	struct ceph_osd_shm_ring rep;
+	atomic_t srv_waiting ____cacheline_aligned;
+};
+
+struct ceph_osd_shm_req {
+	__u64 tid;
+	__u16 version;      /* encoding version of the front */
+	__u16 pad;
+	__u32 front_len;
+	__u32 data_off;     /* write data, offset in client data */
+	__u32 data_len;
+	__u8  front[];
+};
+
+struct ceph_osd_shm_reply {
+	__u64 tid;
+	__u16 version;
+	__u16 pad;
+	__s32 result;       /* 0 or -errno of the transport */
+	__u32 front_len;
+	__u32 data_off;     /* reply data, offset in reply data */
+	__u32 data_len;
+	__u32 pad2;
+	__u8  front[];
+};
+
+struct ceph_osds_shm;
+
+extern struct ceph_osds_shm *
+ceph_osds_shm_start(struct ceph_messenger *msgr, const char *path,
+		    const struct ceph_connection_operations *ops);
+extern void ceph_osds_shm_stop(struct ceph_osds_shm *shm);
+
+extern bool ceph_con_is_shm(struct ceph_connection *con);
+extern void ceph_osds_shm_send(struct ceph_connection *con,
+			       struct ceph_msg *msg);
+
+#endif
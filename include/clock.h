@@ -0,0 +1,69 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include "types.h"
+#include "timedef.h"
+
+/*
+ * Loop clock.
+ *
+ * The event loop samples CLOCK_MONOTONIC once before it computes the
+ * epoll timeout and once after epoll_wait() returns, and `jiffies` is
+ * that sample for everything executed during the iteration: timers,
+ * event actions and tasks.  So all the deadlines and stamps taken in
+ * one iteration are consistent and cost no syscall.  Threads which do
+ * not run an event loop, or code executed before the loop is started,
+ * read the clock as before.
+ *
+ * Callers which need the precise time read it explicitly: nsecs() or
+ * `jiffies_fresh` for wall deadlines, fast_nsecs() for short intervals,
+ * e.g. latency stamps.  With `clock=tsc` fast_nsecs() is rdtsc scaled
+ * by the calibrated frequency, otherwise it is nsecs().  TSC is used
+ * only if it is invariant, and it is never used for jiffies, so a
+ * calibration error can't make timers drift.
+ */
+
+struct clock_tsc {
+	u64  base_cycles;
+	u64  base_nsecs;
+	u64  mult;       /* nsecs per cycle << CLOCK_TSC_SHIFT */
+	bool enabled;
+};
+
+#define CLOCK_TSC_SHIFT 32
+
+extern struct clock_tsc clock_tsc;
+
+extern int clock_enable_tsc(void);
+
+static inline void clock_loop_sample(void)
+{
+	loop_nsecs_stamp = nsecs();
+}
+
+static inline void clock_loop_stop(void)
+{
+	loop_nsecs_stamp = 0;
+}
+
+#ifdef __x86_64__
+static inline u64 fast_nsecs(void)
+{
+	u64 cycles;
+
+	if (!clock_tsc.enabled)
+		return nsecs();
+
+	cycles = __builtin_ia32_rdtsc() - clock_tsc.base_cycles;
+	return clock_tsc.base_nsecs +
+		(u64)(((unsigned __int128)cycles * clock_tsc.mult) >>
+		      CLOCK_TSC_SHIFT);
+}
+#else
+static inline u64 fast_nsecs(void)
+{
+	return nsecs();
+}
+#endif
+
+#endif
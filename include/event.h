@@ -21,10 +21,12 @@ struct event_item {
 
 extern void init_event(void);
 extern void deinit_event(void);
+extern bool in_event_loop(void);
 
 extern int event_item_add(struct event_item *, int fd);
 extern int event_item_del(struct event_item *);
 extern int event_item_mod(struct event_item *);
 extern void event_item_set(struct event_item *);
+extern void event_item_defer(struct event_item *);
 
 #endif
@@ -25,6 +25,19 @@ static inline void mutex_lock(struct mutex *mutex)
 	mutex->owner = current;
 }
 
+/**
+ * mutex_trylock() - takes the mutex if it is free, never sleeps.
+ * Returns 1 if the mutex has been taken, 0 otherwise.
+ */
+static inline int mutex_trylock(struct mutex *mutex)
+{
+	if (mutex->owner)
+		return 0;
+
+	mutex->owner = current;
+	return 1;
+}
+
 static inline void mutex_unlock(struct mutex *mutex)
 {
 	if (WARN(mutex->owner != current,
@@ -3,14 +3,26 @@
 #define _PAGE_H
 
 #include "list.h"
+#include "atomic.h"
 
 #define PAGE_SHIFT	12
 #define PAGE_SIZE	(1UL << PAGE_SHIFT)
 #define PAGE_MASK	(~(PAGE_SIZE-1))
 
+/*
+ * Pages are allocated by alloc_pages() as a contiguous chunk of
+ * 1<<order, like a compound page.  Reference counter and order are
+ * valid only for the first (head) page of a chunk, so get_page() and
+ * put_page() must be called only for head pages.  Descriptors of a
+ * chunk are adjacent, see src/page.c.
+ */
 struct page {
 	struct list_head lru;
 	void *ptr;
+	atomic_t _refcount;
+	unsigned int order;
+	unsigned int flags;   /* PG_* of src/page.c */
+	unsigned int arena;   /* index of the arena if PG_arena */
 };
 
 extern unsigned char zeroes[PAGE_SIZE];
@@ -31,26 +43,47 @@ extern struct page empty_zero_page;
 
 static inline int page_count(struct page *page)
 {
-	return 0;
+	return atomic_read(&page->_refcount);
 }
 
 #define PageSlab(p) (1)
 
-#define get_page(p)
-#define put_page(p)
-
 extern void init_pages(void);
 extern void deinit_pages(void);
 
 extern struct page *alloc_pages(gfp_t gfp_mask, unsigned int order);
+extern void __free_pages(struct page *page, unsigned int order);
+
+struct page_node_stats {
+	unsigned int  node;
+	unsigned long nr_pages;  /* pages in arenas of the node */
+	unsigned long nr_free;   /* free pages in arenas of the node */
+};
+
+extern unsigned int page_nr_arenas(void);
+extern unsigned int page_node_stats(struct page_node_stats *stats,
+				    unsigned int max);
+
+static inline void get_page(struct page *page)
+{
+	atomic_inc(&page->_refcount);
+}
+
+/**
+ * put_page() - drops a reference, the whole chunk of 1<<order pages
+ *              is freed when the last reference is gone.
+ */
+static inline void put_page(struct page *page)
+{
+	if (atomic_dec_and_test(&page->_refcount))
+		__free_pages(page, page->order);
+}
 
 static inline struct page *__page_cache_alloc(gfp_t gfp)
 {
 	return alloc_pages(gfp, 0);
 }
 
-extern void __free_pages(struct page *page, unsigned int order);
-
 #define __free_page(page) __free_pages((page), 0)
 #define free_page(addr) free_pages((addr), 0)
 
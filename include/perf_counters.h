@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _PERF_COUNTERS_H
+#define _PERF_COUNTERS_H
+
+#include "types.h"
+#include "reactor.h"
+
+/*
+ * Perf counters.
+ *
+ * The set of counters and histograms is fixed at build time, see the
+ * ids below and the names in perf_counters.c.  Each reactor updates its
+ * own shard with plain stores, so an update is an add to a thread local
+ * cache line, no atomics and no locks.  Readers sum shards of all
+ * reactors, a read is not a snapshot, but each value is consistent.
+ * Threads which are not reactors update the shard of reactor #0.
+ *
+ * Counters only grow, gauges go up and down (e.g. pages in use), both
+ * are summed over shards.  Histograms are log-linear: each power of two
+ * is split in PERF_HIST_SUB sub-buckets, so a bucket is at most 1/4 of
+ * its value wide.  Latencies are in nanoseconds of fast_nsecs().
+ */
+
+enum perf_counter_id {
+	/* Messenger */
+	PERF_MSGR_RX_MSGS,
+	PERF_MSGR_RX_BYTES,
+	PERF_MSGR_TX_MSGS,
+	PERF_MSGR_TX_BYTES,
+
+	/* OSD server */
+	PERF_OSD_REQS,
+	PERF_OSD_OPS,
+	PERF_OSD_OP_ERRORS,
+	PERF_OSD_OP_IN_BYTES,
+	PERF_OSD_OP_OUT_BYTES,
+
+	/* Page allocator */
+	PERF_PAGE_ALLOCS,
+	PERF_PAGE_FREES,
+	PERF_PAGE_MALLOC_ALLOCS,
+	PERF_PAGE_USED,
+
+	/* Workqueue */
+	PERF_WQ_QUEUED,
+	PERF_WQ_EXECUTED,
+
+	PERF_NR_COUNTERS
+};
+
+enum perf_hist_id {
+	PERF_HIST_OSD_REQ,
+	PERF_HIST_OSD_OP_READ,
+	PERF_HIST_OSD_OP_WRITE,
+	PERF_HIST_OSD_OP_WRITEFULL,
+	PERF_HIST_OSD_OP_ZERO,
+	PERF_HIST_OSD_OP_TRUNCATE,
+	PERF_HIST_OSD_OP_STAT,
+	PERF_HIST_OSD_OP_CALL,
+	PERF_HIST_OSD_OP_OMAPGETVALS,
+	PERF_HIST_OSD_OP_OMAPGETVALSBYKEYS,
+	PERF_HIST_OSD_OP_OMAPSETVALS,
+	PERF_HIST_OSD_OP_OMAPGETKEYS,
+	PERF_HIST_OSD_OP_GETXATTR,
+	PERF_HIST_OSD_OP_SETXATTR,
+	PERF_HIST_OSD_OP_CREATE,
+	PERF_HIST_OSD_OP_OTHER,
+
+	PERF_NR_HISTS
+};
+
+enum perf_counter_type {
+	PERF_TYPE_COUNTER,
+	PERF_TYPE_GAUGE,
+};
+
+enum {
+	PERF_HIST_SUB_BITS = 2,
+	PERF_HIST_SUB      = 1 << PERF_HIST_SUB_BITS,
+	/* Values of 2^PERF_HIST_MAX_BITS and more go to the last bucket */
+	PERF_HIST_MAX_BITS = 41,
+	PERF_HIST_BUCKETS  = (PERF_HIST_MAX_BITS - PERF_HIST_SUB_BITS + 1) <<
+			     PERF_HIST_SUB_BITS,
+};
+
+struct perf_hist {
+	u64 count;
+	u64 sum;
+	u64 buckets[PERF_HIST_BUCKETS];
+};
+
+struct perf_shard {
+	s64              counters[PERF_NR_COUNTERS];
+	struct perf_hist hists[PERF_NR_HISTS];
+} ____cacheline_aligned;
+
+extern struct perf_shard perf_shards[REACTORS_MAX];
+
+static inline unsigned int perf_hist_bucket(u64 val)
+{
+	unsigned int msb;
+
+	if (val < PERF_HIST_SUB)
+		return val;
+
+	msb = 63 - __builtin_clzll(val);
+	if (msb >= PERF_HIST_MAX_BITS)
+		return PERF_HIST_BUCKETS - 1;
+
+	return ((msb - PERF_HIST_SUB_BITS + 1) << PERF_HIST_SUB_BITS) |
+		((val >> (msb - PERF_HIST_SUB_BITS)) & (PERF_HIST_SUB - 1));
+}
+
+static inline void perf_add(enum perf_counter_id id, s64 val)
+{
+	perf_shards[reactor_id].counters[id] += val;
+}
+
+static inline void perf_inc(enum perf_counter_id id)
+{
+	perf_add(id, 1);
+}
+
+static inline void perf_hist_add(enum perf_hist_id id, u64 val)
+{
+	struct perf_hist *hist = &perf_shards[reactor_id].hists[id];
+
+	hist->count++;
+	hist->sum += val;
+	hist->buckets[perf_hist_bucket(val)]++;
+}
+
+extern const char *perf_counter_name(enum perf_counter_id id);
+extern enum perf_counter_type perf_counter_type(enum perf_counter_id id);
+extern const char *perf_hist_name(enum perf_hist_id id);
+
+extern s64 perf_counter_read(enum perf_counter_id id);
+extern void perf_hist_read(enum perf_hist_id id, struct perf_hist *hist);
+
+extern u64 perf_hist_bucket_start(unsigned int bucket);
+extern u64 perf_hist_quantile(const struct perf_hist *hist,
+			      unsigned int permille);
+
+#endif
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include "list.h"
+
+/*
+ * Reactor is an event loop (sched, event, uring and workqueue stack)
+ * executed by a dedicated pthread pinned to a CPU.  Reactor #0 is the
+ * main thread.  Reactors do not share tasks, timers or sockets, they
+ * talk to each other by posting works, which go through lock-free
+ * single-producer/single-consumer rings, see reactor.c.
+ */
+
+enum {
+	REACTORS_MAX = 64,
+};
+
+struct reactor_work;
+typedef void (*reactor_work_func_t)(struct reactor_work *work);
+
+struct reactor_work {
+	struct list_head    entry;    /* entry in the overflow list */
+	reactor_work_func_t func;
+	unsigned int        src;      /* reactor which has posted */
+};
+
+#define INIT_REACTOR_WORK(_work, _func)					\
+	*(_work) = (typeof(*(_work))) {					\
+		.entry = LIST_HEAD_INIT((_work)->entry),		\
+		.func  = (_func),					\
+	}
+
+/* Id of the reactor of the caller */
+extern __thread unsigned int reactor_id;
+extern unsigned int nr_reactors;
+
+extern int init_reactors(unsigned int nr);
+extern void deinit_reactors(void);
+
+extern void reactor_post(unsigned int id, struct reactor_work *work);
+extern int reactor_call(unsigned int id, int (*fn)(void *), void *arg);
+
+#endif
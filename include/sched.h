@@ -1,6 +1,17 @@
 /* SPDX-License-Identifier: GPL-2.0 */
-#ifndef _SCHED_H
-#define _SCHED_H
+#if defined(_LINUX_SCHED_H) && !defined(_SCHED_H)
+/*
+ * We were included with quotes from include/, so #include_next below
+ * found us again instead of the system header, go further.
+ */
+#include_next <sched.h>
+#endif
+
+#ifndef _LINUX_SCHED_H
+#define _LINUX_SCHED_H
+
+/* System headers (e.g. pthread.h) include <sched.h> and find us */
+#include_next <sched.h>
 
 /*
  * wake flags
@@ -64,6 +75,7 @@ extern void clear_current_flags(int flags);
 extern void *task_data(struct task_struct *task);
 
 extern void init_sched(void);
+extern int sched_set_stack_size(size_t size);
 extern struct task_struct *task_create(task_func_t *func, void *param);
 extern unsigned int tasks_to_run(void);
 
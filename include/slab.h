@@ -10,10 +10,12 @@
 
 #define kmalloc(size, gfp) malloc(size)
 #define kzalloc(size, gfp) calloc(1, size)
-#define kmalloc_array(n, size, flags) malloc(n * size)
+#define kmalloc_array(n, size, flags) malloc((n) * (size))
 #define kcalloc(n, size, flags) calloc(n, size)
 #define kfree(ptr) free(ptr)
+#define krealloc(ptr, size, flags) realloc(ptr, size)
 
+#define kstrdup(s, flags) strdup(s)
 #define kstrndup(s, len, flags) strndup(s, len)
 
 #define kvmalloc(size, flags) malloc(size)
@@ -40,69 +42,39 @@ static inline void *kmemdup(const void *buf, size_t len, unsigned long flags)
 #define memalloc_nofs_save() (0)
 #define memalloc_nofs_restore(v) ((void)v)
 
-struct kmem_cache {
-	const char * name;
-	unsigned int size;
-	int          alloced;
+/*
+ * Slab caches of objects of the same size, see src/slab.c.
+ */
+struct kmem_cache;
+
+struct kmem_cache_stats {
+	const char    *name;
+	unsigned int  obj_size;
+	unsigned long objs_inuse;  /* allocated and not yet freed */
+	unsigned long slabs;       /* slabs of the cache */
+	unsigned long bytes;       /* memory taken by slabs */
+	unsigned long allocs;      /* total number of allocations */
+	unsigned long hits;        /* allocations served by magazines */
 };
 
-static inline
-struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
-				     unsigned int align, slab_flags_t flags,
-				     void (*ctor)(void *))
-{
-	struct kmem_cache *cache;
-
-	(void)flags;
-	(void)ctor;
-
-	cache = calloc(1, sizeof(*cache));
-	if (unlikely(!cache))
-		return NULL;
-
-	cache->name = name;
-	cache->size = size;
-
-	return cache;
-}
-
-
-static inline
-void kmem_cache_destroy(struct kmem_cache *c)
-{
-	WARN_ON(c->alloced);
-	free(c);
-}
-
-static inline __malloc
-void *kmem_cache_alloc(struct kmem_cache *c, gfp_t flags)
-{
-	void *mem;
-
-	mem = malloc(c->size);
-	if (unlikely(!mem))
-		return NULL;
-
-	c->alloced++;
+extern struct kmem_cache *kmem_cache_create(const char *name,
+					    unsigned int size,
+					    unsigned int align,
+					    slab_flags_t flags,
+					    void (*ctor)(void *));
+extern void kmem_cache_destroy(struct kmem_cache *c);
+extern __malloc void *kmem_cache_alloc(struct kmem_cache *c, gfp_t flags);
+extern void kmem_cache_free(struct kmem_cache *c, void *p);
 
-	if (flags & __GFP_ZERO)
-		memset(mem, 0, c->size);
-
-	return mem;
-}
+extern void kmem_cache_get_stats(struct kmem_cache *c,
+				 struct kmem_cache_stats *stats);
+extern void kmem_caches_dump_stats(void);
 
 static inline void *kmem_cache_zalloc(struct kmem_cache *k, gfp_t flags)
 {
 	return kmem_cache_alloc(k, flags | __GFP_ZERO);
 }
 
-static inline
-void kmem_cache_free(struct kmem_cache *c, void *p)
-{
-	c->alloced--;
-	free(p);
-}
-
 #define KMEM_CACHE(__struct, __flags)					\
 		kmem_cache_create(#__struct, sizeof(struct __struct),	\
 			__alignof__(struct __struct), (__flags), NULL)
@@ -4,6 +4,7 @@
 
 #include "net.h"
 #include "event.h"
+#include "uring.h"
 
 
 /* Historically, SOCKWQ_ASYNC_NOSPACE & SOCKWQ_ASYNC_WAITDATA were located
@@ -60,11 +61,42 @@ struct socket {
 	int                    state;
 	const struct proto_ops *ops;
 	int                    fd;
-	char                   cache[128<<10]; /* must be ^2 */
+	char                   *cache;     /* read-ahead ring */
+	unsigned int           cache_size; /* ^2, grows on demand */
 	unsigned int           cache_pos;
 	unsigned int           cache_len;
+
+	/* io_uring receive path, see sock_enable_uring() */
+	bool                   uring;
+	bool                   rx_armed;   /* multishot receive is inflight */
+	bool                   rx_eof;
+	int                    rx_err;
+	struct uring_op        rx_op;
+	struct list_head       rx_bufs;    /* received, not yet consumed */
+	struct list_head       rx_starved; /* waits for free buffers */
+
+	/* MSG_ZEROCOPY sends, see sock_sendmsg_zc() */
+	bool                   zc_on;
+	bool                   zc_failed;
+	u32                    zc_next;    /* id of the next send */
+	struct list_head       zc_list;    /* not yet completed sends */
+
+	bool                   released;   /* freed when the kernel is done */
+	struct list_head       reap_entry; /* to be freed, see sock_reap() */
 };
 
+/*
+ * Reference to the data of a zero-copy send, kept by the socket till
+ * the kernel reports it does not need the data anymore.
+ */
+struct sock_zc {
+	struct list_head entry;
+	u32              id;
+	void             (*release)(struct sock_zc *zc);
+};
+
+extern void sock_enable_uring(void);
+
 extern bool sk_stream_is_writeable(const struct sock *sk);
 
 extern ssize_t sock_no_sendpage(struct socket *sock, struct page *page,
@@ -79,9 +111,12 @@ extern int kernel_accept(struct socket *sock, struct socket **newsock,
 extern void sock_release(struct socket *sock);
 extern int kernel_setsockopt(struct socket *sock, int level, int optname,
 			     char *optval, unsigned int optlen);
+extern int kernel_getsockname(struct socket *sock, struct sockaddr *addr);
 extern int kernel_getpeername(struct socket *sock, struct sockaddr *addr);
 extern int sock_recvmsg(struct socket *sock, struct kmsghdr *msg, int flags);
 extern int sock_sendmsg(struct socket *sock, struct kmsghdr *msg);
+extern int sock_sendmsg_zc(struct socket *sock, struct kmsghdr *msg,
+			   struct sock_zc *zc);
 extern int kernel_sendmsg(struct socket *sock, struct kmsghdr *msg,
 			  struct kvec *vec, size_t num, size_t size);
 
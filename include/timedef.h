@@ -8,12 +8,19 @@
 #define HZ 1000
 
 #define MSEC_PER_SEC  1000L
+#define USEC_PER_SEC  1000000L
 
 #define NSEC_PER_SEC  1000000000L
 #define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_USEC 1000L
 
-/* Jiffies here is always msecs from epoch */
-#define jiffies ({ unsigned long j = nsecs(); j / NSEC_PER_MSEC; })
+/*
+ * Jiffies here is always msecs from epoch.  Plain `jiffies` is the time
+ * of the current event loop iteration, see clock.h, `jiffies_fresh`
+ * reads the clock and is for callers which do need the precise time.
+ */
+#define jiffies ({ unsigned long j = loop_nsecs(); j / NSEC_PER_MSEC; })
+#define jiffies_fresh ({ unsigned long j = nsecs(); j / NSEC_PER_MSEC; })
 #define round_jiffies_relative(j) (j)
 
 /*
@@ -57,6 +64,14 @@ static inline unsigned long long nsecs(void)
 	return ((unsigned long long)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
 }
 
+/* Sampled by the event loop, 0 if the thread does not run one */
+extern __thread unsigned long long loop_nsecs_stamp;
+
+static inline unsigned long long loop_nsecs(void)
+{
+	return loop_nsecs_stamp ?: nsecs();
+}
+
 static inline unsigned int jiffies_to_msecs(const unsigned long j)
 {
 	return j;
@@ -3,28 +3,28 @@
 
 #include "types.h"
 #include "list.h"
-#include "rbtree.h"
 
 struct timer;
 
 typedef void (*timer_func_t)(struct timer *);
 
 struct timer {
-	timer_func_t     func;
-	struct list_head list;
-	struct rb_node   node;
-	unsigned long    expire;
+	timer_func_t      func;
+	struct hlist_node entry;
+	unsigned long     expire;
+	unsigned long     slack;  /* jiffies the timer may fire late */
+	unsigned int      idx;    /* bucket of the wheel */
 };
 
 #define __TIMER_INITIALIZER(t) {				\
-	.list = LIST_HEAD_INIT((t).list),			\
-	.node = __RB_NODE_INITIALIZER((t).node),		\
+	.entry = { .next = NULL, .pprev = NULL },		\
 	.func = NULL,						\
+	.slack = 0,						\
 	}
 
 #define INIT_TIMER(t) do {					\
-	INIT_LIST_HEAD(&(t)->list);				\
-	RB_CLEAR_NODE(&(t)->node);				\
+	INIT_HLIST_NODE(&(t)->entry);				\
+	(t)->slack = 0;						\
 	} while (0)
 
 extern unsigned int timer_calc_msecs_timeout(void);
@@ -35,4 +35,19 @@ extern void timer_add(struct timer *timer, unsigned long jexpire,
 extern bool timer_mod(struct timer *timer, unsigned long jexpire);
 extern bool timer_del(struct timer *timer);
 
+/**
+ * timer_set_slack() - lets the timer fire up to @slack jiffies late, so
+ *                     it shares a wheel bucket, i.e. a wakeup, with its
+ *                     neighbours.  Takes effect on the next add or mod.
+ */
+static inline void timer_set_slack(struct timer *timer, unsigned long slack)
+{
+	timer->slack = slack;
+}
+
+static inline bool timer_pending(const struct timer *timer)
+{
+	return !hlist_unhashed(&timer->entry);
+}
+
 #endif
@@ -43,8 +43,10 @@
 /* Copied from linux/compiler-gcc.h since we can't include it directly */
 #define barrier() __asm__ __volatile__("": : :"memory")
 
-#define smp_acquire__after_ctrl_dep()		barrier()
-#define smp_mb() barrier()
+#define smp_acquire__after_ctrl_dep()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
 #define smp_store_mb(var, value)  do { WRITE_ONCE(var, value); barrier(); } while (0)
 
 #define likely(x)	__builtin_expect(!!(x), 1)
@@ -56,6 +58,8 @@
 #define __packed		__attribute__((__packed__))
 #define __malloc		__attribute__((__malloc__))
 #define __aligned(x)		__attribute__((__aligned__(x)))
+#define SMP_CACHE_BYTES		64
+#define ____cacheline_aligned	__aligned(SMP_CACHE_BYTES)
 #define __force
 #define __rcu
 #define __user
@@ -0,0 +1,78 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "types.h"
+#include "list.h"
+
+/*
+ * Asynchronous disk and socket IO on top of io_uring.  Completions are signalled
+ * through an eventfd, which is a regular event item of the event loop,
+ * so the caller task sleeps until its CQE arrives and other tasks keep
+ * running meanwhile.  All submissions made during one loop iteration
+ * are passed to the kernel by a single io_uring_enter() call.
+ *
+ * If io_uring is not available helpers fall back to synchronous
+ * syscalls, so callers do not care.  Helpers must be called from a
+ * task context, because caller sleeps.
+ *
+ * All helpers return number of bytes (or 0 for fsync) or -errno,
+ * like the corresponding syscalls do.
+ */
+
+/*
+ * Request which is not waited for, @fn is called from the event loop
+ * for each CQE of the request, e.g. for each chunk of a multishot
+ * receive, so it must not sleep.
+ */
+struct uring_op {
+	void (*fn)(struct uring_op *op, int res, unsigned int cqe_flags);
+};
+
+/* Provided buffer, filled in by the kernel on receive */
+struct uring_buf {
+	struct list_head entry;
+	void             *addr;
+	unsigned int     len;   /* received */
+	unsigned int     off;   /* consumed */
+	unsigned short   bid;
+};
+
+extern void init_uring(void);
+extern void deinit_uring(void);
+extern bool uring_is_enabled(void);
+
+extern ssize_t uring_readv(int fd, const struct iovec *iov, int iovcnt,
+			   off_t off);
+extern ssize_t uring_writev(int fd, const struct iovec *iov, int iovcnt,
+			    off_t off);
+extern int uring_fsync(int fd, bool datasync);
+extern ssize_t uring_sendmsg(int fd, const struct msghdr *msg, int flags);
+
+struct io_uring_sqe;
+extern int uring_queue_op(const struct io_uring_sqe *sqe,
+			  struct uring_op *op);
+
+extern bool uring_bufs_enabled(void);
+extern unsigned short uring_buf_group(void);
+extern struct uring_buf *uring_buf_get(unsigned int cqe_flags);
+extern void uring_buf_put(struct uring_buf *buf);
+
+static inline ssize_t uring_read(int fd, void *buf, size_t len, off_t off)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return uring_readv(fd, &iov, 1, off);
+}
+
+static inline ssize_t uring_write(int fd, const void *buf, size_t len,
+				  off_t off)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return uring_writev(fd, &iov, 1, off);
+}
+
+#endif
@@ -113,6 +113,9 @@ extern struct workqueue_struct *alloc_workqueue(const char *fmt,
 extern void destroy_workqueue(struct workqueue_struct *wq);
 extern void flush_workqueue(struct workqueue_struct *wq);
 
+extern bool work_pending(struct work_struct *work);
+#define delayed_work_pending(w) work_pending(&(w)->work)
+
 extern bool queue_work(struct workqueue_struct *wq,
 		       struct work_struct *work);
 extern bool flush_work(struct work_struct *work);
@@ -0,0 +1,634 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ceph/ceph_debug.h"
+
+#include "err.h"
+#include "slab.h"
+#include "sched.h"
+#include "event.h"
+#include "wait.h"
+#include "page.h"
+#include "printk.h"
+#include "timedef.h"
+#include "perf_counters.h"
+
+#include "ceph/admin_socket.h"
+
+/*
+ * Admin socket is served by the event loop of the reactor which has
+ * started it: a command is read by the event action of the session,
+ * then a task executes the command and sends the reply, so handlers may
+ * sleep and a slow reader does not stall the loop.
+ */
+
+enum {
+	ADMIN_CMD_MAX       = 512,
+	ADMIN_OUT_MIN       = 4096,
+	ADMIN_SEND_TIMEOUT  = 5 * HZ,
+	ADMIN_NODES_MAX     = 64,
+};
+
+struct ceph_admin_out {
+	char   *buf;     /* starts with the __be32 length of the output */
+	size_t len;
+	size_t size;
+	int    err;
+};
+
+struct ceph_admin_socket {
+	char                 *path;
+	int                  fd;
+	struct event_item    ev;
+	const struct ceph_admin_command
+			     *cmds;
+	unsigned int         nr_cmds;
+	void                 *priv;
+	struct list_head     sessions;  /* reading a command */
+	struct list_head     closed;    /* sessions to free */
+	struct event_item    reap_ev;
+	unsigned int         nr_running; /* commands being executed */
+	struct wait_queue_head
+			     wait;
+};
+
+struct ceph_admin_session {
+	struct ceph_admin_socket *asok;
+	struct list_head     node;      /* entry in ->sessions or ->closed */
+	int                  fd;
+	struct event_item    ev;
+	unsigned int         len;
+	char                 cmd[ADMIN_CMD_MAX];
+};
+
+static int admin_out_reserve(struct ceph_admin_out *out, size_t len)
+{
+	size_t size;
+	char *buf;
+
+	if (out->err)
+		return out->err;
+	if (out->len + len < out->size)
+		return 0;
+
+	size = max_t(size_t, out->size, ADMIN_OUT_MIN);
+	while (size <= out->len + len)
+		size <<= 1;
+	buf = krealloc(out->buf, size, GFP_KERNEL);
+	if (unlikely(!buf)) {
+		out->err = -ENOMEM;
+		return out->err;
+	}
+	out->buf = buf;
+	out->size = size;
+
+	return 0;
+}
+
+void ceph_admin_printf(struct ceph_admin_out *out, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (len < 0 || admin_out_reserve(out, len))
+		return;
+
+	va_start(args, fmt);
+	vsnprintf(out->buf + out->len, out->size - out->len, fmt, args);
+	va_end(args);
+	out->len += len;
+}
+
+/**
+ * ceph_admin_json_str() - prints @len bytes of @str as a quoted and
+ *                         escaped JSON string.
+ */
+void ceph_admin_json_str(struct ceph_admin_out *out, const char *str,
+			 size_t len)
+{
+	unsigned char c;
+	size_t i;
+
+	/* Worst case is \u00XX for every byte */
+	if (admin_out_reserve(out, len * 6 + 2))
+		return;
+
+	out->buf[out->len++] = '"';
+	for (i = 0; i < len; i++) {
+		c = str[i];
+		if (c == '"' || c == '\\') {
+			out->buf[out->len++] = '\\';
+			out->buf[out->len++] = c;
+		} else if (c < 0x20) {
+			out->len += sprintf(out->buf + out->len, "\\u%04x", c);
+		} else {
+			out->buf[out->len++] = c;
+		}
+	}
+	out->buf[out->len++] = '"';
+}
+
+static void admin_out_reset(struct ceph_admin_out *out)
+{
+	out->err = 0;
+	out->len = sizeof(__be32);
+}
+
+/* Built-in commands */
+
+static int admin_help(struct ceph_admin_out *out, void *priv);
+
+static int admin_perf_dump(struct ceph_admin_out *out, void *priv)
+{
+	static const unsigned int quantiles[] = { 500, 900, 990, 999 };
+	struct perf_hist *hist;
+	unsigned int i, q;
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (unlikely(!hist))
+		return -ENOMEM;
+
+	ceph_admin_printf(out, "{\"counters\":{");
+	for (i = 0; i < PERF_NR_COUNTERS; i++)
+		ceph_admin_printf(out, "%s\"%s\":%lld", i ? "," : "",
+				  perf_counter_name(i),
+				  (long long)perf_counter_read(i));
+	ceph_admin_printf(out, "},\"latencies_ns\":{");
+	for (i = 0; i < PERF_NR_HISTS; i++) {
+		perf_hist_read(i, hist);
+		ceph_admin_printf(out, "%s\"%s\":{\"count\":%llu,\"avg\":%llu",
+				  i ? "," : "", perf_hist_name(i),
+				  hist->count, hist->count ?
+				  hist->sum / hist->count : 0);
+		for (q = 0; q < ARRAY_SIZE(quantiles); q++)
+			ceph_admin_printf(out, ",\"p%u\":%llu",
+				quantiles[q] % 100 ? quantiles[q] :
+						     quantiles[q] / 10,
+				perf_hist_quantile(hist, quantiles[q]));
+		ceph_admin_printf(out, "}");
+	}
+	ceph_admin_printf(out, "}}");
+	kfree(hist);
+
+	return 0;
+}
+
+static int admin_perf_histogram_dump(struct ceph_admin_out *out, void *priv)
+{
+	struct perf_hist *hist;
+	unsigned int i, b;
+	bool first;
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (unlikely(!hist))
+		return -ENOMEM;
+
+	ceph_admin_printf(out, "{");
+	for (i = 0; i < PERF_NR_HISTS; i++) {
+		perf_hist_read(i, hist);
+		ceph_admin_printf(out, "%s\"%s\":{\"count\":%llu,\"sum\":%llu,"
+				  "\"buckets\":[", i ? "," : "",
+				  perf_hist_name(i), hist->count, hist->sum);
+		/* Only non-empty buckets, as [start_ns, count] */
+		for (first = true, b = 0; b < PERF_HIST_BUCKETS; b++) {
+			if (!hist->buckets[b])
+				continue;
+			ceph_admin_printf(out, "%s[%llu,%llu]",
+					  first ? "" : ",",
+					  perf_hist_bucket_start(b),
+					  hist->buckets[b]);
+			first = false;
+		}
+		ceph_admin_printf(out, "]}");
+	}
+	ceph_admin_printf(out, "}");
+	kfree(hist);
+
+	return 0;
+}
+
+static int admin_allocator_stats(struct ceph_admin_out *out, void *priv)
+{
+	struct page_node_stats *nodes;
+	unsigned long nr_pages = 0, nr_free = 0;
+	unsigned int i, nr;
+
+	nodes = kcalloc(ADMIN_NODES_MAX, sizeof(*nodes), GFP_KERNEL);
+	if (unlikely(!nodes))
+		return -ENOMEM;
+
+	nr = page_node_stats(nodes, ADMIN_NODES_MAX);
+	ceph_admin_printf(out, "{\"page_size\":%lu,\"arenas\":%u,\"nodes\":[",
+			  PAGE_SIZE, page_nr_arenas());
+	for (i = 0; i < nr; i++) {
+		ceph_admin_printf(out, "%s{\"node\":%u,\"pages\":%lu,"
+				  "\"free_pages\":%lu}", i ? "," : "",
+				  nodes[i].node, nodes[i].nr_pages,
+				  nodes[i].nr_free);
+		nr_pages += nodes[i].nr_pages;
+		nr_free += nodes[i].nr_free;
+	}
+	ceph_admin_printf(out, "],\"pages\":%lu,\"free_pages\":%lu,"
+			  "\"used_pages\":%lld,\"allocs\":%lld,\"frees\":%lld,"
+			  "\"malloc_allocs\":%lld}", nr_pages, nr_free,
+			  (long long)perf_counter_read(PERF_PAGE_USED),
+			  (long long)perf_counter_read(PERF_PAGE_ALLOCS),
+			  (long long)perf_counter_read(PERF_PAGE_FREES),
+			  (long long)perf_counter_read(PERF_PAGE_MALLOC_ALLOCS));
+	kfree(nodes);
+
+	return 0;
+}
+
+static const struct ceph_admin_command admin_builtin_cmds[] = {
+	{ "help", "list available commands", admin_help },
+	{ "perf dump", "counters and latency quantiles", admin_perf_dump },
+	{ "perf histogram dump", "latency histograms",
+	  admin_perf_histogram_dump },
+	{ "allocator stats", "page allocator arenas and usage",
+	  admin_allocator_stats },
+};
+
+static void admin_help_cmds(struct ceph_admin_out *out,
+			    const struct ceph_admin_command *cmds,
+			    unsigned int nr, bool first)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++, first = false) {
+		ceph_admin_printf(out, "%s", first ? "" : ",");
+		ceph_admin_json_str(out, cmds[i].prefix, strlen(cmds[i].prefix));
+		ceph_admin_printf(out, ":");
+		ceph_admin_json_str(out, cmds[i].help, strlen(cmds[i].help));
+	}
+}
+
+static int admin_help(struct ceph_admin_out *out, void *priv)
+{
+	struct ceph_admin_socket *asok = priv;
+
+	ceph_admin_printf(out, "{");
+	admin_help_cmds(out, admin_builtin_cmds,
+			ARRAY_SIZE(admin_builtin_cmds), true);
+	admin_help_cmds(out, asok->cmds, asok->nr_cmds, false);
+	ceph_admin_printf(out, "}");
+
+	return 0;
+}
+
+/**
+ * admin_parse_cmd() - returns the command prefix, either the plain
+ *                     command or the "prefix" of a JSON request.
+ */
+static char *admin_parse_cmd(char *cmd)
+{
+	char *p, *end;
+
+	while (isspace(*cmd))
+		cmd++;
+	end = cmd + strlen(cmd);
+	while (end > cmd && isspace(end[-1]))
+		*--end = '\0';
+	if (*cmd != '{')
+		return cmd;
+
+	p = strstr(cmd, "\"prefix\"");
+	if (!p)
+		return NULL;
+	p = strchr(p + strlen("\"prefix\""), ':');
+	if (!p)
+		return NULL;
+	p = strchr(p, '"');
+	if (!p)
+		return NULL;
+	end = strchr(++p, '"');
+	if (!end)
+		return NULL;
+	*end = '\0';
+
+	return p;
+}
+
+static void admin_execute(struct ceph_admin_socket *asok, char *cmd,
+			  struct ceph_admin_out *out)
+{
+	const struct ceph_admin_command *c = NULL;
+	void *priv = asok;
+	char *prefix;
+	unsigned int i;
+	int ret;
+
+	/* Built-in commands get the socket, the rest get ->priv */
+	prefix = admin_parse_cmd(cmd);
+	for (i = 0; prefix && i < ARRAY_SIZE(admin_builtin_cmds); i++) {
+		if (!strcmp(prefix, admin_builtin_cmds[i].prefix)) {
+			c = &admin_builtin_cmds[i];
+			break;
+		}
+	}
+	for (i = 0; prefix && !c && i < asok->nr_cmds; i++) {
+		if (!strcmp(prefix, asok->cmds[i].prefix)) {
+			c = &asok->cmds[i];
+			priv = asok->priv;
+		}
+	}
+	if (!c) {
+		ceph_admin_printf(out, "{\"error\":\"unknown command\","
+				  "\"command\":");
+		ceph_admin_json_str(out, cmd, strlen(cmd));
+		ceph_admin_printf(out, "}");
+		return;
+	}
+
+	ret = c->handler(out, priv);
+	if (!ret)
+		ret = out->err;
+	if (ret) {
+		admin_out_reset(out);
+		ceph_admin_printf(out, "{\"error\":\"%s\",\"errno\":%d}",
+				  strerror(-ret), ret);
+	}
+}
+
+static int admin_send(int fd, const char *buf, size_t len)
+{
+	unsigned long deadline = jiffies + ADMIN_SEND_TIMEOUT;
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EAGAIN) {
+			if (time_after(jiffies, deadline))
+				return -ETIMEDOUT;
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_timeout(1);
+			continue;
+		}
+		if (ret < 0)
+			return -errno;
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int admin_session_task(void *arg)
+{
+	struct ceph_admin_session *s = arg;
+	struct ceph_admin_socket *asok = s->asok;
+	struct ceph_admin_out out = {};
+	int ret;
+
+	admin_out_reset(&out);
+	admin_execute(asok, s->cmd, &out);
+	if (!out.err) {
+		*(__be32 *)out.buf = cpu_to_be32(out.len - sizeof(__be32));
+		ret = admin_send(s->fd, out.buf, out.len);
+	} else {
+		ret = out.err;
+	}
+	if (ret == -EPIPE || ret == -ECONNRESET)
+		/* Client has gone, nothing to worry about */
+		dout("admin: client of \"%s\" has gone\n", s->cmd);
+	else if (ret)
+		pr_err("admin: reply to \"%s\" failed, ret=%d\n", s->cmd, ret);
+	kfree(out.buf);
+	close(s->fd);
+	kfree(s);
+
+	if (!--asok->nr_running)
+		wake_up(&asok->wait);
+
+	return 0;
+}
+
+/*
+ * Session can't be freed from the action of its own event item, so
+ * sessions closed before a command is read are freed by the reaper.
+ */
+static void admin_reap_sessions(struct event_item *ev)
+{
+	struct ceph_admin_socket *asok =
+		container_of(ev, typeof(*asok), reap_ev);
+	struct ceph_admin_session *s;
+
+	while (!list_empty(&asok->closed)) {
+		s = list_first_entry(&asok->closed, typeof(*s), node);
+		list_del(&s->node);
+		kfree(s);
+	}
+}
+
+static void admin_close_session(struct ceph_admin_session *s)
+{
+	event_item_del(&s->ev);
+	close(s->fd);
+	list_move_tail(&s->node, &s->asok->closed);
+	event_item_defer(&s->asok->reap_ev);
+}
+
+static void admin_session_event(struct event_item *ev)
+{
+	struct ceph_admin_session *s = container_of(ev, typeof(*s), ev);
+	struct ceph_admin_socket *asok = s->asok;
+	struct task_struct *task;
+	char *end;
+	ssize_t ret;
+
+	while (true) {
+		ret = recv(s->fd, s->cmd + s->len, sizeof(s->cmd) - 1 - s->len,
+			   0);
+		if (ret < 0 && errno == EAGAIN)
+			return;
+		if (ret <= 0) {
+			/* Closed before the command is complete */
+			admin_close_session(s);
+			return;
+		}
+		s->len += ret;
+		s->cmd[s->len] = '\0';
+		end = strchr(s->cmd, '\n');
+		if (end || memchr(s->cmd, '\0', s->len)) {
+			if (end)
+				*end = '\0';
+			break;
+		}
+		if (s->len == sizeof(s->cmd) - 1) {
+			pr_err("admin: command is too long\n");
+			admin_close_session(s);
+			return;
+		}
+	}
+
+	/* Command is read, the rest is done by the task */
+	event_item_del(&s->ev);
+	task = task_create(admin_session_task, s);
+	if (unlikely(!task)) {
+		pr_err("admin: failed to create a task\n");
+		close(s->fd);
+		list_move_tail(&s->node, &asok->closed);
+		event_item_defer(&asok->reap_ev);
+		return;
+	}
+	list_del_init(&s->node);
+	asok->nr_running++;
+	wake_up_process(task);
+}
+
+static void admin_accept(struct event_item *ev)
+{
+	struct ceph_admin_socket *asok = container_of(ev, typeof(*asok), ev);
+	struct ceph_admin_session *s;
+	int fd, ret;
+
+	while ((fd = accept4(asok->fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		s = kzalloc(sizeof(*s), GFP_KERNEL);
+		if (unlikely(!s)) {
+			close(fd);
+			continue;
+		}
+		s->asok = asok;
+		s->fd = fd;
+		INIT_EVENT(&s->ev, admin_session_event);
+		s->ev.events = EPOLLIN;
+		list_add_tail(&s->node, &asok->sessions);
+
+		ret = event_item_add(&s->ev, fd);
+		if (unlikely(ret)) {
+			pr_err("admin: event_item_add() failed, ret=%d\n", ret);
+			admin_close_session(s);
+		}
+	}
+	if (errno != EAGAIN)
+		pr_err("admin: accept4() failed, errno=%d\n", errno);
+}
+
+/*
+ * Removes the socket of the previous run, anything else at @path is
+ * left alone.
+ */
+static int admin_unlink_stale(const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st))
+		return errno == ENOENT ? 0 : -errno;
+	if (!S_ISSOCK(st.st_mode))
+		return -EEXIST;
+	if (unlink(path))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * ceph_admin_socket_start() - starts serving the admin socket on @path
+ *                             with built-in commands and @cmds, which are
+ *                             passed @priv.
+ */
+struct ceph_admin_socket *
+ceph_admin_socket_start(const char *path,
+			const struct ceph_admin_command *cmds,
+			unsigned int nr_cmds, void *priv)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct ceph_admin_socket *asok;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return ERR_PTR(-ENAMETOOLONG);
+	strcpy(addr.sun_path, path);
+
+	asok = kzalloc(sizeof(*asok), GFP_KERNEL);
+	if (unlikely(!asok))
+		return ERR_PTR(-ENOMEM);
+
+	asok->cmds = cmds;
+	asok->nr_cmds = nr_cmds;
+	asok->priv = priv;
+	INIT_LIST_HEAD(&asok->sessions);
+	INIT_LIST_HEAD(&asok->closed);
+	init_waitqueue_head(&asok->wait);
+	INIT_EVENT(&asok->reap_ev, admin_reap_sessions);
+	INIT_EVENT(&asok->ev, admin_accept);
+	asok->path = kstrdup(path, GFP_KERNEL);
+	if (unlikely(!asok->path)) {
+		ret = -ENOMEM;
+		goto free_asok;
+	}
+
+	asok->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+			  SOCK_CLOEXEC, 0);
+	if (asok->fd < 0) {
+		ret = -errno;
+		goto free_path;
+	}
+	ret = admin_unlink_stale(path);
+	if (ret) {
+		pr_err("admin: can't use %s, ret=%d\n", path, ret);
+		goto close_fd;
+	}
+	if (bind(asok->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		ret = -errno;
+		goto close_fd;
+	}
+	/* Commands expose the internals, only the owner may connect */
+	if (chmod(path, 0600) || listen(asok->fd, 16)) {
+		ret = -errno;
+		goto unlink;
+	}
+	asok->ev.events = EPOLLIN;
+	ret = event_item_add(&asok->ev, asok->fd);
+	if (ret)
+		goto unlink;
+
+	return asok;
+
+unlink:
+	unlink(path);
+close_fd:
+	close(asok->fd);
+free_path:
+	kfree(asok->path);
+free_asok:
+	kfree(asok);
+
+	return ERR_PTR(ret);
+}
+
+/**
+ * ceph_admin_socket_stop() - closes the socket and waits for commands
+ *                            in progress, called from a task on the
+ *                            reactor which has started the socket.
+ */
+void ceph_admin_socket_stop(struct ceph_admin_socket *asok)
+{
+	struct ceph_admin_session *s;
+
+	event_item_del(&asok->ev);
+	close(asok->fd);
+	unlink(asok->path);
+
+	while (!list_empty(&asok->sessions)) {
+		s = list_first_entry(&asok->sessions, typeof(*s), node);
+		admin_close_session(s);
+	}
+	event_item_del(&asok->reap_ev);
+	admin_reap_sessions(&asok->reap_ev);
+
+	wait_event(asok->wait, !asok->nr_running);
+
+	kfree(asok->path);
+	kfree(asok);
+}
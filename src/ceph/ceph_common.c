@@ -255,6 +255,10 @@ enum {
 	Opt_mount_timeout,
 	Opt_osd_idle_ttl,
 	Opt_osd_request_timeout,
+	Opt_osd_op_tasks,
+	Opt_reply_cork_usecs,
+	Opt_reply_cork_bytes,
+	Opt_tcp_zerocopy_bytes,
 	/* int args above */
 	Opt_fsid,
 	Opt_name,
@@ -262,6 +266,10 @@ enum {
 	Opt_key,
 	Opt_ip,
 	Opt_class_dir,
+	Opt_objectstore,
+	Opt_osd_data,
+	Opt_shm_path,
+	Opt_admin_socket,
 	/* string args above */
 	Opt_share,
 	Opt_crc,
@@ -275,6 +283,7 @@ enum {
 
 static const struct fs_parameter_spec ceph_parameters[] = {
 	fsparam_flag	("abort_on_full",		Opt_abort_on_full),
+	fsparam_string	("admin_socket",		Opt_admin_socket),
 	fsparam_flag_no ("cephx_require_signatures",	Opt_cephx_require_signatures),
 	fsparam_flag_no ("cephx_sign_messages",		Opt_cephx_sign_messages),
 	fsparam_flag_no ("crc",				Opt_crc),
@@ -286,14 +295,21 @@ static const struct fs_parameter_spec ceph_parameters[] = {
 	fsparam_string	("name",			Opt_name),
 	fsparam_u32	("osd_idle_ttl",		Opt_osd_idle_ttl),
 	fsparam_u32	("osd_request_timeout",		Opt_osd_request_timeout),
+	fsparam_u32	("osd_op_tasks",		Opt_osd_op_tasks),
 	fsparam_u32	("osdkeepalive",		Opt_osdkeepalivetimeout),
+	fsparam_u32	("reply_cork_bytes",		Opt_reply_cork_bytes),
+	fsparam_u32	("reply_cork_usecs",		Opt_reply_cork_usecs),
 	__fsparam	(fs_param_is_s32, "osdtimeout", Opt_osdtimeout,
 			 fs_param_deprecated, NULL),
 	fsparam_string	("secret",			Opt_secret),
 	fsparam_flag_no ("share",			Opt_share),
+	fsparam_string	("shm_path",			Opt_shm_path),
 	fsparam_flag_no ("tcp_nodelay",			Opt_tcp_nodelay),
+	fsparam_u32	("tcp_zerocopy_bytes",		Opt_tcp_zerocopy_bytes),
 	fsparam_flag	("noop_write",			Opt_noop_write),
 	fsparam_string	("class_dir",			Opt_class_dir),
+	fsparam_string	("objectstore",			Opt_objectstore),
+	fsparam_string	("osd_data",			Opt_osd_data),
 	{}
 };
 
@@ -317,6 +333,9 @@ struct ceph_options *ceph_alloc_options(void)
 	opt->mount_timeout = CEPH_MOUNT_TIMEOUT_DEFAULT;
 	opt->osd_idle_ttl = CEPH_OSD_IDLE_TTL_DEFAULT;
 	opt->osd_request_timeout = CEPH_OSD_REQUEST_TIMEOUT_DEFAULT;
+	opt->osd_op_tasks = CEPH_OSD_OP_TASKS_DEFAULT;
+	opt->reply_cork_usecs = CEPH_REPLY_CORK_USECS_DEFAULT;
+	opt->reply_cork_bytes = CEPH_REPLY_CORK_BYTES_DEFAULT;
 	return opt;
 }
 EXPORT_SYMBOL(ceph_alloc_options);
@@ -329,6 +348,10 @@ void ceph_destroy_options(struct ceph_options *opt)
 
 	kfree(opt->name);
 	kfree(opt->class_dir);
+	kfree(opt->objectstore);
+	kfree(opt->osd_data);
+	kfree(opt->shm_path);
+	kfree(opt->admin_socket);
 	if (opt->key) {
 		ceph_crypto_key_destroy(opt->key);
 		kfree(opt->key);
@@ -492,6 +515,27 @@ int ceph_parse_param(struct fs_parameter *param, struct ceph_options *opt,
 		opt->osd_request_timeout =
 		    msecs_to_jiffies(result.uint_32 * 1000);
 		break;
+	case Opt_osd_op_tasks:
+		/* At least one task should execute requests */
+		if (result.uint_32 < 1 || result.uint_32 > 4096)
+			goto out_of_range;
+		opt->osd_op_tasks = result.uint_32;
+		break;
+	case Opt_reply_cork_usecs:
+		/* 0 sends replies right away */
+		if (result.uint_32 > USEC_PER_SEC)
+			goto out_of_range;
+		opt->reply_cork_usecs = result.uint_32;
+		break;
+	case Opt_reply_cork_bytes:
+		if (result.uint_32 < 1)
+			goto out_of_range;
+		opt->reply_cork_bytes = result.uint_32;
+		break;
+	case Opt_tcp_zerocopy_bytes:
+		/* 0 disables zero-copy sends */
+		opt->tcp_zerocopy_bytes = result.uint_32;
+		break;
 
 	case Opt_share:
 		if (!result.negated)
@@ -544,6 +588,30 @@ int ceph_parse_param(struct fs_parameter *param, struct ceph_options *opt,
 		param->string = NULL;
 		break;
 
+	case Opt_objectstore:
+		kfree(opt->objectstore);
+		opt->objectstore = param->string;
+		param->string = NULL;
+		break;
+
+	case Opt_osd_data:
+		kfree(opt->osd_data);
+		opt->osd_data = param->string;
+		param->string = NULL;
+		break;
+
+	case Opt_shm_path:
+		kfree(opt->shm_path);
+		opt->shm_path = param->string;
+		param->string = NULL;
+		break;
+
+	case Opt_admin_socket:
+		kfree(opt->admin_socket);
+		opt->admin_socket = param->string;
+		param->string = NULL;
+		break;
+
 	default:
 		BUG();
 	}
@@ -571,6 +639,26 @@ int ceph_print_client_options(struct seq_file *m, struct ceph_client *client,
 		seq_escape(m, opt->class_dir, ", \t\n\\");
 		seq_putc(m, ',');
 	}
+	if (opt->objectstore) {
+		seq_puts(m, "objectstore=");
+		seq_escape(m, opt->objectstore, ", \t\n\\");
+		seq_putc(m, ',');
+	}
+	if (opt->osd_data) {
+		seq_puts(m, "osd_data=");
+		seq_escape(m, opt->osd_data, ", \t\n\\");
+		seq_putc(m, ',');
+	}
+	if (opt->shm_path) {
+		seq_puts(m, "shm_path=");
+		seq_escape(m, opt->shm_path, ", \t\n\\");
+		seq_putc(m, ',');
+	}
+	if (opt->admin_socket) {
+		seq_puts(m, "admin_socket=");
+		seq_escape(m, opt->admin_socket, ", \t\n\\");
+		seq_putc(m, ',');
+	}
 	if (opt->key)
 		seq_puts(m, "secret=<hidden>,");
 
@@ -605,6 +693,14 @@ int ceph_print_client_options(struct seq_file *m, struct ceph_client *client,
 	if (opt->osd_request_timeout != CEPH_OSD_REQUEST_TIMEOUT_DEFAULT)
 		seq_printf(m, "osd_request_timeout=%d,",
 			   jiffies_to_msecs(opt->osd_request_timeout) / 1000);
+	if (opt->osd_op_tasks != CEPH_OSD_OP_TASKS_DEFAULT)
+		seq_printf(m, "osd_op_tasks=%u,", opt->osd_op_tasks);
+	if (opt->reply_cork_usecs != CEPH_REPLY_CORK_USECS_DEFAULT)
+		seq_printf(m, "reply_cork_usecs=%u,", opt->reply_cork_usecs);
+	if (opt->reply_cork_bytes != CEPH_REPLY_CORK_BYTES_DEFAULT)
+		seq_printf(m, "reply_cork_bytes=%u,", opt->reply_cork_bytes);
+	if (opt->tcp_zerocopy_bytes)
+		seq_printf(m, "tcp_zerocopy_bytes=%u,", opt->tcp_zerocopy_bytes);
 
 	/* drop redundant comma */
 	if (m->count != pos)
@@ -0,0 +1,1070 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "ceph/ceph_debug.h"
+
+#include "module.h"
+#include "err.h"
+#include "slab.h"
+
+#include "uring.h"
+#include "crc32c.h"
+
+#include "ceph/ceph_hash.h"
+#include "ceph/objstore.h"
+#include "ceph/decode.h"
+
+/*
+ * Simplest file store possible: each object is stored as a separate
+ * file in the 'objects' directory of the OSD data path.  Omap and
+ * xattrs of an object are loaded into memory and persisted to a
+ * separate meta file, which is a log: each change appends records of
+ * the changed entries, the last record of a key wins.  When appended
+ * records outgrow the last full write, the file is compacted, i.e.
+ * replaced atomically by writing all entries to a temporary file and
+ * renaming it.
+ *
+ * Objects are cached by the generic layer up to FILESTORE_MAX_OBJECTS,
+ * evicted objects are loaded again from the files.
+ *
+ *   <osd_data>/objects/d_<name>  - object data
+ *   <osd_data>/objects/m_<name>  - omap and xattrs
+ *
+ * where <name> is built from pool, hash, snapid, namespace, oid and
+ * locator key, see filestore_object_name().  Names which don't fit
+ * NAME_MAX are hashed, the full name is then kept in the meta log and
+ * checked on load, so a collision is an error, not another object.
+ *
+ * All data IO goes through io_uring, so a task which does IO sleeps
+ * and does not block the event loop.  Because of that an object is
+ * pinned while IO is in progress and its fd can't be closed by the
+ * LRU.  Objects are accessed only by the owner of their shard, so each
+ * shard has own LRU and the limit of opened files is split between
+ * shards.
+ *
+ * Meta is fsynced by each change.  Data and new directory entries are
+ * fsynced once per request by ->sync_object(), before the reply which
+ * claims the request is on disk.
+ */
+
+enum {
+	FILESTORE_MAX_OPEN_FILES = 1024,
+	FILESTORE_MAX_IOVS       = 64,
+	FILESTORE_MAX_RETRIES    = 8,  /* of EINTR or EAGAIN in a row */
+	FILESTORE_BLOCK_SHIFT    = 16, /* 64k chunks of received writes */
+	FILESTORE_MAX_OBJECTS    = 65536,
+	FILESTORE_META_VERSION   = 2,  /* 1 is a snapshot, 2 is a log */
+	FILESTORE_META_COMPACT   = 64 << 10, /* appended before compaction */
+};
+
+/* Records of the meta log */
+enum {
+	FILESTORE_META_OMAP  = 1,
+	FILESTORE_META_XATTR = 2,
+	FILESTORE_META_NAME  = 3, /* full name of an object with hashed name */
+};
+
+struct ceph_filestore_lru {
+	struct list_head       lru;      /* objects with opened fd */
+	unsigned int           nr_open;
+};
+
+struct ceph_filestore {
+	struct ceph_objstore   os;
+	int                    dir_fd;
+	unsigned int           max_open; /* per shard */
+	unsigned int           nr_lrus;
+	struct ceph_filestore_lru
+			       lrus[];   /* one per shard */
+};
+
+struct ceph_filestore_object {
+	struct ceph_osds_object obj;
+	int                     fd;
+	unsigned int            pin;      /* IO in progress, don't close */
+	struct list_head        lru_node; /* entry in ->lru of the shard */
+	u64                     meta_len; /* of the meta log, 0 to rewrite */
+	u64                     meta_base;/* written by the last rewrite */
+	bool                    data_dirty;  /* data is not fsynced */
+	bool                    entry_dirty; /* dir entry is not fsynced */
+	char                    *full_name; /* if ->name is hashed */
+	char                    name[NAME_MAX + 1];
+};
+
+static inline struct ceph_filestore *to_filestore(struct ceph_objstore *os)
+{
+	return container_of(os, struct ceph_filestore, os);
+}
+
+static inline struct ceph_filestore_object *
+to_file_object(struct ceph_osds_object *obj)
+{
+	return container_of(obj, struct ceph_filestore_object, obj);
+}
+
+static inline struct ceph_filestore_lru *
+object_lru(struct ceph_filestore *fs, struct ceph_filestore_object *fobj)
+{
+	return &fs->lrus[fobj->obj.o_shard];
+}
+
+static struct ceph_objstore *filestore_create(struct ceph_options *opt,
+					      unsigned int nr_shards)
+{
+	struct ceph_filestore *fs;
+	int dir_fd, ret, i;
+
+	if (!opt->osd_data) {
+		pr_err("%s: osd_data=<path> option is required\n", __func__);
+		return ERR_PTR(-EINVAL);
+	}
+
+	dir_fd = open(opt->osd_data, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0) {
+		ret = -errno;
+		pr_err("%s: can't open '%s', ret=%d\n", __func__,
+		       opt->osd_data, ret);
+		return ERR_PTR(ret);
+	}
+	ret = mkdirat(dir_fd, "objects", 0755);
+	if (ret && errno != EEXIST) {
+		ret = -errno;
+		goto err;
+	}
+	ret = openat(dir_fd, "objects", O_RDONLY | O_DIRECTORY);
+	close(dir_fd);
+	if (ret < 0) {
+		ret = -errno;
+		pr_err("%s: can't open '%s/objects', ret=%d\n", __func__,
+		       opt->osd_data, ret);
+		return ERR_PTR(ret);
+	}
+	dir_fd = ret;
+
+	fs = kzalloc(struct_size(fs, lrus, nr_shards), GFP_KERNEL);
+	if (!fs) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	fs->dir_fd = dir_fd;
+	fs->max_open = max_t(unsigned int,
+			     FILESTORE_MAX_OPEN_FILES / nr_shards, 1);
+	fs->nr_lrus = nr_shards;
+	for (i = 0; i < nr_shards; i++)
+		INIT_LIST_HEAD(&fs->lrus[i].lru);
+
+	return &fs->os;
+
+err:
+	close(dir_fd);
+	return ERR_PTR(ret);
+}
+
+static void filestore_destroy(struct ceph_objstore *os)
+{
+	struct ceph_filestore *fs = to_filestore(os);
+	int i;
+
+	for (i = 0; i < fs->nr_lrus; i++)
+		WARN_ON(fs->lrus[i].nr_open);
+	close(fs->dir_fd);
+	kfree(fs);
+}
+
+static struct ceph_osds_object *
+filestore_alloc_object(struct ceph_objstore *os)
+{
+	struct ceph_filestore_object *fobj;
+
+	fobj = kmalloc(sizeof(*fobj), GFP_KERNEL);
+	if (!fobj)
+		return NULL;
+
+	fobj->fd = -1;
+	fobj->pin = 0;
+	fobj->meta_len = 0;
+	fobj->meta_base = 0;
+	fobj->data_dirty = false;
+	fobj->entry_dirty = false;
+	fobj->full_name = NULL;
+	fobj->name[0] = '\0';
+	INIT_LIST_HEAD(&fobj->lru_node);
+
+	return &fobj->obj;
+}
+
+static void close_object(struct ceph_filestore *fs,
+			 struct ceph_filestore_object *fobj)
+{
+	if (fobj->fd < 0)
+		return;
+
+	WARN_ON(fobj->pin);
+	close(fobj->fd);
+	fobj->fd = -1;
+	list_del_init(&fobj->lru_node);
+	object_lru(fs, fobj)->nr_open--;
+}
+
+static void filestore_free_object(struct ceph_objstore *os,
+				  struct ceph_osds_object *obj)
+{
+	struct ceph_filestore_object *fobj = to_file_object(obj);
+
+	close_object(to_filestore(os), fobj);
+	kfree(fobj->full_name);
+	kfree(fobj);
+}
+
+static int escape_name(char *buf, size_t size, const char *name, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = name[i];
+
+		if (isalnum(c) || c == '-' || c == '.') {
+			if (n + 1 >= size)
+				return -ENAMETOOLONG;
+			buf[n++] = c;
+		} else {
+			if (n + 3 >= size)
+				return -ENAMETOOLONG;
+			buf[n++] = '%';
+			buf[n++] = hex[c >> 4];
+			buf[n++] = hex[c & 0xf];
+		}
+	}
+	buf[n] = '\0';
+
+	return n;
+}
+
+static int escape_field(char *buf, size_t size, int n, const char *name,
+			size_t len)
+{
+	int ret;
+
+	if (n + 1 >= size)
+		return -ENAMETOOLONG;
+	buf[n++] = '_';
+
+	ret = escape_name(buf + n, size - n, name, len);
+	if (ret < 0)
+		return ret;
+
+	return n + ret;
+}
+
+/**
+ * filestore_object_name() - builds unique file name for an object.
+ *
+ * Prefix "d_" or "m_" is prepended later, so 2 chars are reserved.
+ * Escaping never produces '_' or '#', so names which differ in the
+ * number of fields or are hashed can't clash.  A hashed name keeps
+ * pool, hash and snapid, the full name is kept in ->full_name.
+ */
+static int filestore_object_name(struct ceph_filestore_object *fobj)
+{
+	const struct ceph_hobject_id *hoid = &fobj->obj.o_hoid;
+	size_t size, len;
+	char *buf;
+	int n;
+
+	len = ceph_string_len(hoid->nspace) + hoid->oid.name_len +
+		ceph_string_len(hoid->key);
+	size = 64 + 3 * len;
+	buf = kmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	n = snprintf(buf, size, "%llx_%08x_%llx", hoid->pool, hoid->hash,
+		     hoid->snapid);
+	n = escape_field(buf, size, n, ceph_string_ptr(hoid->nspace),
+			 ceph_string_len(hoid->nspace));
+	if (n >= 0)
+		n = escape_field(buf, size, n, hoid->oid.name,
+				 hoid->oid.name_len);
+	if (n >= 0 && ceph_string_len(hoid->key))
+		/* Keyless names are as they were before keys were added */
+		n = escape_field(buf, size, n, ceph_string_ptr(hoid->key),
+				 ceph_string_len(hoid->key));
+	if (n < 0) {
+		kfree(buf);
+		return n;
+	}
+
+	if (n < sizeof(fobj->name) - 2) {
+		memcpy(fobj->name, buf, n + 1);
+		kfree(buf);
+		return 0;
+	}
+
+	snprintf(fobj->name, sizeof(fobj->name) - 2,
+		 "%llx_%08x_%llx_#%08x%08x", hoid->pool, hoid->hash,
+		 hoid->snapid, crc32c(0, buf, n), ceph_str_hash_rjenkins(buf, n));
+	fobj->full_name = buf;
+
+	return 0;
+}
+
+static int rewrite_meta(struct ceph_filestore *fs,
+			struct ceph_filestore_object *fobj);
+
+static inline void object_path(char *path, size_t size, char prefix,
+			       struct ceph_filestore_object *fobj)
+{
+	snprintf(path, size, "%c_%s", prefix, fobj->name);
+}
+
+static void close_lru_object(struct ceph_filestore *fs,
+			     struct ceph_filestore_lru *lru)
+{
+	struct ceph_filestore_object *fobj;
+
+	list_for_each_entry(fobj, &lru->lru, lru_node) {
+		if (!fobj->pin) {
+			close_object(fs, fobj);
+			return;
+		}
+	}
+	/* Everything is pinned, so exceed the limit */
+}
+
+/**
+ * open_object() - opens data file of an object and pins it, number of
+ *                 opened files is limited, so the least recently used
+ *                 gets closed.  Should be paired with unpin_object().
+ */
+static int open_object(struct ceph_filestore *fs,
+		       struct ceph_filestore_object *fobj, int flags)
+{
+	struct ceph_filestore_lru *lru = object_lru(fs, fobj);
+	char path[NAME_MAX + 1];
+	int fd;
+
+	if (fobj->fd >= 0) {
+		list_move_tail(&fobj->lru_node, &lru->lru);
+		fobj->pin++;
+		return fobj->fd;
+	}
+
+	object_path(path, sizeof(path), 'd', fobj);
+	fd = openat(fs->dir_fd, path, O_RDWR | flags, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (lru->nr_open >= fs->max_open)
+		close_lru_object(fs, lru);
+
+	fobj->fd = fd;
+	fobj->pin++;
+	list_add_tail(&fobj->lru_node, &lru->lru);
+	lru->nr_open++;
+
+	return fd;
+}
+
+static inline void unpin_object(struct ceph_filestore_object *fobj)
+{
+	BUG_ON(!fobj->pin);
+	fobj->pin--;
+}
+
+static int decode_meta_map(void **p, void *end, struct rb_root *root)
+{
+	u32 i, num, key_len, val_len;
+	int ret;
+
+	ceph_decode_32_safe(p, end, num, bad);
+	for (i = 0; i < num; i++) {
+		struct ceph_osds_omap_entry *ome;
+		const char *key;
+
+		ceph_decode_32_safe(p, end, key_len, bad);
+		ceph_decode_need(p, end, key_len, bad);
+		key = *p;
+		*p += key_len;
+
+		ome = ceph_omap_create_and_insert(root, key, key_len);
+		if (!ome)
+			return -ENOMEM;
+
+		ceph_decode_32_safe(p, end, val_len, bad);
+		ceph_decode_need(p, end, val_len, bad);
+		ret = ceph_pagelist_append(ome->e_val_pl, *p, val_len);
+		if (ret)
+			return ret;
+		*p += val_len;
+	}
+
+	return 0;
+
+bad:
+	return -EINVAL;
+}
+
+/*
+ * Replays records of the meta log.  A torn record at the end, i.e. an
+ * append which was interrupted, stops the replay, so @p is left at it.
+ * A name record must match ->full_name, otherwise the files belong to
+ * another object which name has the same hash.
+ */
+static int replay_meta_log(void **p, void *end,
+			   struct ceph_filestore_object *fobj, bool *named)
+{
+	struct ceph_osds_object *obj = &fobj->obj;
+	struct ceph_osds_omap_entry *ome;
+	u32 key_len, val_len;
+	struct rb_root *root;
+	void *rec, *val;
+	char *key;
+	u8 type;
+	int ret;
+
+	while (*p < end) {
+		rec = *p;
+		ceph_decode_8_safe(p, end, type, torn);
+		ceph_decode_32_safe(p, end, key_len, torn);
+		ceph_decode_need(p, end, key_len, torn);
+		key = *p;
+		*p += key_len;
+		ceph_decode_32_safe(p, end, val_len, torn);
+		ceph_decode_need(p, end, val_len, torn);
+		val = *p;
+		*p += val_len;
+
+		if (type == FILESTORE_META_NAME) {
+			if (!fobj->full_name ||
+			    val_len != strlen(fobj->full_name) ||
+			    memcmp(val, fobj->full_name, val_len))
+				return -EEXIST;
+			*named = true;
+			continue;
+		}
+		if (type == FILESTORE_META_OMAP)
+			root = &obj->o_omap;
+		else if (type == FILESTORE_META_XATTR)
+			root = &obj->o_xattrs;
+		else
+			return -EINVAL;
+
+		key = kstrndup(key, key_len, GFP_KERNEL);
+		if (!key)
+			return -ENOMEM;
+		ome = ceph_omap_lookup(root, key);
+		if (!ome)
+			ome = ceph_omap_create_and_insert(root, key, key_len);
+		kfree(key);
+		if (!ome)
+			return -ENOMEM;
+
+		ret = ceph_pagelist_truncate(ome->e_val_pl, 0);
+		if (!ret)
+			ret = ceph_pagelist_append(ome->e_val_pl, val, val_len);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+
+torn:
+	*p = rec;
+	return 0;
+}
+
+static int load_meta(struct ceph_filestore *fs,
+		     struct ceph_filestore_object *fobj)
+{
+	struct ceph_osds_object *obj = &fobj->obj;
+	char path[NAME_MAX + 1];
+	struct stat st;
+	void *buf, *p, *end;
+	bool named = false;
+	ssize_t len;
+	u8 version;
+	int fd, ret;
+
+	object_path(path, sizeof(path), 'm', fobj);
+	fd = openat(fs->dir_fd, path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			return -errno;
+		/* Hashed name is written to the meta before the data */
+		return fobj->full_name ? -EEXIST : 0;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret) {
+		ret = -errno;
+		goto close_fd;
+	}
+	buf = kmalloc(st.st_size, GFP_KERNEL);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto close_fd;
+	}
+	len = pread(fd, buf, st.st_size, 0);
+	if (len != st.st_size) {
+		ret = len < 0 ? -errno : -EIO;
+		goto free_buf;
+	}
+
+	p = buf;
+	end = buf + len;
+	ceph_decode_8_safe(&p, end, version, bad);
+	if (version == 1) {
+		/* Old snapshot, is rewritten as a log by the next sync */
+		ret = decode_meta_map(&p, end, &obj->o_omap);
+		if (!ret)
+			ret = decode_meta_map(&p, end, &obj->o_xattrs);
+		goto free_buf;
+	}
+	if (version != FILESTORE_META_VERSION)
+		goto bad;
+
+	ret = replay_meta_log(&p, end, fobj, &named);
+	if (!ret && p == end) {
+		fobj->meta_len = len;
+		fobj->meta_base = len;
+	}
+	/* Otherwise the torn tail is dropped by rewriting the log */
+
+free_buf:
+	if (!ret && fobj->full_name && !named)
+		ret = -EEXIST;
+	kfree(buf);
+close_fd:
+	close(fd);
+
+	return ret;
+
+bad:
+	ret = -EINVAL;
+	goto free_buf;
+}
+
+static int filestore_load_object(struct ceph_objstore *os,
+				 struct ceph_osds_object *obj)
+{
+	struct ceph_filestore *fs = to_filestore(os);
+	struct ceph_filestore_object *fobj = to_file_object(obj);
+	struct stat st;
+	int fd, ret;
+
+	ret = filestore_object_name(fobj);
+	if (ret)
+		return ret;
+
+	fd = open_object(fs, fobj, 0);
+	if (fd < 0)
+		return fd;
+
+	ret = fstat(fd, &st);
+	unpin_object(fobj);
+	if (ret)
+		return -errno;
+
+	obj->o_size = st.st_size;
+	obj->o_mtime.tv_sec = st.st_mtim.tv_sec;
+	obj->o_mtime.tv_nsec = st.st_mtim.tv_nsec;
+
+	return load_meta(fs, fobj);
+}
+
+static int filestore_create_object(struct ceph_objstore *os,
+				   struct ceph_osds_object *obj)
+{
+	struct ceph_filestore *fs = to_filestore(os);
+	struct ceph_filestore_object *fobj = to_file_object(obj);
+	int fd, ret;
+
+	ret = filestore_object_name(fobj);
+	if (ret)
+		return ret;
+
+	if (fobj->full_name) {
+		/* Data file of a hashed name is valid only with the meta */
+		ret = rewrite_meta(fs, fobj);
+		if (ret)
+			return ret;
+	}
+
+	fd = open_object(fs, fobj, O_CREAT);
+	if (fd < 0)
+		return fd;
+	unpin_object(fobj);
+	fobj->entry_dirty = true;
+
+	return 0;
+}
+
+/* Called by every change of data, so marks data to be fsynced as well */
+static int set_mtime(int fd, struct ceph_osds_object *obj,
+		     const struct timespec64 *mtime)
+{
+	struct timespec ts[2] = {
+		{ .tv_nsec = UTIME_OMIT },
+		{ .tv_sec = mtime->tv_sec, .tv_nsec = mtime->tv_nsec },
+	};
+
+	to_file_object(obj)->data_dirty = true;
+	obj->o_mtime = *mtime;
+	if (futimens(fd, ts))
+		return -errno;
+
+	return 0;
+}
+
+static int filestore_read(struct ceph_objstore *os,
+			  struct ceph_osds_object *obj,
+			  void *dst, u64 off, u64 len)
+{
+	struct ceph_filestore *fs = to_filestore(os);
+	struct ceph_filestore_object *fobj = to_file_object(obj);
+	unsigned int retries = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open_object(fs, fobj, 0);
+	if (fd < 0)
+		return fd;
+
+	while (len) {
+		ret = uring_read(fd, dst, len, off);
+		if (ret < 0) {
+			if ((ret == -EINTR || ret == -EAGAIN) &&
+			    ++retries < FILESTORE_MAX_RETRIES)
+				continue;
+			goto out;
+		}
+		retries = 0;
+		if (!ret) {
+			/* Beyond the end of the file */
+			memset(dst, 0, len);
+			break;
+		}
+		dst += ret;
+		off += ret;
+		len -= ret;
+	}
+	ret = 0;
+out:
+	unpin_object(fobj);
+
+	return ret;
+}
+
+struct filestore_write_ctx {
+	int          fd;
+	off_t        off;
+	unsigned int cnt;
+	struct iovec iov[FILESTORE_MAX_IOVS];
+};
+
+/**
+ * write_iovs() - writes all gathered iovecs, handling short writes.
+ */
+static int write_iovs(struct filestore_write_ctx *ctx)
+{
+	struct iovec *iov = ctx->iov;
+	unsigned int cnt = ctx->cnt;
+	unsigned int retries = 0;
+	ssize_t ret;
+
+	while (cnt) {
+		ret = uring_writev(ctx->fd, iov, cnt, ctx->off);
+		if (ret < 0) {
+			if ((ret == -EINTR || ret == -EAGAIN) &&
+			    ++retries < FILESTORE_MAX_RETRIES)
+				continue;
+			return ret;
+		}
+		retries = 0;
+		ctx->off += ret;
+
+		/* Skip what was written */
+		while (cnt && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+	ctx->cnt = 0;
+
+	return 0;
+}
+
+static int gather_kvec(struct kvec *vec, void *context)
+{
+	struct filestore_write_ctx *ctx = context;
+	int ret;
+
+	if (ctx->cnt == ARRAY_SIZE(ctx->iov)) {
+		ret = write_iovs(ctx);
+		if (ret)
+			return ret;
+	}
+	ctx->iov[ctx->cnt++] = (struct iovec) {
+		.iov_base = vec->iov_base,
+		.iov_len  = vec->iov_len,
+	};
+
+	return 0;
+}
+
+static int filestore_write(struct ceph_objstore *os,
+			   struct ceph_osds_object *obj,
+			   struct ceph_msg_data_cursor *in_cur,
+			   u64 off, u64 len, bool truncate,
+			   const struct timespec64 *mtime)
+{
+	struct ceph_filestore *fs = to_filestore(os);
+	struct ceph_filestore_object *fobj = to_file_object(obj);
+	struct filestore_write_ctx ctx;
+	size_t len_write = len;
+	int fd, ret;
+
+	fd = open_object(fs, fobj, 0);
+	if (fd < 0)
+		return fd;
+
+	ctx.fd = fd;
+	ctx.off = off;
+	ctx.cnt = 0;
+
+	/* Gather data in iovecs and write them out by big chunks */
+	while (len_write) {
+		size_t len;
+
+		ceph_msg_data_cursor_next(in_cur);
+
+		len = iov_iter_count(&in_cur->iter);
+		len = min(len, len_write);
+
+		ret = iov_iter_for_each_range(&in_cur->iter, len,
+					      gather_kvec, &ctx);
+		if (ret)
+			goto out;
+
+		ceph_msg_data_cursor_advance(in_cur, len);
+		len_write -= len;
+	}
+	ret = write_iovs(&ctx);
+	if (ret)
+		goto out;
+
+	if (truncate && ftruncate(fd, ctx.off)) {
+		ret = -errno;
+		goto out;
+	}
+out:
+	if (ctx.off != off) {
+		if (ctx.off > obj->o_size || truncate)
+			obj->o_size = ctx.off;
+		set_mtime(fd, obj, mtime);
+	}
+	unpin_object(fobj);
+
+	return ret;
+}
+
+static int filestore_truncate(struct ceph_objstore *os,
+			      struct ceph_osds_object *obj,
+			      u64 size, const struct timespec64 *mtime)
+{
+	struct ceph_filestore *fs = to_filestore(os);
+	struct ceph_filestore_object *fobj = to_file_object(obj);
+	int fd, ret;
+
+	fd = open_object(fs, fobj, 0);
+	if (fd < 0)
+		return fd;
+
+	if (ftruncate(fd, size)) {
+		ret = -errno;
+	} else {
+		obj->o_size = size;
+		ret = set_mtime(fd, obj, mtime);
+	}
+	unpin_object(fobj);
+
+	return ret;
+}
+
+static int filestore_zero(struct ceph_objstore *os,
+			  struct ceph_osds_object *obj,
+			  u64 off, u64 len, const struct timespec64 *mtime)
+{
+	struct ceph_filestore *fs = to_filestore(os);
+	struct ceph_filestore_object *fobj = to_file_object(obj);
+	int fd, ret;
+
+	fd = open_object(fs, fobj, 0);
+	if (fd < 0)
+		return fd;
+
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      off, len))
+		ret = -errno;
+	else
+		ret = set_mtime(fd, obj, mtime);
+	unpin_object(fobj);
+
+	return ret;
+}
+
+static int encode_meta_record(struct ceph_pagelist *pl, u8 type,
+			      struct ceph_osds_omap_entry *ome)
+{
+	int ret;
+
+	ret = ceph_pagelist_encode_8(pl, type);
+	if (!ret)
+		ret = ceph_pagelist_encode_string(pl, ome->e_key,
+						  ome->e_key_len);
+	if (!ret)
+		ret = ceph_pagelist_encode_pagelist(pl, ome->e_val_pl, true);
+
+	return ret;
+}
+
+static int encode_meta_name(struct ceph_pagelist *pl, const char *name)
+{
+	int ret;
+
+	ret = ceph_pagelist_encode_8(pl, FILESTORE_META_NAME);
+	if (!ret)
+		ret = ceph_pagelist_encode_string(pl, "", 0);
+	if (!ret)
+		ret = ceph_pagelist_encode_string(pl, (char *)name,
+						  strlen(name));
+
+	return ret;
+}
+
+static int encode_meta_map(struct ceph_pagelist *pl, u8 type,
+			   struct rb_root *root)
+{
+	struct ceph_osds_omap_entry *ome;
+	int ret = 0;
+
+	for (ome = ceph_omap_first(root); !ret && ome;
+	     ome = ceph_omap_next(ome))
+		ret = encode_meta_record(pl, type, ome);
+
+	return ret;
+}
+
+static int encode_meta_dirty(struct ceph_pagelist *pl, u8 type,
+			     struct list_head *dirty)
+{
+	struct ceph_osds_omap_entry *ome;
+	int ret;
+
+	list_for_each_entry(ome, dirty, e_dirty) {
+		ret = encode_meta_record(pl, type, ome);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int write_pagelist(int fd, struct ceph_pagelist *pl, off_t off)
+{
+	struct filestore_write_ctx ctx;
+	size_t len = pl->length;
+	struct page *page;
+	int ret;
+
+	ctx.fd = fd;
+	ctx.off = off;
+	ctx.cnt = 0;
+
+	list_for_each_entry(page, &pl->head, lru) {
+		struct kvec vec = {
+			.iov_base = page_address(page),
+			.iov_len  = min_t(size_t, len, PAGE_SIZE),
+		};
+
+		if (!vec.iov_len)
+			break;
+		ret = gather_kvec(&vec, &ctx);
+		if (ret)
+			return ret;
+		len -= vec.iov_len;
+	}
+
+	return write_iovs(&ctx);
+}
+
+/**
+ * append_meta() - appends records of changed entries to the meta log.
+ */
+static int append_meta(struct ceph_filestore *fs,
+		       struct ceph_filestore_object *fobj)
+{
+	struct ceph_osds_object *obj = &fobj->obj;
+	char path[NAME_MAX + 1];
+	struct ceph_pagelist *pl;
+	int fd, ret;
+
+	pl = ceph_pagelist_alloc(GFP_KERNEL);
+	if (!pl)
+		return -ENOMEM;
+
+	ret = encode_meta_dirty(pl, FILESTORE_META_OMAP, &obj->o_dirty_omap);
+	if (!ret)
+		ret = encode_meta_dirty(pl, FILESTORE_META_XATTR,
+					&obj->o_dirty_xattrs);
+	if (ret || !pl->length)
+		goto out;
+
+	object_path(path, sizeof(path), 'm', fobj);
+	fd = openat(fs->dir_fd, path, O_WRONLY);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	ret = write_pagelist(fd, pl, fobj->meta_len);
+	if (!ret)
+		ret = uring_fsync(fd, true);
+	close(fd);
+	if (!ret)
+		fobj->meta_len += pl->length;
+	else
+		/* Tail can be torn, so rewrite everything next time */
+		fobj->meta_len = 0;
+out:
+	ceph_pagelist_release(pl);
+
+	return ret;
+}
+
+/**
+ * rewrite_meta() - replaces the meta log with records of all entries.
+ */
+static int rewrite_meta(struct ceph_filestore *fs,
+			struct ceph_filestore_object *fobj)
+{
+	struct ceph_osds_object *obj = &fobj->obj;
+	char path[NAME_MAX + 1], tmp[NAME_MAX + 1];
+	struct ceph_pagelist *pl;
+	int fd, ret;
+
+	pl = ceph_pagelist_alloc(GFP_KERNEL);
+	if (!pl)
+		return -ENOMEM;
+
+	ret = ceph_pagelist_encode_8(pl, FILESTORE_META_VERSION);
+	if (!ret && fobj->full_name)
+		ret = encode_meta_name(pl, fobj->full_name);
+	if (!ret)
+		ret = encode_meta_map(pl, FILESTORE_META_OMAP, &obj->o_omap);
+	if (!ret)
+		ret = encode_meta_map(pl, FILESTORE_META_XATTR,
+				      &obj->o_xattrs);
+	if (ret)
+		goto out;
+
+	object_path(path, sizeof(path), 'm', fobj);
+	object_path(tmp, sizeof(tmp), 't', fobj);
+
+	fd = openat(fs->dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	ret = write_pagelist(fd, pl, 0);
+	if (!ret)
+		/* Meta file is replaced by rename, so should be on disk */
+		ret = uring_fsync(fd, true);
+	close(fd);
+	if (!ret && renameat(fs->dir_fd, tmp, fs->dir_fd, path))
+		ret = -errno;
+	if (ret) {
+		unlinkat(fs->dir_fd, tmp, 0);
+	} else {
+		fobj->meta_len = pl->length;
+		fobj->meta_base = pl->length;
+		fobj->entry_dirty = true;
+	}
+out:
+	ceph_pagelist_release(pl);
+
+	return ret;
+}
+
+static int filestore_sync_meta(struct ceph_objstore *os,
+			       struct ceph_osds_object *obj)
+{
+	struct ceph_filestore *fs = to_filestore(os);
+	struct ceph_filestore_object *fobj = to_file_object(obj);
+	u64 appended = fobj->meta_len - fobj->meta_base;
+
+	/* Compaction is amortized by at least as much appended */
+	if (!fobj->meta_len ||
+	    appended > max_t(u64, fobj->meta_base, FILESTORE_META_COMPACT))
+		return rewrite_meta(fs, fobj);
+
+	return append_meta(fs, fobj);
+}
+
+static int filestore_sync_object(struct ceph_objstore *os,
+				 struct ceph_osds_object *obj)
+{
+	struct ceph_filestore *fs = to_filestore(os);
+	struct ceph_filestore_object *fobj = to_file_object(obj);
+	int fd, ret;
+
+	if (fobj->data_dirty) {
+		fd = open_object(fs, fobj, 0);
+		if (fd < 0)
+			return fd;
+		/* Not a datasync, mtime is reported by stat */
+		ret = uring_fsync(fd, false);
+		unpin_object(fobj);
+		if (ret)
+			return ret;
+		fobj->data_dirty = false;
+	}
+	if (fobj->entry_dirty) {
+		/* Created data file or renamed meta */
+		ret = uring_fsync(fs->dir_fd, false);
+		if (ret)
+			return ret;
+		fobj->entry_dirty = false;
+	}
+
+	return 0;
+}
+
+const struct ceph_objstore_ops ceph_filestore_ops = {
+	.name          = "filestore",
+	.block_shift   = FILESTORE_BLOCK_SHIFT,
+	.max_objects   = FILESTORE_MAX_OBJECTS,
+	.create        = filestore_create,
+	.destroy       = filestore_destroy,
+	.alloc_object  = filestore_alloc_object,
+	.free_object   = filestore_free_object,
+	.load_object   = filestore_load_object,
+	.create_object = filestore_create_object,
+	.read          = filestore_read,
+	.write         = filestore_write,
+	.truncate      = filestore_truncate,
+	.zero          = filestore_zero,
+	.sync_meta     = filestore_sync_meta,
+	.sync_object   = filestore_sync_object,
+};
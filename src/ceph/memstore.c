@@ -0,0 +1,1034 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "ceph/ceph_debug.h"
+
+#include "module.h"
+#include "err.h"
+#include "slab.h"
+
+#include "ceph/objstore.h"
+
+/*
+ * In-memory object store: data of each object is kept in 64k blocks
+ * which are allocated on the first write.
+ *
+ * Blocks of an object are addressed by a block map indexed by
+ * offset >> OSDS_BLOCK_SHIFT.  Small objects (up to OSDS_LEAF_SIZE
+ * blocks) use a dense array which grows by doubling, bigger objects
+ * switch to a two-level radix: a directory of leaves, each maps
+ * OSDS_LEAF_SIZE blocks.  Present blocks are marked in a bitmap, so
+ * holes are skipped without looking at the slots.
+ *
+ * A block is either a whole 64k page, or, if it was created by a small
+ * write, a granular block: a set of 4k granules which are allocated
+ * on demand, so random small writes do not cost 64k each.  Granular
+ * block is promoted to a whole page when the last granule is filled
+ * in.  Granular blocks are tagged by the low bit of the slot.  If the
+ * client hints that writes are big (CEPH_OSD_OP_SETALLOCHINT), whole
+ * pages are allocated straight away.
+ *
+ * Block and granule pages are refcounted: read replies reference them
+ * directly (see memstore_read_bvecs()), so a page which is modified
+ * while a reply is still inflight is copied first (see cow_page()).
+ */
+
+enum {
+	OSDS_BLOCK_SHIFT    = 16, /* 64k, must be ^2 */
+	OSDS_BLOCK_SIZE     = (1UL << OSDS_BLOCK_SHIFT),
+	OSDS_BLOCK_MASK     = (~(OSDS_BLOCK_SIZE-1)),
+
+	OSDS_GRANULE_SHIFT  = PAGE_SHIFT,
+	OSDS_GRANULE_SIZE   = (1UL << OSDS_GRANULE_SHIFT),
+	OSDS_GRANULE_MASK   = (~(OSDS_GRANULE_SIZE-1)),
+	OSDS_GRANULES       = (1 << (OSDS_BLOCK_SHIFT - OSDS_GRANULE_SHIFT)),
+	OSDS_GRANULES_ALL   = ((1 << OSDS_GRANULES) - 1),
+
+	OSDS_LEAF_SHIFT     = 6,  /* 64 blocks, i.e. 4m, per leaf */
+	OSDS_LEAF_SIZE      = (1 << OSDS_LEAF_SHIFT),
+	OSDS_LEAF_MASK      = (OSDS_LEAF_SIZE - 1),
+
+	/* Bigger expected object size hints are ignored */
+	OSDS_HINT_MAX_SIZE  = (128 << 20),
+};
+
+#define OSDS_NO_BLOCK      ULONG_MAX
+#define OSDS_BLK_GRANULAR  1UL
+
+static struct kmem_cache *ceph_memstore_object_cache;
+static struct kmem_cache *ceph_osds_gblock_cache;
+static struct kmem_cache *ceph_osds_leaf_cache;
+
+struct ceph_memstore {
+	struct ceph_objstore   os;
+	struct page            *zero_block; /* shared by reads of holes */
+};
+
+struct ceph_osds_gblock {
+	u32                    g_present; /* bitmap of present granules */
+	struct page            *g_pages[OSDS_GRANULES];
+};
+
+struct ceph_osds_leaf {
+	u64                    l_present; /* bitmap of present blocks */
+	void                   *l_blocks[OSDS_LEAF_SIZE];
+};
+
+struct ceph_osds_blkmap {
+	unsigned long          m_cap;     /* number of addressable blocks */
+	union {
+		/* Dense, m_cap <= OSDS_LEAF_SIZE */
+		struct {
+			u64                   m_present;
+			void                  **m_blocks;
+		};
+		/* Radix, m_cap > OSDS_LEAF_SIZE */
+		struct ceph_osds_leaf         **m_leaves;
+	};
+};
+
+struct ceph_memstore_object {
+	struct ceph_osds_object obj;
+	struct ceph_osds_blkmap o_blocks;     /* all blocks of the object */
+	u64                     o_write_hint; /* expected write size */
+};
+
+static inline struct ceph_memstore_object *
+to_mem_object(struct ceph_osds_object *obj)
+{
+	return container_of(obj, struct ceph_memstore_object, obj);
+}
+
+static inline struct ceph_memstore *to_memstore(struct ceph_objstore *os)
+{
+	return container_of(os, struct ceph_memstore, os);
+}
+
+static inline bool blk_is_granular(const void *blk)
+{
+	return (unsigned long)blk & OSDS_BLK_GRANULAR;
+}
+
+static inline struct ceph_osds_gblock *blk_to_gblock(void *blk)
+{
+	return (void *)((unsigned long)blk & ~OSDS_BLK_GRANULAR);
+}
+
+static inline void *gblock_to_blk(struct ceph_osds_gblock *gb)
+{
+	return (void *)((unsigned long)gb | OSDS_BLK_GRANULAR);
+}
+
+static void free_blk(void *blk)
+{
+	struct ceph_osds_gblock *gb;
+	unsigned int g;
+
+	if (!blk_is_granular(blk)) {
+		put_page(blk);
+		return;
+	}
+	gb = blk_to_gblock(blk);
+	for (g = 0; g < OSDS_GRANULES; g++)
+		if (gb->g_present & (1U << g))
+			put_page(gb->g_pages[g]);
+	kmem_cache_free(ceph_osds_gblock_cache, gb);
+}
+
+static inline bool blkmap_is_radix(const struct ceph_osds_blkmap *map)
+{
+	return map->m_cap > OSDS_LEAF_SIZE;
+}
+
+/**
+ * blkmap_slot() - returns slot of the block and the bitmap word where
+ *                 the block is marked, or NULL if the block can't be
+ *                 present, i.e. map was not reserved for the index.
+ */
+static inline void **blkmap_slot(struct ceph_osds_blkmap *map,
+				 unsigned long idx, u64 **present)
+{
+	struct ceph_osds_leaf *leaf;
+
+	if (idx >= map->m_cap)
+		return NULL;
+	if (!blkmap_is_radix(map)) {
+		*present = &map->m_present;
+		return &map->m_blocks[idx];
+	}
+	leaf = map->m_leaves[idx >> OSDS_LEAF_SHIFT];
+	if (!leaf)
+		return NULL;
+	*present = &leaf->l_present;
+
+	return &leaf->l_blocks[idx & OSDS_LEAF_MASK];
+}
+
+static inline void *blkmap_lookup(struct ceph_osds_blkmap *map,
+				  unsigned long idx)
+{
+	void **slot;
+	u64 *present;
+
+	slot = blkmap_slot(map, idx, &present);
+
+	return slot ? *slot : NULL;
+}
+
+/**
+ * blkmap_next() - returns index of the first present block starting
+ *                 from @idx or OSDS_NO_BLOCK.
+ */
+static unsigned long blkmap_next(const struct ceph_osds_blkmap *map,
+				 unsigned long idx)
+{
+	struct ceph_osds_leaf *leaf;
+	unsigned long li;
+	u64 word;
+
+	if (idx >= map->m_cap)
+		return OSDS_NO_BLOCK;
+
+	if (!blkmap_is_radix(map)) {
+		word = map->m_present & (~0ULL << idx);
+		return word ? __ffs64(word) : OSDS_NO_BLOCK;
+	}
+	for (li = idx >> OSDS_LEAF_SHIFT;
+	     li < map->m_cap >> OSDS_LEAF_SHIFT;
+	     li++, idx = 0) {
+		leaf = map->m_leaves[li];
+		if (!leaf)
+			continue;
+		word = leaf->l_present & (~0ULL << (idx & OSDS_LEAF_MASK));
+		if (word)
+			return (li << OSDS_LEAF_SHIFT) + __ffs64(word);
+	}
+
+	return OSDS_NO_BLOCK;
+}
+
+/* Smallest power of two which is greater than @idx */
+static inline unsigned long blkmap_grow_nr(unsigned long idx)
+{
+	unsigned long nr = 1;
+
+	while (nr <= idx)
+		nr <<= 1;
+
+	return nr;
+}
+
+static int blkmap_to_radix(struct ceph_osds_blkmap *map,
+			   unsigned long nr_leaves)
+{
+	struct ceph_osds_leaf **leaves, *leaf = NULL;
+	unsigned long i;
+
+	leaves = kcalloc(nr_leaves, sizeof(*leaves), GFP_KERNEL);
+	if (!leaves)
+		return -ENOMEM;
+
+	if (map->m_present) {
+		leaf = kmem_cache_zalloc(ceph_osds_leaf_cache, GFP_KERNEL);
+		if (!leaf) {
+			kfree(leaves);
+			return -ENOMEM;
+		}
+		leaf->l_present = map->m_present;
+		for (i = 0; i < map->m_cap; i++)
+			leaf->l_blocks[i] = map->m_blocks[i];
+	}
+	kfree(map->m_blocks);
+	leaves[0] = leaf;
+	map->m_leaves = leaves;
+	map->m_cap = nr_leaves << OSDS_LEAF_SHIFT;
+
+	return 0;
+}
+
+/**
+ * blkmap_grow() - grows the dense array or the radix directory, so
+ *                 @idx becomes addressable, leaves are not allocated.
+ */
+static int blkmap_grow(struct ceph_osds_blkmap *map, unsigned long idx)
+{
+	unsigned long nr, old_nr;
+	void *p;
+
+	if (idx < map->m_cap)
+		return 0;
+
+	if (idx < OSDS_LEAF_SIZE) {
+		/* Grow dense array */
+		nr = blkmap_grow_nr(idx);
+		p = krealloc(map->m_blocks, nr * sizeof(*map->m_blocks),
+			     GFP_KERNEL);
+		if (!p)
+			return -ENOMEM;
+		map->m_blocks = p;
+		memset(map->m_blocks + map->m_cap, 0,
+		       (nr - map->m_cap) * sizeof(*map->m_blocks));
+		map->m_cap = nr;
+
+		return 0;
+	}
+
+	nr = blkmap_grow_nr(idx >> OSDS_LEAF_SHIFT);
+	if (!blkmap_is_radix(map))
+		return blkmap_to_radix(map, nr);
+
+	/* Grow directory */
+	old_nr = map->m_cap >> OSDS_LEAF_SHIFT;
+	p = krealloc(map->m_leaves, nr * sizeof(*map->m_leaves), GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+	map->m_leaves = p;
+	memset(map->m_leaves + old_nr, 0,
+	       (nr - old_nr) * sizeof(*map->m_leaves));
+	map->m_cap = nr << OSDS_LEAF_SHIFT;
+
+	return 0;
+}
+
+/**
+ * blkmap_reserve() - makes the map addressable for @idx, i.e. slot for
+ *                    the block exists after the call.
+ */
+static int blkmap_reserve(struct ceph_osds_blkmap *map, unsigned long idx)
+{
+	struct ceph_osds_leaf *leaf;
+	unsigned long li;
+	int ret;
+
+	ret = blkmap_grow(map, idx);
+	if (ret)
+		return ret;
+	if (!blkmap_is_radix(map))
+		return 0;
+
+	li = idx >> OSDS_LEAF_SHIFT;
+	if (!map->m_leaves[li]) {
+		leaf = kmem_cache_zalloc(ceph_osds_leaf_cache, GFP_KERNEL);
+		if (!leaf)
+			return -ENOMEM;
+		map->m_leaves[li] = leaf;
+	}
+
+	return 0;
+}
+
+/**
+ * blkmap_set() - sets the block, map must be reserved
+ */
+static void blkmap_set(struct ceph_osds_blkmap *map, unsigned long idx,
+		       void *blk)
+{
+	void **slot;
+	u64 *present;
+
+	slot = blkmap_slot(map, idx, &present);
+	BUG_ON(!slot);
+	*slot = blk;
+	*present |= 1ULL << (idx & OSDS_LEAF_MASK);
+}
+
+/**
+ * blkmap_clear() - removes the block from the map and returns it,
+ *                  a leaf without blocks is freed.
+ */
+static void *blkmap_clear(struct ceph_osds_blkmap *map, unsigned long idx)
+{
+	void **slot, *blk;
+	u64 *present;
+
+	slot = blkmap_slot(map, idx, &present);
+	BUG_ON(!slot || !*slot);
+	blk = *slot;
+	*slot = NULL;
+	*present &= ~(1ULL << (idx & OSDS_LEAF_MASK));
+
+	if (blkmap_is_radix(map) && !*present) {
+		unsigned long li = idx >> OSDS_LEAF_SHIFT;
+
+		kmem_cache_free(ceph_osds_leaf_cache, map->m_leaves[li]);
+		map->m_leaves[li] = NULL;
+	}
+
+	return blk;
+}
+
+static void blkmap_destroy(struct ceph_osds_blkmap *map)
+{
+	unsigned long idx, li;
+
+	for (idx = blkmap_next(map, 0); idx != OSDS_NO_BLOCK;
+	     idx = blkmap_next(map, idx + 1))
+		free_blk(blkmap_lookup(map, idx));
+
+	if (blkmap_is_radix(map)) {
+		for (li = 0; li < map->m_cap >> OSDS_LEAF_SHIFT; li++)
+			kmem_cache_free(ceph_osds_leaf_cache,
+					map->m_leaves[li]);
+		kfree(map->m_leaves);
+	} else {
+		kfree(map->m_blocks);
+	}
+}
+
+static struct ceph_objstore *memstore_create(struct ceph_options *opt,
+					     unsigned int nr_shards)
+{
+	struct ceph_memstore *ms;
+
+	ms = kzalloc(sizeof(*ms), GFP_KERNEL);
+	if (!ms)
+		return ERR_PTR(-ENOMEM);
+
+	ms->zero_block = alloc_pages(GFP_KERNEL | __GFP_ZERO,
+				     OSDS_BLOCK_SHIFT - PAGE_SHIFT);
+	if (!ms->zero_block) {
+		kfree(ms);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	return &ms->os;
+}
+
+static void memstore_destroy(struct ceph_objstore *os)
+{
+	struct ceph_memstore *ms = to_memstore(os);
+
+	/* Inflight replies can still reference it */
+	put_page(ms->zero_block);
+	kfree(ms);
+}
+
+static struct ceph_osds_object *memstore_alloc_object(struct ceph_objstore *os)
+{
+	struct ceph_memstore_object *mobj;
+
+	mobj = kmem_cache_zalloc(ceph_memstore_object_cache, GFP_KERNEL);
+	if (!mobj)
+		return NULL;
+
+	return &mobj->obj;
+}
+
+static void memstore_free_object(struct ceph_objstore *os,
+				 struct ceph_osds_object *obj)
+{
+	struct ceph_memstore_object *mobj = to_mem_object(obj);
+
+	blkmap_destroy(&mobj->o_blocks);
+	kmem_cache_free(ceph_memstore_object_cache, mobj);
+}
+
+static inline void free_block(struct ceph_memstore_object *mobj,
+			      unsigned long idx)
+{
+	free_blk(blkmap_clear(&mobj->o_blocks, idx));
+}
+
+/**
+ * replace_block() - sets a new block, map must be reserved
+ */
+static void replace_block(struct ceph_memstore_object *mobj,
+			  unsigned long idx, void *blk)
+{
+	void *old;
+
+	old = blkmap_lookup(&mobj->o_blocks, idx);
+	blkmap_set(&mobj->o_blocks, idx, blk);
+	if (old)
+		free_blk(old);
+}
+
+/**
+ * cow_page() - if block or granule page is still referenced by inflight
+ *              replies, returns a private copy which the caller puts
+ *              instead, so replies stay stable.  @copy is false if the
+ *              caller is going to overwrite the whole page.
+ */
+static struct page *cow_page(struct page *old, bool copy)
+{
+	struct page *page;
+
+	if (page_count(old) == 1)
+		return old;
+
+	page = alloc_pages(GFP_KERNEL, old->order);
+	if (!page)
+		return NULL;
+
+	if (copy)
+		memcpy(page_address(page), page_address(old),
+		       PAGE_SIZE << old->order);
+	/* Still referenced, so not freed */
+	put_page(old);
+
+	return page;
+}
+
+static struct page *unshare_block(struct ceph_memstore_object *mobj,
+				  unsigned long idx, struct page *old,
+				  bool copy)
+{
+	struct page *page;
+
+	page = cow_page(old, copy);
+	if (page && page != old)
+		blkmap_set(&mobj->o_blocks, idx, page);
+
+	return page;
+}
+
+/**
+ * promote_block() - replaces granular block with a whole page, granules
+ *                   which are not present are zeroed out.
+ */
+static struct page *promote_block(struct ceph_memstore_object *mobj,
+				  unsigned long idx,
+				  struct ceph_osds_gblock *gb)
+{
+	struct page *page;
+	unsigned int g;
+	void *dst;
+
+	page = alloc_pages(GFP_KERNEL, OSDS_BLOCK_SHIFT - PAGE_SHIFT);
+	if (!page)
+		return NULL;
+
+	dst = page_address(page);
+	for (g = 0; g < OSDS_GRANULES; g++, dst += OSDS_GRANULE_SIZE) {
+		if (gb->g_present & (1U << g))
+			memcpy(dst, page_address(gb->g_pages[g]),
+			       OSDS_GRANULE_SIZE);
+		else
+			memset(dst, 0, OSDS_GRANULE_SIZE);
+	}
+	replace_block(mobj, idx, page);
+
+	return page;
+}
+
+/**
+ * adopt_block() - makes @page, which is a received block of a write, to
+ *                 be the block at @blk_off, so data is not copied.
+ */
+static int adopt_block(struct ceph_memstore_object *mobj, off_t blk_off,
+		       struct page *page)
+{
+	unsigned long idx = blk_off >> OSDS_BLOCK_SHIFT;
+	int ret;
+
+	ret = blkmap_reserve(&mobj->o_blocks, idx);
+	if (ret)
+		return ret;
+
+	get_page(page);
+	replace_block(mobj, idx, page);
+
+	return 0;
+}
+
+/**
+ * granule_dst() - returns writable granule of the granular block,
+ *                 granule is allocated if it is a hole.
+ */
+static int granule_dst(struct ceph_memstore_object *mobj, unsigned long idx,
+		       struct ceph_osds_gblock *gb, off_t off_inblk,
+		       size_t len, void **dst, size_t *dst_len)
+{
+	unsigned int g = off_inblk >> OSDS_GRANULE_SHIFT;
+	off_t off_ingr = off_inblk & ~OSDS_GRANULE_MASK;
+	bool whole = (!off_ingr && len >= OSDS_GRANULE_SIZE);
+	struct page *page;
+
+	if (gb->g_present & (1U << g)) {
+		page = cow_page(gb->g_pages[g], !whole);
+		if (!page)
+			return -ENOMEM;
+		gb->g_pages[g] = page;
+	} else if ((gb->g_present | (1U << g)) == OSDS_GRANULES_ALL) {
+		/* Last hole is filled in, block becomes a whole page */
+		page = promote_block(mobj, idx, gb);
+		if (!page)
+			return -ENOMEM;
+		*dst = page_address(page) + off_inblk;
+		*dst_len = OSDS_BLOCK_SIZE - off_inblk;
+
+		return 0;
+	} else {
+		page = alloc_pages(GFP_KERNEL | (whole ? 0 : __GFP_ZERO), 0);
+		if (!page)
+			return -ENOMEM;
+		gb->g_pages[g] = page;
+		gb->g_present |= (1U << g);
+	}
+
+	*dst = page_address(page) + off_ingr;
+	*dst_len = OSDS_GRANULE_SIZE - off_ingr;
+
+	return 0;
+}
+
+/**
+ * next_dst() - returns writable memory of the block at @dst_off, block
+ *              is allocated if it is a hole.  Whole page is allocated
+ *              if the whole block is written or the client hinted big
+ *              writes, otherwise the block is granular.
+ */
+static int next_dst(struct ceph_memstore_object *mobj,
+		    off_t dst_off, size_t len,
+		    void **dst, size_t *dst_len)
+{
+	unsigned long idx = dst_off >> OSDS_BLOCK_SHIFT;
+	off_t off_inblk = dst_off & ~OSDS_BLOCK_MASK;
+	bool whole = (!off_inblk && len >= OSDS_BLOCK_SIZE);
+	struct ceph_osds_gblock *gb;
+	struct page *page;
+	void *blk;
+	int ret;
+
+	ret = blkmap_reserve(&mobj->o_blocks, idx);
+	if (ret)
+		return ret;
+
+	blk = blkmap_lookup(&mobj->o_blocks, idx);
+	if (blk && blk_is_granular(blk) && !whole)
+		return granule_dst(mobj, idx, blk_to_gblock(blk), off_inblk,
+				   len, dst, dst_len);
+
+	if (!blk && !whole && mobj->o_write_hint < OSDS_BLOCK_SIZE) {
+		gb = kmem_cache_zalloc(ceph_osds_gblock_cache, GFP_KERNEL);
+		if (!gb)
+			return -ENOMEM;
+		blkmap_set(&mobj->o_blocks, idx, gblock_to_blk(gb));
+
+		ret = granule_dst(mobj, idx, gb, off_inblk, len, dst, dst_len);
+		if (ret)
+			free_block(mobj, idx);
+
+		return ret;
+	}
+
+	if (blk && !blk_is_granular(blk)) {
+		page = unshare_block(mobj, idx, blk, !whole);
+		if (!page)
+			return -ENOMEM;
+	} else {
+		/* Hole or granules which are overwritten entirely */
+		page = alloc_pages(GFP_KERNEL | (whole ? 0 : __GFP_ZERO),
+				   OSDS_BLOCK_SHIFT - PAGE_SHIFT);
+		if (!page)
+			return -ENOMEM;
+		replace_block(mobj, idx, page);
+	}
+
+	*dst = page_address(page) + off_inblk;
+	*dst_len = OSDS_BLOCK_SIZE - off_inblk;
+
+	return 0;
+}
+
+/**
+ * zero_granules() - zeroes out in-block range of the granular block,
+ *                   fully covered granules are freed.
+ */
+static int zero_granules(struct ceph_osds_gblock *gb, off_t beg, off_t end)
+{
+	unsigned int g;
+
+	for (g = beg >> OSDS_GRANULE_SHIFT;
+	     g < OSDS_GRANULES && ((off_t)g << OSDS_GRANULE_SHIFT) < end;
+	     g++) {
+		off_t gr_off = (off_t)g << OSDS_GRANULE_SHIFT;
+		off_t beg_ingr, end_ingr;
+		struct page *page;
+
+		if (!(gb->g_present & (1U << g)))
+			continue;
+
+		beg_ingr = max(beg, gr_off) - gr_off;
+		end_ingr = min(end, gr_off + (off_t)OSDS_GRANULE_SIZE) - gr_off;
+
+		if (!beg_ingr && end_ingr == OSDS_GRANULE_SIZE) {
+			put_page(gb->g_pages[g]);
+			gb->g_pages[g] = NULL;
+			gb->g_present &= ~(1U << g);
+		} else {
+			page = cow_page(gb->g_pages[g], true);
+			if (!page)
+				return -ENOMEM;
+			gb->g_pages[g] = page;
+			memset(page_address(page) + beg_ingr, 0,
+			       end_ingr - beg_ingr);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * zero_range() - zeroes out the range, blocks and granules which are
+ *                fully covered are freed, i.e. become holes.
+ */
+static int zero_range(struct ceph_memstore_object *mobj,
+		      off_t off, size_t len)
+{
+	struct ceph_osds_blkmap *map = &mobj->o_blocks;
+	off_t end = off + len;
+	unsigned long idx;
+	int ret;
+
+	for (idx = blkmap_next(map, off >> OSDS_BLOCK_SHIFT);
+	     idx != OSDS_NO_BLOCK && ((off_t)idx << OSDS_BLOCK_SHIFT) < end;
+	     idx = blkmap_next(map, idx + 1)) {
+		off_t blk_off = (off_t)idx << OSDS_BLOCK_SHIFT;
+		off_t beg_inblk, end_inblk;
+		struct ceph_osds_gblock *gb;
+		struct page *page;
+		void *blk;
+
+		beg_inblk = max(off, blk_off) - blk_off;
+		end_inblk = min(end, blk_off + (off_t)OSDS_BLOCK_SIZE) -
+			blk_off;
+
+		blk = blkmap_lookup(map, idx);
+		if (!beg_inblk && end_inblk == OSDS_BLOCK_SIZE) {
+			free_block(mobj, idx);
+		} else if (blk_is_granular(blk)) {
+			gb = blk_to_gblock(blk);
+			ret = zero_granules(gb, beg_inblk, end_inblk);
+			if (ret)
+				return ret;
+			if (!gb->g_present)
+				free_block(mobj, idx);
+		} else {
+			page = unshare_block(mobj, idx, blk, true);
+			if (!page)
+				return -ENOMEM;
+			memset(page_address(page) + beg_inblk, 0,
+			       end_inblk - beg_inblk);
+		}
+	}
+
+	return 0;
+}
+
+static int truncate_blocks(struct ceph_memstore_object *mobj, u64 size)
+{
+	if (size < mobj->obj.o_size)
+		return zero_range(mobj, size, mobj->obj.o_size - size);
+
+	return 0;
+}
+
+/**
+ * block_segment() - returns page which backs the block at @off_inblk,
+ *                   offset in the page and length of the contiguous
+ *                   segment till the end of the block or granule.
+ *                   Returns NULL for a hole, then @pg_off is equal to
+ *                   @off_inblk and the segment spans adjacent holes.
+ */
+static struct page *block_segment(void *blk, off_t off_inblk,
+				  off_t *pg_off, size_t *seg_len)
+{
+	struct ceph_osds_gblock *gb;
+	unsigned int g, n;
+
+	if (!blk || !blk_is_granular(blk)) {
+		*pg_off = off_inblk;
+		*seg_len = OSDS_BLOCK_SIZE - off_inblk;
+		return blk;
+	}
+	gb = blk_to_gblock(blk);
+	g = off_inblk >> OSDS_GRANULE_SHIFT;
+	if (gb->g_present & (1U << g)) {
+		*pg_off = off_inblk & ~OSDS_GRANULE_MASK;
+		*seg_len = OSDS_GRANULE_SIZE - *pg_off;
+		return gb->g_pages[g];
+	}
+	for (n = g + 1; n < OSDS_GRANULES; n++)
+		if (gb->g_present & (1U << n))
+			break;
+	*pg_off = off_inblk;
+	*seg_len = ((off_t)n << OSDS_GRANULE_SHIFT) - off_inblk;
+
+	return NULL;
+}
+
+static int memstore_write(struct ceph_objstore *os,
+			  struct ceph_osds_object *obj,
+			  struct ceph_msg_data_cursor *in_cur,
+			  u64 off, u64 len, bool truncate,
+			  const struct timespec64 *mtime)
+{
+	struct ceph_memstore_object *mobj = to_mem_object(obj);
+	void *dst;
+
+	size_t len_write, dst_len;
+	off_t dst_off;
+
+	bool modified = false;
+	int ret;
+
+	/*
+	 * Fill in blocks with data of found/created object
+	 */
+	len_write = len;
+	dst_off = off;
+	dst = NULL;
+	dst_len = 0;
+	ret = 0;
+
+	while (len_write) {
+		size_t len, len2;
+		struct page *page;
+
+		ceph_msg_data_cursor_next(in_cur);
+
+		if (!dst_len && len_write >= OSDS_BLOCK_SIZE &&
+		    !(dst_off & ~OSDS_BLOCK_MASK) &&
+		    (page = ceph_objstore_block_page(in_cur, OSDS_BLOCK_SHIFT))) {
+			/* Whole block was received in place, take it */
+			ret = adopt_block(mobj, dst_off, page);
+			if (ret)
+				goto out;
+
+			ceph_msg_data_cursor_advance(in_cur, OSDS_BLOCK_SIZE);
+			len_write -= OSDS_BLOCK_SIZE;
+			dst_off += OSDS_BLOCK_SIZE;
+			modified = true;
+			continue;
+		}
+
+		if (!dst_len) {
+			ret = next_dst(mobj, dst_off, len_write, &dst, &dst_len);
+			if (ret)
+				goto out;
+		}
+
+		len = iov_iter_count(&in_cur->iter);
+		len = min(len, dst_len);
+		len = min(len, len_write);
+
+		len2 = copy_from_iter(dst, len, &in_cur->iter);
+		WARN_ON(len2 != len);
+
+		ceph_msg_data_cursor_advance(in_cur, len);
+		len_write -= len;
+		dst_len -= len;
+		dst_off += len;
+		dst += len;
+		modified = true;
+	}
+out:
+	if (modified) {
+		obj->o_mtime = *mtime;
+
+		/* Extend object size if needed or truncate */
+		if (truncate && !ret)
+			ret = truncate_blocks(mobj, dst_off);
+		if (dst_off > obj->o_size || truncate)
+			obj->o_size = dst_off;
+	}
+
+	return ret;
+}
+
+static int memstore_read(struct ceph_objstore *os,
+			 struct ceph_osds_object *obj,
+			 void *p, u64 off, u64 len)
+{
+	struct ceph_memstore_object *mobj = to_mem_object(obj);
+	u64 end = off + len;
+
+	while (off < end) {
+		size_t len_copy;
+		struct page *page;
+		off_t pg_off;
+		void *blk;
+
+		blk = blkmap_lookup(&mobj->o_blocks, off >> OSDS_BLOCK_SHIFT);
+		page = block_segment(blk, off & ~OSDS_BLOCK_MASK,
+				     &pg_off, &len_copy);
+		len_copy = min_t(u64, len_copy, end - off);
+		if (page)
+			memcpy(p, page_address(page) + pg_off, len_copy);
+		else
+			/* Hole */
+			memset(p, 0, len_copy);
+
+		p += len_copy;
+		off += len_copy;
+	}
+
+	return 0;
+}
+
+/**
+ * fill_bvecs() - walks segments of the range, references each page
+ *                and fills in @bv if it is not NULL.  Returns number
+ *                of segments.
+ */
+static unsigned int fill_bvecs(struct ceph_memstore *ms,
+			       struct ceph_memstore_object *mobj,
+			       u64 off, u64 end, struct bio_vec *bv)
+{
+	unsigned int nr = 0;
+
+	while (off < end) {
+		size_t len_seg;
+		struct page *page;
+		off_t pg_off;
+		void *blk;
+
+		blk = blkmap_lookup(&mobj->o_blocks, off >> OSDS_BLOCK_SHIFT);
+		page = block_segment(blk, off & ~OSDS_BLOCK_MASK,
+				     &pg_off, &len_seg);
+		len_seg = min_t(u64, len_seg, end - off);
+		if (bv) {
+			if (!page)
+				/* Hole */
+				page = ms->zero_block;
+			get_page(page);
+			bv[nr] = (struct bio_vec) {
+				.bv_page   = page,
+				.bv_len    = len_seg,
+				.bv_offset = pg_off,
+			};
+		}
+		off += len_seg;
+		nr++;
+	}
+
+	return nr;
+}
+
+/**
+ * memstore_read_bvecs() - zero-copy read, each bvec references a block
+ *                         or granule page or the shared zero block for
+ *                         a hole.
+ */
+static int memstore_read_bvecs(struct ceph_objstore *os,
+			       struct ceph_osds_object *obj,
+			       u64 off, u64 len, unsigned int nr_head,
+			       struct ceph_bvec_iter *it,
+			       unsigned int *num_bvecs)
+{
+	struct ceph_memstore *ms = to_memstore(os);
+	struct ceph_memstore_object *mobj = to_mem_object(obj);
+	struct bio_vec *bvecs;
+	unsigned int nr;
+
+	nr = fill_bvecs(ms, mobj, off, off + len, NULL);
+	bvecs = kmalloc_array(nr_head + nr, sizeof(*bvecs), GFP_KERNEL);
+	if (!bvecs)
+		return -ENOMEM;
+
+	fill_bvecs(ms, mobj, off, off + len, bvecs + nr_head);
+	*it = (struct ceph_bvec_iter) {
+		.bvecs = bvecs,
+		.iter = { .bi_size = len },
+	};
+	*num_bvecs = nr_head + nr;
+
+	return 0;
+}
+
+static int memstore_truncate(struct ceph_objstore *os,
+			     struct ceph_osds_object *obj,
+			     u64 size, const struct timespec64 *mtime)
+{
+	int ret;
+
+	ret = truncate_blocks(to_mem_object(obj), size);
+	if (ret)
+		return ret;
+
+	obj->o_size = size;
+	obj->o_mtime = *mtime;
+
+	return 0;
+}
+
+static int memstore_zero(struct ceph_objstore *os,
+			 struct ceph_osds_object *obj,
+			 u64 off, u64 len, const struct timespec64 *mtime)
+{
+	obj->o_mtime = *mtime;
+
+	return zero_range(to_mem_object(obj), off, len);
+}
+
+/**
+ * memstore_set_alloc_hint() - remembers expected write size, which
+ *                             selects granular or whole blocks for
+ *                             holes, and sizes the block map for the
+ *                             expected object size at once.
+ */
+static int memstore_set_alloc_hint(struct ceph_objstore *os,
+				   struct ceph_osds_object *obj,
+				   u64 expected_object_size,
+				   u64 expected_write_size)
+{
+	struct ceph_memstore_object *mobj = to_mem_object(obj);
+
+	mobj->o_write_hint = expected_write_size;
+	if (!expected_object_size ||
+	    expected_object_size > OSDS_HINT_MAX_SIZE)
+		return 0;
+
+	return blkmap_grow(&mobj->o_blocks,
+			   (expected_object_size - 1) >> OSDS_BLOCK_SHIFT);
+}
+
+static void memstore_object_stats(struct ceph_objstore *os,
+				  struct ceph_osds_object *obj,
+				  struct ceph_objstore_stats *st)
+{
+	struct ceph_memstore_object *mobj = to_mem_object(obj);
+	struct ceph_osds_blkmap *map = &mobj->o_blocks;
+	unsigned long idx;
+	void *blk;
+
+	for (idx = blkmap_next(map, 0); idx != OSDS_NO_BLOCK;
+	     idx = blkmap_next(map, idx + 1)) {
+		blk = blkmap_lookup(map, idx);
+		st->blocks++;
+		if (blk_is_granular(blk))
+			st->block_bytes += OSDS_GRANULE_SIZE *
+				__builtin_popcount(blk_to_gblock(blk)->g_present);
+		else
+			st->block_bytes += OSDS_BLOCK_SIZE;
+	}
+}
+
+static int memstore_mod_init(void)
+{
+	ceph_memstore_object_cache = KMEM_CACHE(ceph_memstore_object, 0);
+	ceph_osds_gblock_cache = KMEM_CACHE(ceph_osds_gblock, 0);
+	ceph_osds_leaf_cache = KMEM_CACHE(ceph_osds_leaf, 0);
+	if (!ceph_memstore_object_cache || !ceph_osds_gblock_cache ||
+	    !ceph_osds_leaf_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+module_init(memstore_mod_init);
+
+const struct ceph_objstore_ops ceph_memstore_ops = {
+	.name           = "memstore",
+	.block_shift    = OSDS_BLOCK_SHIFT,
+	.create         = memstore_create,
+	.destroy        = memstore_destroy,
+	.alloc_object   = memstore_alloc_object,
+	.free_object    = memstore_free_object,
+	.read           = memstore_read,
+	.read_bvecs     = memstore_read_bvecs,
+	.write          = memstore_write,
+	.truncate       = memstore_truncate,
+	.zero           = memstore_zero,
+	.set_alloc_hint = memstore_set_alloc_hint,
+	.object_stats   = memstore_object_stats,
+};
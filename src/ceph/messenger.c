@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0
 #include "ceph/ceph_debug.h"
 
+#include <limits.h>
+
 #include "types.h"
 
 #include "crc32c.h"
@@ -25,6 +27,8 @@
 #include "bitops.h"
 #include "rwlock.h"
 #include "getorder.h"
+#include "clock.h"
+#include "perf_counters.h"
 
 #include "ceph/ceph_features.h"
 #include "ceph/libceph.h"
@@ -186,6 +190,7 @@ static struct lock_class_key socket_class;
 
 static void ceph_msgr_accept_workfn(struct work_struct *);
 static void queue_con(struct ceph_connection *con);
+static void queue_con_ready(struct ceph_connection *con);
 static void cancel_con(struct ceph_connection *con);
 static void ceph_con_workfn(struct work_struct *);
 static void con_fault(struct ceph_connection *con);
@@ -244,9 +249,10 @@ static void encode_my_addr(struct ceph_messenger *msgr)
 }
 
 /*
- * work queue for all reading and writing to/from the socket.
+ * work queue for all reading and writing to/from the socket, each
+ * reactor has its own, see listener_start().
  */
-static struct workqueue_struct *ceph_msgr_wq;
+static __thread struct workqueue_struct *ceph_msgr_wq;
 
 static int ceph_msgr_slab_init(void)
 {
@@ -412,7 +418,7 @@ static void ceph_sock_data_ready(struct sock *sk)
 	if (sk->sk_state != TCP_CLOSE_WAIT) {
 		dout("%s on %p state = %lu, queueing work\n", __func__,
 		     con, con->state);
-		queue_con(con);
+		queue_con_ready(con);
 	}
 unlock:
 	read_unlock_bh(&sk->sk_callback_lock);
@@ -439,7 +445,7 @@ static void ceph_sock_write_space(struct sock *sk)
 		if (sk_stream_is_writeable(sk)) {
 			dout("%s %p queueing write work\n", __func__, con);
 			clear_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
-			queue_con(con);
+			queue_con_ready(con);
 		}
 	} else {
 		dout("%s %p nothing to write\n", __func__, con);
@@ -470,12 +476,12 @@ static void ceph_sock_state_change(struct sock *sk)
 		dout("%s TCP_CLOSE_WAIT\n", __func__);
 		con_sock_state_closing(con);
 		con_flag_set(con, CON_FLAG_SOCK_CLOSED);
-		queue_con(con);
+		queue_con_ready(con);
 		break;
 	case TCP_ESTABLISHED:
 		dout("%s TCP_ESTABLISHED\n", __func__);
 		con_sock_state_connected(con);
-		queue_con(con);
+		queue_con_ready(con);
 		break;
 	default:	/* Everything else is uninteresting */
 		break;
@@ -636,6 +642,52 @@ static int ceph_tcp_sendiov(struct socket *sock, struct iov_iter *iter,
 	return r;
 }
 
+/*
+ * Message data sent with MSG_ZEROCOPY is read by the kernel right from
+ * the message pages till the peer acks it, so the message is referenced
+ * till the socket reports the send completed.  Object pages of read
+ * replies are copied by the store on write while referenced, see
+ * cow_page() in memstore.c, so they do not change meanwhile.
+ */
+struct ceph_msg_zc {
+	struct sock_zc  zc;
+	struct ceph_msg *msg;
+};
+
+static void ceph_msg_zc_release(struct sock_zc *zc)
+{
+	struct ceph_msg_zc *mzc = container_of(zc, typeof(*mzc), zc);
+
+	ceph_msg_put(mzc->msg);
+	kfree(mzc);
+}
+
+/*
+ * write data of @m without copying, more is always expected, because
+ * the footer follows.
+ */
+static int ceph_tcp_sendiov_zc(struct socket *sock, struct iov_iter *iter,
+			       struct ceph_msg *m)
+{
+	struct kmsghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL |
+					    MSG_MORE,
+			       .msg_iter = *iter };
+	struct ceph_msg_zc *mzc;
+	int r;
+
+	mzc = kmalloc(sizeof(*mzc), GFP_KERNEL);
+	if (unlikely(!mzc))
+		return ceph_tcp_sendiov(sock, iter, true);
+
+	mzc->zc.release = ceph_msg_zc_release;
+	mzc->msg = ceph_msg_get(m);
+
+	r = sock_sendmsg_zc(sock, &msg, &mzc->zc);
+	if (r == -EAGAIN)
+		r = 0;
+	return r;
+}
+
 /*
  * @more: either or both of MSG_MORE and MSG_SENDPAGE_NOTLAST
  */
@@ -812,6 +864,8 @@ void ceph_con_init(struct ceph_connection *con, void *private,
 	mutex_init(&con->mutex);
 	INIT_LIST_HEAD(&con->out_queue);
 	INIT_LIST_HEAD(&con->out_sent);
+	INIT_LIST_HEAD(&con->cork_item);
+	INIT_LIST_HEAD(&con->ready_item);
 	INIT_DELAYED_WORK(&con->work, ceph_con_workfn);
 
 	con->state = CON_STATE_CLOSED;
@@ -831,17 +885,18 @@ static struct ceph_connection *ceph_con_alloc(struct ceph_messenger *msgr)
 
 /*
  * We maintain a global counter to order connection attempts.  Get
- * a unique seq greater than @gt.
+ * a unique seq greater than @gt.  Called by all reactors, spinlocks
+ * are no-ops here, so the counter is bumped by cmpxchg.
  */
 static u32 get_global_seq(struct ceph_messenger *msgr, u32 gt)
 {
+	int old = atomic_read(&msgr->global_seq);
 	u32 ret;
 
-	spin_lock(&msgr->global_seq_lock);
-	if (msgr->global_seq < gt)
-		msgr->global_seq = gt;
-	ret = ++msgr->global_seq;
-	spin_unlock(&msgr->global_seq_lock);
+	do {
+		ret = max_t(u32, old, gt) + 1;
+	} while (!atomic_try_cmpxchg_relaxed(&msgr->global_seq, &old, ret));
+
 	return ret;
 }
 
@@ -1327,60 +1382,75 @@ static void prepare_message_data(unsigned int dir, struct ceph_msg *msg,
 }
 
 /*
- * Prepare footer for currently outgoing message, and finish things
+ * Queue footer for currently outgoing message, and finish things
  * off.  Assumes out_kvec* are already valid.. we just add on to the end.
  */
 static void prepare_write_message_footer(struct ceph_connection *con)
 {
 	struct ceph_msg *m = con->out_msg;
 
-	m->footer.flags |= CEPH_MSG_FOOTER_COMPLETE;
-
 	dout("prepare_write_message_footer %p\n", con);
 	con_out_kvec_add(con, sizeof_footer(con), &m->footer);
-	if (con->peer_features & CEPH_FEATURE_MSG_AUTH) {
-		if (con->ops->sign_message)
-			con->ops->sign_message(m);
-		else
-			m->footer.sig = 0;
-	} else {
-		m->old_footer.flags = m->footer.flags;
-	}
 	con->out_more = m->more_to_follow;
 	con->out_msg_done = true;
 }
 
+static int crc32c_kvec(struct kvec *vec, void *p)
+{
+	u32 *crc = p;
+
+	*crc = crc32c(*crc, vec->iov_base, vec->iov_len);
+
+	return 0;
+}
+
+static u32 ceph_crc32c_iov(u32 crc, struct iov_iter *iter,
+			   unsigned int length)
+{
+	iov_iter_for_each_range(iter, length, crc32c_kvec, &crc);
+
+	return crc;
+}
+
+static u32 ceph_msg_data_crc(struct ceph_msg *m)
+{
+	struct ceph_msg_data_cursor cursor;
+	size_t len;
+	u32 crc = 0;
+
+	ceph_msg_data_cursor_init(&cursor, m->data, WRITE, m->data_length);
+	while (cursor.total_resid) {
+		if (!cursor.resid) {
+			ceph_msg_data_cursor_advance(&cursor, 0);
+			continue;
+		}
+		ceph_msg_data_cursor_next(&cursor);
+		len = iov_iter_count(&cursor.iter);
+		crc = ceph_crc32c_iov(crc, &cursor.iter, len);
+		ceph_msg_data_cursor_advance(&cursor, len);
+	}
+
+	return crc;
+}
+
 /*
- * Prepare headers for the next outgoing message.
+ * Assign seq and fill in header crc and the whole footer, so the
+ * message can be written as is.  Data crc is calculated here and not
+ * while data is being sent, thus the message can be batched with
+ * others, see write_partial_batch().
  */
-static void prepare_write_message(struct ceph_connection *con)
+static void finalize_write_message(struct ceph_connection *con,
+				   struct ceph_msg *m)
 {
 	bool do_hdrcrc = !ceph_test_opt(con->msgr->options, NO_HDR_CRC);
-	struct ceph_msg *m;
-	u32 crc = 0;
-
-	con_out_kvec_reset(con);
-	con->out_msg_done = false;
+	bool do_datacrc = !ceph_test_opt(con->msgr->options, NO_DATA_CRC);
+	u32 crc;
 
-	/* Sneak an ack in there first?  If we can get it into the same
-	 * TCP packet that's a good thing. */
-	if (con->in_seq > con->in_seq_acked) {
-		con->in_seq_acked = con->in_seq;
-		con_out_kvec_add(con, sizeof (tag_ack), &tag_ack);
-		con->out_temp_ack = cpu_to_le64(con->in_seq_acked);
-		con_out_kvec_add(con, sizeof (con->out_temp_ack),
-			&con->out_temp_ack);
-	}
+	if (m->out_ready)
+		return;
 
-	BUG_ON(list_empty(&con->out_queue));
-	m = list_first_entry(&con->out_queue, struct ceph_msg, list_head);
-	con->out_msg = m;
 	BUG_ON(m->con != con);
 
-	/* put message on sent list */
-	ceph_msg_get(m);
-	list_move_tail(&m->list_head, &con->out_sent);
-
 	/*
 	 * only assign outgoing seq # if we haven't sent this message
 	 * yet.  if it is requeued, resend with it's original seq.
@@ -1393,30 +1463,16 @@ static void prepare_write_message(struct ceph_connection *con)
 			con->ops->reencode_message(m);
 	}
 
-	dout("prepare_write_message %p seq %lld type %d len %d+%d+%zd\n",
-	     m, con->out_seq, le16_to_cpu(m->hdr.type),
-	     le32_to_cpu(m->hdr.front_len), le32_to_cpu(m->hdr.middle_len),
-	     m->data_length);
 	WARN_ON(m->front.iov_len != le32_to_cpu(m->hdr.front_len));
 	WARN_ON(m->data_length != le32_to_cpu(m->hdr.data_len));
 
-	/* tag + hdr + front + middle */
-	con_out_kvec_add(con, sizeof (tag_msg), &tag_msg);
-	con_out_kvec_add(con, sizeof(con->out_hdr), &con->out_hdr);
-	con_out_kvec_add(con, m->front.iov_len, m->front.iov_base);
-
-	if (m->middle)
-		con_out_kvec_add(con, m->middle->vec.iov_len,
-			m->middle->vec.iov_base);
-
 	if (do_hdrcrc)
 		/* fill in hdr crc and finalize hdr */
 		crc = crc32c(0, &m->hdr, offsetof(struct ceph_msg_header, crc));
 	else
 		crc = 0;
 
-	con->out_msg->hdr.crc = cpu_to_le32(crc);
-	memcpy(&con->out_hdr, &con->out_msg->hdr, sizeof(con->out_hdr));
+	m->hdr.crc = cpu_to_le32(crc);
 
 	if (do_hdrcrc)
 		/* fill in front and middle crc, footer */
@@ -1424,22 +1480,90 @@ static void prepare_write_message(struct ceph_connection *con)
 	else
 		crc = 0;
 
-	con->out_msg->footer.front_crc = cpu_to_le32(crc);
+	m->footer.front_crc = cpu_to_le32(crc);
 	if (m->middle && do_hdrcrc) {
 		crc = crc32c(0, m->middle->vec.iov_base,
 				m->middle->vec.iov_len);
-		con->out_msg->footer.middle_crc = cpu_to_le32(crc);
+		m->footer.middle_crc = cpu_to_le32(crc);
 	} else
-		con->out_msg->footer.middle_crc = 0;
+		m->footer.middle_crc = 0;
 	dout("%s front_crc %u middle_crc %u\n", __func__,
-	     le32_to_cpu(con->out_msg->footer.front_crc),
-	     le32_to_cpu(con->out_msg->footer.middle_crc));
-	con->out_msg->footer.flags = 0;
+	     le32_to_cpu(m->footer.front_crc),
+	     le32_to_cpu(m->footer.middle_crc));
+	m->footer.flags = 0;
+
+	if (!m->data_length) {
+		m->footer.data_crc = 0;
+	} else if (!do_datacrc) {
+		m->footer.data_crc = 0;
+		m->footer.flags |= CEPH_MSG_FOOTER_NOCRC;
+	} else if (!m->data_crc_ready) {
+		/*
+		 * Data does not depend on the seq, so it is not summed
+		 * again when a batched message gives its seq back.
+		 */
+		m->footer.data_crc = cpu_to_le32(ceph_msg_data_crc(m));
+		m->data_crc_ready = true;
+	}
+	m->footer.flags |= CEPH_MSG_FOOTER_COMPLETE;
+
+	if (con->peer_features & CEPH_FEATURE_MSG_AUTH) {
+		if (con->ops->sign_message)
+			con->ops->sign_message(m);
+		else
+			m->footer.sig = 0;
+	} else {
+		m->old_footer.flags = m->footer.flags;
+	}
+	m->out_ready = true;
+}
+
+/*
+ * Prepare headers for the next outgoing message.
+ */
+static void prepare_write_message(struct ceph_connection *con)
+{
+	struct ceph_msg *m;
+	u64 len;
+
+	con_out_kvec_reset(con);
+	con->out_msg_done = false;
+
+	BUG_ON(list_empty(&con->out_queue));
+	m = list_first_entry(&con->out_queue, struct ceph_msg, list_head);
+	con->out_msg = m;
+	BUG_ON(m->con != con);
+
+	/* put message on sent list */
+	ceph_msg_get(m);
+	list_move_tail(&m->list_head, &con->out_sent);
+
+	len = le32_to_cpu(m->hdr.front_len) + le32_to_cpu(m->hdr.middle_len) +
+		m->data_length;
+	con->out_bytes += len;
+	perf_inc(PERF_MSGR_TX_MSGS);
+	perf_add(PERF_MSGR_TX_BYTES, len);
+
+	finalize_write_message(con, m);
+
+	dout("prepare_write_message %p seq %lld type %d len %d+%d+%zd\n",
+	     m, le64_to_cpu(m->hdr.seq), le16_to_cpu(m->hdr.type),
+	     le32_to_cpu(m->hdr.front_len), le32_to_cpu(m->hdr.middle_len),
+	     m->data_length);
+
+	/* tag + hdr + front + middle */
+	con_out_kvec_add(con, sizeof (tag_msg), &tag_msg);
+	memcpy(&con->out_hdr, &m->hdr, sizeof(con->out_hdr));
+	con_out_kvec_add(con, sizeof(con->out_hdr), &con->out_hdr);
+	con_out_kvec_add(con, m->front.iov_len, m->front.iov_base);
+
+	if (m->middle)
+		con_out_kvec_add(con, m->middle->vec.iov_len,
+			m->middle->vec.iov_base);
 
 	/* is there a data payload? */
-	con->out_msg->footer.data_crc = 0;
 	if (m->data_length) {
-		prepare_message_data(WRITE, con->out_msg, m->data_length);
+		prepare_message_data(WRITE, m, m->data_length);
 		con->out_more = 1;  /* data + footer will follow */
 	} else {
 		/* no, queue up footer too and be done */
@@ -1736,85 +1860,295 @@ out:
 	return ret;  /* done! */
 }
 
-static int crc32c_kvec(struct kvec *vec, void *p)
+/*
+ * Outgoing batch: everything which is ready to be written, i.e. pending
+ * kvecs, rest of the data and the footer of the current message and as
+ * many queued messages as fit, goes to the socket with one sendmsg().
+ * Queued messages are finalized before they are added, so their header
+ * and footer are taken right from the message.
+ *
+ * Data of a message bigger than `tcp_zerocopy_bytes` is sent alone with
+ * MSG_ZEROCOPY: the kernel keeps reading pinned pages till the data is
+ * acked, and everything else in the batch, e.g. ->out_hdr or an ack,
+ * may be rewritten meanwhile.
+ */
+struct con_out_batch {
+	struct kvec vec[IOV_MAX];
+	unsigned int nr;
+	size_t bytes;
+};
+
+static __thread struct con_out_batch out_batch;
+
+static bool out_batch_add(struct con_out_batch *b, void *base, size_t len)
 {
-	u32 *crc = p;
+	if (!len)
+		return true;
+	if (b->nr == ARRAY_SIZE(b->vec))
+		return false;
 
-	*crc = crc32c(*crc, vec->iov_base, vec->iov_len);
+	b->vec[b->nr].iov_base = base;
+	b->vec[b->nr].iov_len = len;
+	b->nr++;
+	b->bytes += len;
 
-	return 0;
+	return true;
 }
 
-static u32 ceph_crc32c_iov(u32 crc, struct iov_iter *iter,
-			   unsigned int length)
+/*
+ * Adds segments of @iter while there is room, returns number of bytes
+ * added.  Multi-page bvecs are contiguous, so are added as a whole.
+ */
+static size_t out_batch_add_iter(struct con_out_batch *b,
+				 struct iov_iter *iter)
 {
-	iov_iter_for_each_range(iter, length, crc32c_kvec, &crc);
+	size_t skip = iter->iov_offset, count = iter->count;
+	size_t len, added = 0;
+	unsigned long i;
+	void *base;
 
-	return crc;
+	BUG_ON(!iov_iter_is_kvec(iter) && !iov_iter_is_bvec(iter));
+
+	for (i = 0; count && i < iter->nr_segs; i++) {
+		if (iov_iter_is_kvec(iter)) {
+			const struct kvec *kv = &iter->kvec[i];
+
+			base = kv->iov_base + skip;
+			len = min(kv->iov_len - skip, count);
+		} else {
+			const struct bio_vec *bv = &iter->bvec[i];
+
+			base = page_address(bv->bv_page) + bv->bv_offset + skip;
+			len = min_t(size_t, bv->bv_len - skip, count);
+		}
+		if (!out_batch_add(b, base, len))
+			break;
+		added += len;
+		count -= len;
+		skip = 0;
+	}
+
+	return added;
+}
+
+/*
+ * Adds data from @cursor on, @cursor is advanced, so should be a copy.
+ * Returns false if the batch is full.
+ */
+static bool out_batch_add_data(struct con_out_batch *b,
+			       struct ceph_msg_data_cursor *cursor)
+{
+	size_t len;
+
+	while (cursor->total_resid) {
+		if (!cursor->resid) {
+			ceph_msg_data_cursor_advance(cursor, 0);
+			continue;
+		}
+		ceph_msg_data_cursor_next(cursor);
+		len = out_batch_add_iter(b, &cursor->iter);
+		if (!len)
+			return false;
+		ceph_msg_data_cursor_advance(cursor, len);
+	}
+
+	return true;
+}
+
+static bool con_msg_zerocopy(struct ceph_connection *con,
+			     struct ceph_msg *m)
+{
+	unsigned int min = con->msgr->options->tcp_zerocopy_bytes;
+
+	return min && m->data_length >= min;
+}
+
+static bool out_batch_add_msg(struct ceph_connection *con,
+			      struct con_out_batch *b, struct ceph_msg *m)
+{
+	struct ceph_msg_data_cursor cursor;
+
+	if (!out_batch_add(b, &tag_msg, sizeof(tag_msg)) ||
+	    !out_batch_add(b, &m->hdr, sizeof(m->hdr)) ||
+	    !out_batch_add(b, m->front.iov_base, m->front.iov_len))
+		return false;
+	if (m->middle && !out_batch_add(b, m->middle->vec.iov_base,
+					m->middle->vec.iov_len))
+		return false;
+	if (m->data_length) {
+		/* Zero-copy data goes alone, the batch ends here */
+		if (con_msg_zerocopy(con, m))
+			return false;
+		ceph_msg_data_cursor_init(&cursor, m->data, WRITE,
+					  m->data_length);
+		if (!out_batch_add_data(b, &cursor))
+			return false;
+	}
+
+	return out_batch_add(b, &m->footer, sizeof_footer(con));
+}
+
+/*
+ * Accounts @ret bytes written from out_kvec, returns what is left.
+ */
+static size_t con_out_kvec_advance(struct ceph_connection *con, size_t ret)
+{
+	size_t len;
+
+	while (ret && con->out_kvec_left) {
+		len = min(ret, con->out_kvec_cur->iov_len);
+		con->out_kvec_cur->iov_len -= len;
+		con->out_kvec_cur->iov_base += len;
+		con->out_kvec_bytes -= len;
+		ret -= len;
+		if (!con->out_kvec_cur->iov_len) {
+			con->out_kvec_cur++;
+			con->out_kvec_left--;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Accounts @ret bytes of the batch as written, as if messages were
+ * sent one by one, so a partially written message ends up as the usual
+ * ->out_msg with its out_kvec and data cursor.  Batched messages up to
+ * @last which were not reached give their fresh seqs back, so a message
+ * revoked before it is sent does not leave a hole in the sequence.
+ */
+static void con_out_batch_commit(struct ceph_connection *con, size_t ret,
+				 struct ceph_msg *last, u64 out_seq)
+{
+	struct ceph_msg_data_cursor *cursor;
+	struct ceph_msg *m;
+	unsigned int nr = 0;
+	size_t len;
+
+	for (;;) {
+		ret = con_out_kvec_advance(con, ret);
+		if (con->out_kvec_left)
+			break;
+		if (con->out_msg && !con->out_msg_done) {
+			cursor = &con->out_msg->cursor;
+			while (ret && cursor->total_resid) {
+				if (!cursor->resid) {
+					ceph_msg_data_cursor_advance(cursor, 0);
+					continue;
+				}
+				ceph_msg_data_cursor_next(cursor);
+				len = min(ret, iov_iter_count(&cursor->iter));
+				ceph_msg_data_cursor_advance(cursor, len);
+				ret -= len;
+			}
+			if (cursor->total_resid)
+				break;
+
+			/* queue up footer, too */
+			con_out_kvec_reset(con);
+			prepare_write_message_footer(con);
+			continue;
+		}
+		if (con->out_msg) {
+			ceph_msg_put(con->out_msg);
+			con->out_msg = NULL;   /* we're done with this one */
+		}
+		if (!ret)
+			break;
+		prepare_write_message(con);
+	}
+
+	if (!last)
+		return;
+	list_for_each_entry(m, &con->out_queue, list_head) {
+		if (!m->needs_out_seq && le64_to_cpu(m->hdr.seq) > out_seq) {
+			m->needs_out_seq = true;
+			m->out_ready = false;
+			nr++;
+		}
+		if (m == last)
+			break;
+	}
+	con->out_seq -= nr;
 }
+
 /*
- * Write as much message data payload as we can.  If we finish, queue
- * up the footer.
- *  1 -> done, footer is now queued in out_kvec[].
+ * Write as much of the batch as we can.
+ *  1 -> done, though the batch could be full, so out_kvec or out_msg
+ *       may be still pending
  *  0 -> socket full, but more to do
  * <0 -> error
  */
-static int write_partial_message_data(struct ceph_connection *con)
+static int write_partial_batch(struct ceph_connection *con)
 {
-	struct ceph_msg *msg = con->out_msg;
-	struct ceph_msg_data_cursor *cursor = &msg->cursor;
-	bool do_datacrc = !ceph_test_opt(con->msgr->options, NO_DATA_CRC);
-	int more = MSG_MORE | MSG_SENDPAGE_NOTLAST;
-	u32 crc;
-
-	dout("%s %p msg %p\n", __func__, con, msg);
+	struct con_out_batch *b = &out_batch;
+	struct ceph_msg_data_cursor cursor;
+	struct ceph_msg *m, *last = NULL, *zc = NULL;
+	u64 out_seq = con->out_seq;
+	struct iov_iter it;
+	bool full = false;
+	unsigned int i;
+	int ret = 0;
 
-	if (!msg->num_data_items)
-		return -EINVAL;
+	b->nr = 0;
+	b->bytes = 0;
 
-	/*
-	 * Iterate through each page that contains data to be
-	 * written, and send as much as possible for each.
-	 *
-	 * If we are calculating the data crc (the default), we will
-	 * need to map the page.  If we have no pages, they have
-	 * been revoked, so use the zero page.
-	 */
-	crc = do_datacrc ? le32_to_cpu(msg->footer.data_crc) : 0;
-	while (cursor->total_resid) {
-		int ret;
+	/* Sneak an ack in there first?  If we can get it into the same
+	 * TCP packet that's a good thing. */
+	if (!con->out_msg && !con->out_kvec_left &&
+	    !list_empty(&con->out_queue) && con->in_seq > con->in_seq_acked) {
+		con_out_kvec_reset(con);
+		con->in_seq_acked = con->in_seq;
+		con_out_kvec_add(con, sizeof (tag_ack), &tag_ack);
+		con->out_temp_ack = cpu_to_le64(con->in_seq_acked);
+		con_out_kvec_add(con, sizeof (con->out_temp_ack),
+			&con->out_temp_ack);
+	}
 
-		if (!cursor->resid) {
-			ceph_msg_data_cursor_advance(cursor, 0);
-			continue;
+	for (i = 0; i < con->out_kvec_left; i++)
+		out_batch_add(b, con->out_kvec_cur[i].iov_base,
+			      con->out_kvec_cur[i].iov_len);
+
+	if (con->out_msg && !con->out_msg_done) {
+		cursor = con->out_msg->cursor;
+		if (cursor.total_resid && con_msg_zerocopy(con, con->out_msg)) {
+			/* Send pending kvecs first, then data alone */
+			if (!b->nr) {
+				zc = con->out_msg;
+				out_batch_add_data(b, &cursor);
+			}
+			full = true;
+		} else {
+			full = !out_batch_add_data(b, &cursor) ||
+				!out_batch_add(b, &con->out_msg->footer,
+					       sizeof_footer(con));
 		}
-
-		ceph_msg_data_cursor_next(cursor);
-		if (iov_iter_count(&cursor->iter) == cursor->total_resid)
-			more = MSG_MORE;
-		ret = ceph_tcp_sendiov(con->sock, &cursor->iter, more);
-		if (ret <= 0) {
-			if (do_datacrc)
-				msg->footer.data_crc = cpu_to_le32(crc);
-
-			return ret;
+	}
+	if (!full) {
+		list_for_each_entry(m, &con->out_queue, list_head) {
+			finalize_write_message(con, m);
+			last = m;
+			if (!out_batch_add_msg(con, b, m)) {
+				full = true;
+				break;
+			}
 		}
-		if (do_datacrc)
-			crc = ceph_crc32c_iov(crc, &cursor->iter, ret);
-		ceph_msg_data_cursor_advance(cursor, (size_t)ret);
 	}
 
-	dout("%s %p msg %p done\n", __func__, con, msg);
-
-	/* prepare and queue up footer, too */
-	if (do_datacrc)
-		msg->footer.data_crc = cpu_to_le32(crc);
-	else
-		msg->footer.flags |= CEPH_MSG_FOOTER_NOCRC;
-	con_out_kvec_reset(con);
-	prepare_write_message_footer(con);
+	dout("%s %p %u kvecs %zu bytes full %d\n", __func__, con,
+	     b->nr, b->bytes, full);
+	if (b->bytes) {
+		iov_iter_kvec(&it, WRITE, b->vec, b->nr, b->bytes);
+		if (zc)
+			ret = ceph_tcp_sendiov_zc(con->sock, &it, zc);
+		else
+			ret = ceph_tcp_sendiov(con->sock, &it, full);
+	}
+	con_out_batch_commit(con, ret > 0 ? ret : 0, last, out_seq);
+	if (ret < 0)
+		return ret;
 
-	return 1;	/* must return > 0 to indicate success */
+	return (size_t)ret == b->bytes ? 1 : 0;
 }
 
 /*
@@ -2699,6 +3033,8 @@ static int read_partial_msg_data(struct ceph_connection *con)
  * read (part of) a message.
  */
 static int ceph_con_in_msg_alloc(struct ceph_connection *con, int *skip);
+static int ceph_con_in_msg_alloc_data(struct ceph_connection *con,
+				      unsigned int data_len);
 
 static int read_partial_message(struct ceph_connection *con)
 {
@@ -2790,9 +3126,12 @@ static int read_partial_message(struct ceph_connection *con)
 		if (m->middle)
 			m->middle->vec.iov_len = 0;
 
-		/* prepare for data payload, if any */
-
-		if (data_len)
+		/*
+		 * Prepare for data payload, if any.  If data was not
+		 * allocated, ->alloc_msg_data() will be called when the
+		 * front is read.
+		 */
+		if (data_len && m->num_data_items)
 			prepare_message_data(READ, con->in_msg, data_len);
 	}
 
@@ -2813,6 +3152,11 @@ static int read_partial_message(struct ceph_connection *con)
 
 	/* (page) data */
 	if (data_len) {
+		if (!m->num_data_items) {
+			ret = ceph_con_in_msg_alloc_data(con, data_len);
+			if (ret < 0)
+				return ret;
+		}
 		ret = read_partial_msg_data(con);
 		if (ret <= 0)
 			return ret;
@@ -2870,6 +3214,7 @@ static int read_partial_message(struct ceph_connection *con)
 static void process_message(struct ceph_connection *con)
 {
 	struct ceph_msg *msg = con->in_msg;
+	u64 len;
 
 	BUG_ON(con->in_msg->con != con);
 	con->in_msg = NULL;
@@ -2878,9 +3223,16 @@ static void process_message(struct ceph_connection *con)
 	if (con->peer_name.type == 0)
 		con->peer_name = msg->hdr.src;
 
+	len = le32_to_cpu(msg->hdr.front_len) +
+		le32_to_cpu(msg->hdr.middle_len) +
+		le32_to_cpu(msg->hdr.data_len);
 	con->in_seq++;
+	con->in_bytes += len;
 	mutex_unlock(&con->mutex);
 
+	perf_inc(PERF_MSGR_RX_MSGS);
+	perf_add(PERF_MSGR_RX_BYTES, len);
+
 	dout("===== %p %llu from %s%lld %d=%s len %d+%d (%u %u %u) =====\n",
 	     msg, le64_to_cpu(msg->hdr.seq),
 	     ENTITY_NAME(msg->hdr.src),
@@ -2975,6 +3327,16 @@ more:
 	dout("try_write out_kvec_bytes %d\n", con->out_kvec_bytes);
 	BUG_ON(!con->sock);
 
+	/* messages go in batches, see write_partial_batch() */
+	if (con->state == CON_STATE_OPEN && !con->out_skip) {
+		ret = write_partial_batch(con);
+		if (ret <= 0)
+			goto out;
+		if (con->out_kvec_left || con->out_msg)
+			goto more;  /* batch was full */
+		goto do_next;
+	}
+
 	/* kvec data queued? */
 	if (con->out_kvec_left) {
 		ret = write_partial_kvec(con);
@@ -2987,26 +3349,6 @@ more:
 			goto out;
 	}
 
-	/* msg pages? */
-	if (con->out_msg) {
-		if (con->out_msg_done) {
-			ceph_msg_put(con->out_msg);
-			con->out_msg = NULL;   /* we're done with this one */
-			goto do_next;
-		}
-
-		ret = write_partial_message_data(con);
-		if (ret == 1)
-			goto more;  /* we need to send the footer, too! */
-		if (ret == 0)
-			goto out;
-		if (ret < 0) {
-			dout("try_write write_partial_message_data err %d\n",
-			     ret);
-			goto out;
-		}
-	}
-
 do_next:
 	if (con->state == CON_STATE_OPEN) {
 		if (con_flag_test_and_clear(con, CON_FLAG_KEEPALIVE_PENDING)) {
@@ -3014,10 +3356,8 @@ do_next:
 			goto more;
 		}
 		/* is anything else pending? */
-		if (!list_empty(&con->out_queue)) {
-			prepare_write_message(con);
+		if (!list_empty(&con->out_queue))
 			goto more;
-		}
 		if (con->in_seq > con->in_seq_acked) {
 			prepare_write_ack(con);
 			goto more;
@@ -3302,15 +3642,13 @@ static void con_fault_finish(struct ceph_connection *con)
 }
 
 /*
- * Do some work on a connection.  Drop a connection ref when we're done.
+ * Do some work on a connection, called with con->mutex held, which is
+ * released.
  */
-static void ceph_con_workfn(struct work_struct *work)
+static void con_work(struct ceph_connection *con)
 {
-	struct ceph_connection *con = container_of(work, struct ceph_connection,
-						   work.work);
 	bool fault;
 
-	mutex_lock(&con->mutex);
 	while (true) {
 		int ret;
 
@@ -3363,16 +3701,97 @@ static void ceph_con_workfn(struct work_struct *work)
 
 	if (fault)
 		con_fault_finish(con);
+}
+
+/*
+ * Do some work on a connection.  Drop a connection ref when we're done.
+ */
+static void ceph_con_workfn(struct work_struct *work)
+{
+	struct ceph_connection *con = container_of(work, struct ceph_connection,
+						   work.work);
 
+	mutex_lock(&con->mutex);
+	con_work(con);
 	con->ops->put(con);
 }
 
+/**
+ * con_work_inline() - does the connection work right in the event loop,
+ *                     if callbacks of @con never sleep, @con is open and
+ *                     no worker has it queued or is busy with it.
+ *                     Returns false if the work should be queued.
+ */
+static bool con_work_inline(struct ceph_connection *con)
+{
+	if (!con->ops->nosleep || con->state != CON_STATE_OPEN)
+		return false;
+	if (delayed_work_pending(&con->work))
+		return false;
+	if (!mutex_trylock(&con->mutex))
+		/* Worker is in the middle of it */
+		return false;
+
+	con_work(con);
+
+	return true;
+}
+
+/*
+ * Connections made ready by socket callbacks of the event loop.  The
+ * socket is still in use when a callback returns, so the work runs at
+ * the end of the loop iteration, see con_work_inline().
+ */
+struct ceph_msgr_ready {
+	struct event_item ev;
+	struct list_head  cons;
+};
+
+static __thread struct ceph_msgr_ready msgr_ready;
+
+static void msgr_ready_run(struct event_item *ev)
+{
+	struct ceph_connection *con;
+
+	while (!list_empty(&msgr_ready.cons)) {
+		con = list_first_entry(&msgr_ready.cons, typeof(*con),
+				       ready_item);
+		list_del_init(&con->ready_item);
+		if (!con_work_inline(con))
+			queue_con(con);
+		con->ops->put(con);
+	}
+}
+
+static void queue_con_ready(struct ceph_connection *con)
+{
+	if (!con->ops->nosleep || !in_event_loop()) {
+		queue_con(con);
+		return;
+	}
+	if (!list_empty(&con->ready_item))
+		/* Runs anyway */
+		return;
+	if (!con->ops->get(con)) {
+		dout("%s %p ref count 0\n", __func__, con);
+		return;
+	}
+	if (!msgr_ready.ev.action) {
+		INIT_EVENT(&msgr_ready.ev, msgr_ready_run);
+		INIT_LIST_HEAD(&msgr_ready.cons);
+	}
+	list_add_tail(&con->ready_item, &msgr_ready.cons);
+	event_item_defer(&msgr_ready.ev);
+}
+
 /*
  * Generic error/fault handler.  A retry mechanism is used with
  * exponential backoff
  */
 static void con_fault(struct ceph_connection *con)
 {
+	struct ceph_msg *m;
+
 	dout("fault %p state %lu to peer %s\n",
 	     con, con->state, ceph_pr_addr(&con->peer_addr));
 
@@ -3404,6 +3823,9 @@ static void con_fault(struct ceph_connection *con)
 
 	/* Requeue anything that hasn't been acked */
 	list_splice_init(&con->out_sent, &con->out_queue);
+	/* Signature depends on the session, finalize again */
+	list_for_each_entry(m, &con->out_queue, list_head)
+		m->out_ready = false;
 
 	/* If there are no messages queued or keepalive pending, place
 	 * the connection in a STANDBY state */
@@ -3441,7 +3863,9 @@ void ceph_messenger_init(struct ceph_messenger *msgr,
 			 struct ceph_options *options,
 			 u64 sup_features, u64 req_features)
 {
-	spin_lock_init(&msgr->global_seq_lock);
+	int i;
+
+	atomic_set(&msgr->global_seq, 0);
 
 	if (myaddr) {
 		msgr->inst.addr = *myaddr;
@@ -3463,10 +3887,16 @@ void ceph_messenger_init(struct ceph_messenger *msgr,
 
 	atomic_set(&msgr->stopping, 0);
 	write_pnet(&msgr->net, get_net(current->nsproxy->net_ns));
-	INIT_WORK(&msgr->accept_work, ceph_msgr_accept_workfn);
-	msgr->listen_sock = NULL;
+	for (i = 0; i < ARRAY_SIZE(msgr->listeners); i++) {
+		struct ceph_msgr_listener *l = &msgr->listeners[i];
+
+		l->msgr = msgr;
+		INIT_WORK(&l->accept_work, ceph_msgr_accept_workfn);
+		l->sock = NULL;
+		l->def_data_ready = NULL;
+	}
+	msgr->nr_listeners = 0;
 	msgr->con_ops = NULL;
-	msgr->def_data_ready = NULL;
 
 	dout("%s %p\n", __func__, msgr);
 }
@@ -3482,15 +3912,17 @@ EXPORT_SYMBOL(ceph_messenger_fini);
 static void ceph_msgr_accept_workfn(struct work_struct *work)
 {
 	struct sockaddr_storage peer_addr;
+	struct ceph_msgr_listener *l;
 	struct ceph_messenger *msgr;
 	struct ceph_connection *con;
 	struct socket *newsock;
 	int ret;
 
-	msgr = container_of(work, typeof(*msgr), accept_work);
+	l = container_of(work, typeof(*l), accept_work);
+	msgr = l->msgr;
 
 	while (true) {
-		ret = kernel_accept(msgr->listen_sock, &newsock, O_NONBLOCK);
+		ret = kernel_accept(l->sock, &newsock, O_NONBLOCK);
 		if (ret < 0) {
 			if (ret != -EAGAIN)
 				pr_warn("failed to accept err=%d\n", ret);
@@ -3555,52 +3987,48 @@ static void ceph_msgr_accept_workfn(struct work_struct *work)
 
 static void ceph_sock_listen_data_ready(struct sock *sk)
 {
-	struct ceph_messenger *msgr;
+	struct ceph_msgr_listener *l;
 
 	read_lock_bh(&sk->sk_callback_lock);
-	msgr = sk->sk_user_data;
-	if (!msgr || atomic_read(&msgr->stopping))
+	l = sk->sk_user_data;
+	if (!l || atomic_read(&l->msgr->stopping))
 		goto out;
 
 	if (sk->sk_state == TCP_LISTEN)
-		queue_work(ceph_msgr_wq, &msgr->accept_work);
+		queue_work(ceph_msgr_wq, &l->accept_work);
 out:
 	read_unlock_bh(&sk->sk_callback_lock);
 }
 
 /*
- * Binds socket and starts listening. Function does not take any locks, so
- * should not be concurrently called with itself or with *_stop_listen().
+ * Binds socket of the listener and starts listening, called on the
+ * reactor which accepts connections from the listener.
  */
-int ceph_messenger_start_listen(struct ceph_messenger *msgr,
-				const struct ceph_connection_operations *ops)
+static int listener_start(void *arg)
 {
-	struct sockaddr_storage addr;
+	struct ceph_msgr_listener *l = arg;
+	struct ceph_messenger *msgr = l->msgr;
 	struct socket *sock;
 	int opt, ret;
 
-	if (!ops || !ops->alloc_con || !ops->accept_con)
-		return -EINVAL;
-
-	if (msgr->con_ops)
-		return -EALREADY;
-
-	msgr->con_ops = ops;
-
-	/* Avoid unaligned access by pointer warn because of packed struct */
-	addr = msgr->inst.addr.in_addr;
+	if (!ceph_msgr_wq) {
+		/* Reactors other than #0 need a queue for own connections */
+		ceph_msgr_wq = alloc_workqueue("ceph-msgr", WQ_MEM_RECLAIM, 0);
+		if (!ceph_msgr_wq)
+			return -ENOMEM;
+	}
 
 	ret = sock_create_kern(read_pnet(&msgr->net),
-			       addr.ss_family, SOCK_STREAM,
-			       IPPROTO_TCP, &msgr->listen_sock);
+			       l->addr.ss_family, SOCK_STREAM,
+			       IPPROTO_TCP, &l->sock);
 	if (ret) {
 		pr_err("failed to create a socket: %d\n", ret);
 		return ret;
 	}
 
-	sock = msgr->listen_sock;
-	sock->sk->sk_user_data = msgr;
-	msgr->def_data_ready = sock->sk->sk_data_ready;
+	sock = l->sock;
+	sock->sk->sk_user_data = l;
+	l->def_data_ready = sock->sk->sk_data_ready;
 	sock->sk->sk_data_ready = ceph_sock_listen_data_ready;
 
 	if (ceph_test_opt(msgr->options, TCP_NODELAY)) {
@@ -3621,12 +4049,25 @@ int ceph_messenger_start_listen(struct ceph_messenger *msgr,
 		goto err_sock;
 	}
 
-	ret = kernel_bind(sock, (struct sockaddr *)&addr,
-			  sizeof(addr));
+	opt = 1;
+	ret = kernel_setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+				(char *)&opt, sizeof(opt));
+	if (ret) {
+		pr_err("failed to set SO_REUSEPORT sock opt %d\n", ret);
+		goto err_sock;
+	}
+
+	ret = kernel_bind(sock, (struct sockaddr *)&l->addr,
+			  sizeof(l->addr));
 	if (ret) {
 		pr_err("failed to bind port socket %d\n", ret);
 		goto err_sock;
 	}
+	ret = kernel_getsockname(sock, (struct sockaddr *)&l->addr);
+	if (ret < 0) {
+		pr_err("failed to get sock name %d\n", ret);
+		goto err_sock;
+	}
 
 	ret = kernel_listen(sock, 128);
 	if (ret) {
@@ -3638,12 +4079,79 @@ int ceph_messenger_start_listen(struct ceph_messenger *msgr,
 
 err_sock:
 	sock_release(sock);
-	msgr->def_data_ready = NULL;
-	msgr->listen_sock = NULL;
-	msgr->con_ops = NULL;
+	l->def_data_ready = NULL;
+	l->sock = NULL;
 
 	return ret;
+}
+
+/*
+ * Stops listening, called on the reactor of the listener.
+ */
+static int listener_stop(void *arg)
+{
+	struct ceph_msgr_listener *l = arg;
+
+	/*
+	 * Reset user data and forward all possible following data
+	 * readiness calls to default callback.  This lets safe
+	 * module unload.
+	 */
+
+	write_lock_bh(&l->sock->sk->sk_callback_lock);
+	l->sock->sk->sk_user_data = NULL;
+	l->sock->sk->sk_data_ready = l->def_data_ready;
+	write_unlock_bh(&l->sock->sk->sk_callback_lock);
+	cancel_work_sync(&l->accept_work);
+
+	sock_release(l->sock);
+	l->sock = NULL;
+	l->def_data_ready = NULL;
+
+	return 0;
+}
+
+/*
+ * Binds sockets and starts listening on each reactor. Function does not
+ * take any locks, so should not be concurrently called with itself or
+ * with *_stop_listen().
+ */
+int ceph_messenger_start_listen(struct ceph_messenger *msgr,
+				const struct ceph_connection_operations *ops)
+{
+	struct ceph_msgr_listener *l;
+	unsigned int i;
+	int ret;
+
+	if (!ops || !ops->alloc_con || !ops->accept_con)
+		return -EINVAL;
+
+	if (msgr->con_ops)
+		return -EALREADY;
 
+	msgr->con_ops = ops;
+
+	/* Avoid unaligned access by pointer warn because of packed struct */
+	msgr->listeners[0].addr = msgr->inst.addr.in_addr;
+
+	for (i = 0; i < nr_reactors; i++) {
+		l = &msgr->listeners[i];
+		if (i)
+			/* Exactly where the first one is bound, even if port 0 */
+			l->addr = msgr->listeners[0].addr;
+
+		ret = reactor_call(i, listener_start, l);
+		if (ret)
+			goto err;
+		msgr->nr_listeners++;
+	}
+
+	return 0;
+
+err:
+	ceph_messenger_stop_listen(msgr);
+
+	return ret;
 }
 EXPORT_SYMBOL(ceph_messenger_start_listen);
 
@@ -3656,25 +4164,15 @@ EXPORT_SYMBOL(ceph_messenger_start_listen);
  */
 void ceph_messenger_stop_listen(struct ceph_messenger *msgr)
 {
+	unsigned int i;
+
 	if (!msgr->con_ops)
 		return;
 
-	/*
-	 * Reset user data and forward all possible following data
-	 * readiness calls to default callback.  This lets safe
-	 * module unload.
-	 */
-
-	write_lock_bh(&msgr->listen_sock->sk->sk_callback_lock);
-	msgr->listen_sock->sk->sk_user_data = NULL;
-	msgr->listen_sock->sk->sk_data_ready = msgr->def_data_ready;
-	write_unlock_bh(&msgr->listen_sock->sk->sk_callback_lock);
-	cancel_work_sync(&msgr->accept_work);
-
-	sock_release(msgr->listen_sock);
-	msgr->listen_sock = NULL;
+	for (i = 0; i < msgr->nr_listeners; i++)
+		reactor_call(i, listener_stop, &msgr->listeners[i]);
+	msgr->nr_listeners = 0;
 	msgr->con_ops = NULL;
-	msgr->def_data_ready = NULL;
 }
 EXPORT_SYMBOL(ceph_messenger_stop_listen);
 
@@ -3700,14 +4198,17 @@ static void clear_standby(struct ceph_connection *con)
 }
 
 /*
- * Queue up an outgoing message on the given connection.
+ * Put an outgoing message on the queue of the given connection, returns
+ * false if the message was dropped.
  */
-void ceph_con_send(struct ceph_connection *con, struct ceph_msg *msg)
+static bool con_queue_msg(struct ceph_connection *con, struct ceph_msg *msg)
 {
 	/* set src+dst */
 	msg->hdr.src = con->msgr->inst.name;
 	BUG_ON(msg->front.iov_len != le32_to_cpu(msg->hdr.front_len));
 	msg->needs_out_seq = true;
+	msg->out_ready = false;
+	msg->data_crc_ready = false;
 
 	mutex_lock(&con->mutex);
 
@@ -3715,7 +4216,7 @@ void ceph_con_send(struct ceph_connection *con, struct ceph_msg *msg)
 		dout("con_send %p closed, dropping %p\n", con, msg);
 		ceph_msg_put(msg);
 		mutex_unlock(&con->mutex);
-		return;
+		return false;
 	}
 
 	msg_con_set(msg, con);
@@ -3732,6 +4233,17 @@ void ceph_con_send(struct ceph_connection *con, struct ceph_msg *msg)
 	clear_standby(con);
 	mutex_unlock(&con->mutex);
 
+	return true;
+}
+
+/*
+ * Queue up an outgoing message on the given connection.
+ */
+void ceph_con_send(struct ceph_connection *con, struct ceph_msg *msg)
+{
+	if (!con_queue_msg(con, msg))
+		return;
+
 	/* if there wasn't anything waiting to send before, queue
 	 * new work */
 	if (con_flag_test_and_set(con, CON_FLAG_WRITE_PENDING) == 0)
@@ -3739,6 +4251,88 @@ void ceph_con_send(struct ceph_connection *con, struct ceph_msg *msg)
 }
 EXPORT_SYMBOL(ceph_con_send);
 
+/*
+ * Corked connections of the event loop: messages are queued, but the
+ * connection work is not, till the end of the loop iteration, so all
+ * replies produced by one iteration go out in one batch.
+ */
+struct ceph_msgr_cork {
+	struct event_item ev;
+	struct list_head  cons;
+};
+
+static __thread struct ceph_msgr_cork msgr_cork;
+
+/*
+ * @can_inline is true for the flush at the end of the loop iteration,
+ * where the write can go right away, see con_work_inline().
+ */
+static void con_uncork(struct ceph_connection *con, bool can_inline)
+{
+	dout("%s %p %u bytes\n", __func__, con, con->cork_bytes);
+	list_del_init(&con->cork_item);
+	if (con_flag_test_and_set(con, CON_FLAG_WRITE_PENDING) == 0 &&
+	    !(can_inline && con_work_inline(con)))
+		queue_con(con);
+	con->ops->put(con);
+}
+
+static void msgr_cork_flush(struct event_item *ev)
+{
+	struct ceph_connection *con;
+
+	while (!list_empty(&msgr_cork.cons)) {
+		con = list_first_entry(&msgr_cork.cons, typeof(*con),
+				       cork_item);
+		con_uncork(con, true);
+	}
+}
+
+/**
+ * ceph_con_send_corked() - queues a message like ceph_con_send(), but
+ *                          the write is deferred to the end of the event
+ *                          loop iteration, or until `reply_cork_bytes`
+ *                          are corked or `reply_cork_usecs` have passed.
+ */
+void ceph_con_send_corked(struct ceph_connection *con, struct ceph_msg *msg)
+{
+	struct ceph_options *opt = con->msgr->options;
+	unsigned int len;
+
+	if (!opt->reply_cork_usecs) {
+		ceph_con_send(con, msg);
+		return;
+	}
+
+	len = le32_to_cpu(msg->hdr.front_len) +
+		le32_to_cpu(msg->hdr.middle_len) + msg->data_length;
+	if (!con_queue_msg(con, msg))
+		return;
+
+	if (list_empty(&con->cork_item)) {
+		/* Being written, message goes with the rest */
+		if (con_flag_test(con, CON_FLAG_WRITE_PENDING))
+			return;
+		if (!con->ops->get(con))
+			return;
+		if (!msgr_cork.ev.action) {
+			INIT_EVENT(&msgr_cork.ev, msgr_cork_flush);
+			INIT_LIST_HEAD(&msgr_cork.cons);
+		}
+		list_add_tail(&con->cork_item, &msgr_cork.cons);
+		con->cork_stamp = fast_nsecs();
+		con->cork_bytes = 0;
+		event_item_defer(&msgr_cork.ev);
+	}
+	con->cork_bytes += len;
+
+	if (con->cork_bytes >= opt->reply_cork_bytes ||
+	    fast_nsecs() - con->cork_stamp >=
+	    (u64)opt->reply_cork_usecs * NSEC_PER_USEC)
+		con_uncork(con, false);
+}
+EXPORT_SYMBOL(ceph_con_send_corked);
+
 /*
  * Revoke a message that was previously queued for send
  */
@@ -3858,6 +4452,43 @@ bool ceph_con_keepalive_expired(struct ceph_connection *con,
 	return false;
 }
 
+static const char *con_state_name(unsigned long state)
+{
+	switch (state) {
+	case CON_STATE_CLOSED:      return "closed";
+	case CON_STATE_PREOPEN:     return "preopen";
+	case CON_STATE_CONNECTING:  return "connecting";
+	case CON_STATE_NEGOTIATING: return "negotiating";
+	case CON_STATE_OPEN:        return "open";
+	case CON_STATE_STANDBY:     return "standby";
+	default:                    return "unknown";
+	}
+}
+
+/**
+ * ceph_con_get_stats() - fills @st with the state, queue depths and
+ *                        traffic of the connection.  Does not sleep, so
+ *                        the caller may walk its connections, must be
+ *                        called on the reactor of the connection.
+ */
+void ceph_con_get_stats(struct ceph_connection *con,
+			struct ceph_con_stats *st)
+{
+	struct list_head *pos;
+
+	memset(st, 0, sizeof(*st));
+	st->state = con_state_name(con->state);
+	list_for_each(pos, &con->out_queue)
+		st->out_queue++;
+	list_for_each(pos, &con->out_sent)
+		st->out_sent++;
+	st->cork_bytes = con->cork_bytes;
+	st->in_seq = con->in_seq;
+	st->out_seq = con->out_seq;
+	st->in_bytes = con->in_bytes;
+	st->out_bytes = con->out_bytes;
+}
+
 static struct ceph_msg_data *ceph_msg_data_get_next(struct ceph_msg *msg)
 {
 	BUG_ON(msg->num_data_items >= msg->max_data_items);
@@ -3870,9 +4501,10 @@ static void ceph_bvecs_release(struct ceph_bvec_iter *bvec_pos,
 	struct bio_vec *bvec;
 	unsigned int i;
 
+	/* Pages can be shared, e.g. with object blocks, so drop a ref */
 	for (i = 0; i < num_bvecs; i++) {
 		bvec = &bvec_pos->bvecs[i];
-		__free_pages(bvec->bv_page, get_order(bvec->bv_len));
+		put_page(bvec->bv_page);
 	}
 	kfree(bvec_pos->bvecs);
 	bvec_pos->bvecs = NULL;
@@ -4215,6 +4847,34 @@ static int ceph_con_in_msg_alloc(struct ceph_connection *con, int *skip)
 	return ret;
 }
 
+/*
+ * Allocate data payload of the incoming message, when front and middle
+ * are already read, so the connection owner can place data according
+ * to the decoded front.
+ */
+static int ceph_con_in_msg_alloc_data(struct ceph_connection *con,
+				      unsigned int data_len)
+{
+	struct ceph_msg *msg = con->in_msg;
+	int ret;
+
+	if (!con->ops->alloc_msg_data)
+		/* See read_partial_msg_data() */
+		return 0;
+
+	ret = con->ops->alloc_msg_data(con, msg);
+	if (ret) {
+		con->error_msg = "error allocating data for incoming message";
+		return ret;
+	}
+	if (!msg->num_data_items || msg->data_length < data_len) {
+		con->error_msg = "data of incoming message is too short";
+		return -EIO;
+	}
+	prepare_message_data(READ, msg, data_len);
+
+	return 0;
+}
 
 /*
  * Free a generically kmalloc'd message.
@@ -4237,6 +4897,12 @@ static void ceph_msg_release(struct kref *kref)
 
 	msg_con_set(m, NULL);
 
+	if (m->release_private) {
+		m->release_private(m);
+		m->release_private = NULL;
+		m->private = NULL;
+	}
+
 	/* drop middle, data, if any */
 	if (m->middle) {
 		ceph_buffer_put(m->middle);
@@ -0,0 +1,686 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "ceph/ceph_debug.h"
+
+#include "module.h"
+#include "err.h"
+#include "slab.h"
+#include "sched.h"
+
+#include "ceph/objstore.h"
+
+enum {
+	COLL_MIN_BITS = 4,
+	/* objects, omap entries and blocks counted before the stats yield */
+	STATS_BATCH   = 4096,
+};
+
+/**
+ * Define RB functions for ordered object iteration by hoid
+ */
+DEFINE_RB_INSDEL_FUNCS2(object_by_hoid, struct ceph_osds_object, o_hoid,
+			ceph_hoid_compare, RB_BYPTR, o_node);
+
+/**
+ * Define RB functions for omap lookup by string
+ */
+DEFINE_RB_FUNCS2(omap_entry, struct ceph_osds_omap_entry, e_key,
+		 strcmp, RB_BYVAL, const char *, e_node);
+
+static struct kmem_cache *ceph_omap_entry_cache;
+
+static const struct ceph_objstore_ops *objstore_backends[] = {
+	&ceph_memstore_ops,
+	&ceph_filestore_ops,
+};
+
+struct ceph_objstore *ceph_objstore_create(struct ceph_options *opt,
+					   unsigned int nr_shards)
+{
+	const struct ceph_objstore_ops *ops = NULL;
+	struct ceph_objstore_shard *shards;
+	struct ceph_objstore *os;
+	const char *name;
+	int i;
+
+	name = opt->objectstore ?: ceph_memstore_ops.name;
+	for (i = 0; i < ARRAY_SIZE(objstore_backends); i++) {
+		if (!strcmp(objstore_backends[i]->name, name)) {
+			ops = objstore_backends[i];
+			break;
+		}
+	}
+	if (!ops) {
+		pr_err("%s: unknown objectstore '%s'\n", __func__, name);
+		return ERR_PTR(-EINVAL);
+	}
+
+	shards = kcalloc(nr_shards, sizeof(*shards), GFP_KERNEL);
+	if (!shards)
+		return ERR_PTR(-ENOMEM);
+	for (i = 0; i < nr_shards; i++) {
+		hash_init(shards[i].sh_colls);
+		INIT_LIST_HEAD(&shards[i].sh_lru);
+	}
+
+	os = ops->create(opt, nr_shards);
+	if (IS_ERR(os)) {
+		kfree(shards);
+		return os;
+	}
+
+	os->ops = ops;
+	os->os_nr_shards = nr_shards;
+	os->os_max_objects = ops->max_objects ?
+		max_t(unsigned int, ops->max_objects / nr_shards, 1) : 0;
+	os->os_shards = shards;
+
+	pr_notice(">>>> Use %s objectstore\n", ops->name);
+
+	return os;
+}
+
+static inline struct ceph_objstore_shard *
+spgid_shard(struct ceph_objstore *os, const struct ceph_spg *spgid)
+{
+	return &os->os_shards[ceph_objstore_shard(os, spgid)];
+}
+
+struct ceph_objstore_coll *
+ceph_objstore_lookup_coll(struct ceph_objstore *os,
+			  const struct ceph_spg *spgid)
+{
+	struct ceph_objstore_shard *shard = spgid_shard(os, spgid);
+	struct ceph_objstore_coll *coll;
+
+	hash_for_each_possible(shard->sh_colls, coll, c_node,
+			       ceph_spgid_key(spgid)) {
+		if (!ceph_spg_compare(&coll->c_spgid, spgid))
+			return coll;
+	}
+
+	return NULL;
+}
+
+static struct ceph_objstore_coll *
+create_coll(struct ceph_objstore *os, const struct ceph_spg *spgid)
+{
+	struct ceph_objstore_coll *coll;
+
+	coll = kmalloc(sizeof(*coll), GFP_KERNEL);
+	if (!coll)
+		return NULL;
+
+	coll->c_slots = kcalloc(1 << COLL_MIN_BITS, sizeof(*coll->c_slots),
+				GFP_KERNEL);
+	if (!coll->c_slots) {
+		kfree(coll);
+		return NULL;
+	}
+	coll->c_spgid = *spgid;
+	coll->c_objects = RB_ROOT;
+	coll->c_bits = COLL_MIN_BITS;
+	coll->c_count = 0;
+	hash_add(spgid_shard(os, spgid)->sh_colls, &coll->c_node,
+		 ceph_spgid_key(spgid));
+
+	return coll;
+}
+
+static void free_object(struct ceph_objstore *os,
+			struct ceph_osds_object *obj)
+{
+	ceph_omap_destroy(&obj->o_omap);
+	ceph_omap_destroy(&obj->o_xattrs);
+	ceph_hoid_destroy(&obj->o_hoid);
+	os->ops->free_object(os, obj);
+}
+
+static void destroy_coll(struct ceph_objstore *os,
+			 struct ceph_objstore_coll *coll)
+{
+	struct ceph_osds_object *obj;
+
+	while ((obj = ceph_coll_first_object(coll))) {
+		erase_object_by_hoid(&coll->c_objects, obj);
+		free_object(os, obj);
+	}
+	hash_del(&coll->c_node);
+	kfree(coll->c_slots);
+	kfree(coll);
+}
+
+void ceph_objstore_destroy(struct ceph_objstore *os)
+{
+	struct ceph_objstore_shard *shards = os->os_shards;
+	struct ceph_objstore_coll *coll;
+	struct hlist_node *tmp;
+	unsigned int i;
+	int bkt;
+
+	for (i = 0; i < os->os_nr_shards; i++)
+		hash_for_each_safe(shards[i].sh_colls, bkt, tmp, coll, c_node)
+			destroy_coll(os, coll);
+	os->ops->destroy(os);
+	kfree(shards);
+}
+
+static void omap_stats(struct rb_root *root, u64 *entries, u64 *bytes)
+{
+	struct ceph_osds_omap_entry *ome;
+
+	for (ome = ceph_omap_first(root); ome; ome = ceph_omap_next(ome)) {
+		*entries += 1;
+		*bytes += ome->e_key_len;
+		if (ome->e_val_pl)
+			*bytes += ome->e_val_pl->length;
+	}
+}
+
+static u64 stats_work(const struct ceph_objstore_stats *st)
+{
+	return st->objects + st->omap_entries + st->xattrs + st->blocks;
+}
+
+static struct ceph_osds_object *
+coll_lookup_object_gt(struct ceph_objstore_coll *coll,
+		      const struct ceph_hobject_id *hoid)
+{
+	struct rb_node *n = coll->c_objects.rb_node;
+	struct ceph_osds_object *obj, *gt = NULL;
+
+	while (n) {
+		obj = rb_entry(n, struct ceph_osds_object, o_node);
+		if (ceph_hoid_compare(hoid, &obj->o_hoid) < 0) {
+			gt = obj;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+
+	return gt;
+}
+
+/**
+ * ceph_objstore_shard_stats() - adds statistics of objects of the @shard
+ *                               to @st, called by the owner of the shard
+ *                               from a task.
+ *
+ * The walk yields every STATS_BATCH objects, omap entries and blocks so
+ * requests of the shard are not stalled by a big store, and resumes
+ * from the object following the last one by hoid, since objects may
+ * be freed meanwhile.  Collections live as long as the store.
+ */
+void ceph_objstore_shard_stats(struct ceph_objstore *os, unsigned int shard,
+			       struct ceph_objstore_stats *st)
+{
+	u64 yield_at = stats_work(st) + STATS_BATCH;
+	struct ceph_objstore_coll *coll;
+	struct ceph_osds_object *obj;
+	struct ceph_hobject_id last;
+	int bkt;
+
+	hash_for_each(os->os_shards[shard].sh_colls, bkt, coll, c_node) {
+		st->colls++;
+		obj = ceph_coll_first_object(coll);
+		while (obj) {
+			st->objects++;
+			st->bytes += obj->o_size;
+			omap_stats(&obj->o_omap, &st->omap_entries,
+				   &st->omap_bytes);
+			omap_stats(&obj->o_xattrs, &st->xattrs,
+				   &st->xattr_bytes);
+			if (os->ops->object_stats)
+				os->ops->object_stats(os, obj, st);
+
+			if (stats_work(st) < yield_at) {
+				obj = ceph_coll_next_object(obj);
+				continue;
+			}
+			ceph_hoid_init(&last);
+			ceph_hoid_copy(&last, &obj->o_hoid);
+			schedule();
+			obj = coll_lookup_object_gt(coll, &last);
+			ceph_hoid_destroy(&last);
+			yield_at = stats_work(st) + STATS_BATCH;
+		}
+	}
+}
+
+/*
+ * Objects of one PG share low bits of the hash, so the slot is taken
+ * from the high bits of the multiplicative hash.
+ */
+static inline unsigned int slot_idx(u32 hash, unsigned int bits)
+{
+	return hash_32(hash, bits);
+}
+
+static struct ceph_osds_object *
+coll_lookup_object(struct ceph_objstore_coll *coll,
+		   const struct ceph_hobject_id *hoid)
+{
+	unsigned int mask = (1U << coll->c_bits) - 1;
+	unsigned int idx = slot_idx(hoid->hash, coll->c_bits);
+	struct ceph_objstore_slot *slot;
+
+	for (;; idx = (idx + 1) & mask) {
+		slot = &coll->c_slots[idx];
+		if (!slot->s_obj)
+			return NULL;
+		if (slot->s_hash == hoid->hash &&
+		    !ceph_hoid_compare(&slot->s_obj->o_hoid, hoid))
+			return slot->s_obj;
+	}
+}
+
+static void slots_insert(struct ceph_objstore_slot *slots, unsigned int bits,
+			 struct ceph_osds_object *obj)
+{
+	unsigned int mask = (1U << bits) - 1;
+	unsigned int idx = slot_idx(obj->o_hoid.hash, bits);
+
+	while (slots[idx].s_obj)
+		idx = (idx + 1) & mask;
+
+	slots[idx].s_hash = obj->o_hoid.hash;
+	slots[idx].s_obj = obj;
+}
+
+/**
+ * coll_grow() - doubles the table, keeps load factor below 3/4
+ */
+static int coll_grow(struct ceph_objstore_coll *coll)
+{
+	unsigned int i, bits = coll->c_bits + 1;
+	struct ceph_objstore_slot *slots;
+
+	slots = kcalloc(1 << bits, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < (1U << coll->c_bits); i++) {
+		if (coll->c_slots[i].s_obj)
+			slots_insert(slots, bits, coll->c_slots[i].s_obj);
+	}
+	kfree(coll->c_slots);
+	coll->c_slots = slots;
+	coll->c_bits = bits;
+
+	return 0;
+}
+
+static int coll_insert_object(struct ceph_objstore_coll *coll,
+			      struct ceph_osds_object *obj)
+{
+	int ret;
+
+	if ((coll->c_count + 1) * 4 > (3U << coll->c_bits)) {
+		ret = coll_grow(coll);
+		if (ret)
+			return ret;
+	}
+	slots_insert(coll->c_slots, coll->c_bits, obj);
+	insert_object_by_hoid(&coll->c_objects, obj);
+	coll->c_count++;
+	obj->o_coll = coll;
+
+	return 0;
+}
+
+/*
+ * Backward shift deletion: entries of the probe run after the removed
+ * one are moved back, unless their home slot is after the hole, so
+ * lookups never stop at an empty slot before the entry.
+ */
+static void slots_remove(struct ceph_objstore_coll *coll,
+			 struct ceph_osds_object *obj)
+{
+	unsigned int mask = (1U << coll->c_bits) - 1;
+	unsigned int i = slot_idx(obj->o_hoid.hash, coll->c_bits);
+	struct ceph_objstore_slot *slots = coll->c_slots;
+	unsigned int j, home;
+
+	while (slots[i].s_obj != obj)
+		i = (i + 1) & mask;
+
+	for (j = (i + 1) & mask; slots[j].s_obj; j = (j + 1) & mask) {
+		home = slot_idx(slots[j].s_hash, coll->c_bits);
+		/* Stays if home is in (i, j] cyclically */
+		if (i < j ? (home > i && home <= j) :
+			    (home > i || home <= j))
+			continue;
+		slots[i] = slots[j];
+		i = j;
+	}
+	slots[i] = (struct ceph_objstore_slot){};
+}
+
+static void coll_remove_object(struct ceph_objstore_coll *coll,
+			       struct ceph_osds_object *obj)
+{
+	slots_remove(coll, obj);
+	erase_object_by_hoid(&coll->c_objects, obj);
+	coll->c_count--;
+}
+
+static inline bool object_is_dirty(struct ceph_osds_object *obj)
+{
+	return !list_empty(&obj->o_dirty_omap) ||
+		!list_empty(&obj->o_dirty_xattrs);
+}
+
+/**
+ * evict_objects() - frees least recently used objects while the shard
+ *                   is over the limit, objects which are used by requests
+ *                   or have unsynced omap are skipped.
+ */
+static void evict_objects(struct ceph_objstore *os,
+			  struct ceph_objstore_shard *shard)
+{
+	struct ceph_osds_object *obj, *tmp;
+
+	if (!os->os_max_objects)
+		return;
+
+	list_for_each_entry_safe(obj, tmp, &shard->sh_lru, o_lru) {
+		if (shard->sh_nr_objects <= os->os_max_objects)
+			return;
+		if (obj->o_users || object_is_dirty(obj))
+			continue;
+
+		coll_remove_object(obj->o_coll, obj);
+		list_del(&obj->o_lru);
+		shard->sh_nr_objects--;
+		free_object(os, obj);
+	}
+	/* Everything else is used or dirty, so exceed the limit */
+}
+
+static void get_object(struct ceph_objstore *os,
+		       struct ceph_osds_object *obj)
+{
+	list_move_tail(&obj->o_lru, &os->os_shards[obj->o_shard].sh_lru);
+	obj->o_users++;
+}
+
+/* Called for an object which has just been inserted to the collection */
+static void cache_object(struct ceph_objstore *os,
+			 struct ceph_osds_object *obj)
+{
+	struct ceph_objstore_shard *shard = &os->os_shards[obj->o_shard];
+
+	obj->o_users++;
+	list_add_tail(&obj->o_lru, &shard->sh_lru);
+	shard->sh_nr_objects++;
+	evict_objects(os, shard);
+}
+
+/**
+ * ceph_objstore_put_object() - called when the object returned by
+ *                              ceph_objstore_lookup() or
+ *                              ceph_objstore_create_object() is not used
+ *                              by the caller anymore, may free it.
+ */
+void ceph_objstore_put_object(struct ceph_objstore *os,
+			      struct ceph_osds_object *obj)
+{
+	BUG_ON(!obj->o_users);
+	if (!--obj->o_users)
+		evict_objects(os, &os->os_shards[obj->o_shard]);
+}
+
+static struct ceph_osds_object *
+alloc_object(struct ceph_objstore *os, const struct ceph_spg *spgid,
+	     const struct ceph_hobject_id *hoid)
+{
+	struct ceph_osds_object *obj;
+
+	obj = os->ops->alloc_object(os);
+	if (!obj)
+		return NULL;
+
+	obj->o_shard = ceph_objstore_shard(os, spgid);
+	obj->o_users = 0;
+	obj->o_coll = NULL;
+	obj->o_size = 0;
+	obj->o_mtime = (struct timespec64){};
+	obj->o_omap = RB_ROOT;
+	obj->o_xattrs = RB_ROOT;
+	INIT_LIST_HEAD(&obj->o_dirty_omap);
+	INIT_LIST_HEAD(&obj->o_dirty_xattrs);
+	INIT_LIST_HEAD(&obj->o_lru);
+	RB_CLEAR_NODE(&obj->o_node);
+	ceph_hoid_init(&obj->o_hoid);
+	ceph_hoid_copy(&obj->o_hoid, hoid);
+
+	return obj;
+}
+
+/**
+ * ceph_objstore_lookup() - returns object from the index or loads it
+ *                          from the storage if backend supports that.
+ *                          Returns NULL if object does not exist and
+ *                          ERR_PTR() if it can't be loaded, the latter
+ *                          must not be treated as a missing object.
+ */
+struct ceph_osds_object *
+ceph_objstore_lookup(struct ceph_objstore *os, const struct ceph_spg *spgid,
+		     const struct ceph_hobject_id *hoid)
+{
+	struct ceph_objstore_coll *coll;
+	struct ceph_osds_object *obj;
+	int ret;
+
+	coll = ceph_objstore_lookup_coll(os, spgid);
+	if (coll) {
+		obj = coll_lookup_object(coll, hoid);
+		if (obj) {
+			get_object(os, obj);
+			return obj;
+		}
+	}
+	if (!os->ops->load_object)
+		return NULL;
+
+	obj = alloc_object(os, spgid, hoid);
+	if (!obj)
+		return ERR_PTR(-ENOMEM);
+
+	ret = os->ops->load_object(os, obj);
+	if (ret) {
+		if (ret != -ENOENT)
+			pr_err("%s: can't load object '%.*s', ret=%d\n",
+			       __func__, hoid->oid.name_len, hoid->oid.name,
+			       ret);
+		goto free;
+	}
+	ret = -ENOMEM;
+	if (!coll)
+		coll = create_coll(os, spgid);
+	if (!coll || coll_insert_object(coll, obj))
+		goto free;
+	cache_object(os, obj);
+
+	return obj;
+free:
+	free_object(os, obj);
+	return ret == -ENOENT ? NULL : ERR_PTR(ret);
+}
+
+/**
+ * ceph_objstore_create_object() - creates an object which is not in the
+ *                                 store, returns ERR_PTR() on failure.
+ */
+struct ceph_osds_object *
+ceph_objstore_create_object(struct ceph_objstore *os,
+			    const struct ceph_spg *spgid,
+			    const struct ceph_hobject_id *hoid)
+{
+	struct ceph_objstore_coll *coll;
+	struct ceph_osds_object *obj;
+	int ret;
+
+	coll = ceph_objstore_lookup_coll(os, spgid);
+	if (!coll) {
+		coll = create_coll(os, spgid);
+		if (!coll)
+			return ERR_PTR(-ENOMEM);
+	}
+
+	obj = alloc_object(os, spgid, hoid);
+	if (!obj)
+		return ERR_PTR(-ENOMEM);
+
+	if (os->ops->create_object) {
+		ret = os->ops->create_object(os, obj);
+		if (ret) {
+			pr_err("%s: can't create object '%.*s', ret=%d\n",
+			       __func__, hoid->oid.name_len, hoid->oid.name,
+			       ret);
+			goto free;
+		}
+	}
+	ret = -ENOMEM;
+	if (coll_insert_object(coll, obj))
+		goto free;
+	cache_object(os, obj);
+
+	return obj;
+free:
+	free_object(os, obj);
+	return ERR_PTR(ret);
+}
+
+struct ceph_osds_omap_entry *
+ceph_omap_lookup(struct rb_root *root, const char *key)
+{
+	return lookup_omap_entry(root, key);
+}
+
+static struct ceph_osds_omap_entry *
+lookup_omap_entry_ge_gt(struct rb_root *root, const char *key, bool equal)
+{
+	struct rb_node *n = root->rb_node;
+	struct ceph_osds_omap_entry *right = NULL;
+	int cmp = 0;
+
+	while (n) {
+		struct ceph_osds_omap_entry *ome;
+
+		ome = rb_entry(n, typeof(*ome), e_node);
+		cmp = strcmp(key, ome->e_key);
+		if (cmp < 0) {
+			right = ome;
+			n = n->rb_left;
+		}
+		else if (cmp > 0) {
+			n = n->rb_right;
+		} else {
+			if (equal)
+				/* Exact match */
+				return ome;
+
+			/*
+			 * We were asked to lookup for the next node,
+			 * i.e. greater than the key, which is simply
+			 * the in-order successor of the found one.
+			 */
+			return ceph_omap_next(ome);
+		}
+	}
+
+	return right;
+}
+
+struct ceph_osds_omap_entry *
+ceph_omap_lookup_ge(struct rb_root *root, const char *key)
+{
+	return lookup_omap_entry_ge_gt(root, key, true);
+}
+
+struct ceph_osds_omap_entry *
+ceph_omap_lookup_gt(struct rb_root *root, const char *key)
+{
+	return lookup_omap_entry_ge_gt(root, key, false);
+}
+
+struct ceph_osds_omap_entry *
+ceph_omap_create_and_insert(struct rb_root *root, const char *key,
+			    size_t key_len)
+{
+	struct ceph_osds_omap_entry *ome;
+
+	ome = kmem_cache_alloc(ceph_omap_entry_cache, GFP_KERNEL);
+	if (!ome)
+		return NULL;
+
+	ome->e_key = kstrndup(key, key_len, GFP_KERNEL);
+	if (!ome->e_key) {
+		kmem_cache_free(ceph_omap_entry_cache, ome);
+		return NULL;
+	}
+	ome->e_key_len = key_len;
+	RB_CLEAR_NODE(&ome->e_node);
+	INIT_LIST_HEAD(&ome->e_dirty);
+
+	ome->e_val_pl = ceph_pagelist_alloc(GFP_KERNEL);
+	if (!ome->e_val_pl) {
+		kfree(ome->e_key);
+		kmem_cache_free(ceph_omap_entry_cache, ome);
+		return NULL;
+	}
+	insert_omap_entry(root, ome);
+
+	return ome;
+}
+
+void ceph_omap_destroy(struct rb_root *root)
+{
+	struct ceph_osds_omap_entry *ome;
+
+	while ((ome = ceph_omap_first(root))) {
+		erase_omap_entry(root, ome);
+		list_del(&ome->e_dirty);
+		ceph_pagelist_release(ome->e_val_pl);
+		kfree(ome->e_key);
+		kmem_cache_free(ceph_omap_entry_cache, ome);
+	}
+}
+
+static void omap_clean(struct list_head *dirty)
+{
+	struct ceph_osds_omap_entry *ome, *tmp;
+
+	list_for_each_entry_safe(ome, tmp, dirty, e_dirty)
+		list_del_init(&ome->e_dirty);
+}
+
+/**
+ * ceph_objstore_sync_meta() - persists changed omap entries and xattrs
+ *                             of an object, the object is clean if
+ *                             succeeded and can be evicted.
+ */
+int ceph_objstore_sync_meta(struct ceph_objstore *os,
+			    struct ceph_osds_object *obj)
+{
+	int ret = 0;
+
+	if (os->ops->sync_meta)
+		ret = os->ops->sync_meta(os, obj);
+	if (!ret) {
+		omap_clean(&obj->o_dirty_omap);
+		omap_clean(&obj->o_dirty_xattrs);
+	}
+
+	return ret;
+}
+
+static int objstore_mod_init(void)
+{
+	ceph_omap_entry_cache = KMEM_CACHE(ceph_osds_omap_entry, 0);
+
+	return ceph_omap_entry_cache ? 0 : -ENOMEM;
+}
+module_init(objstore_mod_init);
@@ -3805,6 +3805,8 @@ static int handle_one_map(struct ceph_osd_client *osdc,
 		ceph_osdmap_destroy(osdc->osdmap);
 		osdc->osdmap = newmap;
 	}
+	/* Incremental is applied in place, so publish in any case */
+	atomic_set(&osdc->epoch, osdc->osdmap->epoch);
 
 	was_full &= !ceph_osdmap_flag(osdc, CEPH_OSDMAP_FULL);
 	scan_requests(&osdc->homeless_osd, skipped_map, was_full, true,
@@ -5095,6 +5097,7 @@ int ceph_osdc_init(struct ceph_osd_client *osdc, struct ceph_client *client)
 	osdc->osdmap = ceph_osdmap_alloc();
 	if (!osdc->osdmap)
 		goto out;
+	atomic_set(&osdc->epoch, osdc->osdmap->epoch);
 
 	osdc->req_mempool = mempool_create_slab_pool(10,
 						     ceph_osd_request_cache);
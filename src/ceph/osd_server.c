@@ -8,22 +8,24 @@
 #include "getorder.h"
 
 #include "semaphore.h"
+#include "sched.h"
+#include "hashtable.h"
+#include "reactor.h"
+#include "clock.h"
+#include "perf_counters.h"
 
 #include "ceph/ceph_features.h"
 #include "ceph/libceph.h"
 #include "ceph/osd_server.h"
 #include "ceph/osd_client.h"
+#include "ceph/osd_shm.h"
 #include "ceph/messenger.h"
 #include "ceph/decode.h"
 #include "ceph/auth.h"
 #include "ceph/osdmap.h"
+#include "ceph/objstore.h"
 #include "ceph/objclass/class_loader.h"
-
-enum {
-	OSDS_BLOCK_SHIFT    = 16, /* 64k, must be ^2 */
-	OSDS_BLOCK_SIZE     = (1UL << OSDS_BLOCK_SHIFT),
-	OSDS_BLOCK_MASK     = (~(OSDS_BLOCK_SIZE-1))
-};
+#include "ceph/admin_socket.h"
 
 static const struct ceph_connection_operations osds_con_ops;
 
@@ -51,55 +53,86 @@ struct ceph_msg_osd_op {
 struct ceph_osds_con {
 	struct ceph_connection con;
 	struct kref ref;
+	struct list_head c_node;   /* entry in ->s_cons */
 };
 
-struct ceph_osd_server {
-	struct ceph_client     *client;
-	int                    osd;
-	struct ceph_cls_loader class_loader;
-	struct rb_root         s_objects;  /* all objects */
+enum {
+	OSDS_OBJ_QUEUES_HASH_BITS = 10,
 };
 
-struct ceph_osds_object {
-	struct rb_node         o_node;    /* node of ->s_objects */
-	struct ceph_hobject_id o_hoid;
-	struct rb_root         o_blocks;  /* all blocks of the object */
-	struct rb_root         o_omap;    /* omap of the object */
-	struct rb_root         o_xattrs;  /* xattr of the object */
-	size_t                 o_size;    /* size of an object */
-	struct timespec64      o_mtime;   /* modification time of an object */
+/*
+ * Decoded OSD op, which is executed by one of the op tasks.
+ *
+ * Connections live on the reactor which has accepted them, so a request
+ * is decoded there, forwarded to the reactor which owns the PG and then
+ * returned back with the reply, so messages and connections are
+ * released on their own reactor.
+ */
+struct ceph_osds_request {
+	struct list_head       r_node;   /* entry in ->s_runnable or
+					    ->q_pending */
+	struct reactor_work    r_work;
+	struct ceph_msg        *r_msg;
+	struct ceph_msg        *r_reply;
+	unsigned int           r_reactor; /* reactor of the connection */
+	u64                    r_stamp;   /* fast_nsecs() of the submit */
+	struct list_head       r_inflight; /* entry in ->s_requests of the
+					      reactor of the connection */
+	struct ceph_osds_obj_queue
+			       *r_queue;
+	struct ceph_msg_osd_op r_req;
 };
 
-struct ceph_osds_block {
-	struct rb_node         b_node;    /* node of ->o_blocks */
-	struct page            *b_page;
-	off_t                  b_off;     /* offset inside a whole object */
+/*
+ * Requests to the same object are executed one by one in the order
+ * they are received, so each object which has requests in flight
+ * has a queue.  Only the head request of the queue is runnable.
+ */
+struct ceph_osds_obj_queue {
+	struct hlist_node      q_node;    /* entry in ->s_obj_queues */
+	struct ceph_hobject_id *q_hoid;   /* hoid of the head request */
+	struct list_head       q_pending; /* requests waiting for the head */
 };
 
-struct ceph_osds_omap_entry {
-	struct rb_node         e_node;   /* node of ->o_omap or ->o_xattrs */
-	char                   *e_key;
-	unsigned int           e_key_len;
-	struct ceph_pagelist   *e_val_pl;
+struct ceph_osds_op_task {
+	struct ceph_osds_shard *shard;
+	struct task_struct     *task;
+	struct list_head       idle_node; /* entry in ->s_idle_tasks */
 };
 
-/**
- * Define RB functions for object lookup and insert by hoid
- */
-DEFINE_RB_FUNCS2(object_by_hoid, struct ceph_osds_object, o_hoid,
-		 ceph_hoid_compare, RB_BYPTR, struct ceph_hobject_id *,
-		 o_node);
-
-/**
- * Define RB functions for object block lookup by offset
+/*
+ * PGs are sharded between reactors, shard #N is owned by the reactor #N
+ * and has own op tasks, object queues and class loader.  Requests are
+ * executed by the owner of the PG (see ceph_objstore_shard()), so
+ * objects are never shared between reactors and neither the store nor
+ * the shard needs locks.
  */
-DEFINE_RB_FUNCS(object_block_by_off, struct ceph_osds_block, b_off, b_node);
+struct ceph_osds_shard {
+	struct ceph_osd_server *osds;
+	struct ceph_cls_loader s_class_loader;
+	struct ceph_osds_op_task
+			       *s_op_tasks;
+	unsigned int           s_nr_op_tasks;
+	struct list_head       s_idle_tasks;
+	struct list_head       s_runnable; /* requests ready to execute */
+	DECLARE_HASHTABLE(s_obj_queues, OSDS_OBJ_QUEUES_HASH_BITS);
+	struct list_head       s_cons;     /* accepted by the reactor */
+	struct list_head       s_requests; /* in flight, received by the
+					      reactor */
+};
 
-/**
- * Define RB functions for omap lookup by string
- */
-DEFINE_RB_FUNCS2(omap_entry, struct ceph_osds_omap_entry, e_key,
-		 strcmp, RB_BYVAL, char *, e_node);
+struct ceph_osd_server {
+	struct ceph_client     *client;
+	int                    osd;
+	struct ceph_objstore   *store;
+
+	struct ceph_osds_shard *s_shards;  /* one per reactor */
+	unsigned int           s_nr_shards;
+	bool                   s_stopping;
+	struct ceph_osds_shm   *shm;       /* co-located clients */
+	struct ceph_admin_socket
+			       *asok;
+};
 
 static int handle_osd_op(struct ceph_msg *msg, struct ceph_msg_osd_op *req,
 			 struct ceph_osd_req_op *op,
@@ -138,13 +171,24 @@ static int alloc_bvec(struct ceph_bvec_iter *it, size_t data_len)
 	return 0;
 }
 
+/*
+ * Returns NULL if object does not exist, ERR_PTR() if it can't be
+ * loaded: ops must fail with that error and never create an object
+ * over the one which is on the storage.
+ */
 static struct ceph_osds_object *
 ceph_lookup_object(struct ceph_osd_server *osds,
 		   struct ceph_msg_osd_op *req)
 {
-	if (!req->object)
-		req->object = lookup_object_by_hoid(&osds->s_objects,
-						    &req->hoid);
+	struct ceph_osds_object *obj;
+
+	if (!req->object) {
+		obj = ceph_objstore_lookup(osds->store, &req->spgid,
+					   &req->hoid);
+		if (IS_ERR_OR_NULL(obj))
+			return obj;
+		req->object = obj;
+	}
 	return req->object;
 }
 
@@ -154,18 +198,10 @@ ceph_create_and_insert_object(struct ceph_osd_server *osds,
 {
 	struct ceph_osds_object *obj;
 
-	obj = kmalloc(sizeof(*obj), GFP_KERNEL);
-	if (!obj)
-		return NULL;
-
-	obj->o_size = 0;
-	obj->o_blocks = RB_ROOT;
-	obj->o_omap = RB_ROOT;
-	obj->o_xattrs = RB_ROOT;
-	RB_CLEAR_NODE(&obj->o_node);
-	ceph_hoid_init(&obj->o_hoid);
-	ceph_hoid_copy(&obj->o_hoid, &req->hoid);
-	insert_object_by_hoid(&osds->s_objects, obj);
+	obj = ceph_objstore_create_object(osds->store, &req->spgid,
+					  &req->hoid);
+	if (IS_ERR(obj))
+		return obj;
 
 	/* Cache an object */
 	req->object = obj;
@@ -173,35 +209,6 @@ ceph_create_and_insert_object(struct ceph_osd_server *osds,
 	return obj;
 }
 
-static struct ceph_osds_omap_entry *
-ceph_create_and_insert_omap(struct rb_root *root, const char *key)
-{
-	struct ceph_osds_omap_entry *ome;
-	size_t key_len = strlen(key);
-
-	ome = kmalloc(sizeof(*ome), GFP_KERNEL);
-	if (!ome)
-		return NULL;
-
-	ome->e_key = kstrndup(key, key_len, GFP_KERNEL);
-	if (!ome->e_key) {
-		kfree(ome);
-		return NULL;
-	}
-	ome->e_key_len = key_len;
-	RB_CLEAR_NODE(&ome->e_node);
-
-	ome->e_val_pl = ceph_pagelist_alloc(GFP_KERNEL);
-	if (!ome->e_val_pl) {
-		kfree(ome->e_key);
-		kfree(ome);
-		return NULL;
-	}
-	insert_omap_entry(root, ome);
-
-	return ome;
-}
-
 static int osds_accept_con(struct ceph_connection *con)
 {
 	pr_err("@@ con %p\n", con);
@@ -211,6 +218,8 @@ static int osds_accept_con(struct ceph_connection *con)
 
 static struct ceph_connection *osds_alloc_con(struct ceph_messenger *msgr)
 {
+	struct ceph_client *client = container_of(msgr, typeof(*client), msgr);
+	struct ceph_osd_server *osds = client->private;
 	struct ceph_osds_con *osds_con;
 
 	osds_con = kzalloc(sizeof(*osds_con), GFP_KERNEL | __GFP_NOFAIL);
@@ -218,6 +227,9 @@ static struct ceph_connection *osds_alloc_con(struct ceph_messenger *msgr)
 		return NULL;
 
 	kref_init(&osds_con->ref);
+	/* Connection is accepted, served and released by this reactor */
+	list_add_tail(&osds_con->c_node,
+		      &osds->s_shards[reactor_id].s_cons);
 
 	return &osds_con->con;
 }
@@ -237,6 +249,7 @@ static void osds_free_con(struct kref *ref)
 	struct ceph_osds_con *osds_con;
 
 	osds_con = container_of(ref, typeof(*osds_con), ref);
+	list_del(&osds_con->c_node);
 	kfree(osds_con);
 }
 
@@ -727,42 +740,13 @@ static inline struct ceph_osd_client *con_to_osdc(struct ceph_connection *con)
 	return &client->osdc;
 }
 
-static inline int next_dst(struct ceph_osd_req_op *op,
-			   struct ceph_osds_object *obj,
-			   struct ceph_osds_block **pblk,
-			   off_t dst_off,
-			   size_t *dst_len)
+/**
+ * this_shard() - returns the shard of the caller reactor, ops are
+ *                executed by the owner, so that is the shard of the PG.
+ */
+static inline struct ceph_osds_shard *this_shard(struct ceph_osd_server *osds)
 {
-	struct ceph_osds_block *blk;
-	off_t blk_off;
-
-	blk_off = ALIGN_DOWN(dst_off, OSDS_BLOCK_SIZE);
-	blk = lookup_object_block_by_off(&obj->o_blocks, blk_off);
-	if (!blk) {
-		unsigned int order;
-
-		blk = kmalloc(sizeof(*blk), GFP_KERNEL);
-		if (!blk)
-			return -ENOMEM;
-
-		RB_CLEAR_NODE(&blk->b_node);
-		order = OSDS_BLOCK_SHIFT - PAGE_SHIFT;
-		blk->b_page = alloc_pages(GFP_KERNEL | __GFP_ZERO, order);
-		blk->b_off = blk_off;
-
-		if (!blk->b_page) {
-			kfree(blk);
-			return -ENOMEM;
-		}
-
-		insert_object_block_by_off(&obj->o_blocks, blk);
-	}
-
-	*dst_len = OSDS_BLOCK_SIZE - (dst_off & ~OSDS_BLOCK_MASK);
-	*pblk = blk;
-
-
-	return 0;
+	return &osds->s_shards[reactor_id];
 }
 
 static int handle_osd_op_write(struct ceph_msg *msg,
@@ -772,13 +756,6 @@ static int handle_osd_op_write(struct ceph_msg *msg,
 {
 	struct ceph_osd_server *osds = con_to_osds(msg->con);
 	struct ceph_osds_object *obj;
-	struct ceph_osds_block *blk;
-
-	size_t len_write, dst_len;
-	off_t dst_off;
-
-	bool modified = false;
-	int ret;
 
 	if (!op->extent.length)
 		/* Nothing to do */
@@ -793,91 +770,106 @@ static int handle_osd_op_write(struct ceph_msg *msg,
 	 * Find or create an object
 	 */
 	obj = ceph_lookup_object(osds, req);
-	if (!obj) {
+	if (!obj)
 		obj = ceph_create_and_insert_object(osds, req);
-		if (!obj)
-			return -ENOMEM;
-	}
-
-	/*
-	 * Fill in blocks with data of found/created object
-	 */
-	len_write = op->extent.length;
-	dst_off = op->extent.offset;
-	blk = NULL;
-	dst_len = 0;
-	ret = 0;
-
-	while (len_write) {
-		size_t len, len2;
-		void *dst;
-
-		if (!dst_len) {
-			ret = next_dst(op, obj, &blk, dst_off, &dst_len);
-			if (ret)
-				goto out;
-		}
+	if (IS_ERR(obj))
+		return PTR_ERR(obj);
 
-		ceph_msg_data_cursor_next(in_cur);
-
-		len = iov_iter_count(&in_cur->iter);
-		len = min(len, dst_len);
-		len = min(len, len_write);
+	return ceph_objstore_write(osds->store, obj, in_cur,
+				   op->extent.offset, op->extent.length,
+				   op->op == CEPH_OSD_OP_WRITEFULL,
+				   &req->mtime);
+}
 
-		dst = page_address(blk->b_page);
-		len2 = copy_from_iter(dst + (dst_off & ~OSDS_BLOCK_MASK),
-				      len, &in_cur->iter);
-		WARN_ON(len2 != len);
+/**
+ * encode_sparse_map() - encodes extent map of a sparse read, for now
+ *                       we have only 1 entry.
+ */
+static void encode_sparse_map(void *p, u64 off, u64 len)
+{
+	ceph_encode_32(&p, 1); /* map size */
+	ceph_encode_64(&p, off); /* offset as a key */
+	ceph_encode_64(&p, len); /* len as a value */
+	ceph_encode_32(&p, len); /* len of the following extent */
+}
 
-		ceph_msg_data_cursor_advance(in_cur, len);
-		len_write -= len;
-		dst_len -= len;
-		dst_off += len;
-		modified = true;
-	}
-out:
-	if (modified) {
-		bool truncate = (op->op == CEPH_OSD_OP_WRITEFULL);
+/**
+ * read_extent_copy() - reads the extent into a freshly allocated buffer
+ */
+static int read_extent_copy(struct ceph_osd_server *osds,
+			    struct ceph_osds_object *obj,
+			    struct ceph_osd_req_op *op,
+			    size_t map_size, size_t len_read)
+{
+	struct ceph_bvec_iter it;
+	void *p;
+	int ret;
 
-		obj->o_mtime = req->mtime;
+	/* Allocate bvec for the read chunk */
+	ret = alloc_bvec(&it, map_size + len_read);
+	if (ret)
+		return ret;
 
-		/* Extend object size if needed or truncate */
-		if (dst_off > obj->o_size || truncate)
-			obj->o_size = dst_off;
+	/* Setup output length and data, give ownership to msg */
+	op->outdata_len = map_size + len_read;
+	op->outdata = &op->extent.osd_data;
+	ceph_msg_data_bvecs_init(op->outdata, &it, 1, true);
 
-		/* FIXME: need to free the rest in case of truncate */
+	/* Here we always have 1 segment bvec, with mpages though */
+	p = page_address(it.bvecs->bv_page);
+	if (map_size) {
+		encode_sparse_map(p, op->extent.offset, len_read);
+		p += map_size;
 	}
 
-	return ret;
+	return ceph_objstore_read(osds->store, obj, p,
+				  op->extent.offset, len_read);
 }
 
 /**
- * lookup_block_ge() - returns block which offset equal or greater than @off
+ * read_extent_zerocopy() - builds reply bvecs which reference object
+ *                          pages, sparse map goes to the first segment.
  */
-static struct ceph_osds_block *lookup_block_ge(struct ceph_osds_object *obj,
-					       off_t off)
+static int read_extent_zerocopy(struct ceph_osd_server *osds,
+				struct ceph_osds_object *obj,
+				struct ceph_osd_req_op *op,
+				size_t map_size, size_t len_read)
 {
-	struct rb_node *n = obj->o_blocks.rb_node;
-	struct ceph_osds_block *right = NULL;
-	int cmp = 0;
+	struct ceph_bvec_iter it;
+	struct page *page = NULL;
+	unsigned int num_bvecs;
+	int ret;
 
-	while (n) {
-		struct ceph_osds_block *blk;
+	if (map_size) {
+		page = alloc_pages(GFP_KERNEL, 0);
+		if (!page)
+			return -ENOMEM;
+		encode_sparse_map(page_address(page), op->extent.offset,
+				  len_read);
+	}
 
-		blk = rb_entry(n, typeof(*blk), b_node);
-		cmp = RB_CMP3WAY(off, blk->b_off);
-		if (cmp < 0) {
-			right = blk;
-			n = n->rb_left;
-		}
-		else if (cmp > 0) {
-			n = n->rb_right;
-		} else {
-			return blk;
-		}
+	ret = ceph_objstore_read_bvecs(osds->store, obj, op->extent.offset,
+				       len_read, page ? 1 : 0, &it,
+				       &num_bvecs);
+	if (ret) {
+		if (page)
+			put_page(page);
+		return ret;
+	}
+	if (page) {
+		it.bvecs[0] = (struct bio_vec) {
+			.bv_page = page,
+			.bv_len  = map_size,
+		};
+		it.iter.bi_size += map_size;
 	}
 
-	return right;
+	/* Setup output, give ownership of the bvecs and page refs to msg */
+	op->outdata_len = map_size + len_read;
+	op->outdata = &op->extent.osd_data;
+	ceph_msg_data_bvecs_init(op->outdata, &it, num_bvecs, true);
+
+	return 0;
 }
 
 static int handle_osd_op_read(struct ceph_msg *msg,
@@ -886,18 +878,13 @@ static int handle_osd_op_read(struct ceph_msg *msg,
 {
 	struct ceph_osd_server *osds = con_to_osds(msg->con);
 	struct ceph_osds_object *obj;
-	struct ceph_osds_block *blk;
 	size_t len_read, map_size;
-	off_t off, blk_off;
-	unsigned off_inpg;
 	bool is_sparse;
-	void *p;
-	int ret;
-
-	struct ceph_bvec_iter it;
 
 	/* Find an object */
 	obj = ceph_lookup_object(osds, req);
+	if (IS_ERR(obj))
+		return PTR_ERR(obj);
 	if (!obj)
 		return -ENOENT;
 
@@ -914,77 +901,54 @@ static int handle_osd_op_read(struct ceph_msg *msg,
 
 	len_read = min(op->extent.length, obj->o_size - op->extent.offset);
 
-	/* Allocate bvec for the read chunk */
-	ret = alloc_bvec(&it, map_size + len_read);
-	if (ret)
-		return ret;
-
-	/* Setup output length and data */
-	op->outdata_len = map_size + len_read;
-	op->outdata = &op->extent.osd_data;
-
-	/* Give ownership to msg */
-	ceph_msg_data_bvecs_init(&op->extent.osd_data, &it, 1, true);
-
-	/* Here we always have 1 segment bvec, with mpages though */
-	p = page_address(it.bvecs->bv_page);
-
-	if (is_sparse) {
-		/* Encode extent map, for now we have only 1 entry */
-		ceph_encode_32(&p, 1); /* map size */
-		ceph_encode_64(&p, op->extent.offset); /* offset as a key */
-		ceph_encode_64(&p, len_read); /* len as a value */
-		ceph_encode_32(&p, len_read); /* len of the following extent */
-	}
+	if (ceph_objstore_can_read_bvecs(osds->store))
+		return read_extent_zerocopy(osds, obj, op, map_size, len_read);
 
-	off_inpg = 0;
-	off = op->extent.offset;
-	blk_off = ALIGN_DOWN(off, OSDS_BLOCK_SIZE);
-	blk = lookup_block_ge(obj, blk_off);
-	while (blk && len_read) {
-		/* Found block is exactly we were looking for or the next one */
-		BUG_ON(blk->b_off < blk_off);
-
-		/* Zero out a possible hole before block */
-		if (blk->b_off > off) {
-			size_t len_zero = blk->b_off - off;
-
-			len_zero = min(len_zero, len_read);
-			memset(p + off_inpg, 0, len_zero);
+	return read_extent_copy(osds, obj, op, map_size, len_read);
+}
 
-			len_read -= len_zero;
-			off_inpg += len_zero;
-			off += len_zero;
-		}
+static int handle_osd_op_zero(struct ceph_msg *msg,
+			      struct ceph_msg_osd_op *req,
+			      struct ceph_osd_req_op *op)
+{
+	struct ceph_osd_server *osds = con_to_osds(msg->con);
+	struct ceph_osds_object *obj;
+	u64 len;
 
-		/* Copy block */
-		if (len_read) {
-			void *src = page_address(blk->b_page);
-			off_t off_inblk = off & ~OSDS_BLOCK_MASK;
-			size_t len_copy;
+	obj = ceph_lookup_object(osds, req);
+	if (IS_ERR(obj))
+		return PTR_ERR(obj);
+	if (!obj)
+		/* Nothing to zero */
+		return 0;
 
-			len_copy = min((size_t)OSDS_BLOCK_SIZE - off_inblk,
-				       len_read);
+	if (op->extent.offset >= obj->o_size)
+		/* Zeroing beyond the object is a noop */
+		return 0;
 
-			memcpy(p + off_inpg, src + off_inblk, len_copy);
+	len = min(op->extent.length, obj->o_size - op->extent.offset);
+	if (!len)
+		return 0;
 
-			len_read -= len_copy;
-			off_inpg += len_copy;
-			off += len_copy;
-		}
+	return ceph_objstore_zero(osds->store, obj, op->extent.offset,
+				  len, &req->mtime);
+}
 
-		/* Get the next block */
-		if (len_read) {
-			blk = rb_entry_safe(rb_next(&blk->b_node),
-					    typeof(*blk), b_node);
-		}
-	}
+static int handle_osd_op_truncate(struct ceph_msg *msg,
+				  struct ceph_msg_osd_op *req,
+				  struct ceph_osd_req_op *op)
+{
+	struct ceph_osd_server *osds = con_to_osds(msg->con);
+	struct ceph_osds_object *obj;
 
-	if (len_read)
-		/* Zero out the rest */
-		memset(p + off_inpg, 0, len_read);
+	obj = ceph_lookup_object(osds, req);
+	if (!obj)
+		obj = ceph_create_and_insert_object(osds, req);
+	if (IS_ERR(obj))
+		return PTR_ERR(obj);
 
-	return 0;
+	return ceph_objstore_truncate(osds->store, obj, op->extent.offset,
+				      &req->mtime);
 }
 
 static int handle_osd_op_stat(struct ceph_msg *msg,
@@ -1001,6 +965,8 @@ static int handle_osd_op_stat(struct ceph_msg *msg,
 
 	/* Find an object */
 	obj = ceph_lookup_object(osds, req);
+	if (IS_ERR(obj))
+		return PTR_ERR(obj);
 	if (!obj)
 		return -ENOENT;
 
@@ -1343,8 +1309,8 @@ static int handle_osd_op_call(struct ceph_msg *msg,
 		.msg = msg,
 		.req = req,
 	};
-	ret = ceph_cls_method_call(&osds->class_loader, cname, mname,
-				   &osds_ctx.ctx);
+	ret = ceph_cls_method_call(&this_shard(osds)->s_class_loader,
+				   cname, mname, &osds_ctx.ctx);
 	if (ret)
 		return ret;
 
@@ -1362,59 +1328,6 @@ static int handle_osd_op_call(struct ceph_msg *msg,
 	return 0;
 }
 
-static struct ceph_osds_omap_entry *
-lookup_omap_entry_ge_gt(struct rb_root *root, const char *key, bool equal)
-{
-	struct rb_node *n = root->rb_node;
-	struct ceph_osds_omap_entry *right = NULL;
-	int cmp = 0;
-
-	while (n) {
-		struct ceph_osds_omap_entry *ome;
-
-		ome = rb_entry(n, typeof(*ome), e_node);
-		cmp = strcmp(key, ome->e_key);
-		if (cmp < 0) {
-			right = ome;
-			n = n->rb_left;
-		}
-		else if (cmp > 0) {
-			n = n->rb_right;
-		} else {
-			if (equal)
-				/* Exact match */
-				return ome;
-
-			/*
-			 * We were asked to lookup for the next node,
-			 * i.e. greater than the key. Two options exist:
-			 * a) return right node from the current one,
-			 * b) if right node does not exist - return the
-			 *    cached right, when we turned left.
-			 */
-			n = n->rb_right;
-			if (n)
-				return rb_entry(n, typeof(*ome), e_node);
-
-			return right;
-		}
-	}
-
-	return right;
-}
-
-static struct ceph_osds_omap_entry *
-lookup_omap_entry_ge(struct rb_root *root, const char *key)
-{
-	return lookup_omap_entry_ge_gt(root, key, true);
-}
-
-static struct ceph_osds_omap_entry *
-lookup_omap_entry_gt(struct rb_root *root, const char *key)
-{
-	return lookup_omap_entry_ge_gt(root, key, false);
-}
-
 static int ceph_encode_omap_entry(struct ceph_pagelist *pl,
 				  struct ceph_osds_omap_entry *ome)
 {
@@ -1471,6 +1384,10 @@ static int handle_osd_op_omapgetvals(struct ceph_msg *msg,
 		goto err;
 
 	obj = ceph_lookup_object(osds, req);
+	if (IS_ERR(obj)) {
+		ret = PTR_ERR(obj);
+		goto err;
+	}
 	if (!obj)
 		/* Last bits and we are done */
 		goto finish;
@@ -1480,12 +1397,12 @@ static int handle_osd_op_omapgetvals(struct ceph_msg *msg,
 		 * 'prefix' is to the right from 'after', so do not waste
 		 * time and do lookup *starting* from 'prefix', thus GE.
 		 */
-		ome = lookup_omap_entry_ge(&obj->o_omap, prefix);
+		ome = ceph_omap_lookup_ge(&obj->o_omap, prefix);
 	} else {
 		/*
 		 * Lookup for omaps greater than 'after', thus GT.
 		 */
-		ome = lookup_omap_entry_gt(&obj->o_omap, after);
+		ome = ceph_omap_lookup_gt(&obj->o_omap, after);
 	}
 
 	for (cnt = 0; ome && cnt < max; cnt++) {
@@ -1499,8 +1416,7 @@ static int handle_osd_op_omapgetvals(struct ceph_msg *msg,
 			goto err;
 
 		/* Get the next node */
-		ome = rb_entry_safe(rb_next(&ome->e_node),
-				    typeof(*ome), e_node);
+		ome = ceph_omap_next(ome);
 	}
 
 	/* Do we have more? */
@@ -1574,6 +1490,10 @@ static int handle_osd_op_omapgetvalsbykeys(struct ceph_msg *msg,
 		goto err;
 
 	obj = ceph_lookup_object(osds, req);
+	if (IS_ERR(obj)) {
+		ret = PTR_ERR(obj);
+		goto err;
+	}
 	if (!obj)
 		/* Last bits and we are done */
 		goto finish;
@@ -1585,7 +1505,7 @@ static int handle_osd_op_omapgetvalsbykeys(struct ceph_msg *msg,
 		/* Extract a key and lookup for an entry */
 		key = cursor_decode_safe_str(in_cur, GFP_KERNEL,
 					     einval, enomem);
-		ome = lookup_omap_entry(&obj->o_omap, key);
+		ome = ceph_omap_lookup(&obj->o_omap, key);
 		kfree(key);
 
 		if (!ome)
@@ -1645,10 +1565,11 @@ static int handle_osd_op_omapsetvals(struct ceph_msg *msg,
 
 	/* Find or create an object */
 	obj = ceph_lookup_object(osds, req);
-	if (!obj) {
+	if (!obj)
 		obj = ceph_create_and_insert_object(osds, req);
-		if (!obj)
-			goto enomem;
+	if (IS_ERR(obj)) {
+		ret = PTR_ERR(obj);
+		goto err;
 	}
 
 	for (i = 0; i < cnt; i++) {
@@ -1659,9 +1580,10 @@ static int handle_osd_op_omapsetvals(struct ceph_msg *msg,
 		/* Extract key and look omap entry */
 		key = cursor_decode_safe_str(in_cur, GFP_KERNEL,
 					     einval, enomem);
-		ome = lookup_omap_entry(&obj->o_omap, key);
+		ome = ceph_omap_lookup(&obj->o_omap, key);
 		if (!ome)
-			ome = ceph_create_and_insert_omap(&obj->o_omap, key);
+			ome = ceph_omap_create_and_insert(&obj->o_omap, key,
+							  strlen(key));
 		kfree(key);
 		if (!ome)
 			goto enomem;
@@ -1686,9 +1608,11 @@ static int handle_osd_op_omapsetvals(struct ceph_msg *msg,
 		/* In case old value was bigger than the new one */
 		ret = ceph_pagelist_truncate(ome->e_val_pl, val_len);
 		WARN_ON(ret);
+
+		ceph_omap_set_dirty(&obj->o_dirty_omap, ome);
 	}
 
-	return 0;
+	return ceph_objstore_sync_meta(osds->store, obj);
 
 err:
 	return ret;
@@ -1740,6 +1664,10 @@ static int handle_osd_op_omapgetkeys(struct ceph_msg *msg,
 		goto err;
 
 	obj = ceph_lookup_object(osds, req);
+	if (IS_ERR(obj)) {
+		ret = PTR_ERR(obj);
+		goto err;
+	}
 	if (!obj)
 		/* Last bits and we are done */
 		goto finish;
@@ -1747,7 +1675,7 @@ static int handle_osd_op_omapgetkeys(struct ceph_msg *msg,
 	/*
 	 * Lookup for omaps greater than 'after', thus GT.
 	 */
-	ome = lookup_omap_entry_gt(&obj->o_omap, after);
+	ome = ceph_omap_lookup_gt(&obj->o_omap, after);
 
 	for (cnt = 0; ome && cnt < max; cnt++) {
 		/* Encode key */
@@ -1757,8 +1685,7 @@ static int handle_osd_op_omapgetkeys(struct ceph_msg *msg,
 			goto err;
 
 		/* Get the next node */
-		ome = rb_entry_safe(rb_next(&ome->e_node),
-				    typeof(*ome), e_node);
+		ome = ceph_omap_next(ome);
 	}
 
 	/* Do we have more? */
@@ -1825,10 +1752,14 @@ static int handle_osd_op_getxattr(struct ceph_msg *msg,
 		goto enomem;
 
 	obj = ceph_lookup_object(osds, req);
+	if (IS_ERR(obj)) {
+		ret = PTR_ERR(obj);
+		goto err;
+	}
 	if (!obj)
 		goto einval;
 
-	ome = lookup_omap_entry(&obj->o_xattrs, key);
+	ome = ceph_omap_lookup(&obj->o_xattrs, key);
 	if (!ome)
 		goto enodata;
 
@@ -1887,16 +1818,18 @@ static int handle_osd_op_setxattr(struct ceph_msg *msg,
 
 	/* Find or create an object */
 	obj = ceph_lookup_object(osds, req);
-	if (!obj) {
+	if (!obj)
 		obj = ceph_create_and_insert_object(osds, req);
-		if (!obj)
-			goto enomem;
+	if (IS_ERR(obj)) {
+		ret = PTR_ERR(obj);
+		goto err;
 	}
 
 	/* Find or create new xattr */
-	ome = lookup_omap_entry(&obj->o_xattrs, key);
+	ome = ceph_omap_lookup(&obj->o_xattrs, key);
 	if (!ome) {
-		ome = ceph_create_and_insert_omap(&obj->o_xattrs, key);
+		ome = ceph_omap_create_and_insert(&obj->o_xattrs, key,
+						  strlen(key));
 		if (!ome)
 			goto enomem;
 	}
@@ -1922,9 +1855,10 @@ static int handle_osd_op_setxattr(struct ceph_msg *msg,
 	ret = ceph_pagelist_truncate(ome->e_val_pl, val_len);
 	WARN_ON(ret);
 
+	ceph_omap_set_dirty(&obj->o_dirty_xattrs, ome);
 	kfree(key);
 
-	return 0;
+	return ceph_objstore_sync_meta(osds->store, obj);
 
 err:
 	kfree(key);
@@ -1947,20 +1881,78 @@ static int handle_osd_op_create(struct ceph_msg *msg,
 	struct ceph_osds_object *obj;
 
 	obj = ceph_lookup_object(osds, req);
+	if (IS_ERR(obj))
+		return PTR_ERR(obj);
 	if (obj)
 		return op->flags & CEPH_OSD_OP_FLAG_EXCL ? -EEXIST : 0;
 
 	obj = ceph_create_and_insert_object(osds, req);
+
+	return PTR_ERR_OR_ZERO(obj);
+}
+
+static int handle_osd_op_setallochint(struct ceph_msg *msg,
+				      struct ceph_msg_osd_op *req,
+				      struct ceph_osd_req_op *op)
+{
+	struct ceph_osd_server *osds = con_to_osds(msg->con);
+	struct ceph_osds_object *obj;
+
+	/* Like OSD does, hint creates an object */
+	obj = ceph_lookup_object(osds, req);
 	if (!obj)
-		return -ENOMEM;
+		obj = ceph_create_and_insert_object(osds, req);
+	if (IS_ERR(obj))
+		return PTR_ERR(obj);
 
-	return 0;
+	return ceph_objstore_set_alloc_hint(osds->store, obj,
+				op->alloc_hint.expected_object_size,
+				op->alloc_hint.expected_write_size);
+}
+
+static enum perf_hist_id osd_op_perf_hist(u16 op)
+{
+	switch (op) {
+	case CEPH_OSD_OP_READ:
+	case CEPH_OSD_OP_SYNC_READ:
+	case CEPH_OSD_OP_SPARSE_READ:
+		return PERF_HIST_OSD_OP_READ;
+	case CEPH_OSD_OP_WRITE:
+		return PERF_HIST_OSD_OP_WRITE;
+	case CEPH_OSD_OP_WRITEFULL:
+		return PERF_HIST_OSD_OP_WRITEFULL;
+	case CEPH_OSD_OP_ZERO:
+		return PERF_HIST_OSD_OP_ZERO;
+	case CEPH_OSD_OP_TRUNCATE:
+		return PERF_HIST_OSD_OP_TRUNCATE;
+	case CEPH_OSD_OP_STAT:
+		return PERF_HIST_OSD_OP_STAT;
+	case CEPH_OSD_OP_CALL:
+		return PERF_HIST_OSD_OP_CALL;
+	case CEPH_OSD_OP_OMAPGETVALS:
+		return PERF_HIST_OSD_OP_OMAPGETVALS;
+	case CEPH_OSD_OP_OMAPGETVALSBYKEYS:
+		return PERF_HIST_OSD_OP_OMAPGETVALSBYKEYS;
+	case CEPH_OSD_OP_OMAPSETVALS:
+		return PERF_HIST_OSD_OP_OMAPSETVALS;
+	case CEPH_OSD_OP_OMAPGETKEYS:
+		return PERF_HIST_OSD_OP_OMAPGETKEYS;
+	case CEPH_OSD_OP_GETXATTR:
+		return PERF_HIST_OSD_OP_GETXATTR;
+	case CEPH_OSD_OP_SETXATTR:
+		return PERF_HIST_OSD_OP_SETXATTR;
+	case CEPH_OSD_OP_CREATE:
+		return PERF_HIST_OSD_OP_CREATE;
+	default:
+		return PERF_HIST_OSD_OP_OTHER;
+	}
 }
 
 static int handle_osd_op(struct ceph_msg *msg, struct ceph_msg_osd_op *req,
 			 struct ceph_osd_req_op *op,
 			 struct ceph_msg_data_cursor *in_cur)
 {
+	u64 stamp = fast_nsecs();
 	int ret;
 
 	switch (op->op) {
@@ -1973,6 +1965,12 @@ static int handle_osd_op(struct ceph_msg *msg, struct ceph_msg_osd_op *req,
 	case CEPH_OSD_OP_SPARSE_READ:
 		ret = handle_osd_op_read(msg, req, op);
 		break;
+	case CEPH_OSD_OP_ZERO:
+		ret = handle_osd_op_zero(msg, req, op);
+		break;
+	case CEPH_OSD_OP_TRUNCATE:
+		ret = handle_osd_op_truncate(msg, req, op);
+		break;
 	case CEPH_OSD_OP_STAT:
 		ret = handle_osd_op_stat(msg, req, op);
 		break;
@@ -2000,9 +1998,11 @@ static int handle_osd_op(struct ceph_msg *msg, struct ceph_msg_osd_op *req,
 	case CEPH_OSD_OP_CREATE:
 		ret = handle_osd_op_create(msg, req, op);
 		break;
+	case CEPH_OSD_OP_SETALLOCHINT:
+		ret = handle_osd_op_setallochint(msg, req, op);
+		break;
 	case CEPH_OSD_OP_WATCH:
 	case CEPH_OSD_OP_LIST_WATCHERS:
-	case CEPH_OSD_OP_SETALLOCHINT:
 		/* FIXME: pretend we support these commands */
 		ret = 0;
 		break;
@@ -2018,37 +2018,37 @@ static int handle_osd_op(struct ceph_msg *msg, struct ceph_msg_osd_op *req,
 	}
 	op->rval = ret;
 
+	perf_inc(PERF_OSD_OPS);
+	if (ret < 0)
+		perf_inc(PERF_OSD_OP_ERRORS);
+	perf_add(PERF_OSD_OP_IN_BYTES, op->indata_len);
+	perf_add(PERF_OSD_OP_OUT_BYTES, op->outdata_len);
+	perf_hist_add(osd_op_perf_hist(op->op), fast_nsecs() - stamp);
+
 	return ret;
 }
 
-static void handle_osd_ops(struct ceph_connection *con, struct ceph_msg *msg)
+static void handle_osd_ops(struct ceph_osds_request *r)
 {
+	struct ceph_msg *msg = r->r_msg;
+	struct ceph_connection *con = msg->con;
 	struct ceph_osd_client *osdc = con_to_osdc(con);
+	struct ceph_osd_server *osds = con_to_osds(con);
+	struct ceph_msg_osd_op *req = &r->r_req;
 	struct ceph_msg_data_cursor in_cur;
-	struct ceph_msg_osd_op req;
 	struct ceph_msg *reply;
-	int ret, i;
-
-	/* See osds_alloc_msg(), we gather input in a single data */
-	BUG_ON(msg->num_data_items > 1);
-
-	ret = ceph_decode_msg_osd_op(msg, &req);
-	if (unlikely(ret)) {
-		pr_err("%s: con %p, failed to decode a message, ret=%d\n",
-		       __func__, con, ret);
-		return;
-	}
+	int ret, err, i;
 
 	/* Init iterator for input data, ->data_length can be 0 */
 	ceph_msg_data_cursor_init(&in_cur, msg->data, WRITE,
 				  msg->data_length);
 
 	/* Iterate over all operations */
-	for (i = 0; i < req.num_ops; i++) {
-		struct ceph_osd_req_op *op = &req.ops[i];
+	for (ret = 0, i = 0; i < req->num_ops; i++) {
+		struct ceph_osd_req_op *op = &req->ops[i];
 
 		/* Make things happen */
-		ret = handle_osd_op(msg, &req, op, &in_cur);
+		ret = handle_osd_op(msg, req, op, &in_cur);
 		if (ret && (op->flags & CEPH_OSD_OP_FLAG_FAILOK) &&
 		    ret != -EAGAIN && ret != -EINPROGRESS)
 			/* Ignore op error and continue executing */
@@ -2057,44 +2057,420 @@ static void handle_osd_ops(struct ceph_connection *con, struct ceph_msg *msg)
 		if (ret)
 			break;
 	}
+	if (req->object) {
+		/* Reply is ONDISK, so changes must be persistent by now */
+		err = ceph_objstore_sync_object(osds->store, req->object);
+		if (!ret)
+			ret = err;
+		/* Can be evicted from the cache now */
+		ceph_objstore_put_object(osds->store, req->object);
+		req->object = NULL;
+	}
 
-	/* Create reply message */
-	reply = create_osd_op_reply(&req, ret, osdc->osdmap->epoch,
+	/*
+	 * Create reply message.  The map is replaced and freed by the
+	 * monc on reactor #0, so take the epoch it publishes.
+	 */
+	reply = create_osd_op_reply(req, ret, atomic_read(&osdc->epoch),
 			/* TODO: Not actually clear to me when to set those */
 			CEPH_OSD_FLAG_ACK | CEPH_OSD_FLAG_ONDISK);
-
-	deinit_msg_osd_op(&req);
-
 	if (unlikely(!reply)) {
 		pr_err("%s: con %p, failed to allocate a reply\n",
 		       __func__, con);
 		return;
 	}
 
-	ceph_con_send(con, reply);
+	/* Sent by finish_osds_request() on the reactor of the connection */
+	r->r_reply = reply;
 }
 
-static void osds_dispatch(struct ceph_connection *con, struct ceph_msg *msg)
+static inline u32 hoid_queue_key(const struct ceph_hobject_id *hoid)
 {
-	int type = le16_to_cpu(msg->hdr.type);
+	return hoid->hash ^ (u32)hoid->pool;
+}
 
-	switch (type) {
-	case CEPH_MSG_OSD_OP:
-		handle_osd_ops(con, msg);
-		break;
-	default:
-		pr_err("@@ message type %d, \"%s\"\n", type,
-		       ceph_msg_type_name(type));
-		break;
+static struct ceph_osds_obj_queue *
+lookup_obj_queue(struct ceph_osds_shard *shard,
+		 const struct ceph_hobject_id *hoid)
+{
+	struct ceph_osds_obj_queue *queue;
+
+	hash_for_each_possible(shard->s_obj_queues, queue, q_node,
+			       hoid_queue_key(hoid)) {
+		if (!ceph_hoid_compare(queue->q_hoid, hoid))
+			return queue;
 	}
 
-	ceph_msg_put(msg);
+	return NULL;
 }
 
-static struct ceph_msg *alloc_msg_with_bvec(struct ceph_msg_header *hdr)
+static void free_osds_request(struct ceph_osds_request *r)
 {
-	struct ceph_msg *m;
-	int type = le16_to_cpu(hdr->type);
+	list_del(&r->r_inflight);
+	deinit_msg_osd_op(&r->r_req);
+	ceph_msg_put(r->r_msg);
+	kfree(r);
+}
+
+static void send_and_free_osds_request(struct ceph_osds_request *r)
+{
+	struct ceph_connection *con = r->r_msg->con;
+
+	perf_inc(PERF_OSD_REQS);
+	perf_hist_add(PERF_HIST_OSD_REQ, fast_nsecs() - r->r_stamp);
+
+	if (r->r_reply && ceph_con_is_shm(con))
+		ceph_osds_shm_send(con, r->r_reply);
+	else if (r->r_reply)
+		ceph_con_send_corked(con, r->r_reply);
+	free_osds_request(r);
+}
+
+static void finish_osds_request_workfn(struct reactor_work *work)
+{
+	struct ceph_osds_request *r;
+
+	r = container_of(work, typeof(*r), r_work);
+	send_and_free_osds_request(r);
+}
+
+/**
+ * finish_osds_request() - sends the reply, if any, and frees the request
+ *                         on the reactor of the connection.
+ */
+static void finish_osds_request(struct ceph_osds_request *r)
+{
+	if (r->r_reactor == reactor_id) {
+		send_and_free_osds_request(r);
+		return;
+	}
+	INIT_REACTOR_WORK(&r->r_work, finish_osds_request_workfn);
+	reactor_post(r->r_reactor, &r->r_work);
+}
+
+static void make_request_runnable(struct ceph_osds_shard *shard,
+				  struct ceph_osds_request *r)
+{
+	struct ceph_osds_op_task *t;
+
+	list_add_tail(&r->r_node, &shard->s_runnable);
+
+	t = list_first_entry_or_null(&shard->s_idle_tasks,
+				     typeof(*t), idle_node);
+	if (t) {
+		list_del_init(&t->idle_node);
+		wake_up_process(t->task);
+	}
+}
+
+/**
+ * complete_osds_request() - frees request and makes the next request
+ *                           to the same object runnable.
+ */
+static void complete_osds_request(struct ceph_osds_shard *shard,
+				  struct ceph_osds_request *r)
+{
+	struct ceph_osds_obj_queue *queue = r->r_queue;
+	struct ceph_osds_request *next;
+
+	next = list_first_entry_or_null(&queue->q_pending,
+					typeof(*next), r_node);
+	if (next) {
+		list_del_init(&next->r_node);
+		queue->q_hoid = &next->r_req.hoid;
+		make_request_runnable(shard, next);
+	} else {
+		hash_del(&queue->q_node);
+		kfree(queue);
+	}
+	finish_osds_request(r);
+}
+
+static int osds_op_task(void *arg)
+{
+	struct ceph_osds_op_task *t = arg;
+	struct ceph_osds_shard *shard = t->shard;
+	struct ceph_osds_request *r;
+
+	while (!kthread_should_stop(current)) {
+		r = list_first_entry_or_null(&shard->s_runnable,
+					     typeof(*r), r_node);
+		if (!r) {
+			/* Nothing to do, wait for a request */
+			list_add(&t->idle_node, &shard->s_idle_tasks);
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule();
+			list_del_init(&t->idle_node);
+			continue;
+		}
+		list_del_init(&r->r_node);
+
+		handle_osd_ops(r);
+		complete_osds_request(shard, r);
+	}
+
+	return 0;
+}
+
+/**
+ * queue_osds_request() - queues a request for the op tasks, called on
+ *                        the reactor which owns the PG.
+ */
+static void queue_osds_request(struct ceph_osd_server *osds,
+			       struct ceph_osds_request *r)
+{
+	struct ceph_osds_shard *shard = this_shard(osds);
+	struct ceph_osds_obj_queue *queue;
+
+	if (unlikely(READ_ONCE(osds->s_stopping))) {
+		/* Op tasks are stopped, nobody will execute a request */
+		finish_osds_request(r);
+		return;
+	}
+
+	queue = lookup_obj_queue(shard, &r->r_req.hoid);
+	if (queue) {
+		/* Object is busy, wait for preceding requests */
+		r->r_queue = queue;
+		list_add_tail(&r->r_node, &queue->q_pending);
+		return;
+	}
+	queue = kmalloc(sizeof(*queue), GFP_KERNEL);
+	if (unlikely(!queue)) {
+		pr_err("%s: con %p, failed to allocate a queue\n",
+		       __func__, r->r_msg->con);
+		finish_osds_request(r);
+		return;
+	}
+	INIT_LIST_HEAD(&queue->q_pending);
+	queue->q_hoid = &r->r_req.hoid;
+	hash_add(shard->s_obj_queues, &queue->q_node,
+		 hoid_queue_key(queue->q_hoid));
+	r->r_queue = queue;
+
+	make_request_runnable(shard, r);
+}
+
+static void queue_osds_request_workfn(struct reactor_work *work)
+{
+	struct ceph_osds_request *r;
+
+	r = container_of(work, typeof(*r), r_work);
+	queue_osds_request(con_to_osds(r->r_msg->con), r);
+}
+
+/*
+ * Decodes an OSD op once per message: if the message has data that is
+ * done by osds_alloc_msg_data() and the request is kept by the message
+ * till it is submitted.
+ */
+static struct ceph_osds_request *
+decode_osds_request(struct ceph_connection *con, struct ceph_msg *msg)
+{
+	struct ceph_osds_request *r;
+	int ret;
+
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (unlikely(!r)) {
+		pr_err("%s: con %p, failed to allocate a request\n",
+		       __func__, con);
+		return NULL;
+	}
+	ret = ceph_decode_msg_osd_op(msg, &r->r_req);
+	if (unlikely(ret)) {
+		pr_err("%s: con %p, failed to decode a message, ret=%d\n",
+		       __func__, con, ret);
+		kfree(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static void release_decoded_osds_request(struct ceph_msg *msg)
+{
+	struct ceph_osds_request *r = msg->private;
+
+	deinit_msg_osd_op(&r->r_req);
+	kfree(r);
+}
+
+/**
+ * submit_osd_ops() - decodes a message and queues a request for the
+ *                    op tasks of the PG owner.  Takes ownership of the
+ *                    message.
+ */
+static void submit_osd_ops(struct ceph_connection *con, struct ceph_msg *msg)
+{
+	struct ceph_osd_server *osds = con_to_osds(con);
+	struct ceph_osds_request *r;
+	unsigned int owner;
+
+	/* See osds_alloc_msg(), we gather input in a single data */
+	BUG_ON(msg->num_data_items > 1);
+
+	if (unlikely(READ_ONCE(osds->s_stopping))) {
+		/* Op tasks are stopped, nobody will execute a request */
+		ceph_msg_put(msg);
+		return;
+	}
+
+	r = msg->private;
+	if (r) {
+		/* Decoded by osds_alloc_msg_data() */
+		msg->private = NULL;
+		msg->release_private = NULL;
+	} else {
+		r = decode_osds_request(con, msg);
+		if (unlikely(!r)) {
+			ceph_msg_put(msg);
+			return;
+		}
+	}
+	INIT_LIST_HEAD(&r->r_node);
+	r->r_msg = msg;
+	r->r_reply = NULL;
+	r->r_reactor = reactor_id;
+	r->r_stamp = fast_nsecs();
+	list_add_tail(&r->r_inflight, &this_shard(osds)->s_requests);
+
+	owner = ceph_objstore_shard(osds->store, &r->r_req.spgid);
+	if (owner == reactor_id) {
+		queue_osds_request(osds, r);
+		return;
+	}
+	INIT_REACTOR_WORK(&r->r_work, queue_osds_request_workfn);
+	reactor_post(owner, &r->r_work);
+}
+
+static void osds_dispatch(struct ceph_connection *con, struct ceph_msg *msg)
+{
+	int type = le16_to_cpu(msg->hdr.type);
+
+	switch (type) {
+	case CEPH_MSG_OSD_OP:
+		/* Request owns the message */
+		submit_osd_ops(con, msg);
+		return;
+	default:
+		pr_err("@@ message type %d, \"%s\"\n", type,
+		       ceph_msg_type_name(type));
+		break;
+	}
+
+	ceph_msg_put(msg);
+}
+
+/**
+ * start_shard_op_tasks() - starts op tasks of the shard, called on the
+ *                          reactor which owns the shard.
+ */
+static int start_shard_op_tasks(void *arg)
+{
+	struct ceph_osds_shard *shard = arg;
+	unsigned int i, nr = shard->osds->client->options->osd_op_tasks;
+	struct ceph_osds_op_task *t;
+
+	shard->s_op_tasks = kcalloc(nr, sizeof(*shard->s_op_tasks),
+				    GFP_KERNEL);
+	if (!shard->s_op_tasks)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		t = &shard->s_op_tasks[i];
+		t->shard = shard;
+		INIT_LIST_HEAD(&t->idle_node);
+		t->task = task_create(osds_op_task, t);
+		if (!t->task)
+			return -ENOMEM;
+		shard->s_nr_op_tasks++;
+		wake_up_process(t->task);
+	}
+
+	return 0;
+}
+
+static int start_op_tasks(struct ceph_osd_server *osds)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < osds->s_nr_shards; i++) {
+		ret = reactor_call(i, start_shard_op_tasks, &osds->s_shards[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * stop_shard_op_tasks() - stops op tasks of the shard and finishes
+ *                         requests which were not executed, called on
+ *                         the reactor which owns the shard.
+ */
+static int stop_shard_op_tasks(void *arg)
+{
+	struct ceph_osds_shard *shard = arg;
+	struct ceph_osds_obj_queue *queue;
+	struct ceph_osds_request *r, *tmp;
+	struct hlist_node *n;
+	unsigned int i;
+	int bkt;
+
+	for (i = 0; i < shard->s_nr_op_tasks; i++)
+		kthread_stop(shard->s_op_tasks[i].task);
+	shard->s_nr_op_tasks = 0;
+	kfree(shard->s_op_tasks);
+	shard->s_op_tasks = NULL;
+
+	/* Tasks are stopped, free everything which was not executed */
+	list_for_each_entry_safe(r, tmp, &shard->s_runnable, r_node) {
+		list_del(&r->r_node);
+		finish_osds_request(r);
+	}
+	hash_for_each_safe(shard->s_obj_queues, bkt, n, queue, q_node) {
+		list_for_each_entry_safe(r, tmp, &queue->q_pending, r_node) {
+			list_del(&r->r_node);
+			finish_osds_request(r);
+		}
+		hash_del(&queue->q_node);
+		kfree(queue);
+	}
+
+	return 0;
+}
+
+static int sync_reactor(void *arg)
+{
+	return 0;
+}
+
+static void stop_op_tasks(struct ceph_osd_server *osds)
+{
+	unsigned int i;
+
+	WRITE_ONCE(osds->s_stopping, true);
+
+	/*
+	 * Round trip to each reactor, so requests which are decoded
+	 * before reactors see the stopping flag are already posted to
+	 * the owners.  Works are executed in order and the stop call is
+	 * posted after them, so owners queue or finish these requests
+	 * before stopping and osds is not touched afterwards.
+	 */
+	for (i = 0; i < osds->s_nr_shards; i++)
+		reactor_call(i, sync_reactor, NULL);
+
+	for (i = 0; i < osds->s_nr_shards; i++)
+		reactor_call(i, stop_shard_op_tasks, &osds->s_shards[i]);
+}
+
+static struct ceph_msg *alloc_msg_with_bvec(struct ceph_msg_header *hdr,
+					    bool alloc_data)
+{
+	struct ceph_msg *m;
+	int type = le16_to_cpu(hdr->type);
 	u32 front_len = le32_to_cpu(hdr->front_len);
 	u32 data_len = le32_to_cpu(hdr->data_len);
 
@@ -2102,7 +2478,7 @@ static struct ceph_msg *alloc_msg_with_bvec(struct ceph_msg_header *hdr)
 	if (!m)
 		return NULL;
 
-	if (data_len) {
+	if (data_len && alloc_data) {
 		struct ceph_bvec_iter it;
 		int ret;
 
@@ -2130,8 +2506,10 @@ static struct ceph_msg *osds_alloc_msg(struct ceph_connection *con,
 	case CEPH_MSG_OSD_MAP:
 	case CEPH_MSG_OSD_BACKOFF:
 	case CEPH_MSG_WATCH_NOTIFY:
+		return alloc_msg_with_bvec(hdr, true);
 	case CEPH_MSG_OSD_OP:
-		return alloc_msg_with_bvec(hdr);
+		/* Data is allocated by osds_alloc_msg_data() */
+		return alloc_msg_with_bvec(hdr, false);
 	case CEPH_MSG_OSD_OPREPLY:
 		/* fall through */
 	default:
@@ -2142,17 +2520,151 @@ static struct ceph_msg *osds_alloc_msg(struct ceph_connection *con,
 	}
 }
 
+static void release_bvecs(struct bio_vec *bvecs, unsigned int num_bvecs)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_bvecs; i++)
+		put_page(bvecs[i].bv_page);
+	kfree(bvecs);
+}
+
+/**
+ * alloc_write_bvecs() - if the whole payload of the request belongs to
+ *                       WRITE ops, allocates blocks of the objectstore
+ *                       block size aligned on the object offsets of each
+ *                       write, so the backend can take whole blocks.
+ *
+ * Returns -EOPNOTSUPP if the payload is not suitable.
+ */
+static int alloc_write_bvecs(struct ceph_osd_server *osds,
+			     const struct ceph_msg_osd_op *req, u32 data_len,
+			     struct ceph_bvec_iter *it,
+			     unsigned int *num_bvecs)
+{
+	unsigned int shift = osds->store->ops->block_shift;
+	size_t blk_size = 1UL << shift;
+	struct bio_vec *bvecs;
+	unsigned int i, nr;
+	u64 total;
+
+	if (!shift)
+		return -EOPNOTSUPP;
+
+	for (nr = 0, total = 0, i = 0; i < req->num_ops; i++) {
+		const struct ceph_osd_req_op *op = &req->ops[i];
+		u64 off = op->extent.offset;
+
+		if (!op->indata_len)
+			continue;
+		if ((op->op != CEPH_OSD_OP_WRITE &&
+		     op->op != CEPH_OSD_OP_WRITEFULL) ||
+		    op->indata_len != op->extent.length)
+			return -EOPNOTSUPP;
+
+		nr += (ALIGN(off + op->indata_len, blk_size) -
+		       ALIGN_DOWN(off, blk_size)) >> shift;
+		total += op->indata_len;
+	}
+	if (total != data_len)
+		return -EOPNOTSUPP;
+
+	bvecs = kmalloc_array(nr, sizeof(*bvecs), GFP_KERNEL);
+	if (!bvecs)
+		return -ENOMEM;
+
+	for (nr = 0, i = 0; i < req->num_ops; i++) {
+		const struct ceph_osd_req_op *op = &req->ops[i];
+		u64 off = op->extent.offset;
+		u64 end = off + op->indata_len;
+
+		while (off < end) {
+			size_t off_inblk = off & (blk_size - 1);
+			size_t len = min_t(u64, blk_size - off_inblk,
+					   end - off);
+			struct page *page;
+
+			page = alloc_pages(GFP_KERNEL, shift - PAGE_SHIFT);
+			if (!page) {
+				release_bvecs(bvecs, nr);
+				return -ENOMEM;
+			}
+			bvecs[nr++] = (struct bio_vec) {
+				.bv_page   = page,
+				.bv_len    = len,
+				.bv_offset = off_inblk,
+			};
+			off += len;
+		}
+	}
+	*it = (struct ceph_bvec_iter) {
+		.bvecs = bvecs,
+		.iter = { .bi_size = data_len },
+	};
+	*num_bvecs = nr;
+
+	return 0;
+}
+
+/**
+ * osds_alloc_msg_data() - called by the messenger when the front of the
+ *                         OSD op is read, so the payload of writes is
+ *                         received straight into object sized blocks.
+ */
+static int osds_alloc_msg_data(struct ceph_connection *con,
+			       struct ceph_msg *msg)
+{
+	struct ceph_osd_server *osds = con_to_osds(con);
+	u32 data_len = le32_to_cpu(msg->hdr.data_len);
+	struct ceph_osds_request *r;
+	struct ceph_bvec_iter it;
+	unsigned int num_bvecs;
+	int ret = -EOPNOTSUPP;
+
+	r = decode_osds_request(con, msg);
+	if (r) {
+		/* Kept for submit_osd_ops() */
+		msg->private = r;
+		msg->release_private = release_decoded_osds_request;
+		ret = alloc_write_bvecs(osds, &r->r_req, data_len, &it,
+					&num_bvecs);
+	}
+	if (ret == -EOPNOTSUPP) {
+		/* Everything else is gathered in a single chunk */
+		ret = alloc_bvec(&it, data_len);
+		num_bvecs = 1;
+	}
+	if (ret)
+		return ret;
+
+	/* Give ownership to msg */
+	ceph_msg_data_add_bvecs(msg, &it, num_bvecs, true);
+
+	return 0;
+}
+
 static void osds_fault(struct ceph_connection *con)
 {
 	ceph_con_close(con);
 	osds_con_put(con);
 }
 
+static void deinit_shards(struct ceph_osd_server *osds)
+{
+	unsigned int i;
+
+	for (i = 0; i < osds->s_nr_shards; i++)
+		ceph_cls_deinit(&osds->s_shards[i].s_class_loader);
+	kfree(osds->s_shards);
+}
+
 struct ceph_osd_server *
 ceph_create_osd_server(struct ceph_options *opt, int osd)
 {
+	struct ceph_osds_shard *shard;
 	struct ceph_osd_server *osds;
 	struct ceph_client *client;
+	unsigned int i;
 	int ret;
 
 	osds = kzalloc(sizeof(*osds), GFP_KERNEL);
@@ -2160,25 +2672,236 @@ ceph_create_osd_server(struct ceph_options *opt, int osd)
 		return ERR_PTR(-ENOMEM);
 
 	osds->osd = osd;
-	osds->s_objects = RB_ROOT;
-	ceph_cls_init(&osds->class_loader, opt);
+	osds->s_nr_shards = nr_reactors;
+	osds->s_shards = kcalloc(osds->s_nr_shards, sizeof(*osds->s_shards),
+				 GFP_KERNEL);
+	if (unlikely(!osds->s_shards)) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	for (i = 0; i < osds->s_nr_shards; i++) {
+		shard = &osds->s_shards[i];
+		shard->osds = osds;
+		INIT_LIST_HEAD(&shard->s_idle_tasks);
+		INIT_LIST_HEAD(&shard->s_runnable);
+		hash_init(shard->s_obj_queues);
+		INIT_LIST_HEAD(&shard->s_cons);
+		INIT_LIST_HEAD(&shard->s_requests);
+		ceph_cls_init(&shard->s_class_loader, opt);
+	}
+	osds->store = ceph_objstore_create(opt, osds->s_nr_shards);
+	if (unlikely(IS_ERR(osds->store))) {
+		ret = PTR_ERR(osds->store);
+		goto deinit_shards;
+	}
 
 	client = __ceph_create_client(opt, osds, CEPH_ENTITY_TYPE_OSD,
 				      osd, CEPH_FEATURES_SUPPORTED_OSD,
 				      CEPH_FEATURES_REQUIRED_OSD);
 	if (unlikely(IS_ERR(client))) {
 		ret = PTR_ERR(client);
-		goto err;
+		goto destroy_store;
 	}
 	osds->client = client;
 
 	return osds;
 
+destroy_store:
+	ceph_objstore_destroy(osds->store);
+deinit_shards:
+	deinit_shards(osds);
 err:
 	kfree(osds);
 	return ERR_PTR(ret);
 }
 
+/*
+ * Admin socket commands.  Connections, requests and objects are owned
+ * by reactors, so each reactor dumps its own with reactor_call().
+ */
+
+struct osds_admin_ctx {
+	struct ceph_osd_server *osds;
+	struct ceph_admin_out  *out;
+	bool                   first;
+};
+
+static int osds_admin_for_each_reactor(struct ceph_osd_server *osds,
+				       struct ceph_admin_out *out,
+				       int (*fn)(void *))
+{
+	struct osds_admin_ctx ctx = {
+		.osds  = osds,
+		.out   = out,
+		.first = true,
+	};
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < osds->s_nr_shards; i++) {
+		ret = reactor_call(i, fn, &ctx);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	return 0;
+}
+
+static int osds_dump_ops_in_flight_fn(void *arg)
+{
+	struct osds_admin_ctx *ctx = arg;
+	struct ceph_osds_shard *shard = this_shard(ctx->osds);
+	struct ceph_osds_request *r;
+	struct ceph_msg_osd_op *req;
+	u64 now = fast_nsecs();
+	unsigned int i;
+
+	list_for_each_entry(r, &shard->s_requests, r_inflight) {
+		req = &r->r_req;
+		ceph_admin_printf(ctx->out, "%s{\"reactor\":%u,\"tid\":%llu,"
+				  "\"client\":\"%s%lld\",\"pool\":%lld,"
+				  "\"object\":", ctx->first ? "" : ",",
+				  reactor_id, req->tid,
+				  ENTITY_NAME(r->r_msg->hdr.src),
+				  req->hoid.pool);
+		ceph_admin_json_str(ctx->out, req->hoid.oid.name,
+				    req->hoid.oid.name_len);
+		ceph_admin_printf(ctx->out, ",\"age_us\":%llu,\"ops\":[",
+				  (now - r->r_stamp) / NSEC_PER_USEC);
+		for (i = 0; i < req->num_ops; i++)
+			ceph_admin_printf(ctx->out, "%s\"%s\"", i ? "," : "",
+					  ceph_osd_op_name(req->ops[i].op));
+		ceph_admin_printf(ctx->out, "]}");
+		ctx->first = false;
+	}
+
+	return 0;
+}
+
+static int osds_dump_ops_in_flight(struct ceph_admin_out *out, void *priv)
+{
+	int ret;
+
+	ceph_admin_printf(out, "{\"ops\":[");
+	ret = osds_admin_for_each_reactor(priv, out,
+					  osds_dump_ops_in_flight_fn);
+	ceph_admin_printf(out, "]}");
+
+	return ret;
+}
+
+static void osds_print_store_stats(struct ceph_admin_out *out,
+				   const struct ceph_objstore_stats *st)
+{
+	ceph_admin_printf(out, "{\"collections\":%llu,\"objects\":%llu,"
+			  "\"bytes\":%llu,\"blocks\":%llu,"
+			  "\"block_bytes\":%llu,\"omap_entries\":%llu,"
+			  "\"omap_bytes\":%llu,\"xattrs\":%llu,"
+			  "\"xattr_bytes\":%llu}",
+			  st->colls, st->objects, st->bytes, st->blocks,
+			  st->block_bytes, st->omap_entries, st->omap_bytes,
+			  st->xattrs, st->xattr_bytes);
+}
+
+struct osds_store_stats_ctx {
+	struct ceph_osd_server     *osds;
+	struct ceph_objstore_stats st;
+};
+
+static int osds_store_stats_fn(void *arg)
+{
+	struct osds_store_stats_ctx *ctx = arg;
+
+	memset(&ctx->st, 0, sizeof(ctx->st));
+	ceph_objstore_shard_stats(ctx->osds->store, reactor_id, &ctx->st);
+
+	return 0;
+}
+
+static int osds_store_stats(struct ceph_admin_out *out, void *priv)
+{
+	struct osds_store_stats_ctx ctx = { .osds = priv };
+	struct ceph_objstore_stats total;
+	struct ceph_osd_server *osds = priv;
+	unsigned int i;
+	int ret;
+
+	memset(&total, 0, sizeof(total));
+	ceph_admin_printf(out, "{\"shards\":[");
+	for (i = 0; i < osds->s_nr_shards; i++) {
+		ret = reactor_call(i, osds_store_stats_fn, &ctx);
+		if (unlikely(ret))
+			return ret;
+		if (i)
+			ceph_admin_printf(out, ",");
+		osds_print_store_stats(out, &ctx.st);
+		total.colls        += ctx.st.colls;
+		total.objects      += ctx.st.objects;
+		total.bytes        += ctx.st.bytes;
+		total.blocks       += ctx.st.blocks;
+		total.block_bytes  += ctx.st.block_bytes;
+		total.omap_entries += ctx.st.omap_entries;
+		total.omap_bytes   += ctx.st.omap_bytes;
+		total.xattrs       += ctx.st.xattrs;
+		total.xattr_bytes  += ctx.st.xattr_bytes;
+	}
+	ceph_admin_printf(out, "],\"total\":");
+	osds_print_store_stats(out, &total);
+	ceph_admin_printf(out, "}");
+
+	return 0;
+}
+
+static int osds_dump_connections_fn(void *arg)
+{
+	struct osds_admin_ctx *ctx = arg;
+	struct ceph_osds_shard *shard = this_shard(ctx->osds);
+	struct ceph_osds_con *osds_con;
+	struct ceph_connection *con;
+	struct ceph_con_stats st;
+
+	list_for_each_entry(osds_con, &shard->s_cons, c_node) {
+		con = &osds_con->con;
+		ceph_con_get_stats(con, &st);
+		ceph_admin_printf(ctx->out, "%s{\"reactor\":%u,"
+				  "\"peer\":\"%s%lld\",\"addr\":\"%s\","
+				  "\"state\":\"%s\",\"out_queue\":%u,"
+				  "\"out_sent\":%u,\"cork_bytes\":%u,"
+				  "\"in_seq\":%llu,\"out_seq\":%llu,"
+				  "\"in_bytes\":%llu,\"out_bytes\":%llu}",
+				  ctx->first ? "" : ",", reactor_id,
+				  ENTITY_NAME(con->peer_name),
+				  ceph_pr_addr(&con->peer_addr), st.state,
+				  st.out_queue, st.out_sent, st.cork_bytes,
+				  st.in_seq, st.out_seq, st.in_bytes,
+				  st.out_bytes);
+		ctx->first = false;
+	}
+
+	return 0;
+}
+
+static int osds_dump_connections(struct ceph_admin_out *out, void *priv)
+{
+	int ret;
+
+	ceph_admin_printf(out, "{\"connections\":[");
+	ret = osds_admin_for_each_reactor(priv, out,
+					  osds_dump_connections_fn);
+	ceph_admin_printf(out, "]}");
+
+	return ret;
+}
+
+static const struct ceph_admin_command osds_admin_cmds[] = {
+	{ "dump_ops_in_flight", "requests received and not yet replied",
+	  osds_dump_ops_in_flight },
+	{ "store stats", "objects, blocks and omap of the object store",
+	  osds_store_stats },
+	{ "connections", "accepted connections with queue depths and traffic",
+	  osds_dump_connections },
+};
+
 static void ceph_stop_osd_server(struct ceph_osd_server *osds)
 {
 	unsigned long _300ms = msecs_to_jiffies(300);
@@ -2215,61 +2938,17 @@ static void ceph_stop_osd_server(struct ceph_osd_server *osds)
 		pr_notice(">>>> Tear down osd.%d\n", osds->osd);
 }
 
-static void destroy_blocks(struct ceph_osds_object *obj)
-{
-	struct ceph_osds_block *blk;
-
-	while ((blk = rb_entry_safe(rb_first(&obj->o_blocks),
-				    typeof(*blk), b_node))) {
-		erase_object_block_by_off(&obj->o_blocks, blk);
-		__free_pages(blk->b_page, OSDS_BLOCK_SHIFT - PAGE_SHIFT);
-		kfree(blk);
-	}
-}
-
-static void __destroy_omap(struct rb_root *root)
-{
-	struct ceph_osds_omap_entry *ome;
-
-	while ((ome = rb_entry_safe(rb_first(root),
-				    typeof(*ome), e_node))) {
-		erase_omap_entry(root, ome);
-		ceph_pagelist_release(ome->e_val_pl);
-		kfree(ome->e_key);
-		kfree(ome);
-	}
-}
-
-static void destroy_omap(struct ceph_osds_object *obj)
-{
-	__destroy_omap(&obj->o_omap);
-}
-
-static void destroy_xattrs(struct ceph_osds_object *obj)
-{
-	__destroy_omap(&obj->o_xattrs);
-}
-
-static void destroy_objects(struct ceph_osd_server *osds)
-{
-	struct ceph_osds_object *obj;
-
-	while ((obj = rb_entry_safe(rb_first(&osds->s_objects),
-				    typeof(*obj), o_node))) {
-		destroy_blocks(obj);
-		destroy_omap(obj);
-		destroy_xattrs(obj);
-		erase_object_by_hoid(&osds->s_objects, obj);
-		kfree(obj);
-	}
-}
-
 void ceph_destroy_osd_server(struct ceph_osd_server *osds)
 {
+	if (osds->asok)
+		ceph_admin_socket_stop(osds->asok);
 	ceph_stop_osd_server(osds);
+	if (osds->shm)
+		ceph_osds_shm_stop(osds->shm);
+	stop_op_tasks(osds);
 	ceph_destroy_client(osds->client);
-	destroy_objects(osds);
-	ceph_cls_deinit(&osds->class_loader);
+	ceph_objstore_destroy(osds->store);
+	deinit_shards(osds);
 	kfree(osds);
 }
 
@@ -2289,12 +2968,42 @@ int ceph_start_osd_server(struct ceph_osd_server *osds)
 
 	pr_notice(">>>> Ceph session opened\n");
 
+	ret = start_op_tasks(osds);
+	if (unlikely(ret))
+		goto err;
+
 	ret = ceph_messenger_start_listen(&client->msgr, &osds_con_ops);
 	if (unlikely(ret))
 		goto err;
 
 	pr_notice(">>>> Start listening\n");
 
+	if (client->options->shm_path) {
+		osds->shm = ceph_osds_shm_start(&client->msgr,
+						client->options->shm_path,
+						&osds_con_ops);
+		if (IS_ERR(osds->shm)) {
+			ret = PTR_ERR(osds->shm);
+			osds->shm = NULL;
+			goto err;
+		}
+		pr_notice(">>>> Serve co-located clients on %s\n",
+			  client->options->shm_path);
+	}
+
+	if (client->options->admin_socket) {
+		osds->asok = ceph_admin_socket_start(
+				client->options->admin_socket, osds_admin_cmds,
+				ARRAY_SIZE(osds_admin_cmds), osds);
+		if (IS_ERR(osds->asok)) {
+			ret = PTR_ERR(osds->asok);
+			osds->asok = NULL;
+			goto err;
+		}
+		pr_notice(">>>> Admin socket on %s\n",
+			  client->options->admin_socket);
+	}
+
 	ret = ceph_monc_osd_to_crush_add(&client->monc, osds->osd, "0.0010");
 	if (unlikely(ret))
 		goto err;
@@ -2333,17 +3042,27 @@ int ceph_start_osd_server(struct ceph_osd_server *osds)
 	return 0;
 
 err:
+	if (osds->asok) {
+		ceph_admin_socket_stop(osds->asok);
+		osds->asok = NULL;
+	}
+	if (osds->shm) {
+		ceph_osds_shm_stop(osds->shm);
+		osds->shm = NULL;
+	}
 	ceph_messenger_stop_listen(&client->msgr);
 
 	return ret;
 }
 
 static const struct ceph_connection_operations osds_con_ops = {
-	.alloc_con     = osds_alloc_con,
-	.accept_con    = osds_accept_con,
-	.get           = osds_con_get,
-	.put           = osds_con_put,
-	.dispatch      = osds_dispatch,
-	.fault         = osds_fault,
-	.alloc_msg     = osds_alloc_msg,
+	.nosleep        = true,
+	.alloc_con      = osds_alloc_con,
+	.accept_con     = osds_accept_con,
+	.get            = osds_con_get,
+	.put            = osds_con_put,
+	.dispatch       = osds_dispatch,
+	.fault          = osds_fault,
+	.alloc_msg      = osds_alloc_msg,
+	.alloc_msg_data = osds_alloc_msg_data,
 };
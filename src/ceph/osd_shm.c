@@ -0,0 +1,733 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ceph/ceph_debug.h"
+
+#include "err.h"
+#include "slab.h"
+#include "event.h"
+#include "kref.h"
+#include "printk.h"
+
+#include "ceph/libceph.h"
+#include "ceph/messenger.h"
+#include "ceph/osd_shm.h"
+
+/*
+ * Server side of the shared-memory transport, see osd_shm.h for the
+ * protocol.  Sessions are served by the event loop of the reactor which
+ * has started the server: requests are drained from the ring on the
+ * doorbell and are fed to ->dispatch() of the OSD server as if they
+ * were received by the messenger, replies come back to the same
+ * reactor, see ceph_osds_shm_send().
+ */
+
+struct ceph_osds_shm {
+	struct ceph_messenger  *msgr;
+	const struct ceph_connection_operations
+			       *ops;      /* of the OSD server */
+	char                   *path;
+	int                    fd;
+	struct event_item      ev;
+	struct list_head       sessions;
+	struct list_head       closed;    /* sessions to put */
+	struct event_item      reap_ev;
+};
+
+struct ceph_osds_shm_con {
+	struct ceph_connection con;
+	struct kref            ref;
+	struct ceph_osds_shm   *shm;
+	struct list_head       node;      /* entry in ->sessions or ->closed */
+	bool                   ready;     /* hello is done */
+	bool                   closed;
+
+	int                    ctl_fd;
+	int                    req_efd;
+	int                    rep_efd;
+	int                    memfd;
+	struct event_item      ctl_ev;
+	struct event_item      req_ev;
+
+	void                   *area;
+	size_t                 size;
+	struct ceph_osd_shm_header
+			       *hdr;
+	void                   *req_ring;
+	void                   *rep_ring;
+	void                   *client_data;
+	void                   *reply_data;
+
+	/*
+	 * Reply data is allocated in order, as a ring: everything up to
+	 * the end of the data of the last released reply slot is free.
+	 */
+	u64                    data_head;
+	u64                    data_tail;
+	u64                    data_end[CEPH_OSD_SHM_RING_SIZE];
+	u32                    rep_seen;  /* reply ring head seen last */
+	struct list_head       backlog;   /* replies waiting for room */
+};
+
+enum {
+	SHM_REQ_FRONT_MAX = CEPH_OSD_SHM_SLOT_SIZE -
+			    sizeof(struct ceph_osd_shm_req),
+	SHM_REP_FRONT_MAX = CEPH_OSD_SHM_SLOT_SIZE -
+			    sizeof(struct ceph_osd_shm_reply),
+	SHM_RING_BYTES    = CEPH_OSD_SHM_SLOT_SIZE * CEPH_OSD_SHM_RING_SIZE,
+};
+
+static const struct ceph_connection_operations shm_con_ops;
+
+static inline struct ceph_osds_shm_con *to_shm_con(struct ceph_connection *con)
+{
+	return container_of(con, struct ceph_osds_shm_con, con);
+}
+
+static struct ceph_connection *shm_con_get(struct ceph_connection *con)
+{
+	kref_get(&to_shm_con(con)->ref);
+
+	return con;
+}
+
+static void shm_free_con(struct kref *ref)
+{
+	struct ceph_osds_shm_con *s;
+
+	s = container_of(ref, typeof(*s), ref);
+	kfree(s);
+}
+
+static void shm_con_put(struct ceph_connection *con)
+{
+	kref_put(&to_shm_con(con)->ref, shm_free_con);
+}
+
+bool ceph_con_is_shm(struct ceph_connection *con)
+{
+	return con->ops == &shm_con_ops;
+}
+
+static void shm_ring_doorbell(struct ceph_osd_shm_ring *ring, int efd)
+{
+	u64 one = 1;
+
+	if (!atomic_xchg(&ring->notified, 1) &&
+	    write(efd, &one, sizeof(one)) < 0)
+		pr_err("shm: write() failed, errno=%d\n", errno);
+}
+
+/*
+ * Session can't be freed from the action of its own event item, so
+ * closed sessions are put by the deferred reaper.
+ */
+static void shm_reap_sessions(struct event_item *ev)
+{
+	struct ceph_osds_shm *shm = container_of(ev, typeof(*shm), reap_ev);
+	struct ceph_osds_shm_con *s;
+
+	while (!list_empty(&shm->closed)) {
+		s = list_first_entry(&shm->closed, typeof(*s), node);
+		list_del_init(&s->node);
+		shm_con_put(&s->con);
+	}
+}
+
+static void shm_close_session(struct ceph_osds_shm_con *s)
+{
+	struct ceph_msg *msg;
+
+	if (s->closed)
+		return;
+	s->closed = true;
+
+	dout("%s: session %p\n", __func__, s);
+
+	while (!list_empty(&s->backlog)) {
+		msg = list_first_entry(&s->backlog, typeof(*msg), list_head);
+		list_del_init(&msg->list_head);
+		ceph_msg_put(msg);
+	}
+	event_item_del(&s->ctl_ev);
+	event_item_del(&s->req_ev);
+	if (s->area)
+		munmap(s->area, s->size);
+	if (s->memfd >= 0)
+		close(s->memfd);
+	if (s->req_efd >= 0)
+		close(s->req_efd);
+	if (s->rep_efd >= 0)
+		close(s->rep_efd);
+	close(s->ctl_fd);
+
+	/* Requests in flight keep their refs */
+	list_move_tail(&s->node, &s->shm->closed);
+	event_item_defer(&s->shm->reap_ev);
+}
+
+/**
+ * shm_release_data() - frees reply data of the reply slots which the
+ *                      client has released.
+ */
+static void shm_release_data(struct ceph_osds_shm_con *s, u32 head)
+{
+	if (head == s->rep_seen)
+		return;
+
+	s->data_head = s->data_end[(head - 1) & (CEPH_OSD_SHM_RING_SIZE - 1)];
+	s->rep_seen = head;
+}
+
+/*
+ * Copies @len bytes of message data from @cursor on to @buf, or from
+ * @buf if @to_msg.
+ */
+static void shm_copy_data(struct ceph_msg_data_cursor *cursor, void *buf,
+			  size_t len, bool to_msg)
+{
+	struct iov_iter it;
+	size_t copied;
+
+	while (len && cursor->total_resid) {
+		if (!cursor->resid) {
+			ceph_msg_data_cursor_advance(cursor, 0);
+			continue;
+		}
+		ceph_msg_data_cursor_next(cursor);
+		it = cursor->iter;
+		if (to_msg)
+			copied = _copy_to_iter(buf, min(len, it.count), &it);
+		else
+			copied = _copy_from_iter(buf, min(len, it.count), &it);
+		ceph_msg_data_cursor_advance(cursor, copied);
+		buf += copied;
+		len -= copied;
+	}
+}
+
+/**
+ * shm_put_reply() - puts a reply to the ring, returns false if there is
+ *                   no room for the slot or for the data.
+ */
+static bool shm_put_reply(struct ceph_osds_shm_con *s, struct ceph_msg *msg)
+{
+	struct ceph_osd_shm_ring *ring = &s->hdr->rep;
+	struct ceph_msg_data_cursor cursor;
+	struct ceph_osd_shm_reply *slot;
+	u32 tail = ring->tail, head;
+	size_t front_len, data_len, off, skip;
+	int result = 0;
+
+	head = smp_load_acquire(&ring->head);
+	if (tail - head == CEPH_OSD_SHM_RING_SIZE)
+		return false;
+	shm_release_data(s, head);
+
+	front_len = msg->front.iov_len;
+	data_len = msg->data_length;
+	if (front_len > SHM_REP_FRONT_MAX ||
+	    data_len > CEPH_OSD_SHM_REPLY_DATA) {
+		result = -E2BIG;
+		front_len = data_len = 0;
+	}
+
+	off = 0;
+	if (data_len) {
+		/* Data is contiguous, so the end of the area can be skipped */
+		off = s->data_tail % CEPH_OSD_SHM_REPLY_DATA;
+		skip = 0;
+		if (off + data_len > CEPH_OSD_SHM_REPLY_DATA)
+			skip = CEPH_OSD_SHM_REPLY_DATA - off;
+		if (s->data_tail + skip + data_len - s->data_head >
+		    CEPH_OSD_SHM_REPLY_DATA)
+			return false;
+		s->data_tail += skip;
+		off = s->data_tail % CEPH_OSD_SHM_REPLY_DATA;
+
+		ceph_msg_data_cursor_init(&cursor, msg->data, WRITE,
+					  data_len);
+		shm_copy_data(&cursor, s->reply_data + off, data_len, false);
+		s->data_tail += data_len;
+	}
+	s->data_end[tail & (CEPH_OSD_SHM_RING_SIZE - 1)] = s->data_tail;
+
+	slot = s->rep_ring + (tail & (CEPH_OSD_SHM_RING_SIZE - 1)) *
+		CEPH_OSD_SHM_SLOT_SIZE;
+	*slot = (struct ceph_osd_shm_reply) {
+		.tid       = le64_to_cpu(msg->hdr.tid),
+		.version   = le16_to_cpu(msg->hdr.version),
+		.result    = result,
+		.front_len = front_len,
+		.data_off  = off,
+		.data_len  = data_len,
+	};
+	memcpy(slot->front, msg->front.iov_base, front_len);
+	smp_store_release(&ring->tail, tail + 1);
+
+	shm_ring_doorbell(ring, s->rep_efd);
+	ceph_msg_put(msg);
+
+	return true;
+}
+
+static void shm_flush_backlog(struct ceph_osds_shm_con *s)
+{
+	struct ceph_msg *msg;
+
+	while (!list_empty(&s->backlog)) {
+		msg = list_first_entry(&s->backlog, typeof(*msg), list_head);
+		list_del_init(&msg->list_head);
+		if (!shm_put_reply(s, msg)) {
+			list_add(&msg->list_head, &s->backlog);
+			return;
+		}
+	}
+	atomic_set(&s->hdr->srv_waiting, 0);
+}
+
+/**
+ * ceph_osds_shm_send() - sends a reply to the client of the session,
+ *                        called on the reactor of the session.  Takes
+ *                        ownership of @msg.
+ */
+void ceph_osds_shm_send(struct ceph_connection *con, struct ceph_msg *msg)
+{
+	struct ceph_osds_shm_con *s = to_shm_con(con);
+
+	if (unlikely(s->closed)) {
+		ceph_msg_put(msg);
+		return;
+	}
+	if (list_empty(&s->backlog) && shm_put_reply(s, msg))
+		return;
+
+	list_add_tail(&msg->list_head, &s->backlog);
+	/* Client may have released slots meanwhile, so retry after */
+	atomic_xchg(&s->hdr->srv_waiting, 1);
+	shm_flush_backlog(s);
+}
+
+/**
+ * shm_submit() - makes a message of a request slot and dispatches it.
+ */
+static int shm_submit(struct ceph_osds_shm_con *s,
+		      struct ceph_osd_shm_req *slot)
+{
+	struct ceph_connection *con = &s->con;
+	struct ceph_msg_data_cursor cursor;
+	struct ceph_msg *msg;
+	u32 front_len = READ_ONCE(slot->front_len);
+	u32 data_off = READ_ONCE(slot->data_off);
+	u32 data_len = READ_ONCE(slot->data_len);
+	int ret;
+
+	if (front_len > SHM_REQ_FRONT_MAX ||
+	    data_len > CEPH_OSD_SHM_CLIENT_DATA ||
+	    data_off > CEPH_OSD_SHM_CLIENT_DATA - data_len)
+		return -EINVAL;
+
+	msg = ceph_msg_new2(CEPH_MSG_OSD_OP, front_len, 1, GFP_KERNEL, false);
+	if (unlikely(!msg))
+		return -ENOMEM;
+
+	memcpy(msg->front.iov_base, slot->front, front_len);
+	msg->hdr.front_len = cpu_to_le32(front_len);
+	msg->hdr.tid = cpu_to_le64(slot->tid);
+	msg->hdr.version = cpu_to_le16(slot->version);
+	msg->hdr.data_len = cpu_to_le32(data_len);
+	msg->hdr.src = con->peer_name;
+	msg->con = con->ops->get(con);
+
+	if (data_len) {
+		ret = s->shm->ops->alloc_msg_data(con, msg);
+		if (unlikely(ret)) {
+			ceph_msg_put(msg);
+			return ret;
+		}
+		ceph_msg_data_cursor_init(&cursor, msg->data, READ, data_len);
+		shm_copy_data(&cursor, s->client_data + data_off, data_len,
+			      true);
+	}
+
+	/* Takes ownership of the message */
+	s->shm->ops->dispatch(con, msg);
+
+	return 0;
+}
+
+static void shm_drain_requests(struct ceph_osds_shm_con *s)
+{
+	struct ceph_osd_shm_ring *ring = &s->hdr->req;
+	u32 head = ring->head, tail;
+	int ret;
+
+	tail = smp_load_acquire(&ring->tail);
+	while (head != tail && !s->closed) {
+		ret = shm_submit(s, s->req_ring +
+				 (head & (CEPH_OSD_SHM_RING_SIZE - 1)) *
+				 CEPH_OSD_SHM_SLOT_SIZE);
+		if (unlikely(ret)) {
+			pr_err("shm: session %p, bad request, ret=%d\n",
+			       s, ret);
+			shm_close_session(s);
+			return;
+		}
+		/* Data is copied out, give the slot back */
+		smp_store_release(&ring->head, ++head);
+	}
+}
+
+static void shm_req_doorbell(struct event_item *ev)
+{
+	struct ceph_osds_shm_con *s = container_of(ev, typeof(*s), req_ev);
+	u64 cnt;
+
+	if (read(s->req_efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		pr_err("shm: read() failed, errno=%d\n", errno);
+
+	/* Client which posts after that rings the doorbell again */
+	atomic_xchg(&s->hdr->req.notified, 0);
+
+	shm_flush_backlog(s);
+	shm_drain_requests(s);
+}
+
+static int shm_setup_area(struct ceph_osds_shm_con *s)
+{
+	size_t hdr_size = PAGE_ALIGN(sizeof(*s->hdr));
+	int ret;
+
+	s->size = hdr_size + 2 * SHM_RING_BYTES +
+		CEPH_OSD_SHM_CLIENT_DATA + CEPH_OSD_SHM_REPLY_DATA;
+
+	s->memfd = memfd_create("pech-osd-shm", MFD_CLOEXEC);
+	if (s->memfd < 0)
+		return -errno;
+	if (ftruncate(s->memfd, s->size))
+		return -errno;
+
+	s->area = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       s->memfd, 0);
+	if (s->area == MAP_FAILED) {
+		s->area = NULL;
+		return -errno;
+	}
+	s->hdr = s->area;
+	s->req_ring = s->area + hdr_size;
+	s->rep_ring = s->req_ring + SHM_RING_BYTES;
+	s->client_data = s->rep_ring + SHM_RING_BYTES;
+	s->reply_data = s->client_data + CEPH_OSD_SHM_CLIENT_DATA;
+
+	s->req_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->req_efd < 0)
+		return -errno;
+	s->rep_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->rep_efd < 0)
+		return -errno;
+
+	INIT_EVENT(&s->req_ev, shm_req_doorbell);
+	s->req_ev.events = EPOLLIN;
+	ret = event_item_add(&s->req_ev, s->req_efd);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+static int shm_send_hello(struct ceph_osds_shm_con *s,
+			  struct ceph_osd_shm_hello *hello)
+{
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = {
+		.iov_base = hello,
+		.iov_len  = sizeof(*hello),
+	};
+	struct msghdr msg = {
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+	};
+	struct cmsghdr *cm;
+	ssize_t ret;
+	int *fds;
+
+	if (!hello->result) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(3 * sizeof(int));
+		fds = (int *)CMSG_DATA(cm);
+		fds[0] = s->memfd;
+		fds[1] = s->req_efd;
+		fds[2] = s->rep_efd;
+	}
+	ret = sendmsg(s->ctl_fd, &msg, MSG_NOSIGNAL);
+	if (ret < 0)
+		return -errno;
+	if (ret != sizeof(*hello))
+		return -EIO;
+
+	return 0;
+}
+
+static int shm_handle_hello(struct ceph_osds_shm_con *s)
+{
+	struct ceph_osd_shm_hello hello;
+	ssize_t len;
+	int ret;
+
+	len = recv(s->ctl_fd, &hello, sizeof(hello), 0);
+	if (len < 0)
+		return errno == EAGAIN ? 0 : -errno;
+	if (len != sizeof(hello) || hello.magic != CEPH_OSD_SHM_MAGIC)
+		return -EINVAL;
+
+	s->con.peer_features = hello.features;
+	s->con.peer_name.type = hello.entity_type;
+	s->con.peer_name.num = cpu_to_le64(hello.entity_num);
+
+	ret = -EOPNOTSUPP;
+	if (hello.version == CEPH_OSD_SHM_VERSION)
+		ret = shm_setup_area(s);
+
+	memset(&hello, 0, sizeof(hello));
+	hello = (struct ceph_osd_shm_hello) {
+		.magic            = CEPH_OSD_SHM_MAGIC,
+		.version          = CEPH_OSD_SHM_VERSION,
+		.result           = ret,
+		.size             = s->size,
+		.req_ring_off     = s->req_ring - s->area,
+		.rep_ring_off     = s->rep_ring - s->area,
+		.client_data_off  = s->client_data - s->area,
+		.reply_data_off   = s->reply_data - s->area,
+		.slot_size        = CEPH_OSD_SHM_SLOT_SIZE,
+		.ring_size        = CEPH_OSD_SHM_RING_SIZE,
+		.client_data_size = CEPH_OSD_SHM_CLIENT_DATA,
+		.reply_data_size  = CEPH_OSD_SHM_REPLY_DATA,
+	};
+	if (ret)
+		memset(&hello.size, 0, sizeof(hello) -
+		       offsetof(typeof(hello), size));
+
+	ret = shm_send_hello(s, &hello) ?: hello.result;
+	if (ret)
+		return ret;
+
+	s->ready = true;
+	pr_info("shm: session %p with %s%lld\n", s,
+		ENTITY_NAME(s->con.peer_name));
+
+	return 0;
+}
+
+static void shm_ctl_event(struct event_item *ev)
+{
+	struct ceph_osds_shm_con *s = container_of(ev, typeof(*s), ctl_ev);
+	char buf[64];
+	ssize_t len;
+	int ret;
+
+	if (ev->revents & (EPOLLERR | EPOLLHUP)) {
+		shm_close_session(s);
+		return;
+	}
+	if (!s->ready) {
+		ret = shm_handle_hello(s);
+		if (ret) {
+			pr_err("shm: session %p, handshake failed, ret=%d\n",
+			       s, ret);
+			shm_close_session(s);
+		}
+		return;
+	}
+	/* Nothing is expected after the hello, but EOF */
+	len = recv(s->ctl_fd, buf, sizeof(buf), 0);
+	if (!len || (len < 0 && errno != EAGAIN))
+		shm_close_session(s);
+}
+
+/*
+ * Clients are trusted, see osd_shm.h, so only the user of the OSD and
+ * root are let in.
+ */
+static bool shm_peer_allowed(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		pr_err("shm: SO_PEERCRED failed, errno=%d\n", errno);
+		return false;
+	}
+	if (cred.uid && cred.uid != geteuid()) {
+		pr_warn("shm: rejected pid %d of uid %u\n", cred.pid, cred.uid);
+		return false;
+	}
+
+	return true;
+}
+
+static void shm_accept(struct event_item *ev)
+{
+	struct ceph_osds_shm *shm = container_of(ev, typeof(*shm), ev);
+	struct ceph_osds_shm_con *s;
+	int fd, ret;
+
+	while ((fd = accept4(shm->fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (!shm_peer_allowed(fd)) {
+			close(fd);
+			continue;
+		}
+		s = kzalloc(sizeof(*s), GFP_KERNEL);
+		if (unlikely(!s)) {
+			close(fd);
+			continue;
+		}
+		kref_init(&s->ref);
+		s->shm = shm;
+		s->con.msgr = shm->msgr;
+		s->con.ops = &shm_con_ops;
+		s->ctl_fd = fd;
+		s->memfd = s->req_efd = s->rep_efd = -1;
+		INIT_LIST_HEAD(&s->backlog);
+		INIT_EVENT(&s->req_ev, shm_req_doorbell);
+		INIT_EVENT(&s->ctl_ev, shm_ctl_event);
+		s->ctl_ev.events = EPOLLIN;
+		list_add_tail(&s->node, &shm->sessions);
+
+		ret = event_item_add(&s->ctl_ev, fd);
+		if (unlikely(ret)) {
+			pr_err("shm: event_item_add() failed, ret=%d\n", ret);
+			shm_close_session(s);
+		}
+	}
+	if (errno != EAGAIN)
+		pr_err("shm: accept4() failed, errno=%d\n", errno);
+}
+
+/*
+ * Removes a socket left by the previous run, but nothing else which
+ * happens to be at @path.
+ */
+static int shm_unlink_stale(const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st))
+		return errno == ENOENT ? 0 : -errno;
+	if (!S_ISSOCK(st.st_mode))
+		return -EEXIST;
+	if (unlink(path))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * ceph_osds_shm_start() - starts serving co-located clients on the unix
+ *                         socket @path, requests are passed to @ops of
+ *                         the OSD server.
+ */
+struct ceph_osds_shm *
+ceph_osds_shm_start(struct ceph_messenger *msgr, const char *path,
+		    const struct ceph_connection_operations *ops)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct ceph_osds_shm *shm;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return ERR_PTR(-ENAMETOOLONG);
+	strcpy(addr.sun_path, path);
+
+	shm = kzalloc(sizeof(*shm), GFP_KERNEL);
+	if (unlikely(!shm))
+		return ERR_PTR(-ENOMEM);
+
+	shm->msgr = msgr;
+	shm->ops = ops;
+	INIT_LIST_HEAD(&shm->sessions);
+	INIT_LIST_HEAD(&shm->closed);
+	INIT_EVENT(&shm->reap_ev, shm_reap_sessions);
+	INIT_EVENT(&shm->ev, shm_accept);
+	shm->path = kstrdup(path, GFP_KERNEL);
+	if (unlikely(!shm->path)) {
+		ret = -ENOMEM;
+		goto free_shm;
+	}
+
+	shm->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+			 SOCK_CLOEXEC, 0);
+	if (shm->fd < 0) {
+		ret = -errno;
+		goto free_path;
+	}
+	ret = shm_unlink_stale(path);
+	if (ret) {
+		pr_err("shm: can't use %s, ret=%d\n", path, ret);
+		goto close_fd;
+	}
+	if (bind(shm->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		ret = -errno;
+		goto close_fd;
+	}
+	/* Nobody can connect before listen(), so no race with chmod() */
+	if (chmod(path, 0600) || listen(shm->fd, 16)) {
+		ret = -errno;
+		goto unlink;
+	}
+	shm->ev.events = EPOLLIN;
+	ret = event_item_add(&shm->ev, shm->fd);
+	if (ret)
+		goto unlink;
+
+	return shm;
+
+unlink:
+	unlink(path);
+close_fd:
+	close(shm->fd);
+free_path:
+	kfree(shm->path);
+free_shm:
+	kfree(shm);
+
+	return ERR_PTR(ret);
+}
+
+/**
+ * ceph_osds_shm_stop() - closes all sessions and the socket, called on
+ *                        the reactor which has started the server.
+ */
+void ceph_osds_shm_stop(struct ceph_osds_shm *shm)
+{
+	struct ceph_osds_shm_con *s;
+
+	event_item_del(&shm->ev);
+	close(shm->fd);
+	unlink(shm->path);
+
+	while (!list_empty(&shm->sessions)) {
+		s = list_first_entry(&shm->sessions, typeof(*s), node);
+		shm_close_session(s);
+	}
+	event_item_del(&shm->reap_ev);
+	shm_reap_sessions(&shm->reap_ev);
+
+	kfree(shm->path);
+	kfree(shm);
+}
+
+static const struct ceph_connection_operations shm_con_ops = {
+	.get = shm_con_get,
+	.put = shm_con_put,
+};
@@ -2,10 +2,12 @@
 #include "slab.h"
 #include "gfp.h"
 //#include <linux/string.h>
-#include "spinlock.h"
 #include "ceph/string_table.h"
 
-static DEFINE_SPINLOCK(string_tree_lock);
+#include <pthread.h>
+
+/* Strings are created by decoding of messages on any reactor */
+static pthread_mutex_t string_tree_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct rb_root string_tree = RB_ROOT;
 
 struct ceph_string *ceph_find_or_create_string(const char* str, size_t len)
@@ -15,7 +17,7 @@ struct ceph_string *ceph_find_or_create_string(const char* str, size_t len)
 	int ret;
 
 	exist = NULL;
-	spin_lock(&string_tree_lock);
+	pthread_mutex_lock(&string_tree_lock);
 	p = &string_tree.rb_node;
 	while (*p) {
 		exist = rb_entry(*p, struct ceph_string, node);
@@ -33,7 +35,7 @@ struct ceph_string *ceph_find_or_create_string(const char* str, size_t len)
 		RB_CLEAR_NODE(&exist->node);
 		exist = NULL;
 	}
-	spin_unlock(&string_tree_lock);
+	pthread_mutex_unlock(&string_tree_lock);
 	if (exist)
 		return exist;
 
@@ -50,7 +52,7 @@ retry:
 	exist = NULL;
 	parent = NULL;
 	p = &string_tree.rb_node;
-	spin_lock(&string_tree_lock);
+	pthread_mutex_lock(&string_tree_lock);
 	while (*p) {
 		parent = *p;
 		exist = rb_entry(*p, struct ceph_string, node);
@@ -72,7 +74,7 @@ retry:
 		RB_CLEAR_NODE(&exist->node);
 		ret = -EAGAIN;
 	}
-	spin_unlock(&string_tree_lock);
+	pthread_mutex_unlock(&string_tree_lock);
 	if (ret == -EAGAIN)
 		goto retry;
 
@@ -89,12 +91,12 @@ void ceph_release_string(struct kref *ref)
 {
 	struct ceph_string *cs = container_of(ref, struct ceph_string, kref);
 
-	spin_lock(&string_tree_lock);
+	pthread_mutex_lock(&string_tree_lock);
 	if (!RB_EMPTY_NODE(&cs->node)) {
 		rb_erase(&cs->node, &string_tree);
 		RB_CLEAR_NODE(&cs->node);
 	}
-	spin_unlock(&string_tree_lock);
+	pthread_mutex_unlock(&string_tree_lock);
 
 	kfree_rcu(cs, rcu);
 }
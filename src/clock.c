@@ -0,0 +1,71 @@
+#include <errno.h>
+#ifdef __x86_64__
+#include <cpuid.h>
+#endif
+
+#include "clock.h"
+#include "printk.h"
+
+__thread unsigned long long loop_nsecs_stamp;
+
+struct clock_tsc clock_tsc;
+
+#ifdef __x86_64__
+
+enum {
+	TSC_CALIBRATE_MSECS = 20,
+};
+
+static bool tsc_is_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	/* Constant rate in all P-, C- and T-states */
+	return edx & (1U << 8);
+}
+
+/**
+ * clock_enable_tsc() - calibrates TSC against CLOCK_MONOTONIC, so
+ *                      fast_nsecs() reads TSC.  Called once on start,
+ *                      before reactors are started.
+ */
+int clock_enable_tsc(void)
+{
+	struct timespec ts = {
+		.tv_nsec = TSC_CALIBRATE_MSECS * NSEC_PER_MSEC,
+	};
+	u64 c0, c1, n0, n1;
+
+	if (!tsc_is_invariant())
+		return -EOPNOTSUPP;
+
+	n0 = nsecs();
+	c0 = __builtin_ia32_rdtsc();
+	nanosleep(&ts, NULL);
+	n1 = nsecs();
+	c1 = __builtin_ia32_rdtsc();
+	if (c1 <= c0)
+		return -EINVAL;
+
+	clock_tsc.mult = div64_u64((n1 - n0) << CLOCK_TSC_SHIFT, c1 - c0);
+	clock_tsc.base_cycles = c1;
+	clock_tsc.base_nsecs = n1;
+	clock_tsc.enabled = true;
+
+	pr_notice("clock: TSC %llu kHz\n",
+		  div64_u64((c1 - c0) * USEC_PER_SEC, n1 - n0));
+
+	return 0;
+}
+
+#else
+
+int clock_enable_tsc(void)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif
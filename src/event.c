@@ -7,9 +7,12 @@
 #include "event.h"
 #include "sched.h"
 #include "timer.h"
+#include "clock.h"
 
 struct event_task_struct {
 	struct list_head set_events;
+	struct list_head deferred_events;
+	struct task_struct *task;
 	int              epollfd;
 	bool             stopped;
 };
@@ -44,9 +47,28 @@ static void events_set_do_action(struct event_task_struct *s)
 	}
 }
 
+/*
+ * Deferred actions are called once per loop iteration, after all
+ * events, so they see everything the iteration has produced.
+ */
+static void events_deferred_do_action(struct event_task_struct *s)
+{
+	struct event_item *item;
+	LIST_HEAD(deferred_events);
+
+	list_splice_init(&s->deferred_events, &deferred_events);
+
+	while (!list_empty(&deferred_events)) {
+		item = list_first_entry(&deferred_events, typeof(*item), entry);
+		list_del_init(&item->entry);
+		item->action(item);
+	}
+}
+
 static bool events_are_set(struct event_task_struct *s)
 {
-	return !list_empty(&s->set_events);
+	return !list_empty(&s->set_events) ||
+		!list_empty(&s->deferred_events);
 }
 
 static int event_task(void *arg)
@@ -57,6 +79,9 @@ static int event_task(void *arg)
 	int i, num;
 
 	while (!s->stopped) {
+		/* Tasks have run since the last sample */
+		clock_loop_sample();
+
 		/* Get closest expiration timeout from timer */
 		timeout = timer_calc_msecs_timeout();
 
@@ -75,6 +100,8 @@ static int event_task(void *arg)
 			}
 			num = 0;
 		}
+		/* Time of the iteration, see clock.h */
+		clock_loop_sample();
 
 		/* Firstly run all possibly expired timers */
 		timer_run();
@@ -86,10 +113,14 @@ static int event_task(void *arg)
 		/* Run all set events actions */
 		events_set_do_action(s);
 
+		/* And what was deferred till the end of the iteration */
+		events_deferred_do_action(s);
+
 		schedule();
 	}
 
 	/* Finalizion */
+	clock_loop_stop();
 	close(s->epollfd);
 
 	s->epollfd = -1;
@@ -109,12 +140,14 @@ void init_event(void)
 	BUG_ON(event_struct.epollfd >= 0);
 
 	INIT_LIST_HEAD(&event_struct.set_events);
+	INIT_LIST_HEAD(&event_struct.deferred_events);
 
 	event_struct.epollfd = epoll_create1(EPOLL_CLOEXEC);
 	BUG_ON(event_struct.epollfd < 0);
 
 	task = task_create(event_task, &event_struct);
 	BUG_ON(!task);
+	event_struct.task = task;
 
 	wake_up_process(task);
 }
@@ -124,6 +157,16 @@ void deinit_event(void)
 	event_struct.stopped = true;
 }
 
+/**
+ * in_event_loop() - true if called by the event loop task, i.e. from an
+ *                   event action or a timer, where nothing may wait for
+ *                   the loop itself.
+ */
+bool in_event_loop(void)
+{
+	return current == event_struct.task;
+}
+
 static int __event_item_mod(struct event_item *item, int op)
 {
 	struct epoll_event ev = {
@@ -151,6 +194,8 @@ int event_item_del(struct event_item *item)
 {
 	int ret = -EBADF;
 
+	/* Deleted item must not fire if it was set */
+	list_del_init(&item->entry);
 	if (item->fd >= 0) {
 		ret = __event_item_mod(item, EPOLL_CTL_DEL);
 		item->fd = -1;
@@ -168,3 +213,14 @@ void event_item_set(struct event_item *item)
 {
 	list_move_tail(&item->entry, &event_struct.set_events);
 }
+
+/**
+ * event_item_defer() - calls the action of @item once at the end of the
+ *                      current, or the next if called from a task, loop
+ *                      iteration.  Does nothing if it is already deferred.
+ */
+void event_item_defer(struct event_item *item)
+{
+	if (list_empty(&item->entry))
+		list_add_tail(&item->entry, &event_struct.deferred_events);
+}
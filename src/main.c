@@ -8,11 +8,16 @@
 #include "sched.h"
 #include "timer.h"
 #include "event.h"
+#include "uring.h"
 #include "workqueue.h"
 #include "timedef.h"
 #include "err.h"
 #include "module.h"
 #include "printk.h"
+#include "slab.h"
+#include "reactor.h"
+#include "socket.h"
+#include "clock.h"
 
 #include "ceph/libceph.h"
 #include "ceph/ceph_features.h"
@@ -26,10 +31,32 @@ struct init_struct {
 	bool                stop_in_progress;
 	int                 sig_fd;
 	int                 osd;
+	unsigned int        nr_reactors;
 };
 
-static int parse_options(struct ceph_options *opts, int argc, char **argv)
+/* Size with an optional K or M suffix */
+static size_t parse_size(const char *str)
 {
+	char *end;
+	size_t size;
+
+	size = strtoul(str, &end, 0);
+	switch (*end) {
+	case 'M':
+	case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		size <<= 10;
+	}
+
+	return size;
+}
+
+static int parse_options(struct init_struct *init, int argc, char **argv)
+{
+	struct ceph_options *opts = init->opt;
 	int ret = 0, i;
 
 	for (i = 1; i < argc; i++) {
@@ -67,6 +94,40 @@ static int parse_options(struct ceph_options *opts, int argc, char **argv)
 				printk_set_current_level(atoi(value));
 				continue;
 			}
+			/* Parse 'reactors=' just here */
+			if (!strcmp(key, "reactors")) {
+				init->nr_reactors = atoi(value);
+				continue;
+			}
+			/* Parse 'sockets=' just here */
+			if (!strcmp(key, "sockets")) {
+				if (!strcmp(value, "uring")) {
+					sock_enable_uring();
+				} else if (strcmp(value, "epoll")) {
+					ret = -EINVAL;
+					break;
+				}
+				continue;
+			}
+			/* Parse 'task_stack_size=' just here */
+			if (!strcmp(key, "task_stack_size")) {
+				ret = sched_set_stack_size(parse_size(value));
+				if (ret)
+					break;
+				continue;
+			}
+			/* Parse 'clock=' just here */
+			if (!strcmp(key, "clock")) {
+				if (!strcmp(value, "tsc")) {
+					if (clock_enable_tsc())
+						pr_warn("clock: TSC is not usable, "
+							"monotonic is used\n");
+				} else if (strcmp(value, "monotonic")) {
+					ret = -EINVAL;
+					break;
+				}
+				continue;
+			}
 
 			param.string = strndup(value, v_len);
 			if (!param.string)
@@ -87,7 +148,9 @@ static int parse_options(struct ceph_options *opts, int argc, char **argv)
 static void destroy_loop(void)
 {
 	/* Eventually tear down the rest after which we exit the loop */
+	deinit_reactors();
 	deinit_workqueue();
+	deinit_uring();
 	deinit_event();
 }
 
@@ -211,11 +274,13 @@ int main(int argc, char **argv)
 	int ret;
 
 	memset(&init, 0, sizeof(init));
+	init.nr_reactors = 1;
 
 	init_formatting();
 	init_pages();
 	init_sched();
 	init_event();
+	init_uring();
 	init_workqueue();
 	init_modules();
 	init_signals(&init);
@@ -223,7 +288,7 @@ int main(int argc, char **argv)
 	init.opt = ceph_alloc_options();
 	BUG_ON(!init.opt);
 
-	ret = parse_options(init.opt, argc, argv);
+	ret = parse_options(&init, argc, argv);
 	if (WARN(ret < 0, "failed to parse options: %d\n", ret))
 		return -1;
 
@@ -237,6 +302,10 @@ int main(int argc, char **argv)
 	if (WARN(init.osd < 0, "'name' option does not contain a valid integer\n"))
 		return -1;
 
+	ret = init_reactors(init.nr_reactors);
+	if (WARN(ret < 0, "failed to start reactors: %d\n", ret))
+		return -1;
+
 	/* Create start task and wake up it */
 	task = task_create(start_task, &init);
 	BUG_ON(!task);
@@ -250,6 +319,7 @@ int main(int argc, char **argv)
 	while (tasks_to_run())
 		schedule();
 
+	kmem_caches_dump_stats();
 	deinit_pages();
 
 	return 0;
@@ -1,114 +1,536 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <unistd.h>
+
 #include "types.h"
 #include "page.h"
 #include "gfp.h"
+#include "bug.h"
+#include "printk.h"
+#include "perf_counters.h"
+
+#include <pthread.h>
+
+/*
+ * Page allocator.
+ *
+ * Pages are carved buddy-style from arenas: big regions which are
+ * mmap'ed at once, backed by hugetlb pages if the system has them
+ * reserved (1G, then 2M), or by transparent huge pages otherwise, so
+ * a big in-memory store does not thrash the TLB.  Each arena has a
+ * dense array of page descriptors, descriptors of a chunk are adjacent
+ * like for the kernel compound page, so `page + i` works.
+ *
+ * Arenas belong to a NUMA node (memory is bound with mbind()) and each
+ * node has own free lists, a thread allocates from the node it is
+ * running on.  Hugetlb pages are reserved by mmap() but taken on fault,
+ * where a shortage on the node is SIGBUS, so hugetlb arenas are mapped
+ * with the node policy and faulted in right away, see arena_map_huge().
+ *
+ * Like slab magazines, each thread keeps small stacks of free chunks of
+ * low orders of its node, so the node lock is taken only to refill an
+ * empty stack or to flush a full one, by a half.  Chunks in magazines
+ * are not counted as free by the node.  Chunks of order bigger than an arena, or when no arena
+ * can be mapped, are malloc'ed with descriptors in a footer:
+ *
+ *    PAGE_SIZE PAGE_SIZE ...|page#0 page#1 ...
+ *    ^         ^_____________|______|
+ *    |_______________________|
+ *
+ */
+
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB       (30 << MAP_HUGE_SHIFT)
+#endif
 
-#define MAX_ORDER          11
-#define MAX_SZ_IN_ORDER    32<<20 /* 32mb, should be ^2 */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+enum {
+	ARENA_SHIFT        = 26, /* 64m */
+	ARENA_HUGE1G_SHIFT = 30,
+	ARENA_THP_SHIFT    = 21, /* 2m */
+	ARENA_MAX_ORDER    = ARENA_HUGE1G_SHIFT - PAGE_SHIFT,
+	ARENA_MAX_NR       = 4096,
+	PAGE_MAX_NODES     = 64,
+	PAGE_MAG_MAX_ORDER = 4,  /* 64k, objstore blocks */
+	PAGE_MAG_SIZE      = 16, /* chunks of an order in a magazine */
+};
+
+enum {
+	PG_arena = 1 << 0, /* descriptor of an arena */
+	PG_buddy = 1 << 1, /* head of a free chunk in a free list */
+};
+
+struct page_arena {
+	void               *base;
+	struct page        *pages;   /* descriptors of all pages */
+	unsigned long      nr_pages;
+	unsigned int       order;    /* arena is 1<<order pages */
+	unsigned int       node;
+};
+
+struct page_node {
+	pthread_mutex_t    lock;
+	struct list_head   free_area[ARENA_MAX_ORDER + 1];
+	unsigned long      nr_free;  /* free pages in arenas of the node */
+	unsigned long      nr_pages; /* all pages in arenas of the node */
+	/* hugetlb pages are reserved per node, so they run out per node */
+	bool               huge1g_failed;
+	bool               huge2m_failed;
+};
+
+struct page_magazine {
+	unsigned int       m_nr;
+	struct page        *m_pages[PAGE_MAG_SIZE];
+};
+
+struct page_thread {
+	struct list_head     t_node;  /* node of page_threads */
+	struct page_magazine t_mags[PAGE_MAG_MAX_ORDER + 1];
+};
 
 unsigned char zeroes[PAGE_SIZE];
 
 struct page empty_zero_page = {
 	.lru = LIST_HEAD_INIT(empty_zero_page.lru),
-	.ptr = zeroes
+	.ptr = zeroes,
+	/* Never freed */
+	._refcount = ATOMIC_INIT(1),
 };
 
-struct free_pages {
-	struct list_head lru_pages;
-	int              nr_lru_pages;
-};
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct page_arena arenas[ARENA_MAX_NR];
+static unsigned int nr_arenas;
 
-#define DECLARE_ORDER(n)						\
-	[n] = {								\
-		.lru_pages = LIST_HEAD_INIT(orders[n].lru_pages),	\
-	}
-
-/* XXX Not thread safe */
-static struct free_pages orders[] = {
-	DECLARE_ORDER(0),
-	DECLARE_ORDER(1),
-	DECLARE_ORDER(2),
-	DECLARE_ORDER(3),
-	DECLARE_ORDER(4),
-	DECLARE_ORDER(5),
-	DECLARE_ORDER(6),
-	DECLARE_ORDER(7),
-	DECLARE_ORDER(8),
-	DECLARE_ORDER(9),
-	DECLARE_ORDER(10),
-	DECLARE_ORDER(11),
-};
+static struct page_node page_nodes[PAGE_MAX_NODES];
+static pthread_once_t page_nodes_once = PTHREAD_ONCE_INIT;
+
+static __thread int page_node_id = -1;
+
+static pthread_mutex_t page_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(page_threads);
+static pthread_key_t page_thread_key;
+static __thread struct page_thread *page_thread;
+
+static void init_page_nodes(void)
+{
+	struct page_node *pn;
+	int n, o;
+
+	for (n = 0; n < PAGE_MAX_NODES; n++) {
+		pn = &page_nodes[n];
+		pthread_mutex_init(&pn->lock, NULL);
+		for (o = 0; o <= ARENA_MAX_ORDER; o++)
+			INIT_LIST_HEAD(&pn->free_area[o]);
+	}
+}
+
+static void page_thread_exit(void *arg);
+
+static void init_page_once(void)
+{
+	init_page_nodes();
+	BUG_ON(pthread_key_create(&page_thread_key, page_thread_exit));
+}
 
 void init_pages(void)
 {
+	pthread_once(&page_nodes_once, init_page_once);
 }
 
-void deinit_pages(void)
+static unsigned int current_node(void)
+{
+	unsigned int cpu, node;
+
+	if (likely(page_node_id >= 0))
+		return page_node_id;
+
+	/* Threads are pinned, so the node is stable */
+	if (getcpu(&cpu, &node) || node >= PAGE_MAX_NODES)
+		node = 0;
+	page_node_id = node;
+
+	return node;
+}
+
+static void *arena_map(unsigned int shift, int flags)
+{
+	size_t size = 1UL << shift;
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | flags,
+		   -1, 0);
+
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/**
+ * arena_map_thp() - maps a region aligned on the huge page size and
+ *                   asks for transparent huge pages.
+ */
+static void *arena_map_thp(unsigned int shift)
+{
+	size_t size = 1UL << shift, align = 1UL << ARENA_THP_SHIFT;
+	void *ptr, *aligned;
+
+	ptr = arena_map(shift + 1, 0);
+	if (!ptr)
+		return NULL;
+
+	aligned = (void *)ALIGN((unsigned long)ptr, align);
+	if (aligned != ptr)
+		munmap(ptr, aligned - ptr);
+	munmap(aligned + size, (ptr + (size << 1)) - (aligned + size));
+	(void)madvise(aligned, size, MADV_HUGEPAGE);
+
+	return aligned;
+}
+
+/**
+ * arena_map_huge() - maps hugetlb arena for the node.  Thread policy is
+ *                    bound to the node around mmap(), so the reservation
+ *                    counts pages of the node only, and pages are faulted
+ *                    by MADV_POPULATE_WRITE, which fails instead of SIGBUS
+ *                    if the node still runs out of them.
+ */
+static void *arena_map_huge(unsigned int shift, int flags, unsigned int node)
+{
+	unsigned long nodemask = 1UL << node;
+	size_t size = 1UL << shift;
+	bool bound;
+	void *ptr;
+
+	bound = !syscall(__NR_set_mempolicy, MPOL_BIND, &nodemask,
+			 sizeof(nodemask) * 8);
+	ptr = arena_map(shift, flags);
+	if (ptr && madvise(ptr, size, MADV_POPULATE_WRITE) &&
+	    errno != EINVAL) {
+		/* EINVAL is an old kernel, reservation is all we have */
+		munmap(ptr, size);
+		ptr = NULL;
+	}
+	if (bound)
+		/* Threads run with the default policy */
+		syscall(__NR_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+
+	return ptr;
+}
+
+static void arena_bind(void *ptr, size_t size, unsigned int node)
+{
+	unsigned long nodemask = 1UL << node;
+	static bool warned;
+	int ret;
+
+	ret = syscall(__NR_mbind, ptr, size, MPOL_BIND, &nodemask,
+		      sizeof(nodemask) * 8, 0);
+	if (ret && !warned) {
+		/* E.g. no NUMA, not fatal */
+		pr_notice("page arena: mbind() failed, errno=%d\n", errno);
+		warned = true;
+	}
+}
+
+static void free_area_add(struct page_node *pn, struct page *page,
+			  unsigned int order)
+{
+	page->order = order;
+	page->flags |= PG_buddy;
+	list_add(&page->lru, &pn->free_area[order]);
+}
+
+static void free_area_del(struct page *page)
+{
+	page->flags &= ~PG_buddy;
+	list_del_init(&page->lru);
+}
+
+/**
+ * arena_create() - maps a new arena for the node and puts its pages
+ *                  to the free lists.  Called with node lock.
+ */
+static int arena_create(struct page_node *pn, unsigned int node)
+{
+	struct page_arena *arena;
+	unsigned int shift, i;
+	const char *kind;
+	struct page *pages;
+	void *base = NULL;
+
+	if (READ_ONCE(nr_arenas) == ARENA_MAX_NR)
+		return -ENOMEM;
+
+	shift = ARENA_SHIFT;
+	if (!pn->huge1g_failed) {
+		shift = ARENA_HUGE1G_SHIFT;
+		base = arena_map_huge(shift, MAP_HUGETLB | MAP_HUGE_1GB,
+				      node);
+		pn->huge1g_failed = !base;
+		kind = "1G hugetlb";
+	}
+	if (!base && !pn->huge2m_failed) {
+		shift = ARENA_SHIFT;
+		base = arena_map_huge(shift, MAP_HUGETLB, node);
+		pn->huge2m_failed = !base;
+		kind = "2M hugetlb";
+	}
+	if (!base) {
+		shift = ARENA_SHIFT;
+		base = arena_map_thp(shift);
+		kind = "THP";
+	}
+	if (!base)
+		return -ENOMEM;
+
+	arena_bind(base, 1UL << shift, node);
+
+	pages = calloc(1UL << (shift - PAGE_SHIFT), sizeof(*pages));
+	if (!pages) {
+		munmap(base, 1UL << shift);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&arenas_lock);
+	arena = &arenas[nr_arenas];
+	*arena = (struct page_arena) {
+		.base     = base,
+		.pages    = pages,
+		.nr_pages = 1UL << (shift - PAGE_SHIFT),
+		.order    = shift - PAGE_SHIFT,
+		.node     = node,
+	};
+	for (i = 0; i < arena->nr_pages; i++) {
+		INIT_LIST_HEAD(&pages[i].lru);
+		pages[i].ptr = base + ((unsigned long)i << PAGE_SHIFT);
+		pages[i].flags = PG_arena;
+		pages[i].arena = nr_arenas;
+	}
+	/* Publish after descriptors are ready */
+	WRITE_ONCE(nr_arenas, nr_arenas + 1);
+	pthread_mutex_unlock(&arenas_lock);
+
+	free_area_add(pn, pages, arena->order);
+	pn->nr_free += arena->nr_pages;
+	pn->nr_pages += arena->nr_pages;
+
+	pr_info("page arena #%u: %luM on node %u, %s\n", arena - arenas,
+		(1UL << shift) >> 20, node, kind);
+
+	return 0;
+}
+
+/**
+ * node_alloc() - takes a chunk from the free lists of the node,
+ *                splitting a bigger one if needed.  Called with lock.
+ */
+static struct page *node_alloc(struct page_node *pn, unsigned int order)
+{
+	struct page *page, *buddy;
+	unsigned int o;
+
+	for (o = order; o <= ARENA_MAX_ORDER; o++)
+		if (!list_empty(&pn->free_area[o]))
+			break;
+	if (o > ARENA_MAX_ORDER)
+		return NULL;
+
+	page = list_first_entry(&pn->free_area[o], typeof(*page), lru);
+	free_area_del(page);
+
+	/* Give back upper halves */
+	while (o > order) {
+		o--;
+		buddy = page + (1UL << o);
+		free_area_add(pn, buddy, o);
+	}
+	page->order = order;
+	pn->nr_free -= 1UL << order;
+
+	return page;
+}
+
+/**
+ * node_free() - puts a chunk back to the free lists of the node, merging
+ *               it with free buddies.  Called with lock.
+ */
+static void node_free(struct page_node *pn, struct page *page,
+		      unsigned int order)
 {
-	int order;
+	struct page_arena *arena = &arenas[page->arena];
+	unsigned long pfn = page - arena->pages, buddy_pfn;
+	struct page *buddy;
+
+	pn->nr_free += 1UL << order;
+	while (order < arena->order) {
+		buddy_pfn = pfn ^ (1UL << order);
+		buddy = arena->pages + buddy_pfn;
+		if (!(buddy->flags & PG_buddy) || buddy->order != order)
+			break;
+
+		/* Merge with the buddy */
+		free_area_del(buddy);
+		pfn &= ~(1UL << order);
+		order++;
+	}
+	free_area_add(pn, arena->pages + pfn, order);
+}
+
+static inline struct page_node *page_node(struct page *page)
+{
+	return &page_nodes[arenas[page->arena].node];
+}
+
+static struct page_thread *page_thread_get(void)
+{
+	struct page_thread *t = page_thread;
+
+	if (likely(t))
+		return t;
+
+	t = calloc(1, sizeof(*t));
+	if (unlikely(!t))
+		return NULL;
 
-	for (order = 0; order < ARRAY_SIZE(orders); order++) {
-		struct free_pages *free_pages = &orders[order];
+	pthread_setspecific(page_thread_key, t);
 
-		while (!list_empty(&free_pages->lru_pages)) {
-			struct page *page;
+	pthread_mutex_lock(&page_threads_lock);
+	list_add_tail(&t->t_node, &page_threads);
+	pthread_mutex_unlock(&page_threads_lock);
+	page_thread = t;
 
-			page = list_first_entry(&free_pages->lru_pages,
-						typeof(*page), lru);
-			list_del(&page->lru);
-			__free_pages(page, order);
+	return t;
+}
+
+/**
+ * mag_refill() - takes a half of the magazine from the node, the rest is
+ *                left for frees.
+ */
+static void mag_refill(struct page_node *pn, unsigned int node,
+		       struct page_magazine *mag, unsigned int order)
+{
+	struct page *page;
+
+	pthread_mutex_lock(&pn->lock);
+	while (mag->m_nr < PAGE_MAG_SIZE / 2) {
+		page = node_alloc(pn, order);
+		if (!page) {
+			/* New arena only if nothing is taken */
+			if (mag->m_nr || arena_create(pn, node))
+				break;
+			continue;
 		}
+		mag->m_pages[mag->m_nr++] = page;
 	}
+	pthread_mutex_unlock(&pn->lock);
 }
 
 /**
- * alloc_pages() - allocates 1<<order of pages.
- *
- * In order to minimize allocations the layout is the following:
- *
- *    PAGE_SIZE PAGE_SIZE ...|page#0 page#1 ...
- *    ^         ^_____________|______|
- *    |_______________________|
- *
+ * mag_flush() - gives @nr chunks from the top of the magazine back to
+ *               the node, all chunks of a magazine are of the same node.
  */
-struct page *alloc_pages(gfp_t gfp_mask, unsigned int order)
+static void mag_flush(struct page_magazine *mag, unsigned int order,
+		      unsigned int nr)
 {
-	unsigned int i, num = 1 << order;
-	unsigned int footer_sz;
-	struct page *first_page, *page;
-	struct free_pages *free_pages;
-	void *ptr;
+	struct page_node *pn;
 
-	BUILD_BUG_ON(ARRAY_SIZE(orders) != MAX_ORDER + 1);
+	if (!nr)
+		return;
 
-       if (order > MAX_ORDER)
-               goto alloc;
+	pn = page_node(mag->m_pages[mag->m_nr - 1]);
+	pthread_mutex_lock(&pn->lock);
+	while (nr--)
+		node_free(pn, mag->m_pages[--mag->m_nr], order);
+	pthread_mutex_unlock(&pn->lock);
+}
 
-	free_pages = &orders[order];
-	if (!list_empty(&free_pages->lru_pages)) {
-		/* Fast path */
+static void page_thread_exit(void *arg)
+{
+	struct page_thread *t = arg;
+	unsigned int o;
 
-		if (WARN_ON(!free_pages->nr_lru_pages))
-			goto alloc;
+	pthread_mutex_lock(&page_threads_lock);
+	for (o = 0; o <= PAGE_MAG_MAX_ORDER; o++)
+		mag_flush(&t->t_mags[o], o, t->t_mags[o].m_nr);
+	list_del(&t->t_node);
+	pthread_mutex_unlock(&page_threads_lock);
+	free(t);
+}
 
-		free_pages->nr_lru_pages--;
-		page = list_first_entry(&free_pages->lru_pages,
-					typeof(*page), lru);
-		list_del_init(&page->lru);
+static struct page *arena_alloc(unsigned int order)
+{
+	unsigned int node = current_node(), n;
+	struct page_node *pn = &page_nodes[node];
+	struct page_magazine *mag;
+	struct page_thread *t;
+	struct page *page;
 
-		if (gfp_mask & __GFP_ZERO)
-			memset(page_address(page), 0, num * PAGE_SIZE);
+	t = order <= PAGE_MAG_MAX_ORDER ? page_thread_get() : NULL;
+	if (likely(t)) {
+		mag = &t->t_mags[order];
+		if (unlikely(!mag->m_nr))
+			mag_refill(pn, node, mag, order);
+		if (likely(mag->m_nr))
+			return mag->m_pages[--mag->m_nr];
+	} else {
+		pthread_mutex_lock(&pn->lock);
+		page = node_alloc(pn, order);
+		if (!page && order <= ARENA_SHIFT - PAGE_SHIFT &&
+		    !arena_create(pn, node))
+			page = node_alloc(pn, order);
+		pthread_mutex_unlock(&pn->lock);
+		if (page)
+			return page;
+	}
 
-		return page;
+	/* Steal from other nodes */
+	for (page = NULL, n = 0; n < PAGE_MAX_NODES && !page; n++) {
+		pn = &page_nodes[n];
+		if (n == node || !READ_ONCE(pn->nr_free))
+			continue;
+		pthread_mutex_lock(&pn->lock);
+		page = node_alloc(pn, order);
+		pthread_mutex_unlock(&pn->lock);
 	}
-alloc:
-	footer_sz = num * sizeof(*page);
-	ptr = malloc(footer_sz + num * PAGE_SIZE);
+
+	return page;
+}
+
+static void arena_free(struct page *page, unsigned int order)
+{
+	struct page_node *pn = page_node(page);
+	struct page_magazine *mag;
+	struct page_thread *t;
+
+	/* Magazines keep chunks of the own node only */
+	t = order <= PAGE_MAG_MAX_ORDER && pn == &page_nodes[current_node()] ?
+		page_thread_get() : NULL;
+	if (likely(t)) {
+		mag = &t->t_mags[order];
+		if (unlikely(mag->m_nr == PAGE_MAG_SIZE))
+			mag_flush(mag, order, PAGE_MAG_SIZE / 2);
+		mag->m_pages[mag->m_nr++] = page;
+		return;
+	}
+
+	pthread_mutex_lock(&pn->lock);
+	node_free(pn, page, order);
+	pthread_mutex_unlock(&pn->lock);
+}
+
+static struct page *malloc_pages(unsigned int order)
+{
+	unsigned int i, num = 1 << order;
+	struct page *first_page, *page;
+	void *ptr;
+
+	ptr = malloc(num * sizeof(*page) + num * PAGE_SIZE);
 	if (!ptr)
 		return NULL;
 
-	if (gfp_mask & __GFP_ZERO)
-		memset(ptr, 0, num * PAGE_SIZE);
-
 	first_page = ptr + num * PAGE_SIZE;
 
 	/* Fill in header */
@@ -116,31 +538,105 @@ alloc:
 		page = first_page + i;
 		INIT_LIST_HEAD(&page->lru);
 		page->ptr = ptr + i * PAGE_SIZE;
+		atomic_set(&page->_refcount, 0);
+		page->order = 0;
+		page->flags = 0;
 	}
 
 	return first_page;
 }
 
-void __free_pages(struct page *page, unsigned int order)
+void deinit_pages(void)
 {
-	struct free_pages *free_pages;
-	unsigned int num = 1 << order;
-	unsigned int max_nr;
+	struct page_arena *arena;
+	struct page_thread *t;
+	unsigned int i, o;
 
-       if (order > MAX_ORDER)
-	       /* Directly to free */
-               goto free;
+	/* Chunks of magazines go away together with arenas */
+	pthread_mutex_lock(&page_threads_lock);
+	list_for_each_entry(t, &page_threads, t_node)
+		for (o = 0; o <= PAGE_MAG_MAX_ORDER; o++)
+			t->t_mags[o].m_nr = 0;
+	pthread_mutex_unlock(&page_threads_lock);
 
-	free_pages = &orders[order];
+	for (i = 0; i < nr_arenas; i++) {
+		arena = &arenas[i];
+		munmap(arena->base, arena->nr_pages << PAGE_SHIFT);
+		free(arena->pages);
+	}
+	nr_arenas = 0;
+	init_page_nodes();
+}
 
-	max_nr = MAX_SZ_IN_ORDER >> PAGE_SHIFT >> order;
-	if (free_pages->nr_lru_pages < max_nr) {
-		/* Fast path */
+/**
+ * alloc_pages() - allocates 1<<order of pages.
+ */
+struct page *alloc_pages(gfp_t gfp_mask, unsigned int order)
+{
+	struct page *page = NULL;
 
-		free_pages->nr_lru_pages++;
-		list_add(&page->lru, &free_pages->lru_pages);
+	init_pages();
+
+	if (order <= ARENA_MAX_ORDER)
+		page = arena_alloc(order);
+	if (!page) {
+		page = malloc_pages(order);
+		if (!page)
+			return NULL;
+		perf_inc(PERF_PAGE_MALLOC_ALLOCS);
+	}
+	atomic_set(&page->_refcount, 1);
+	page->order = order;
+
+	perf_inc(PERF_PAGE_ALLOCS);
+	perf_add(PERF_PAGE_USED, 1 << order);
+
+	if (gfp_mask & __GFP_ZERO)
+		memset(page_address(page), 0, PAGE_SIZE << order);
+
+	return page;
+}
+
+void __free_pages(struct page *page, unsigned int order)
+{
+	unsigned int num = 1 << order;
+
+	perf_inc(PERF_PAGE_FREES);
+	perf_add(PERF_PAGE_USED, -(s64)num);
+
+	if (page->flags & PG_arena) {
+		arena_free(page, order);
 		return;
 	}
-free:
 	free((void *)page - num * PAGE_SIZE);
 }
+
+unsigned int page_nr_arenas(void)
+{
+	return READ_ONCE(nr_arenas);
+}
+
+/**
+ * page_node_stats() - fills in @stats of up to @max NUMA nodes which have
+ *                     arenas, returns the number of filled in entries.
+ */
+unsigned int page_node_stats(struct page_node_stats *stats, unsigned int max)
+{
+	struct page_node *pn;
+	unsigned int n, nr = 0;
+
+	for (n = 0; n < PAGE_MAX_NODES && nr < max; n++) {
+		pn = &page_nodes[n];
+		if (!READ_ONCE(pn->nr_pages))
+			continue;
+		pthread_mutex_lock(&pn->lock);
+		stats[nr++] = (struct page_node_stats) {
+			.node     = n,
+			.nr_pages = pn->nr_pages,
+			.nr_free  = pn->nr_free,
+		};
+		pthread_mutex_unlock(&pn->lock);
+	}
+
+	return nr;
+}
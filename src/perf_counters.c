@@ -0,0 +1,145 @@
+#include "perf_counters.h"
+#include "bug.h"
+
+struct perf_shard perf_shards[REACTORS_MAX];
+
+struct perf_counter_desc {
+	const char             *name;
+	enum perf_counter_type type;
+};
+
+static const struct perf_counter_desc perf_counters[PERF_NR_COUNTERS] = {
+	[PERF_MSGR_RX_MSGS]       = { "msgr_rx_msgs",       PERF_TYPE_COUNTER },
+	[PERF_MSGR_RX_BYTES]      = { "msgr_rx_bytes",      PERF_TYPE_COUNTER },
+	[PERF_MSGR_TX_MSGS]       = { "msgr_tx_msgs",       PERF_TYPE_COUNTER },
+	[PERF_MSGR_TX_BYTES]      = { "msgr_tx_bytes",      PERF_TYPE_COUNTER },
+	[PERF_OSD_REQS]           = { "osd_reqs",           PERF_TYPE_COUNTER },
+	[PERF_OSD_OPS]            = { "osd_ops",            PERF_TYPE_COUNTER },
+	[PERF_OSD_OP_ERRORS]      = { "osd_op_errors",      PERF_TYPE_COUNTER },
+	[PERF_OSD_OP_IN_BYTES]    = { "osd_op_in_bytes",    PERF_TYPE_COUNTER },
+	[PERF_OSD_OP_OUT_BYTES]   = { "osd_op_out_bytes",   PERF_TYPE_COUNTER },
+	[PERF_PAGE_ALLOCS]        = { "page_allocs",        PERF_TYPE_COUNTER },
+	[PERF_PAGE_FREES]         = { "page_frees",         PERF_TYPE_COUNTER },
+	[PERF_PAGE_MALLOC_ALLOCS] = { "page_malloc_allocs", PERF_TYPE_COUNTER },
+	[PERF_PAGE_USED]          = { "page_used",          PERF_TYPE_GAUGE },
+	[PERF_WQ_QUEUED]          = { "wq_queued",          PERF_TYPE_COUNTER },
+	[PERF_WQ_EXECUTED]        = { "wq_executed",        PERF_TYPE_COUNTER },
+};
+
+static const char *perf_hists[PERF_NR_HISTS] = {
+	[PERF_HIST_OSD_REQ]                  = "osd_req_lat",
+	[PERF_HIST_OSD_OP_READ]              = "osd_op_read_lat",
+	[PERF_HIST_OSD_OP_WRITE]             = "osd_op_write_lat",
+	[PERF_HIST_OSD_OP_WRITEFULL]         = "osd_op_writefull_lat",
+	[PERF_HIST_OSD_OP_ZERO]              = "osd_op_zero_lat",
+	[PERF_HIST_OSD_OP_TRUNCATE]          = "osd_op_truncate_lat",
+	[PERF_HIST_OSD_OP_STAT]              = "osd_op_stat_lat",
+	[PERF_HIST_OSD_OP_CALL]              = "osd_op_call_lat",
+	[PERF_HIST_OSD_OP_OMAPGETVALS]       = "osd_op_omapgetvals_lat",
+	[PERF_HIST_OSD_OP_OMAPGETVALSBYKEYS] = "osd_op_omapgetvalsbykeys_lat",
+	[PERF_HIST_OSD_OP_OMAPSETVALS]       = "osd_op_omapsetvals_lat",
+	[PERF_HIST_OSD_OP_OMAPGETKEYS]       = "osd_op_omapgetkeys_lat",
+	[PERF_HIST_OSD_OP_GETXATTR]          = "osd_op_getxattr_lat",
+	[PERF_HIST_OSD_OP_SETXATTR]          = "osd_op_setxattr_lat",
+	[PERF_HIST_OSD_OP_CREATE]            = "osd_op_create_lat",
+	[PERF_HIST_OSD_OP_OTHER]             = "osd_op_other_lat",
+};
+
+const char *perf_counter_name(enum perf_counter_id id)
+{
+	BUG_ON(id >= PERF_NR_COUNTERS);
+	return perf_counters[id].name;
+}
+
+enum perf_counter_type perf_counter_type(enum perf_counter_id id)
+{
+	BUG_ON(id >= PERF_NR_COUNTERS);
+	return perf_counters[id].type;
+}
+
+const char *perf_hist_name(enum perf_hist_id id)
+{
+	BUG_ON(id >= PERF_NR_HISTS);
+	return perf_hists[id];
+}
+
+/**
+ * perf_counter_read() - sums the counter over shards of all reactors.
+ */
+s64 perf_counter_read(enum perf_counter_id id)
+{
+	unsigned int i;
+	s64 val = 0;
+
+	BUG_ON(id >= PERF_NR_COUNTERS);
+	for (i = 0; i < nr_reactors; i++)
+		val += READ_ONCE(perf_shards[i].counters[id]);
+
+	return val;
+}
+
+/**
+ * perf_hist_read() - sums the histogram over shards of all reactors.
+ */
+void perf_hist_read(enum perf_hist_id id, struct perf_hist *hist)
+{
+	const struct perf_hist *h;
+	unsigned int i, b;
+
+	BUG_ON(id >= PERF_NR_HISTS);
+	memset(hist, 0, sizeof(*hist));
+	for (i = 0; i < nr_reactors; i++) {
+		h = &perf_shards[i].hists[id];
+		hist->count += READ_ONCE(h->count);
+		hist->sum += READ_ONCE(h->sum);
+		for (b = 0; b < PERF_HIST_BUCKETS; b++)
+			hist->buckets[b] += READ_ONCE(h->buckets[b]);
+	}
+}
+
+/**
+ * perf_hist_bucket_start() - the smallest value which goes to @bucket,
+ *                            see perf_hist_bucket().
+ */
+u64 perf_hist_bucket_start(unsigned int bucket)
+{
+	unsigned int msb, sub;
+
+	if (bucket < PERF_HIST_SUB)
+		return bucket;
+
+	msb = (bucket >> PERF_HIST_SUB_BITS) + PERF_HIST_SUB_BITS - 1;
+	sub = bucket & (PERF_HIST_SUB - 1);
+
+	return (u64)(PERF_HIST_SUB | sub) << (msb - PERF_HIST_SUB_BITS);
+}
+
+/**
+ * perf_hist_quantile() - upper bound of the bucket where the @permille
+ *                        quantile falls, e.g. 990 for p99.  Returns 0
+ *                        for an empty histogram.
+ */
+u64 perf_hist_quantile(const struct perf_hist *hist, unsigned int permille)
+{
+	u64 total = 0, rank;
+	unsigned int b;
+
+	for (b = 0; b < PERF_HIST_BUCKETS; b++)
+		total += hist->buckets[b];
+	if (!total)
+		return 0;
+
+	/* Buckets are summed separately, so do not trust ->count */
+	rank = (total * permille + 999) / 1000;
+	if (!rank)
+		rank = 1;
+	for (b = 0; b < PERF_HIST_BUCKETS - 1; b++) {
+		if (hist->buckets[b] >= rank)
+			break;
+		rank -= hist->buckets[b];
+	}
+	if (b == PERF_HIST_BUCKETS - 1)
+		return perf_hist_bucket_start(b);
+
+	return perf_hist_bucket_start(b + 1) - 1;
+}
@@ -0,0 +1,387 @@
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "err.h"
+#include "slab.h"
+#include "sched.h"
+#include "event.h"
+#include "uring.h"
+#include "workqueue.h"
+#include "completion.h"
+#include "printk.h"
+#include "reactor.h"
+
+#include <pthread.h>
+
+/*
+ * Reactors.
+ *
+ * Each reactor has an incoming ring per reactor (itself included), so
+ * every ring has a single producer and a single consumer and needs no
+ * locks: the producer owns ->tail, the consumer owns ->head and each
+ * side publishes its index with release and reads the other one with
+ * acquire.  Rings are drained by an eventfd doorbell, which is
+ * registered in the event loop of the reactor, so posted works are
+ * executed from the event loop, i.e. from the same context as socket
+ * events.  The doorbell is rung only when ->notified flips from 0 to 1,
+ * the consumer clears it before draining.
+ *
+ * If a ring is full the work goes to the overflow list of the consumer
+ * under the lock, and the producer keeps using the list until the
+ * consumer has executed everything from it, so works of one producer
+ * are always executed in order.
+ */
+
+enum {
+	REACTOR_RING_SIZE = 256,
+};
+
+struct reactor_ring {
+	unsigned int        head ____cacheline_aligned; /* consumer */
+	unsigned int        tail ____cacheline_aligned; /* producer */
+	atomic_t            nr_overflow; /* works of the producer in
+					    ->works of the consumer */
+	struct reactor_work *slots[REACTOR_RING_SIZE];
+};
+
+struct reactor {
+	pthread_t          thread;
+	struct reactor_ring *rings;  /* incoming, indexed by producer */
+	unsigned int       nr_rings;
+	atomic_t           notified; /* doorbell is rung */
+	pthread_mutex_t    lock;
+	struct list_head   works;    /* overflowed works, under ->lock */
+	int                efd;      /* doorbell */
+	struct event_item  ev;
+	struct reactor_work stop_work;
+	int                cpu;
+};
+
+/*
+ * Synchronous call of a function on another reactor, function is
+ * executed from a task, so is allowed to sleep.
+ */
+struct reactor_call {
+	struct reactor_work work;
+	int                 (*fn)(void *);
+	void                *arg;
+	int                 ret;
+	unsigned int        caller;
+	struct completion   done;
+};
+
+__thread unsigned int reactor_id;
+unsigned int nr_reactors = 1;
+
+static struct reactor reactors[REACTORS_MAX];
+
+static bool ring_push(struct reactor_ring *ring, struct reactor_work *work)
+{
+	unsigned int tail = ring->tail;
+
+	if (tail - smp_load_acquire(&ring->head) == REACTOR_RING_SIZE)
+		return false;
+
+	ring->slots[tail & (REACTOR_RING_SIZE - 1)] = work;
+	smp_store_release(&ring->tail, tail + 1);
+
+	return true;
+}
+
+/**
+ * ring_drain() - executes works which are in the ring at the moment of
+ *                the call, works posted meanwhile wait for the next
+ *                doorbell, so a busy producer does not starve the loop.
+ */
+static void ring_drain(struct reactor_ring *ring)
+{
+	unsigned int head = ring->head, tail;
+	struct reactor_work *work;
+
+	tail = smp_load_acquire(&ring->tail);
+	while (head != tail) {
+		work = ring->slots[head & (REACTOR_RING_SIZE - 1)];
+		/* Slot is read, give it back before the work is executed */
+		smp_store_release(&ring->head, ++head);
+		work->func(work);
+	}
+}
+
+static void reactor_doorbell(struct event_item *ev)
+{
+	struct reactor *r = container_of(ev, typeof(*r), ev);
+	struct reactor_work *work;
+	bool overflow = false;
+	LIST_HEAD(works);
+	unsigned int i;
+	u64 cnt;
+
+	if (read(r->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		pr_err("reactor #%u: read() failed, errno=%d\n",
+		       reactor_id, errno);
+
+	/* Producers which post after that ring the doorbell again */
+	atomic_xchg(&r->notified, 0);
+
+	for (i = 0; i < r->nr_rings; i++)
+		overflow |= !!atomic_read(&r->rings[i].nr_overflow);
+	if (overflow) {
+		/*
+		 * Take overflowed works before draining rings: everything
+		 * a producer has pushed to its ring before it overflowed
+		 * is visible after the lock, so is executed first.
+		 */
+		pthread_mutex_lock(&r->lock);
+		list_splice_init(&r->works, &works);
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	for (i = 0; i < r->nr_rings; i++)
+		ring_drain(&r->rings[i]);
+
+	while (!list_empty(&works)) {
+		work = list_first_entry(&works, typeof(*work), entry);
+		list_del_init(&work->entry);
+		/* Producer can use the ring again when that reaches 0 */
+		atomic_dec(&r->rings[work->src].nr_overflow);
+		work->func(work);
+	}
+}
+
+static void reactor_init_doorbell(struct reactor *r)
+{
+	int ret;
+
+	INIT_EVENT(&r->ev, reactor_doorbell);
+	r->ev.events = EPOLLIN;
+	ret = event_item_add(&r->ev, r->efd);
+	BUG_ON(ret);
+}
+
+static void *reactor_thread(void *arg)
+{
+	struct reactor *r = arg;
+
+	reactor_id = r - reactors;
+	init_sched();
+	init_event();
+	init_uring();
+	init_workqueue();
+	reactor_init_doorbell(r);
+
+	/* Run till deinit_reactors() */
+	while (tasks_to_run())
+		schedule();
+
+	return NULL;
+}
+
+static void reactor_stop_workfn(struct reactor_work *work)
+{
+	/* See destroy_loop() in main.c */
+	deinit_workqueue();
+	deinit_uring();
+	deinit_event();
+}
+
+/**
+ * reactor_post() - queues @work to be executed by the event loop of the
+ *                  reactor @id.  @work->func must not sleep.  Works
+ *                  posted by one reactor to another are executed in
+ *                  the order they are posted.
+ */
+void reactor_post(unsigned int id, struct reactor_work *work)
+{
+	struct reactor *r = &reactors[id];
+	struct reactor_ring *ring = &r->rings[reactor_id];
+	u64 one = 1;
+
+	work->src = reactor_id;
+	if (atomic_read(&ring->nr_overflow) || !ring_push(ring, work)) {
+		pthread_mutex_lock(&r->lock);
+		list_add_tail(&work->entry, &r->works);
+		atomic_inc(&ring->nr_overflow);
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	if (!atomic_xchg(&r->notified, 1) &&
+	    write(r->efd, &one, sizeof(one)) < 0)
+		pr_err("reactor #%u: write() failed, errno=%d\n", id, errno);
+}
+
+static void reactor_call_done(struct reactor_work *work)
+{
+	struct reactor_call *call = container_of(work, typeof(*call), work);
+
+	complete(&call->done);
+}
+
+static int reactor_call_task(void *arg)
+{
+	struct reactor_call *call = arg;
+
+	call->ret = call->fn(call->arg);
+	INIT_REACTOR_WORK(&call->work, reactor_call_done);
+	reactor_post(call->caller, &call->work);
+
+	return 0;
+}
+
+static void reactor_call_workfn(struct reactor_work *work)
+{
+	struct reactor_call *call = container_of(work, typeof(*call), work);
+	struct task_struct *task;
+
+	task = task_create(reactor_call_task, call);
+	if (unlikely(!task)) {
+		call->ret = -ENOMEM;
+		INIT_REACTOR_WORK(&call->work, reactor_call_done);
+		reactor_post(call->caller, &call->work);
+		return;
+	}
+	wake_up_process(task);
+}
+
+/**
+ * reactor_call() - calls @fn on the reactor @id and waits for the result.
+ *                  Must be called from a task.
+ */
+int reactor_call(unsigned int id, int (*fn)(void *), void *arg)
+{
+	struct reactor_call call;
+
+	if (id == reactor_id)
+		return fn(arg);
+
+	call.fn = fn;
+	call.arg = arg;
+	call.caller = reactor_id;
+	init_completion(&call.done);
+	INIT_REACTOR_WORK(&call.work, reactor_call_workfn);
+	reactor_post(id, &call.work);
+	wait_for_completion(&call.done);
+
+	return call.ret;
+}
+
+/*
+ * Reactors are pinned to CPUs allowed for the process one by one, if
+ * there are more reactors than CPUs some share a CPU.
+ */
+static int reactor_cpus(int *cpus, unsigned int nr)
+{
+	unsigned int i, n;
+	cpu_set_t set;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return -errno;
+
+	for (n = 0, cpu = 0; cpu < CPU_SETSIZE && n < nr; cpu++)
+		if (CPU_ISSET(cpu, &set))
+			cpus[n++] = cpu;
+	if (n < nr)
+		pr_warn("reactors: %u reactors, but only %u CPUs\n", nr, n);
+	for (i = n; i < nr; i++)
+		cpus[i] = cpus[i % n];
+
+	return 0;
+}
+
+/**
+ * init_reactors() - makes the caller reactor #0 and starts @nr - 1
+ *                   pthreads for the rest.  Reactors are pinned to CPUs
+ *                   if there are more than one.
+ */
+int init_reactors(unsigned int nr)
+{
+	int cpus[REACTORS_MAX];
+	pthread_attr_t attr;
+	struct reactor *r;
+	unsigned int i;
+	cpu_set_t set;
+	int ret;
+
+	if (!nr || nr > REACTORS_MAX)
+		return -EINVAL;
+
+	ret = reactor_cpus(cpus, nr);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		r = &reactors[i];
+		kfree(r->rings);
+		r->rings = kcalloc(nr, sizeof(*r->rings), GFP_KERNEL);
+		if (!r->rings)
+			return -ENOMEM;
+		r->nr_rings = nr;
+		atomic_set(&r->notified, 0);
+		pthread_mutex_init(&r->lock, NULL);
+		INIT_LIST_HEAD(&r->works);
+		r->cpu = cpus[i];
+		r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (r->efd < 0)
+			return -errno;
+	}
+
+	r = &reactors[0];
+	r->thread = pthread_self();
+	reactor_init_doorbell(r);
+	if (nr == 1)
+		/* Single loop as it always was, leave it to the scheduler */
+		return 0;
+
+	CPU_ZERO(&set);
+	CPU_SET(r->cpu, &set);
+	ret = -pthread_setaffinity_np(r->thread, sizeof(set), &set);
+	if (ret)
+		return ret;
+
+	for (i = 1; i < nr; i++) {
+		r = &reactors[i];
+
+		ret = -pthread_attr_init(&attr);
+		if (ret)
+			return ret;
+		CPU_ZERO(&set);
+		CPU_SET(r->cpu, &set);
+		ret = -pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		if (!ret)
+			ret = -pthread_create(&r->thread, &attr,
+					      reactor_thread, r);
+		pthread_attr_destroy(&attr);
+		if (ret)
+			return ret;
+
+		nr_reactors++;
+	}
+	pr_notice("reactors: %u reactors are started\n", nr_reactors);
+
+	return 0;
+}
+
+/**
+ * deinit_reactors() - stops event loops of reactors and waits for their
+ *                     pthreads.  Called from a task of reactor #0.
+ */
+void deinit_reactors(void)
+{
+	struct reactor *r;
+	unsigned int i;
+
+	for (i = 1; i < nr_reactors; i++) {
+		r = &reactors[i];
+		INIT_REACTOR_WORK(&r->stop_work, reactor_stop_workfn);
+		reactor_post(i, &r->stop_work);
+	}
+	for (i = 1; i < nr_reactors; i++) {
+		r = &reactors[i];
+		pthread_join(r->thread, NULL);
+		kfree(r->rings);
+		r->rings = NULL;
+		r->nr_rings = 0;
+	}
+	nr_reactors = 1;
+}
@@ -1,6 +1,5 @@
 #include <stdlib.h>
-#include <ucontext.h>
-#include <setjmp.h>
+#include <sys/mman.h>
 #ifdef _USE_VALGRIND
 #include <valgrind/valgrind.h>
 #endif
@@ -11,15 +10,48 @@
 #include "completion.h"
 #include "timedef.h"
 #include "timer.h"
+#include "page.h"
 #include "err.h"
 
-#define TASK_STACK_SIZE (1<<16) /* 64k */
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#include <pthread.h>
+
+/*
+ * Tasks.
+ *
+ * Each task runs on its own stack, switching between tasks saves the
+ * callee-saved registers on the stack of the current task and loads the
+ * stack pointer of the next one, see task_ctx_switch() below.  Nothing
+ * else is saved: no signal mask, no FPU state, so a switch is a few
+ * dozens of instructions.
+ *
+ * Stacks are mmap'd with a PROT_NONE guard page below, so an overflow
+ * faults instead of corrupting the heap, and are committed by the
+ * kernel on touch, so only the used part costs memory.  task_struct
+ * lives at the top of its stack.  Stacks of dead tasks are kept in a
+ * per-thread pool and are reused, so a task per request is cheap.
+ */
+
+enum {
+	TASK_STACK_SIZE     = 64 << 10,  /* default */
+	TASK_STACK_SIZE_MIN = 16 << 10,
+	TASK_STACK_SIZE_MAX = 64 << 20,
+	TASK_STACK_GUARD    = PAGE_SIZE,
+	TASK_STACK_POOL     = 64,        /* stacks kept per thread */
+};
 
 struct task_struct {
 	struct list_head tsk_list;
 	int         tsk_ref;
-	jmp_buf     tsk_ctx;
-	void	    *tsk_stack;
+	void        *tsk_sp;          /* saved stack pointer */
+	void	    *tsk_stack;       /* mapping, guard page first */
+	size_t      tsk_stack_size;   /* of the mapping */
+	struct task_struct
+		    *tsk_pool_next;   /* in the stack pool */
 	task_func_t *tsk_func;
 	void        *tsk_arg;
 	long        tsk_state;
@@ -32,6 +64,163 @@ struct task_struct {
 
 __thread struct task_struct *current;
 static __thread struct task_struct idle_task;
+static __thread struct task_struct *dead_task;
+
+static __thread struct task_struct *stack_pool;
+static __thread unsigned int stack_pool_nr;
+static size_t task_stack_size = TASK_STACK_SIZE;
+
+/*
+ * void task_ctx_switch(void **from_sp, void *to_sp)
+ *
+ * Saves callee-saved registers of the caller on its stack and its stack
+ * pointer to @from_sp, then restores registers of the task which was
+ * switched away at @to_sp and returns to it.  A new task is started by
+ * a frame made by task_ctx_init(), which "returns" to task_entry().
+ */
+void task_ctx_switch(void **from_sp, void *to_sp);
+
+#if defined(__x86_64__)
+
+asm(".text\n"
+    ".p2align 4\n"
+    ".globl task_ctx_switch\n"
+    ".hidden task_ctx_switch\n"
+    ".type task_ctx_switch, @function\n"
+    "task_ctx_switch:\n"
+    "	pushq %rbp\n"
+    "	pushq %rbx\n"
+    "	pushq %r12\n"
+    "	pushq %r13\n"
+    "	pushq %r14\n"
+    "	pushq %r15\n"
+    "	movq %rsp, (%rdi)\n"
+    "	movq %rsi, %rsp\n"
+    "	popq %r15\n"
+    "	popq %r14\n"
+    "	popq %r13\n"
+    "	popq %r12\n"
+    "	popq %rbx\n"
+    "	popq %rbp\n"
+    "	ret\n"
+    ".size task_ctx_switch, .-task_ctx_switch\n");
+
+static void *task_ctx_init(void *top, void (*entry)(void))
+{
+	unsigned long *sp = top;
+
+	*--sp = 0;                      /* return address of @entry */
+	*--sp = (unsigned long)entry;   /* popped by ret */
+	sp -= 6;                        /* rbp, rbx, r12 - r15 */
+	memset(sp, 0, 6 * sizeof(*sp));
+
+	return sp;
+}
+
+#elif defined(__aarch64__)
+
+asm(".text\n"
+    ".p2align 4\n"
+    ".globl task_ctx_switch\n"
+    ".hidden task_ctx_switch\n"
+    ".type task_ctx_switch, %function\n"
+    "task_ctx_switch:\n"
+    "	sub sp, sp, #160\n"
+    "	stp x19, x20, [sp, #0]\n"
+    "	stp x21, x22, [sp, #16]\n"
+    "	stp x23, x24, [sp, #32]\n"
+    "	stp x25, x26, [sp, #48]\n"
+    "	stp x27, x28, [sp, #64]\n"
+    "	stp x29, x30, [sp, #80]\n"
+    "	stp d8, d9, [sp, #96]\n"
+    "	stp d10, d11, [sp, #112]\n"
+    "	stp d12, d13, [sp, #128]\n"
+    "	stp d14, d15, [sp, #144]\n"
+    "	mov x9, sp\n"
+    "	str x9, [x0]\n"
+    "	mov sp, x1\n"
+    "	ldp x19, x20, [sp, #0]\n"
+    "	ldp x21, x22, [sp, #16]\n"
+    "	ldp x23, x24, [sp, #32]\n"
+    "	ldp x25, x26, [sp, #48]\n"
+    "	ldp x27, x28, [sp, #64]\n"
+    "	ldp x29, x30, [sp, #80]\n"
+    "	ldp d8, d9, [sp, #96]\n"
+    "	ldp d10, d11, [sp, #112]\n"
+    "	ldp d12, d13, [sp, #128]\n"
+    "	ldp d14, d15, [sp, #144]\n"
+    "	add sp, sp, #160\n"
+    "	ret\n"
+    ".size task_ctx_switch, .-task_ctx_switch\n");
+
+static void *task_ctx_init(void *top, void (*entry)(void))
+{
+	unsigned long *sp = top;
+
+	sp -= 20;                       /* x19 - x30, d8 - d15 */
+	memset(sp, 0, 20 * sizeof(*sp));
+	sp[11] = (unsigned long)entry;  /* x30, where ret goes */
+
+	return sp;
+}
+
+#else
+#error "Context switch is not implemented for this architecture"
+#endif
+
+#ifdef __SANITIZE_ADDRESS__
+/*
+ * ASan must know which stack is current, otherwise it takes frames of
+ * one task for frames of another one.
+ */
+static __thread void *asan_thread_stack;
+static __thread size_t asan_thread_stack_size;
+
+static void asan_init_thread_stack(void)
+{
+	pthread_attr_t attr;
+
+	if (pthread_getattr_np(pthread_self(), &attr))
+		return;
+	pthread_attr_getstack(&attr, &asan_thread_stack,
+			      &asan_thread_stack_size);
+	pthread_attr_destroy(&attr);
+}
+
+static void asan_start_switch(struct task_struct *from,
+			      struct task_struct *to, void **fake_stack)
+{
+	void *bottom = asan_thread_stack;
+	size_t size = asan_thread_stack_size;
+
+	if (to != &idle_task) {
+		bottom = to->tsk_stack + TASK_STACK_GUARD;
+		size = to->tsk_stack_size - TASK_STACK_GUARD;
+	}
+	/* Fake stack of a dead task is freed */
+	__sanitizer_start_switch_fiber(from->tsk_state == TASK_DEAD ?
+				       NULL : fake_stack, bottom, size);
+}
+
+static void asan_finish_switch(void *fake_stack)
+{
+	__sanitizer_finish_switch_fiber(fake_stack, NULL, NULL);
+}
+
+static void asan_unpoison_stack(struct task_struct *task)
+{
+	ASAN_UNPOISON_MEMORY_REGION(task->tsk_stack + TASK_STACK_GUARD,
+				    (void *)task - task->tsk_stack -
+				    TASK_STACK_GUARD);
+}
+#else
+static inline void asan_init_thread_stack(void) {}
+static inline void asan_start_switch(struct task_struct *from,
+				     struct task_struct *to,
+				     void **fake_stack) {}
+static inline void asan_finish_switch(void *fake_stack) {}
+static inline void asan_unpoison_stack(struct task_struct *task) {}
+#endif
 
 void init_sched(void)
 {
@@ -39,6 +228,21 @@ void init_sched(void)
 	INIT_LIST_HEAD(&idle_task.tsk_list);
 	current = &idle_task;
 	current->tsk_state = TASK_RUNNING;
+	asan_init_thread_stack();
+}
+
+/**
+ * sched_set_stack_size() - sets stack size of tasks created afterwards,
+ *                          should be called before reactors are started.
+ */
+int sched_set_stack_size(size_t size)
+{
+	if (size < TASK_STACK_SIZE_MIN || size > TASK_STACK_SIZE_MAX)
+		return -EINVAL;
+
+	task_stack_size = PAGE_ALIGN(size);
+
+	return 0;
 }
 
 void __set_current_state(long state)
@@ -66,23 +270,65 @@ void *task_data(struct task_struct *task)
 	return task->tsk_arg;
 }
 
-static struct task_struct *task_alloc(task_func_t *func, void *arg,
-				      size_t stack_sz)
+static struct task_struct *task_stack_map(size_t stack_sz)
 {
+	size_t size = TASK_STACK_GUARD + stack_sz;
 	struct task_struct *task;
+	void *stack;
 
-	task = calloc(1, sizeof(*task));
-	if (!task)
+	stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+		     -1, 0);
+	if (stack == MAP_FAILED)
 		return NULL;
-
-	task->tsk_stack = malloc(stack_sz);
-	if (!task->tsk_stack) {
-		free(task);
+	if (mprotect(stack, TASK_STACK_GUARD, PROT_NONE)) {
+		munmap(stack, size);
 		return NULL;
 	}
 #ifdef _USE_VALGRIND
-	VALGRIND_STACK_REGISTER(task->tsk_stack, task->tsk_stack + stack_sz);
+	VALGRIND_STACK_REGISTER(stack + TASK_STACK_GUARD, stack + size);
 #endif
+	/* Task lives at the top, the stack grows down from it */
+	task = stack + size - ALIGN(sizeof(*task), SMP_CACHE_BYTES);
+	task->tsk_stack = stack;
+	task->tsk_stack_size = size;
+
+	return task;
+}
+
+static void task_stack_unmap(struct task_struct *task)
+{
+#ifdef _USE_VALGRIND
+	VALGRIND_STACK_DEREGISTER(task->tsk_stack + TASK_STACK_GUARD);
+#endif
+	munmap(task->tsk_stack, task->tsk_stack_size);
+}
+
+static struct task_struct *task_alloc(task_func_t *func, void *arg)
+{
+	size_t size = TASK_STACK_GUARD + task_stack_size;
+	struct task_struct *task;
+	void *stack;
+
+	while ((task = stack_pool)) {
+		stack_pool = task->tsk_pool_next;
+		stack_pool_nr--;
+		if (task->tsk_stack_size == size)
+			break;
+		/* Stack size was changed */
+		task_stack_unmap(task);
+	}
+	if (!task) {
+		task = task_stack_map(task_stack_size);
+		if (!task)
+			return NULL;
+	}
+	stack = task->tsk_stack;
+	memset(task, 0, sizeof(*task));
+	task->tsk_stack = stack;
+	task->tsk_stack_size = size;
+	asan_unpoison_stack(task);
+
 	init_completion(&task->tsk_exited);
 	task->tsk_func = func;
 	task->tsk_arg = arg;
@@ -97,11 +343,14 @@ static void task_destroy(struct task_struct *task)
 	BUG_ON(task == &idle_task);
 	BUG_ON(task->tsk_state != TASK_DEAD);
 	BUG_ON(!list_empty(&task->tsk_list));
-#ifdef _USE_VALGRIND
-	VALGRIND_STACK_DEREGISTER(task->tsk_stack);
-#endif
-	free(task->tsk_stack);
-	free(task);
+
+	if (stack_pool_nr < TASK_STACK_POOL) {
+		task->tsk_pool_next = stack_pool;
+		stack_pool = task;
+		stack_pool_nr++;
+		return;
+	}
+	task_stack_unmap(task);
 }
 
 void get_task_struct(struct task_struct *task)
@@ -115,14 +364,27 @@ void put_task_struct(struct task_struct *task)
 		task_destroy(task);
 }
 
+/*
+ * Called by the task which is switched to, on its stack: the previous
+ * task may be dead, then its stack is not used anymore.
+ */
+static void finish_task_switch(void)
+{
+	if (dead_task) {
+		BUG_ON(current == dead_task);
+		put_task_struct(dead_task);
+		dead_task = NULL;
+	}
+}
+
 static void task_switch_to(struct task_struct *from, struct task_struct *to)
 {
-	int is_jmp;
+	void *fake_stack = NULL;
 
 	current = to;
-	is_jmp = setjmp(from->tsk_ctx);
-	if (!is_jmp)
-		longjmp(to->tsk_ctx, 1);
+	asan_start_switch(from, to, &fake_stack);
+	task_ctx_switch(&from->tsk_sp, to->tsk_sp);
+	asan_finish_switch(fake_stack);
 }
 
 /* workqueue.c  */
@@ -131,7 +393,6 @@ void wq_worker_sleeping(struct task_struct *task);
 
 void schedule(void)
 {
-	static __thread struct task_struct *dead_task;
 	struct task_struct *next;
 
 	if (current->tsk_flags & PF_WQ_WORKER)
@@ -152,49 +413,21 @@ void schedule(void)
 		BUG_ON(current == dead_task);
 		BUG_ON(current->tsk_state != TASK_RUNNING);
 	}
-	if (dead_task) {
-		BUG_ON(current == dead_task);
-		put_task_struct(dead_task);
-		dead_task = NULL;
-	}
+	finish_task_switch();
+
 	if (current->tsk_flags & PF_WQ_WORKER)
 		wq_worker_running(current);
 
 }
 
-union trampoline_ptr {
-	void *p;
-	u32  i[2];
-};
-
-struct trampoline_arg {
-	jmp_buf            jmp_back;
-	struct task_struct *task;
-};
-
-/*
- * Here there is a nasty mixture of `ucontext_t` and `jmp_buf`.
- * Obviously `ucontext_t` should be enough to switch between
- * tasks, but glibc does rt_sigprocmask() syscall internally.
- * In order to avoid any extra syscall I decided to use
- * `jmp_buf`, but the problem is that I need a separate stack
- * for a new task, but only for `ucontext_t` new stack can be
- * set, thus for the first time I jump to trampoline using
- * `ucontext_t` and return back using `jmp_buf`.
- */
 __attribute__ ((noreturn))
-static void task_trampoline(int i0, int i1)
+static void task_entry(void)
 {
-	union trampoline_ptr ptr = {
-		.i = { i0, i1 }
-	};
-	struct trampoline_arg *a = ptr.p;
-	struct task_struct *task = a->task;
-	int ret, is_jmp;
+	struct task_struct *task = current;
+	int ret;
 
-	is_jmp = setjmp(task->tsk_ctx);
-	if (!is_jmp)
-		longjmp(a->jmp_back, 1);
+	asan_finish_switch(NULL);
+	finish_task_switch();
 
 	ret = task->tsk_func(task->tsk_arg);
 	task->tsk_exit_code = ret;
@@ -208,39 +441,17 @@ static void task_trampoline(int i0, int i1)
 struct task_struct *task_create(task_func_t *func, void *param)
 {
 	struct task_struct *task;
-	union trampoline_ptr ptr;
-	struct trampoline_arg arg;
-	ucontext_t oneshot_ctx;
-	int is_jmp;
 
-	task = task_alloc(func, param, TASK_STACK_SIZE);
+	task = task_alloc(func, param);
 	if (unlikely(!task))
 		return NULL;
 
-	if (getcontext(&oneshot_ctx) == -1)
-		BUG();
-	oneshot_ctx.uc_stack.ss_sp   = task->tsk_stack;
-	oneshot_ctx.uc_stack.ss_size = TASK_STACK_SIZE;
-	oneshot_ctx.uc_stack.ss_flags = 0;
-	oneshot_ctx.uc_link = NULL;
-
 	task->tsk_state = TASK_IDLE;
 	task->tsk_flags = PF_KTHREAD; /* no other threads here */
 	INIT_LIST_HEAD(&task->tsk_list);
-
-	arg.task = task;
-	ptr.p = &arg;
-
-	/*
-	 * Prepare oneshot context in order to setup stack and everything.
-	 * Used only once and then we return back using `jmp_buf`.
-	 */
-	makecontext(&oneshot_ctx, (void (*)(void))task_trampoline,
-		    2, ptr.i[0], ptr.i[1]);
-
-	is_jmp = setjmp(arg.jmp_back);
-	if (!is_jmp)
-		setcontext(&oneshot_ctx);
+	/* Stack pointer is 16 bytes aligned on a call on both arches */
+	task->tsk_sp = task_ctx_init((void *)((unsigned long)task & ~15UL),
+				     task_entry);
 
 	return task;
 }
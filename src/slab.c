@@ -0,0 +1,479 @@
+#include "slab.h"
+#include "list.h"
+#include "bug.h"
+#include "printk.h"
+
+#include <pthread.h>
+
+/*
+ * Slab caches.
+ *
+ * Objects of a cache are carved from slabs: naturally aligned chunks of
+ * ->slab_size, the slab header lives at the beginning of the chunk, so
+ * the slab of an object is found by masking the object address.  Free
+ * objects of a slab are linked into a freelist, the link is stored in
+ * the object itself, or right after the object if the cache has a
+ * constructor, so the constructed state survives free.
+ *
+ * Slabs of all caches are the shared layer (depot), which is protected
+ * by a lock of a cache.  On top of that each thread has a magazine per
+ * cache: a small stack of free objects, so allocation and free do not
+ * touch the depot and do not take the lock in the common case.  Empty
+ * magazine is refilled and full magazine is flushed by a half, so
+ * alternating alloc/free does not bounce objects.
+ *
+ * Objects which do not fit a slab of KMEM_SLAB_MAX_SIZE are allocated
+ * with malloc() directly.  With _USE_VALGRIND all objects are, so
+ * valgrind sees each object.
+ */
+
+enum {
+	KMEM_SLAB_MIN_SIZE = 16 << 10,
+	KMEM_SLAB_MAX_SIZE = 1 << 20,
+	KMEM_SLAB_MIN_OBJS = 8,
+	KMEM_SLAB_KEEP     = 2,     /* empty slabs kept by the depot */
+	KMEM_MAG_SIZE      = 32,    /* objects in a magazine */
+	KMEM_MAX_CACHES    = 64,
+};
+
+struct kmem_slab {
+	struct list_head  s_list;    /* ->partial or ->empty of the cache */
+	struct kmem_cache *s_cache;
+	void              *s_free;   /* freelist of objects */
+	unsigned int      s_inuse;   /* objects which are out of the slab */
+};
+
+struct kmem_cache {
+	const char        *name;
+	unsigned int      obj_size;  /* requested size */
+	unsigned int      size;      /* object stride in a slab */
+	unsigned int      align;
+	unsigned int      free_off;  /* offset of the freelist link */
+	unsigned int      slab_size; /* 0 if objects are malloc'ed */
+	unsigned int      objs_per_slab;
+	unsigned int      id;        /* index of thread magazines */
+	void              (*ctor)(void *);
+
+	pthread_mutex_t   lock;      /* protects depot */
+	struct list_head  partial;   /* slabs with free objects */
+	struct list_head  empty;     /* slabs without allocated objects */
+	unsigned long     nr_slabs;
+	unsigned long     nr_empty;
+	unsigned long     depot_allocs; /* stats of threads which are gone */
+	unsigned long     depot_frees;
+	unsigned long     depot_hits;
+};
+
+struct kmem_magazine {
+	unsigned int      m_nr;
+	void              *m_objs[KMEM_MAG_SIZE];
+	/* Stats are updated by the owner thread only */
+	unsigned long     m_allocs;
+	unsigned long     m_frees;
+	unsigned long     m_hits;
+};
+
+struct kmem_thread {
+	struct list_head      t_node;  /* node of kmem_threads */
+	struct kmem_magazine  t_mags[KMEM_MAX_CACHES];
+};
+
+static pthread_mutex_t kmem_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kmem_cache *kmem_caches[KMEM_MAX_CACHES];
+static LIST_HEAD(kmem_threads);
+static pthread_once_t kmem_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t kmem_key;
+
+static __thread struct kmem_thread *kmem_thread;
+
+static inline void *obj_get_free(struct kmem_cache *c, void *obj)
+{
+	return *(void **)(obj + c->free_off);
+}
+
+static inline void obj_set_free(struct kmem_cache *c, void *obj, void *next)
+{
+	*(void **)(obj + c->free_off) = next;
+}
+
+static inline unsigned int slab_hdr_size(struct kmem_cache *c)
+{
+	return ALIGN(sizeof(struct kmem_slab), c->align);
+}
+
+static inline struct kmem_slab *obj_to_slab(struct kmem_cache *c, void *obj)
+{
+	return (void *)((unsigned long)obj & ~(unsigned long)(c->slab_size - 1));
+}
+
+static struct kmem_slab *slab_create(struct kmem_cache *c)
+{
+	struct kmem_slab *slab;
+	unsigned int i;
+	void *obj;
+
+	if (posix_memalign((void **)&slab, c->slab_size, c->slab_size))
+		return NULL;
+
+	slab->s_cache = c;
+	slab->s_inuse = 0;
+	slab->s_free = NULL;
+
+	/* Link in reverse, so objects are handed out in address order */
+	obj = (void *)slab + slab_hdr_size(c) + c->objs_per_slab * c->size;
+	for (i = 0; i < c->objs_per_slab; i++) {
+		obj -= c->size;
+		if (c->ctor)
+			c->ctor(obj);
+		obj_set_free(c, obj, slab->s_free);
+		slab->s_free = obj;
+	}
+	c->nr_slabs++;
+
+	return slab;
+}
+
+static void slab_destroy(struct kmem_cache *c, struct kmem_slab *slab)
+{
+	c->nr_slabs--;
+	free(slab);
+}
+
+/**
+ * depot_get() - takes up to @nr objects from slabs of the cache,
+ *               returns number of objects taken.  Called with lock.
+ */
+static unsigned int depot_get(struct kmem_cache *c, void **objs,
+			      unsigned int nr)
+{
+	struct kmem_slab *slab;
+	unsigned int got = 0;
+	void *obj;
+
+	while (got < nr) {
+		if (!list_empty(&c->partial)) {
+			slab = list_first_entry(&c->partial, typeof(*slab),
+						s_list);
+		} else if (!list_empty(&c->empty)) {
+			slab = list_first_entry(&c->empty, typeof(*slab),
+						s_list);
+			list_move(&slab->s_list, &c->partial);
+			c->nr_empty--;
+		} else {
+			slab = slab_create(c);
+			if (!slab)
+				break;
+			list_add(&slab->s_list, &c->partial);
+		}
+		while (got < nr && slab->s_free) {
+			obj = slab->s_free;
+			slab->s_free = obj_get_free(c, obj);
+			slab->s_inuse++;
+			objs[got++] = obj;
+		}
+		if (!slab->s_free)
+			/* Full slabs are not on any list */
+			list_del_init(&slab->s_list);
+	}
+
+	return got;
+}
+
+/**
+ * depot_put() - returns objects to their slabs.  Called with lock.
+ */
+static void depot_put(struct kmem_cache *c, void **objs, unsigned int nr)
+{
+	struct kmem_slab *slab;
+	unsigned int i;
+	void *obj;
+
+	for (i = 0; i < nr; i++) {
+		obj = objs[i];
+		slab = obj_to_slab(c, obj);
+		BUG_ON(slab->s_cache != c || !slab->s_inuse);
+
+		if (!slab->s_free)
+			/* Was full */
+			list_add(&slab->s_list, &c->partial);
+		obj_set_free(c, obj, slab->s_free);
+		slab->s_free = obj;
+
+		if (!--slab->s_inuse) {
+			if (c->nr_empty >= KMEM_SLAB_KEEP) {
+				list_del(&slab->s_list);
+				slab_destroy(c, slab);
+			} else {
+				list_move(&slab->s_list, &c->empty);
+				c->nr_empty++;
+			}
+		}
+	}
+}
+
+static void mag_flush(struct kmem_cache *c, struct kmem_magazine *mag,
+		      unsigned int nr)
+{
+	pthread_mutex_lock(&c->lock);
+	depot_put(c, mag->m_objs + mag->m_nr - nr, nr);
+	pthread_mutex_unlock(&c->lock);
+	mag->m_nr -= nr;
+}
+
+/**
+ * mag_drain() - returns all objects and stats of the magazine to the
+ *               depot.  Called with kmem_lock.
+ */
+static void mag_drain(struct kmem_cache *c, struct kmem_magazine *mag)
+{
+	mag_flush(c, mag, mag->m_nr);
+
+	pthread_mutex_lock(&c->lock);
+	c->depot_allocs += mag->m_allocs;
+	c->depot_frees += mag->m_frees;
+	c->depot_hits += mag->m_hits;
+	pthread_mutex_unlock(&c->lock);
+	memset(mag, 0, sizeof(*mag));
+}
+
+static void kmem_thread_exit(void *arg)
+{
+	struct kmem_thread *t = arg;
+	unsigned int id;
+
+	pthread_mutex_lock(&kmem_lock);
+	for (id = 0; id < KMEM_MAX_CACHES; id++)
+		if (kmem_caches[id])
+			mag_drain(kmem_caches[id], &t->t_mags[id]);
+	list_del(&t->t_node);
+	pthread_mutex_unlock(&kmem_lock);
+	free(t);
+}
+
+static void kmem_key_init(void)
+{
+	BUG_ON(pthread_key_create(&kmem_key, kmem_thread_exit));
+}
+
+static struct kmem_thread *kmem_thread_get(void)
+{
+	struct kmem_thread *t = kmem_thread;
+
+	if (likely(t))
+		return t;
+
+	t = calloc(1, sizeof(*t));
+	if (unlikely(!t))
+		return NULL;
+
+	pthread_once(&kmem_key_once, kmem_key_init);
+	pthread_setspecific(kmem_key, t);
+
+	pthread_mutex_lock(&kmem_lock);
+	list_add_tail(&t->t_node, &kmem_threads);
+	pthread_mutex_unlock(&kmem_lock);
+	kmem_thread = t;
+
+	return t;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+				     unsigned int align, slab_flags_t flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *c;
+	unsigned int id, hdr;
+
+	(void)flags;
+
+	c = calloc(1, sizeof(*c));
+	if (unlikely(!c))
+		return NULL;
+
+	c->name = name;
+	c->obj_size = size;
+	c->ctor = ctor;
+	c->align = max_t(unsigned int, align, sizeof(void *));
+	c->free_off = ctor ? ALIGN(size, sizeof(void *)) : 0;
+	c->size = ALIGN(max_t(unsigned int, size, sizeof(void *)) +
+			(ctor ? sizeof(void *) : 0), c->align);
+	pthread_mutex_init(&c->lock, NULL);
+	INIT_LIST_HEAD(&c->partial);
+	INIT_LIST_HEAD(&c->empty);
+
+#ifndef _USE_VALGRIND
+	hdr = slab_hdr_size(c);
+	c->slab_size = KMEM_SLAB_MIN_SIZE;
+	while (c->slab_size < hdr + KMEM_SLAB_MIN_OBJS * c->size &&
+	       c->slab_size < KMEM_SLAB_MAX_SIZE)
+		c->slab_size <<= 1;
+	if (c->slab_size >= hdr + c->size)
+		c->objs_per_slab = (c->slab_size - hdr) / c->size;
+	else
+		/* Too big, goes to malloc */
+		c->slab_size = 0;
+#endif
+
+	pthread_mutex_lock(&kmem_lock);
+	for (id = 0; id < KMEM_MAX_CACHES; id++)
+		if (!kmem_caches[id])
+			break;
+	if (id < KMEM_MAX_CACHES)
+		kmem_caches[id] = c;
+	pthread_mutex_unlock(&kmem_lock);
+
+	if (WARN(id == KMEM_MAX_CACHES, "too many slab caches\n")) {
+		pthread_mutex_destroy(&c->lock);
+		free(c);
+		return NULL;
+	}
+	c->id = id;
+
+	return c;
+}
+
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+	struct kmem_slab *slab, *tmp;
+	struct kmem_thread *t;
+
+	if (!c)
+		return;
+
+	/* Caller guarantees nobody uses the cache, so drain all threads */
+	pthread_mutex_lock(&kmem_lock);
+	list_for_each_entry(t, &kmem_threads, t_node)
+		mag_drain(c, &t->t_mags[c->id]);
+	kmem_caches[c->id] = NULL;
+	pthread_mutex_unlock(&kmem_lock);
+
+	WARN(c->depot_allocs != c->depot_frees,
+	     "slab cache %s: %lu objects are still in use\n",
+	     c->name, c->depot_allocs - c->depot_frees);
+
+	list_for_each_entry_safe(slab, tmp, &c->empty, s_list)
+		slab_destroy(c, slab);
+	/* Partial or full slabs are leaked together with objects in use */
+
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c, gfp_t flags)
+{
+	struct kmem_magazine *mag;
+	struct kmem_thread *t;
+	void *obj;
+
+	t = kmem_thread_get();
+	if (unlikely(!t))
+		return NULL;
+	mag = &t->t_mags[c->id];
+
+	if (!c->slab_size) {
+		obj = malloc(c->obj_size);
+		if (unlikely(!obj))
+			return NULL;
+		if (c->ctor)
+			c->ctor(obj);
+	} else if (likely(mag->m_nr)) {
+		obj = mag->m_objs[--mag->m_nr];
+		mag->m_hits++;
+	} else {
+		/* Refill a half, the rest is left for frees */
+		pthread_mutex_lock(&c->lock);
+		mag->m_nr = depot_get(c, mag->m_objs, KMEM_MAG_SIZE / 2);
+		pthread_mutex_unlock(&c->lock);
+		if (unlikely(!mag->m_nr))
+			return NULL;
+		obj = mag->m_objs[--mag->m_nr];
+	}
+	mag->m_allocs++;
+
+	if (flags & __GFP_ZERO)
+		memset(obj, 0, c->obj_size);
+
+	return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+	struct kmem_magazine *mag;
+	struct kmem_thread *t;
+
+	if (unlikely(!obj))
+		return;
+
+	t = kmem_thread_get();
+	if (unlikely(!t)) {
+		/* No magazine, straight to the depot */
+		if (c->slab_size) {
+			pthread_mutex_lock(&c->lock);
+			depot_put(c, &obj, 1);
+			pthread_mutex_unlock(&c->lock);
+		} else {
+			free(obj);
+		}
+		return;
+	}
+	mag = &t->t_mags[c->id];
+	mag->m_frees++;
+
+	if (!c->slab_size) {
+		free(obj);
+		return;
+	}
+	if (unlikely(mag->m_nr == KMEM_MAG_SIZE))
+		mag_flush(c, mag, KMEM_MAG_SIZE / 2);
+	mag->m_objs[mag->m_nr++] = obj;
+}
+
+void kmem_cache_get_stats(struct kmem_cache *c,
+			  struct kmem_cache_stats *stats)
+{
+	unsigned long allocs, frees, hits;
+	struct kmem_thread *t;
+
+	pthread_mutex_lock(&kmem_lock);
+	pthread_mutex_lock(&c->lock);
+	allocs = c->depot_allocs;
+	frees = c->depot_frees;
+	hits = c->depot_hits;
+	list_for_each_entry(t, &kmem_threads, t_node) {
+		/* Racy, but good enough for stats */
+		allocs += READ_ONCE(t->t_mags[c->id].m_allocs);
+		frees += READ_ONCE(t->t_mags[c->id].m_frees);
+		hits += READ_ONCE(t->t_mags[c->id].m_hits);
+	}
+	*stats = (struct kmem_cache_stats) {
+		.name       = c->name,
+		.obj_size   = c->obj_size,
+		.objs_inuse = allocs - frees,
+		.slabs      = c->nr_slabs,
+		.bytes      = c->slab_size ? c->nr_slabs * c->slab_size :
+			      (allocs - frees) * c->obj_size,
+		.allocs     = allocs,
+		.hits       = hits,
+	};
+	pthread_mutex_unlock(&c->lock);
+	pthread_mutex_unlock(&kmem_lock);
+}
+
+void kmem_caches_dump_stats(void)
+{
+	struct kmem_cache_stats stats;
+	struct kmem_cache *c;
+	unsigned int id;
+
+	for (id = 0; id < KMEM_MAX_CACHES; id++) {
+		c = READ_ONCE(kmem_caches[id]);
+		if (!c)
+			continue;
+
+		kmem_cache_get_stats(c, &stats);
+		pr_info("slab %-24s size %5u inuse %8lu slabs %6lu bytes %10lu allocs %12lu hit %3lu%%\n",
+			stats.name, stats.obj_size, stats.objs_inuse,
+			stats.slabs, stats.bytes, stats.allocs,
+			stats.allocs ? stats.hits * 100 / stats.allocs : 0);
+	}
+}
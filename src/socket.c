@@ -1,10 +1,313 @@
+#include <time.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
 #include <unistd.h>
 
 #include "socket.h"
+#include "atomic.h"
 #include "bitops.h"
 #include "page.h"
 #include "bvec.h"
 
+/*
+ * Sockets are driven by epoll: readiness is reported by the event loop
+ * and each sock_recvmsg()/sock_sendmsg() is a syscall.  If io_uring
+ * sockets are enabled connected sockets receive with a multishot recv
+ * into provided buffers, which are queued on the socket till consumed,
+ * and send with io_uring sendmsg, thus syscalls of all sockets of the
+ * loop iteration are made by one io_uring_enter().  Epoll is still used
+ * for connect, accept, errors and write space.
+ *
+ * Released socket is freed only when the kernel is done with it, i.e.
+ * when the multishot recv is cancelled and zero-copy sends which are
+ * still inflight are completed.
+ */
+static bool sock_uring;
+
+/*
+ * Kernels with provided buffer rings, but without multishot recv (5.19)
+ * accept the request and fail it with -EINVAL, then sockets fall back
+ * to epoll.  Once a multishot recv is seen working -EINVAL is a real
+ * error.  Shared by reactors.
+ */
+enum {
+	MULTISHOT_UNKNOWN,
+	MULTISHOT_OK,
+	MULTISHOT_FAILED,
+};
+static atomic_t sock_uring_multishot = ATOMIC_INIT(MULTISHOT_UNKNOWN);
+
+static __thread struct list_head starved_socks;
+
+/* Released sockets to be freed at the end of the loop iteration */
+static __thread struct list_head reaped_socks;
+static __thread struct event_item sock_reaper;
+
+/**
+ * sock_enable_uring() - makes sockets, connected or accepted afterwards,
+ *                       use io_uring if it is available.  Should be
+ *                       called before reactors are started.
+ */
+void sock_enable_uring(void)
+{
+	sock_uring = true;
+}
+
+static struct list_head *starved_list(void)
+{
+	if (unlikely(!starved_socks.next))
+		INIT_LIST_HEAD(&starved_socks);
+
+	return &starved_socks;
+}
+
+static int sock_uring_arm(struct socket *sock)
+{
+	struct io_uring_sqe sqe;
+	int ret;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_RECV;
+	sqe.fd = sock->fd;
+	sqe.ioprio = IORING_RECV_MULTISHOT;
+	sqe.flags = IOSQE_BUFFER_SELECT;
+	sqe.buf_group = uring_buf_group();
+
+	ret = uring_queue_op(&sqe, &sock->rx_op);
+	if (!ret)
+		sock->rx_armed = true;
+
+	return ret;
+}
+
+static void sock_free(struct socket *sock)
+{
+	if (sock->fd >= 0)
+		close(sock->fd);
+	list_del(&sock->reap_entry);
+	free(sock->cache);
+	free(sock);
+}
+
+static void sock_free_released(struct socket *sock)
+{
+	if (sock->rx_armed || !list_empty(&sock->zc_list))
+		return;
+
+	event_item_del(&sock->ev);
+	sock_free(sock);
+}
+
+static void sock_reap_released(struct event_item *ev)
+{
+	struct socket *sock;
+
+	while (!list_empty(&reaped_socks)) {
+		sock = list_first_entry(&reaped_socks, typeof(*sock),
+					reap_entry);
+		list_del_init(&sock->reap_entry);
+		sock_free_released(sock);
+	}
+}
+
+/*
+ * Event item can't be freed from its own action, so a released socket
+ * is freed from socket_event() by the deferred reaper.
+ */
+static void sock_reap(struct socket *sock)
+{
+	if (unlikely(!reaped_socks.next)) {
+		INIT_LIST_HEAD(&reaped_socks);
+		INIT_EVENT(&sock_reaper, sock_reap_released);
+	}
+	if (list_empty(&sock->reap_entry))
+		list_add_tail(&sock->reap_entry, &reaped_socks);
+	event_item_defer(&sock_reaper);
+}
+
+static void sock_start_epoll_rx(struct socket *sock)
+{
+	int ret;
+
+	/* Want to read, MOD reports data which is already there */
+	sock->ev.events |= EPOLLIN;
+	ret = event_item_mod(&sock->ev);
+	WARN(ret, "event_item_mod(): err=%d\n", ret);
+}
+
+/*
+ * Called for each chunk received by the multishot recv, from the event
+ * loop.  Chunks are queued and consumed by sock_uring_recvmsg().
+ */
+static void sock_uring_rx(struct uring_op *op, int res, unsigned int flags)
+{
+	struct socket *sock = container_of(op, typeof(*sock), rx_op);
+	struct uring_buf *buf;
+	int ret;
+
+	if (!(flags & IORING_CQE_F_MORE))
+		sock->rx_armed = false;
+	else if (unlikely(atomic_read(&sock_uring_multishot) !=
+			  MULTISHOT_OK))
+		atomic_set(&sock_uring_multishot, MULTISHOT_OK);
+
+	if (unlikely(res == -EINVAL &&
+		     atomic_read(&sock_uring_multishot) != MULTISHOT_OK)) {
+		if (atomic_xchg(&sock_uring_multishot, MULTISHOT_FAILED) !=
+		    MULTISHOT_FAILED)
+			pr_warn("io_uring multishot recv is not supported, "
+				"sockets receive through epoll\n");
+		if (sock->released) {
+			sock_free_released(sock);
+			return;
+		}
+		/* Nothing was received through io_uring, so just switch */
+		sock->uring = false;
+		list_del_init(&sock->rx_starved);
+		if (sock->state == SS_CONNECTED)
+			sock_start_epoll_rx(sock);
+		return;
+	}
+
+	if (res > 0) {
+		buf = uring_buf_get(flags);
+		if (sock->released) {
+			uring_buf_put(buf);
+		} else {
+			buf->len = res;
+			buf->off = 0;
+			list_add_tail(&buf->entry, &sock->rx_bufs);
+		}
+	} else if (!res) {
+		sock->rx_eof = true;
+	} else if (res == -ENOBUFS) {
+		/* Rearmed when someone gives buffers back */
+		if (!sock->released)
+			list_move_tail(&sock->rx_starved, starved_list());
+		return;
+	} else if (res != -ECANCELED) {
+		sock->rx_err = res;
+	}
+
+	if (sock->released) {
+		sock_free_released(sock);
+		return;
+	}
+	if (res > 0 && !sock->rx_armed) {
+		/* Kernel can stop multishot, e.g. on CQ overflow */
+		ret = sock_uring_arm(sock);
+		if (ret)
+			sock->rx_err = ret;
+	}
+	if (sock->state == SS_CONNECTED)
+		sock->sk->sk_data_ready(sock->sk);
+}
+
+static void sock_uring_rearm_starved(void)
+{
+	struct list_head *starved = starved_list();
+	struct socket *sock;
+	int ret;
+
+	while (!list_empty(starved)) {
+		sock = list_first_entry(starved, typeof(*sock), rx_starved);
+		list_del_init(&sock->rx_starved);
+		ret = sock_uring_arm(sock);
+		if (ret) {
+			sock->rx_err = ret;
+			if (sock->state == SS_CONNECTED)
+				sock->sk->sk_data_ready(sock->sk);
+		}
+	}
+}
+
+/*
+ * Starts receiving on a connected socket, through io_uring if enabled
+ * and available, through epoll otherwise.
+ */
+static void sock_start_rx(struct socket *sock)
+{
+	if (sock_uring &&
+	    atomic_read(&sock_uring_multishot) != MULTISHOT_FAILED &&
+	    uring_bufs_enabled()) {
+		sock->uring = true;
+		if (!sock_uring_arm(sock))
+			return;
+		sock->uring = false;
+	}
+	sock_start_epoll_rx(sock);
+}
+
+static void sock_zc_complete(struct socket *sock, u32 lo, u32 hi)
+{
+	struct sock_zc *zc, *tmp;
+
+	list_for_each_entry_safe(zc, tmp, &sock->zc_list, entry) {
+		if (zc->id - lo > hi - lo)
+			continue;
+		list_del_init(&zc->entry);
+		zc->release(zc);
+	}
+}
+
+/*
+ * Socket has failed fatally, so completions of sends still inflight
+ * may never be reported, and the data is not delivered to anyone
+ * anyway.  The kernel holds own references to the pages it has taken,
+ * so just stop waiting.
+ */
+static void sock_zc_drop(struct socket *sock)
+{
+	struct sock_zc *zc;
+
+	while (!list_empty(&sock->zc_list)) {
+		zc = list_first_entry(&sock->zc_list, typeof(*zc), entry);
+		list_del_init(&zc->entry);
+		zc->release(zc);
+	}
+}
+
+/*
+ * Zero-copy completions come through the error queue, which raises
+ * EPOLLERR.  Returns true if that was the only reason of EPOLLERR.
+ */
+static bool sock_zc_reap(struct socket *sock)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+	struct sock_extended_err *serr;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	socklen_t len;
+	int err;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock->fd, &msg, MSG_ERRQUEUE) < 0)
+			break;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP &&
+			      cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 &&
+			      cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (void *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+			    serr->ee_errno)
+				continue;
+			sock_zc_complete(sock, serr->ee_info, serr->ee_data);
+		}
+	}
+
+	len = sizeof(err);
+	if (getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+		return false;
+
+	return !err;
+}
+
 static void socket_event(struct event_item *ev)
 {
 	struct socket *sock;
@@ -14,6 +317,21 @@ static void socket_event(struct event_item *ev)
 	sock = container_of(ev, typeof(*sock), ev);
 	sk = sock->sk;
 
+	if (unlikely(sock->released)) {
+		/* Waits for zero-copy completions only */
+		if (ev->revents & (EPOLLERR | EPOLLHUP)) {
+			/* Error or hangup is fatal, the rest may never come */
+			if (!sock_zc_reap(sock) || (ev->revents & EPOLLHUP))
+				sock_zc_drop(sock);
+		}
+		if (list_empty(&sock->zc_list))
+			sock_reap(sock);
+		return;
+	}
+
+	if ((ev->revents & EPOLLERR) && sock->zc_on && sock_zc_reap(sock))
+		ev->revents &= ~EPOLLERR;
+
 	if (ev->revents & EPOLLERR) {
 		if (sock->state != SS_UNCONNECTED) {
 			/*
@@ -37,10 +355,7 @@ static void socket_event(struct event_item *ev)
 		sk->sk_state = TCP_ESTABLISHED;
 		sk->sk_state_change(sk);
 
-		/* Want to read */
-		sock->ev.events |= EPOLLIN;
-		ret = event_item_mod(&sock->ev);
-		WARN(ret, "event_item_mod(): err=%d\n", ret);
+		sock_start_rx(sock);
 		break;
 
 	case SS_CONNECTED:
@@ -138,7 +453,9 @@ static int socket_accept(struct socket *sock, struct socket *newsock,
 		return -errno;
 
 	/* Add socketfd to the event loop in edge trigger mode */
-	newsock->ev.events = EPOLLET | EPOLLIN | EPOLLOUT;
+	newsock->ev.events = EPOLLET | EPOLLOUT;
+	if (!sock_uring)
+		newsock->ev.events |= EPOLLIN;
 	ret = event_item_add(&newsock->ev, fd);
 	if (WARN(ret, "event_item_add: failed %d\n", ret)) {
 		close(fd);
@@ -150,6 +467,9 @@ static int socket_accept(struct socket *sock, struct socket *newsock,
 	newsock->state = SS_CONNECTED;
 	newsock->sk->sk_state = TCP_ESTABLISHED;
 
+	if (sock_uring)
+		sock_start_rx(newsock);
+
 	return 0;
 }
 
@@ -257,6 +577,11 @@ static int sock_create_lite(int family, int type, int protocol,
 
 	sock->fd = -1;
 	INIT_EVENT(&sock->ev, socket_event);
+	sock->rx_op.fn = sock_uring_rx;
+	INIT_LIST_HEAD(&sock->rx_bufs);
+	INIT_LIST_HEAD(&sock->rx_starved);
+	INIT_LIST_HEAD(&sock->zc_list);
+	INIT_LIST_HEAD(&sock->reap_entry);
 	sock->state = SS_UNCONNECTED;
 	sock->ops = &sock_ops;
 
@@ -378,10 +703,45 @@ done:
  */
 void sock_release(struct socket *sock)
 {
-	event_item_del(&sock->ev);
-	if (sock->fd >= 0)
-		close(sock->fd);
-	free(sock);
+	struct io_uring_sqe sqe;
+	struct uring_buf *buf;
+	bool freed;
+
+	sock->released = true;
+	if (sock->uring) {
+		list_del_init(&sock->rx_starved);
+		freed = !list_empty(&sock->rx_bufs);
+		while (!list_empty(&sock->rx_bufs)) {
+			buf = list_first_entry(&sock->rx_bufs, typeof(*buf),
+					       entry);
+			list_del_init(&buf->entry);
+			uring_buf_put(buf);
+		}
+		if (freed)
+			/* Sockets which wait for buffers can go on */
+			sock_uring_rearm_starved();
+	}
+	if (!list_empty(&sock->zc_list)) {
+		/* Completions which are already queued */
+		sock_zc_reap(sock);
+		if (sock->ev.fd < 0)
+			/*
+			 * Out of epoll after an error or a hangup, so nothing
+			 * would report the rest.
+			 */
+			sock_zc_drop(sock);
+	}
+	if (sock->rx_armed) {
+		/* Freed by sock_uring_rx() on the last CQE */
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_ASYNC_CANCEL;
+		sqe.addr = (uintptr_t)&sock->rx_op;
+		if (WARN(uring_queue_op(&sqe, NULL),
+			 "can't cancel receive, socket is leaked\n"))
+			return;
+	}
+	/* Otherwise freed by socket_event() on the last completion */
+	sock_free_released(sock);
 }
 
 /**
@@ -406,6 +766,20 @@ int kernel_setsockopt(struct socket *sock, int level, int optname,
 	return ret;
 }
 
+/**
+ *	kernel_getsockname - get the address which the socket is bound (kernel space)
+ *	@sock: socket
+ *	@addr: address holder
+ *
+ *	Fills the @addr pointer with the address which the socket is bound.
+ *	Returns the length of the address in bytes or an error code.
+ */
+
+int kernel_getsockname(struct socket *sock, struct sockaddr *addr)
+{
+	return sock->ops->getname(sock, addr, 0);
+}
+
 /**
  *	kernel_peername - get the address which the socket is connected (kernel space)
  *	@sock: socket
@@ -458,7 +832,7 @@ static unsigned int iov_iter_to_iovec(struct iov_iter *iter,
 			skip = 0;
 		}
 	} else if (iov_iter_is_bvec(iter)) {
-		for (i = 0; i < count && iter->nr_segs; i++) {
+		for (i = 0; count && i < iter->nr_segs; i++) {
 			const struct bio_vec *src = &iter->bvec[i];
 			struct iovec *dst = &iovs[i];
 
@@ -479,6 +853,91 @@ static unsigned int iov_iter_to_iovec(struct iov_iter *iter,
 
 }
 
+/*
+ * Copies out data of provided buffers which the multishot receive has
+ * filled, gives consumed buffers back to the ring.
+ */
+static int sock_uring_recvmsg(struct socket *sock, struct kmsghdr *kmsg,
+			      int flags)
+{
+	struct iov_iter *iter = &kmsg->msg_iter;
+	struct uring_buf *buf;
+	bool freed = false;
+	size_t len;
+	int read = 0;
+
+	while (iter->count && !list_empty(&sock->rx_bufs)) {
+		buf = list_first_entry(&sock->rx_bufs, typeof(*buf), entry);
+		len = min_t(size_t, iter->count, buf->len - buf->off);
+		if (!(flags & MSG_TRUNC))
+			len = _copy_to_iter(buf->addr + buf->off, len, iter);
+		else
+			iov_iter_advance(iter, len);
+		buf->off += len;
+		read += len;
+		if (buf->off == buf->len) {
+			list_del_init(&buf->entry);
+			uring_buf_put(buf);
+			freed = true;
+		}
+	}
+	if (freed)
+		sock_uring_rearm_starved();
+
+	if (read)
+		return read;
+	if (sock->rx_err)
+		return sock->rx_err;
+	if (sock->rx_eof) {
+		/* See sock_recvmsg() */
+		sock->state = SS_DISCONNECTING;
+		sock->ev.revents |= EPOLLIN;
+		event_item_set(&sock->ev);
+		return 0;
+	}
+
+	return -EAGAIN;
+}
+
+/*
+ * Read-ahead cache.  Each recvmsg() reads into the caller iter and into
+ * the free space of the cache, so headers and footers of following
+ * messages are served from the cache without syscalls, while payloads
+ * land directly in the caller buffers.  Cache starts small and doubles
+ * each time a recvmsg() fills it up, i.e. when more data was pending
+ * than it could take, so a connection with a stream of small messages
+ * ends up reading several of them per syscall.
+ */
+enum {
+	SOCK_CACHE_MIN = 16<<10,
+	SOCK_CACHE_MAX = 256<<10,
+};
+
+static int sock_cache_resize(struct socket *sock, unsigned int size)
+{
+	unsigned int len_to_end;
+	char *cache;
+
+	cache = malloc(size);
+	if (unlikely(!cache))
+		return -ENOMEM;
+
+	if (sock->cache_len) {
+		/* Linearize the ring */
+		len_to_end = min(sock->cache_len,
+				 sock->cache_size - sock->cache_pos);
+		memcpy(cache, sock->cache + sock->cache_pos, len_to_end);
+		memcpy(cache + len_to_end, sock->cache,
+		       sock->cache_len - len_to_end);
+	}
+	free(sock->cache);
+	sock->cache = cache;
+	sock->cache_size = size;
+	sock->cache_pos = 0;
+
+	return 0;
+}
+
 /**
  *	sock_recvmsg - receive a message from @sock
  *	@sock: socket
@@ -503,12 +962,20 @@ int sock_recvmsg(struct socket *sock, struct kmsghdr *kmsg, int flags)
 	struct iovec *iov = iovec;
 	int ret;
 
+	unsigned int cache_free;
 	off_t cache_pos;
 	int read = 0;
 
+	if (sock->uring)
+		return sock_uring_recvmsg(sock, kmsg, flags);
+
+	if (unlikely(!sock->cache) &&
+	    sock_cache_resize(sock, SOCK_CACHE_MIN))
+		return -ENOMEM;
+
 	/* First consume from the cache if there is something */
 	if (sock->cache_len) {
-		size_t len_to_end = sizeof(sock->cache) - sock->cache_pos;
+		size_t len_to_end = sock->cache_size - sock->cache_pos;
 		size_t len = min_t(size_t, iter->count, sock->cache_len);
 
 		if (!(flags & MSG_TRUNC)) {
@@ -526,7 +993,7 @@ int sock_recvmsg(struct socket *sock, struct kmsghdr *kmsg, int flags)
 
 		sock->cache_len -= len;
 		sock->cache_pos += len;
-		sock->cache_pos &= (sizeof(sock->cache)-1);
+		sock->cache_pos &= (sock->cache_size-1);
 
 		BUG_ON(sock->cache_len && iter->count);
 
@@ -542,22 +1009,22 @@ int sock_recvmsg(struct socket *sock, struct kmsghdr *kmsg, int flags)
 	}
 
 	/* Cache can't be full, there should be some space left */
-	BUG_ON(sock->cache_len == sizeof(sock->cache));
+	BUG_ON(sock->cache_len == sock->cache_size);
 
 	/* Read more into cache, thus take position of free space */
+	cache_free = sock->cache_size - sock->cache_len;
 	cache_pos = (sock->cache_pos + sock->cache_len) &
-		(sizeof(sock->cache)-1);
+		(sock->cache_size-1);
 
 	/* First half */
 	iov[0].iov_base = sock->cache + cache_pos;
-	iov[0].iov_len = min(sizeof(sock->cache) - sock->cache_len,
-			     sizeof(sock->cache) - cache_pos);
+	iov[0].iov_len = min_t(size_t, cache_free,
+			       sock->cache_size - cache_pos);
 	msg.msg_iovlen += 1;
-	if (iov[0].iov_len < sizeof(sock->cache) - sock->cache_len) {
+	if (iov[0].iov_len < cache_free) {
 		/* Second half */
 		iov[1].iov_base = sock->cache;
-		iov[1].iov_len = (sizeof(sock->cache) - sock->cache_len) -
-			iov[0].iov_len;
+		iov[1].iov_len = cache_free - iov[0].iov_len;
 		msg.msg_iovlen += 1;
 	}
 
@@ -586,20 +1053,18 @@ advance_cache:
 		/* Advance cache length */
 		sock->cache_len += ret - rest_to_read;
 		ret = read;
+
+		/* Cache is filled up, there is likely more, so grow */
+		if (sock->cache_len == sock->cache_size &&
+		    sock->cache_size < SOCK_CACHE_MAX)
+			(void)sock_cache_resize(sock, sock->cache_size << 1);
 	}
 
 	return ret;
 }
 
-/**
- *	sock_sendmsg - send a message through @sock
- *	@sock: socket
- *	@kmsg: message to send
- *
- *	Sends @msg through @sock, passing through LSM.
- *	Returns the number of bytes sent, or an error code.
- */
-int sock_sendmsg(struct socket *sock, struct kmsghdr *kmsg)
+static int __sock_sendmsg(struct socket *sock, struct kmsghdr *kmsg,
+			  int flags)
 {
 	struct iov_iter *iter = &kmsg->msg_iter;
 	struct iovec iov[iter->nr_segs];
@@ -615,9 +1080,19 @@ int sock_sendmsg(struct socket *sock, struct kmsghdr *kmsg)
 
 	msg.msg_iovlen = iov_iter_to_iovec(iter, iov);
 
-	ret = sendmsg(sock->fd, &msg, 0);
+	/*
+	 * io_uring send completes through the event loop, so the loop
+	 * itself, which runs connection work inline, sends directly.
+	 */
+	if (sock->uring && !(flags & MSG_ZEROCOPY) && !in_event_loop()) {
+		ret = uring_sendmsg(sock->fd, &msg,
+				    MSG_DONTWAIT | MSG_NOSIGNAL);
+	} else {
+		ret = sendmsg(sock->fd, &msg, flags);
+		if (unlikely(ret < 0))
+			ret = -errno;
+	}
 	if (unlikely(ret < 0)) {
-		ret = -errno;
 		if (ret == -EAGAIN) {
 			int err;
 
@@ -632,6 +1107,65 @@ int sock_sendmsg(struct socket *sock, struct kmsghdr *kmsg)
 	return ret;
 }
 
+/**
+ *	sock_sendmsg - send a message through @sock
+ *	@sock: socket
+ *	@kmsg: message to send
+ *
+ *	Sends @msg through @sock, passing through LSM.
+ *	Returns the number of bytes sent, or an error code.
+ */
+int sock_sendmsg(struct socket *sock, struct kmsghdr *kmsg)
+{
+	return __sock_sendmsg(sock, kmsg, 0);
+}
+
+/**
+ *	sock_sendmsg_zc - send a message through @sock without copying
+ *	@sock: socket
+ *	@kmsg: message to send
+ *	@zc: reference to the data of @kmsg
+ *
+ *	Sends @kmsg with MSG_ZEROCOPY, so the kernel takes the data right
+ *	from the caller pages, which must not change till @zc is released.
+ *	@zc is released when the kernel reports the send completed, or
+ *	right away if nothing was sent zero-copy.  Falls back to the usual
+ *	copying send if the socket does not support zero-copy.
+ *	Returns the number of bytes sent, or an error code.
+ */
+int sock_sendmsg_zc(struct socket *sock, struct kmsghdr *kmsg,
+		    struct sock_zc *zc)
+{
+	int one = 1, ret;
+
+	if (!sock->zc_on && !sock->zc_failed) {
+		if (setsockopt(sock->fd, SOL_SOCKET, SO_ZEROCOPY,
+			       &one, sizeof(one)))
+			sock->zc_failed = true;
+		else
+			sock->zc_on = true;
+	}
+	if (!sock->zc_on) {
+		ret = sock_sendmsg(sock, kmsg);
+		zc->release(zc);
+		return ret;
+	}
+
+	ret = __sock_sendmsg(sock, kmsg, MSG_ZEROCOPY);
+	if (ret > 0) {
+		/* Each successful zero-copy send takes the next id */
+		zc->id = sock->zc_next++;
+		list_add_tail(&zc->entry, &sock->zc_list);
+		return ret;
+	}
+	if (ret == -ENOBUFS)
+		/* Out of optmem for pinned pages, just copy */
+		ret = sock_sendmsg(sock, kmsg);
+	zc->release(zc);
+
+	return ret;
+}
+
 /**
  *	kernel_sendmsg - send a message through @sock (kernel-space)
  *	@sock: socket
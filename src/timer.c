@@ -1,104 +1,226 @@
 #include "timer.h"
-#include "rbtree.h"
+#include "bitops.h"
 #include "timedef.h"
 
-static struct rb_root timer_root = RB_ROOT;
+/*
+ * Hierarchical timing wheel.
+ *
+ * The wheel has WHEEL_DEPTH levels of WHEEL_LVL_SIZE buckets, the
+ * granularity of each next level is WHEEL_CLK_DIV times coarser:
+ *
+ *   level  granularity  range
+ *     0       1 ms      0 ms     -  62 ms
+ *     1       8 ms      63 ms    - 503 ms
+ *     2      64 ms      504 ms   -   4 s
+ *     3     512 ms      4 s      -  32 s
+ *     4       4 s       32 s     -   4 m
+ *     5      32 s       4 m      -  34 m
+ *     6       4 m       34 m     -   4 h
+ *     7      35 m       4 h      -  36 h
+ *
+ * A timer is put to the level its delta falls in and its expiry is
+ * rounded up to the granularity of the level, so it never fires early,
+ * fires at most about 1/8 of its delta late, and timers which are close
+ * share a bucket, i.e. a wakeup.  Timer slack lifts a timer to a coarser
+ * level if it can afford that.  Timers are never cascaded down: a
+ * bucket is due when the wheel clock reaches its expiry, the whole
+ * bucket is spliced off at once.  Pending buckets of a level fit in a
+ * u64, so the next expiry is found with a rotate and an ffs per level.
+ *
+ * Timers further than the wheel covers are parked in the last bucket of
+ * the last level and are requeued when it comes.
+ */
 
-unsigned int timer_calc_msecs_timeout(void)
-{
-	struct timer *first;
-	unsigned long now;
+enum {
+	WHEEL_CLK_SHIFT = 3,
+	WHEEL_CLK_DIV   = 1 << WHEEL_CLK_SHIFT,
+	WHEEL_LVL_BITS  = 6,
+	WHEEL_LVL_SIZE  = 1 << WHEEL_LVL_BITS,
+	WHEEL_LVL_MASK  = WHEEL_LVL_SIZE - 1,
+	WHEEL_DEPTH     = 8,
+};
 
-	if (RB_EMPTY_ROOT(&timer_root))
-		/* Far in the future */
-		return -1;
+#define LVL_SHIFT(n)	((n) * WHEEL_CLK_SHIFT)
+#define LVL_GRAN(n)	(1UL << LVL_SHIFT(n))
+/* First delta of level @n, level 0 starts with 0 */
+#define LVL_START(n)	((unsigned long)(WHEEL_LVL_SIZE - 1) << LVL_SHIFT((n) - 1))
 
-	first = container_of(rb_first(&timer_root), typeof(*first), node);
-	now = jiffies;
-	if (first->expire > now)
-		return jiffies_to_msecs(first->expire - now);
+#define WHEEL_TIMEOUT_CUTOFF	LVL_START(WHEEL_DEPTH)
+#define WHEEL_TIMEOUT_MAX	(WHEEL_TIMEOUT_CUTOFF - LVL_GRAN(WHEEL_DEPTH - 1))
 
-	/* Expire now */
-	return 0;
+struct timer_base {
+	unsigned long     clk;          /* next jiffy to process */
+	unsigned long     next_expiry;
+	bool              next_expiry_recalc;
+	unsigned int      nr_timers;
+	u64               pending[WHEEL_DEPTH];
+	struct hlist_head vectors[WHEEL_DEPTH * WHEEL_LVL_SIZE];
+};
+
+static __thread struct timer_base base;
+
+static inline u64 ror64(u64 word, unsigned int shift)
+{
+	return shift ? (word >> shift) | (word << (64 - shift)) : word;
 }
 
-void timer_run(void)
+static unsigned long timer_next_expiry(void)
 {
-	struct rb_node *next_rb = rb_first(&timer_root);
-	struct timer *timer, *next;
+	unsigned long bucket, next = 0;
+	unsigned int lvl, pos;
+	bool found = false;
 
-	unsigned long now = jiffies;
+	if (!base.next_expiry_recalc)
+		return base.next_expiry;
 
-	while (next_rb) {
-		timer = rb_entry(next_rb, typeof(*timer), node);
-		if (timer->expire > now)
-			break;
+	for (lvl = 0; lvl < WHEEL_DEPTH; lvl++) {
+		if (!base.pending[lvl])
+			continue;
+		/* First bucket of the level processed at or after ->clk */
+		bucket = (base.clk + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl);
+		pos = bucket & WHEEL_LVL_MASK;
+		bucket += __ffs64(ror64(base.pending[lvl], pos));
+		bucket <<= LVL_SHIFT(lvl);
+		if (!found || time_before(bucket, next))
+			next = bucket;
+		found = true;
+	}
+	base.next_expiry = next;
+	base.next_expiry_recalc = false;
 
-		next_rb = rb_next(&timer->node);
-		rb_erase_init(&timer->node, &timer_root);
+	return next;
+}
 
-		/* Run timer for the head and for the rest */
-		while (timer) {
-			next = list_first_entry_or_null(&timer->list,
-							typeof(*next), list);
-			list_del_init(&timer->list);
-			timer->func(timer);
-			timer = next;
-		}
+/*
+ * Wheel clock stays at the last processed jiffy while nothing expires,
+ * deltas of new timers are counted from it, so move it forward to now
+ * as far as pending buckets allow.
+ */
+static void timer_forward_clk(void)
+{
+	unsigned long now = jiffies, next;
+
+	if (!base.nr_timers) {
+		base.clk = now;
+		return;
 	}
+	if (!time_after(now, base.clk))
+		return;
+
+	next = timer_next_expiry();
+	base.clk = time_before(next, now) ? next : now;
 }
 
-static struct rb_node *
-rbtree_insert(struct rb_root *root,
-	      struct rb_node *new,
-	      int (*cmp)(const struct rb_node *a,
-			 const struct rb_node *b))
+static void timer_enqueue(struct timer *timer)
 {
-	struct rb_node **this = &root->rb_node, *parent = NULL;
-	int rc;
-
-	while (*this) {
-		parent = *this;
-		rc = cmp(new, *this);
-		if (rc < 0)
-			this = &(*this)->rb_left;
-		else if (rc > 0)
-			this = &(*this)->rb_right;
-		else
-			return *this;
+	unsigned long expire = timer->expire, delta, bucket;
+	unsigned int lvl = 0, slot;
+
+	delta = expire - base.clk;
+	if ((long)delta < 0) {
+		/* Already expired, goes to the bucket processed next */
+		expire = base.clk;
+		delta = 0;
+	} else if (delta >= WHEEL_TIMEOUT_CUTOFF) {
+		/* Too far, parked and requeued by timer_run() */
+		expire = base.clk + WHEEL_TIMEOUT_MAX;
+		delta = WHEEL_TIMEOUT_MAX;
 	}
-	/* Add new node to the tree and rebalance it */
-	rb_link_node(new, parent, this);
-	rb_insert_color(new, root);
+	while (lvl < WHEEL_DEPTH - 1 &&
+	       (delta >= LVL_START(lvl + 1) ||
+		LVL_GRAN(lvl + 1) - 1 <= timer->slack))
+		lvl++;
+
+	bucket = (expire + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl);
+	slot = bucket & WHEEL_LVL_MASK;
+	timer->idx = lvl * WHEEL_LVL_SIZE + slot;
+	hlist_add_head(&timer->entry, &base.vectors[timer->idx]);
+	base.pending[lvl] |= 1ULL << slot;
 
-	return new;
+	bucket <<= LVL_SHIFT(lvl);
+	if (!base.nr_timers) {
+		base.next_expiry = bucket;
+		base.next_expiry_recalc = false;
+	} else if (!base.next_expiry_recalc &&
+		   time_before(bucket, base.next_expiry)) {
+		base.next_expiry = bucket;
+	}
+	base.nr_timers++;
 }
 
-static int cmp_timers(const struct rb_node *a_, const struct rb_node *b_)
+/**
+ * timer_collect() - splices off buckets which are due at ->clk, upper
+ *                   levels are checked only on their granularity.
+ */
+static unsigned int timer_collect(struct hlist_head *heads)
 {
-	struct timer *a, *b;
+	unsigned long clk = base.clk;
+	unsigned int lvl, slot, n = 0;
+
+	for (lvl = 0; lvl < WHEEL_DEPTH; lvl++) {
+		slot = clk & WHEEL_LVL_MASK;
+		if (base.pending[lvl] & (1ULL << slot)) {
+			base.pending[lvl] &= ~(1ULL << slot);
+			hlist_move_list(&base.vectors[lvl * WHEEL_LVL_SIZE + slot],
+					&heads[n++]);
+		}
+		if (clk & (WHEEL_CLK_DIV - 1))
+			break;
+		clk >>= WHEEL_CLK_SHIFT;
+	}
+
+	return n;
+}
 
-	a = container_of(a_, struct timer, node);
-	b = container_of(b_, struct timer, node);
+unsigned int timer_calc_msecs_timeout(void)
+{
+	unsigned long now, next;
 
-	if (a->expire < b->expire)
+	if (!base.nr_timers)
+		/* Far in the future */
 		return -1;
-	if (a->expire > b->expire)
-		return 1;
 
+	next = timer_next_expiry();
+	now = jiffies;
+	if (time_after(next, now))
+		return jiffies_to_msecs(next - now);
+
+	/* Expire now */
 	return 0;
 }
 
-static void timer_ins(struct timer *timer)
+void timer_run(void)
 {
-	struct rb_node *node;
-	struct timer *old;
-
-	node = rbtree_insert(&timer_root, &timer->node, cmp_timers);
-	if (node != &timer->node) {
-		old = container_of(node, typeof(*old), node);
-		/* Add current timer to the list of found timer */
-		list_add_tail(&timer->list, &old->list);
+	struct hlist_head heads[WHEEL_DEPTH];
+	unsigned long now = jiffies;
+	struct timer *timer;
+	unsigned int i, n;
+
+	while (base.nr_timers && time_after_eq(now, timer_next_expiry())) {
+		/* Nothing is pending in between, so jump */
+		base.clk = base.next_expiry;
+		n = timer_collect(heads);
+		base.clk++;
+		base.next_expiry_recalc = true;
+
+		/*
+		 * Expired timers are still pending till they are run, so
+		 * the callback of one can delete another.
+		 */
+		for (i = 0; i < n; i++) {
+			while (!hlist_empty(&heads[i])) {
+				timer = hlist_entry(heads[i].first,
+						    typeof(*timer), entry);
+				hlist_del_init(&timer->entry);
+				base.nr_timers--;
+				if (time_after(timer->expire, now)) {
+					/* Parked, see timer_enqueue() */
+					timer_enqueue(timer);
+					continue;
+				}
+				timer->func(timer);
+			}
+		}
 	}
 }
 
@@ -117,12 +239,12 @@ static void timer_ins(struct timer *timer)
  */
 void timer_add(struct timer *timer, unsigned long jexpire, timer_func_t func)
 {
-	INIT_LIST_HEAD(&timer->list);
-	RB_CLEAR_NODE(&timer->node);
+	INIT_HLIST_NODE(&timer->entry);
 	timer->func = func;
 	timer->expire = jexpire;
 
-	timer_ins(timer);
+	timer_forward_clk();
+	timer_enqueue(timer);
 }
 
 /**
@@ -138,24 +260,20 @@ void timer_add(struct timer *timer, unsigned long jexpire, timer_func_t func)
  */
 bool timer_del(struct timer *timer)
 {
-	struct timer *next;
+	unsigned int idx;
 
-	if (list_empty(&timer->list) && RB_EMPTY_NODE(&timer->node)) {
+	if (!timer_pending(timer))
 		/* Already deleted */
 		return false;
-	} else if (list_empty(&timer->list)) {
-		/* Timer is a single one */
-		rb_erase_init(&timer->node, &timer_root);
-	} else if (RB_EMPTY_NODE(&timer->node)) {
-		/* Timer was added to the list of another timer */
-		list_del_init(&timer->list);
-	} else {
-		/* Carefully remove timer head and replace it with the next one */
-		next = list_first_entry(&timer->list, typeof(*next), list);
-		list_del_init(&timer->list);
-		rb_replace_node(&timer->node, &next->node, &timer_root);
-		RB_CLEAR_NODE(&timer->node);
+
+	idx = timer->idx;
+	hlist_del_init(&timer->entry);
+	if (hlist_empty(&base.vectors[idx])) {
+		base.pending[idx / WHEEL_LVL_SIZE] &=
+			~(1ULL << (idx & WHEEL_LVL_MASK));
+		base.next_expiry_recalc = true;
 	}
+	base.nr_timers--;
 
 	return true;
 }
@@ -175,7 +293,8 @@ bool timer_mod(struct timer *timer, unsigned long jexpire)
 
 	del = timer_del(timer);
 	timer->expire = jexpire;
-	timer_ins(timer);
+	timer_forward_clk();
+	timer_enqueue(timer);
 
 	return del;
 }
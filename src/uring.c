@@ -0,0 +1,648 @@
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "err.h"
+#include "slab.h"
+#include "uring.h"
+#include "event.h"
+#include "sched.h"
+#include "wait.h"
+#include "completion.h"
+#include "printk.h"
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+
+/* Provided receive buffers, see uring_bufs_enabled() */
+enum {
+	URING_BUF_GROUP = 0,
+	URING_BUF_NR    = 512,
+	URING_BUF_SIZE  = 16 << 10,
+};
+
+#define uring_load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define uring_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct uring_sq {
+	unsigned int *head;
+	unsigned int *tail;
+	unsigned int *ring_mask;
+	unsigned int *ring_entries;
+	unsigned int *array;
+	struct io_uring_sqe *sqes;
+	unsigned int to_submit;
+};
+
+struct uring_cq {
+	unsigned int *head;
+	unsigned int *tail;
+	unsigned int *ring_mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct uring_bufs {
+	struct io_uring_buf_ring *ring;
+	void               *mem;
+	struct uring_buf   *bufs;     /* descriptors, indexed by bid */
+	unsigned short     tail;
+	bool               failed;
+};
+
+struct uring_struct {
+	int                ring_fd;
+	int                ev_fd;
+	struct uring_sq    sq;
+	struct uring_cq    cq;
+	void               *sq_ptr;
+	size_t             sq_sz;
+	void               *cq_ptr;
+	size_t             cq_sz;
+	size_t             sqes_sz;
+	unsigned int       cq_entries;
+	unsigned int       inflight;  /* waited requests */
+	struct uring_bufs  bufs;
+	struct event_item  cq_ev;     /* eventfd, signals completions */
+	struct event_item  submit_ev; /* set event, flushes submissions */
+	wait_queue_head_t  wait;      /* waiters for a free slot */
+};
+
+struct uring_req {
+	struct uring_op   op;
+	struct completion done;
+	int               res;
+};
+
+static __thread struct uring_struct uring = {
+	.ring_fd = -1,
+	.ev_fd = -1,
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_is_enabled(void)
+{
+	return uring.ring_fd >= 0;
+}
+
+/**
+ * uring_submit() - passes queued SQEs to the kernel, returns 0 if all of
+ *                  them are taken or the kernel is busy, otherwise -errno
+ *                  of io_uring_enter(), the rest is left in the SQ, see
+ *                  uring_fail_unsubmitted().
+ */
+static int uring_submit(struct uring_struct *u)
+{
+	int ret;
+
+	while (u->sq.to_submit) {
+		ret = io_uring_enter(u->ring_fd, u->sq.to_submit, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EBUSY)
+				/* Try again on the next loop iteration */
+				break;
+			return -errno;
+		}
+		u->sq.to_submit -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * uring_fail_unsubmitted() - takes back SQEs which the kernel has refused,
+ *                            the kernel has not seen them, and completes
+ *                            each op with @err as if a CQE had come.
+ */
+static void uring_fail_unsubmitted(struct uring_struct *u, int err)
+{
+	struct uring_op *ops[URING_ENTRIES];
+	unsigned int i, nr, tail;
+
+	nr = u->sq.to_submit;
+	BUG_ON(nr > ARRAY_SIZE(ops));
+	tail = *u->sq.tail - nr;
+	for (i = 0; i < nr; i++)
+		ops[i] = (struct uring_op *)(uintptr_t)
+			u->sq.sqes[(tail + i) & *u->sq.ring_mask].user_data;
+	uring_store_release(u->sq.tail, tail);
+	u->sq.to_submit = 0;
+
+	/* Ops may queue again, so the SQ is consistent by now */
+	for (i = 0; i < nr; i++) {
+		if (ops[i])
+			ops[i]->fn(ops[i], err, 0);
+	}
+	if (waitqueue_active(&u->wait))
+		wake_up(&u->wait);
+}
+
+static void uring_reap(struct uring_struct *u)
+{
+	unsigned int head, tail;
+	struct io_uring_cqe *cqe;
+	struct uring_op *op;
+
+	head = *u->cq.head;
+	tail = uring_load_acquire(u->cq.tail);
+	while (head != tail) {
+		cqe = &u->cq.cqes[head & *u->cq.ring_mask];
+		op = (struct uring_op *)(uintptr_t)cqe->user_data;
+		/* Requests without op, e.g. cancels, are not interesting */
+		if (op)
+			op->fn(op, cqe->res, cqe->flags);
+		head++;
+	}
+	uring_store_release(u->cq.head, head);
+
+	if (waitqueue_active(&u->wait))
+		wake_up(&u->wait);
+}
+
+static void uring_cq_event(struct event_item *ev)
+{
+	struct uring_struct *u = container_of(ev, typeof(*u), cq_ev);
+	eventfd_t cnt;
+
+	/* Eventfd is non-blocking, so ignore EAGAIN */
+	(void)eventfd_read(u->ev_fd, &cnt);
+	uring_reap(u);
+}
+
+static void uring_submit_event(struct event_item *ev)
+{
+	struct uring_struct *u = container_of(ev, typeof(*u), submit_ev);
+	int ret;
+
+	ret = uring_submit(u);
+	if (unlikely(ret)) {
+		pr_err("io_uring_enter() failed, fail %u requests, err=%d\n",
+		       u->sq.to_submit, ret);
+		uring_fail_unsubmitted(u, ret);
+	} else if (u->sq.to_submit) {
+		/* Kernel is busy, repeat on the next iteration */
+		ev->revents |= EPOLLOUT;
+		event_item_set(ev);
+	}
+}
+
+static bool uring_sq_has_room(struct uring_struct *u)
+{
+	unsigned int head = uring_load_acquire(u->sq.head);
+
+	return *u->sq.tail - head < *u->sq.ring_entries;
+}
+
+static bool uring_has_room(struct uring_struct *u)
+{
+	/*
+	 * Limit inflight requests by CQ size in order not to overflow
+	 * completion queue, SQ should have a free entry as well.
+	 */
+	return u->inflight < u->cq_entries && uring_sq_has_room(u);
+}
+
+static void uring_push(struct uring_struct *u,
+		       const struct io_uring_sqe *tmpl,
+		       struct uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	tail = *u->sq.tail;
+	idx = tail & *u->sq.ring_mask;
+	sqe = &u->sq.sqes[idx];
+	*sqe = *tmpl;
+	sqe->user_data = (uintptr_t)op;
+	u->sq.array[idx] = idx;
+	uring_store_release(u->sq.tail, tail + 1);
+	u->sq.to_submit++;
+
+	/* Submission is deferred till the end of the loop iteration */
+	if (list_empty(&u->submit_ev.entry)) {
+		u->submit_ev.revents |= EPOLLOUT;
+		event_item_set(&u->submit_ev);
+	}
+}
+
+static void uring_req_done(struct uring_op *op, int res, unsigned int flags)
+{
+	struct uring_req *req = container_of(op, typeof(*req), op);
+
+	uring.inflight--;
+	req->res = res;
+	complete(&req->done);
+}
+
+static void uring_queue_and_wait(struct uring_struct *u,
+				 struct io_uring_sqe *tmpl,
+				 struct uring_req *req)
+{
+	wait_event(u->wait, uring_has_room(u));
+
+	req->op.fn = uring_req_done;
+	init_completion(&req->done);
+	uring_push(u, tmpl, &req->op);
+	u->inflight++;
+
+	wait_for_completion(&req->done);
+}
+
+/**
+ * uring_queue_op() - queues a request without waiting for it, @op->fn is
+ *                    called for each CQE of the request from the event
+ *                    loop, so must not sleep.  @op can be NULL if the
+ *                    result is not needed.  Can be called from any
+ *                    context, returns -EBUSY if SQ is full.
+ */
+int uring_queue_op(const struct io_uring_sqe *tmpl, struct uring_op *op)
+{
+	struct uring_struct *u = &uring;
+	int ret;
+
+	if (!uring_is_enabled())
+		return -EOPNOTSUPP;
+
+	if (!uring_sq_has_room(u)) {
+		/*
+		 * Do not wait, flush what is queued instead.  On error
+		 * what is queued is failed by uring_submit_event().
+		 */
+		ret = uring_submit(u);
+		if (ret)
+			return ret;
+		if (!uring_sq_has_room(u))
+			return -EBUSY;
+	}
+	uring_push(u, tmpl, op);
+
+	return 0;
+}
+
+static int uring_do_rw(int opcode, int fd, const struct iovec *iov,
+		       int iovcnt, off_t off)
+{
+	struct io_uring_sqe sqe = {
+		.opcode = opcode,
+		.fd     = fd,
+		.off    = off,
+		.addr   = (uintptr_t)iov,
+		.len    = iovcnt,
+	};
+	struct uring_req req;
+
+	uring_queue_and_wait(&uring, &sqe, &req);
+
+	return req.res;
+}
+
+ssize_t uring_readv(int fd, const struct iovec *iov, int iovcnt, off_t off)
+{
+	ssize_t ret;
+
+	if (uring_is_enabled())
+		return uring_do_rw(IORING_OP_READV, fd, iov, iovcnt, off);
+
+	ret = preadv(fd, iov, iovcnt, off);
+
+	return ret < 0 ? -errno : ret;
+}
+
+ssize_t uring_writev(int fd, const struct iovec *iov, int iovcnt, off_t off)
+{
+	ssize_t ret;
+
+	if (uring_is_enabled())
+		return uring_do_rw(IORING_OP_WRITEV, fd, iov, iovcnt, off);
+
+	ret = pwritev(fd, iov, iovcnt, off);
+
+	return ret < 0 ? -errno : ret;
+}
+
+int uring_fsync(int fd, bool datasync)
+{
+	struct io_uring_sqe sqe = {
+		.opcode      = IORING_OP_FSYNC,
+		.fd          = fd,
+		.fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0,
+	};
+	struct uring_req req;
+	int ret;
+
+	if (uring_is_enabled()) {
+		uring_queue_and_wait(&uring, &sqe, &req);
+
+		return req.res;
+	}
+
+	ret = datasync ? fdatasync(fd) : fsync(fd);
+
+	return ret < 0 ? -errno : 0;
+}
+
+ssize_t uring_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	struct io_uring_sqe sqe = {
+		.opcode    = IORING_OP_SENDMSG,
+		.fd        = fd,
+		.addr      = (uintptr_t)msg,
+		.len       = 1,
+		.msg_flags = flags,
+	};
+	struct uring_req req;
+	ssize_t ret;
+
+	if (uring_is_enabled()) {
+		uring_queue_and_wait(&uring, &sqe, &req);
+
+		return req.res;
+	}
+
+	ret = sendmsg(fd, msg, flags);
+
+	return ret < 0 ? -errno : ret;
+}
+
+/*
+ * Provided buffers.  A ring of buffers is registered in the kernel,
+ * which picks a buffer for each received chunk and reports its id in
+ * the CQE, so a receive is not bound to a buffer until data arrives.
+ * A buffer is given back to the ring by uring_buf_put() when the data
+ * is consumed.
+ */
+static int uring_bufs_init(struct uring_struct *u)
+{
+	struct uring_bufs *b = &u->bufs;
+	struct io_uring_buf_reg reg;
+	size_t ring_sz, mem_sz;
+	unsigned int i;
+	int ret;
+
+	ring_sz = URING_BUF_NR * sizeof(struct io_uring_buf);
+	mem_sz = (size_t)URING_BUF_NR * URING_BUF_SIZE;
+
+	b->bufs = kcalloc(URING_BUF_NR, sizeof(*b->bufs), GFP_KERNEL);
+	if (!b->bufs)
+		return -ENOMEM;
+	/* Ring should be page aligned */
+	b->ring = mmap(NULL, ring_sz, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->ring == MAP_FAILED) {
+		ret = -errno;
+		goto free_bufs;
+	}
+	b->mem = mmap(NULL, mem_sz, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->mem == MAP_FAILED) {
+		ret = -errno;
+		goto unmap_ring;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)b->ring;
+	reg.ring_entries = URING_BUF_NR;
+	reg.bgid = URING_BUF_GROUP;
+	ret = io_uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1);
+	if (ret) {
+		ret = -errno;
+		goto unmap_mem;
+	}
+
+	for (i = 0; i < URING_BUF_NR; i++) {
+		b->bufs[i].addr = b->mem + (size_t)i * URING_BUF_SIZE;
+		b->bufs[i].bid = i;
+		INIT_LIST_HEAD(&b->bufs[i].entry);
+		uring_buf_put(&b->bufs[i]);
+	}
+
+	return 0;
+
+unmap_mem:
+	munmap(b->mem, mem_sz);
+unmap_ring:
+	munmap(b->ring, ring_sz);
+free_bufs:
+	kfree(b->bufs);
+	b->bufs = NULL;
+	b->ring = NULL;
+
+	return ret;
+}
+
+static void uring_bufs_deinit(struct uring_struct *u)
+{
+	struct uring_bufs *b = &u->bufs;
+	struct io_uring_buf_reg reg;
+
+	if (b->ring) {
+		memset(&reg, 0, sizeof(reg));
+		reg.bgid = URING_BUF_GROUP;
+		(void)io_uring_register(u->ring_fd,
+					IORING_UNREGISTER_PBUF_RING, &reg, 1);
+		munmap(b->mem, (size_t)URING_BUF_NR * URING_BUF_SIZE);
+		munmap(b->ring, URING_BUF_NR * sizeof(struct io_uring_buf));
+		kfree(b->bufs);
+	}
+	memset(b, 0, sizeof(*b));
+}
+
+/**
+ * uring_bufs_enabled() - registers provided buffers on the first call,
+ *                        returns true if receives can select buffers
+ *                        from the group %URING_BUF_GROUP.
+ */
+bool uring_bufs_enabled(void)
+{
+	struct uring_struct *u = &uring;
+	int ret;
+
+	if (u->bufs.ring)
+		return true;
+	if (u->bufs.failed || !uring_is_enabled())
+		return false;
+
+	ret = uring_bufs_init(u);
+	if (ret) {
+		pr_warn("io_uring provided buffers are not available, "
+			"err=%d\n", ret);
+		u->bufs.failed = true;
+		return false;
+	}
+
+	return true;
+}
+
+unsigned short uring_buf_group(void)
+{
+	return URING_BUF_GROUP;
+}
+
+/**
+ * uring_buf_get() - returns the buffer reported by the CQE @flags, the
+ *                   buffer is owned by the caller till uring_buf_put().
+ */
+struct uring_buf *uring_buf_get(unsigned int cqe_flags)
+{
+	struct uring_bufs *b = &uring.bufs;
+
+	BUG_ON(!(cqe_flags & IORING_CQE_F_BUFFER));
+
+	return &b->bufs[cqe_flags >> IORING_CQE_BUFFER_SHIFT];
+}
+
+void uring_buf_put(struct uring_buf *buf)
+{
+	struct uring_bufs *b = &uring.bufs;
+	struct io_uring_buf *ent;
+
+	ent = &b->ring->bufs[b->tail & (URING_BUF_NR - 1)];
+	ent->addr = (uintptr_t)buf->addr;
+	ent->len = URING_BUF_SIZE;
+	ent->bid = buf->bid;
+	buf->len = buf->off = 0;
+	uring_store_release(&b->ring->tail, ++b->tail);
+}
+
+static int uring_mmap(struct uring_struct *u, struct io_uring_params *p)
+{
+	u->sq_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	u->cq_sz = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	/* We rely on single mmap, which is available since 5.4 */
+	if (!(p->features & IORING_FEAT_SINGLE_MMAP))
+		return -EOPNOTSUPP;
+
+	if (u->cq_sz > u->sq_sz)
+		u->sq_sz = u->cq_sz;
+	u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->ring_fd,
+			 IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		return -errno;
+	u->cq_ptr = u->sq_ptr;
+
+	u->sq.sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->ring_fd,
+			  IORING_OFF_SQES);
+	if (u->sq.sqes == MAP_FAILED) {
+		munmap(u->sq_ptr, u->sq_sz);
+		return -errno;
+	}
+
+	u->sq.head = u->sq_ptr + p->sq_off.head;
+	u->sq.tail = u->sq_ptr + p->sq_off.tail;
+	u->sq.ring_mask = u->sq_ptr + p->sq_off.ring_mask;
+	u->sq.ring_entries = u->sq_ptr + p->sq_off.ring_entries;
+	u->sq.array = u->sq_ptr + p->sq_off.array;
+
+	u->cq.head = u->cq_ptr + p->cq_off.head;
+	u->cq.tail = u->cq_ptr + p->cq_off.tail;
+	u->cq.ring_mask = u->cq_ptr + p->cq_off.ring_mask;
+	u->cq.cqes = u->cq_ptr + p->cq_off.cqes;
+	u->cq_entries = p->cq_entries;
+
+	return 0;
+}
+
+static void uring_munmap(struct uring_struct *u)
+{
+	munmap(u->sq.sqes, u->sqes_sz);
+	munmap(u->sq_ptr, u->sq_sz);
+}
+
+void init_uring(void)
+{
+	struct uring_struct *u = &uring;
+	struct io_uring_params p;
+	int ret;
+
+	BUG_ON(u->ring_fd >= 0);
+
+	init_waitqueue_head(&u->wait);
+	INIT_EVENT(&u->cq_ev, uring_cq_event);
+	INIT_EVENT(&u->submit_ev, uring_submit_event);
+
+	memset(&p, 0, sizeof(p));
+	/* Multishot receives may post many CQEs, have some room */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+	u->ring_fd = io_uring_setup(URING_ENTRIES, &p);
+	if (u->ring_fd < 0) {
+		pr_warn("io_uring is not available, errno=%d, "
+			"fall back to synchronous IO\n", errno);
+		u->ring_fd = -1;
+		return;
+	}
+	ret = uring_mmap(u, &p);
+	if (ret)
+		goto close_ring;
+
+	u->ev_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (u->ev_fd < 0)
+		goto unmap;
+	ret = io_uring_register(u->ring_fd, IORING_REGISTER_EVENTFD,
+				&u->ev_fd, 1);
+	if (ret)
+		goto close_ev;
+
+	u->cq_ev.events = EPOLLIN;
+	ret = event_item_add(&u->cq_ev, u->ev_fd);
+	if (ret)
+		goto close_ev;
+
+	return;
+
+close_ev:
+	close(u->ev_fd);
+	u->ev_fd = -1;
+unmap:
+	uring_munmap(u);
+close_ring:
+	pr_warn("io_uring setup failed, fall back to synchronous IO\n");
+	close(u->ring_fd);
+	u->ring_fd = -1;
+}
+
+void deinit_uring(void)
+{
+	struct uring_struct *u = &uring;
+
+	if (u->ring_fd < 0)
+		return;
+
+	WARN(u->inflight, "%u io_uring requests are still inflight\n",
+	     u->inflight);
+
+	event_item_del(&u->cq_ev);
+	list_del_init(&u->submit_ev.entry);
+	uring_bufs_deinit(u);
+	close(u->ev_fd);
+	uring_munmap(u);
+	close(u->ring_fd);
+	u->ev_fd = -1;
+	u->ring_fd = -1;
+}
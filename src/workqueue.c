@@ -28,6 +28,7 @@
 #include "timedef.h"
 #include "completion.h"
 #include "workqueue.h"
+#include "perf_counters.h"
 
 enum {
 	MIN_IDLE_WORKERS_IN_POOL = 2,           /* how many idle workers in pool */
@@ -323,6 +324,7 @@ static void process_one_work(struct worker *worker, struct work_struct *work)
 
 	/* Only regular works have ->wq set, not barriers */
 	if (wq) {
+		perf_inc(PERF_WQ_EXECUTED);
 		wq_dec_nr_in_flight(wq, 0, work_color);
 
 		if (!list_empty(&wq->delayed_works)) {
@@ -680,6 +682,15 @@ static bool work_is_pending(struct work_struct *work)
 	return (work->flags & WORK_PENDING);
 }
 
+/**
+ * work_pending() - true if @work is queued, or its delayed timer is
+ *                  armed, and has not started executing yet.
+ */
+bool work_pending(struct work_struct *work)
+{
+	return work_is_pending(work);
+}
+
 static bool __queue_work(struct work_struct *work)
 {
 	struct worker_pool *pool = &worker_pool;
@@ -687,6 +698,7 @@ static bool __queue_work(struct work_struct *work)
 
 	work->color = wq->work_color;
 	wq->nr_in_flight[wq->work_color]++;
+	perf_inc(PERF_WQ_QUEUED);
 
 	if (likely(wq->nr_active < wq->max_active)) {
 		wq->nr_active++;